@@ -0,0 +1,67 @@
+#ifndef AUDIT_LOG_H
+#define AUDIT_LOG_H
+
+#include <stdint.h>
+
+/*
+* binary audit log, written by rpc_server when RPC_AUDIT_DIR is set and read by audit_query.
+* the log is a directory of segment files (audit-<sequence>.seg), each a fixed-size, memory-mapped file:
+*
+*   header | time index | records | strings
+*
+* records are fixed-size and reference their strings by offset into the segment's string area, where every
+* distinct username, operation and filename of the segment is stored once (NUL terminated). the time index
+* keeps the earliest and latest time of every AUDIT_INDEX_INTERVAL consecutive records, so a time range query
+* only reads the blocks that overlap it. regions are filled in place and their unwritten parts stay file holes
+*/
+
+#define AUDIT_SEGMENT_MAGIC "AUDSEG1"
+#define AUDIT_SEGMENT_VERSION 1
+#define AUDIT_SEGMENT_PREFIX "audit-"
+#define AUDIT_SEGMENT_SUFFIX ".seg"
+#define AUDIT_SEGMENT_RECORDS (1 << 20)  // records per segment
+#define AUDIT_SEGMENT_STRINGS (8 << 20)  // string area bytes per segment
+#define AUDIT_INDEX_INTERVAL 1024  // records per time index entry
+#define AUDIT_NO_STRING UINT32_MAX  // filename of records not done on a file
+
+struct audit_segment_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_capacity;
+    uint32_t string_capacity;
+    uint32_t index_interval;
+    uint64_t index_offset;  // byte offsets of the regions from the start of the file
+    uint64_t records_offset;
+    uint64_t strings_offset;
+    uint32_t record_count;  // records (and index entries) up to here are complete
+    uint32_t string_bytes;
+    uint32_t min_time;  // time range of the whole segment, valid once record_count > 0
+    uint32_t max_time;
+    uint32_t sealed;  // 1 once the server moved on to a later segment or exited
+};
+
+struct audit_index_entry {
+    uint32_t min_time;
+    uint32_t max_time;
+};
+
+struct audit_log_record {
+    uint32_t time;  // seconds since the epoch
+    uint32_t username;  // offsets into the string area
+    uint32_t operation;
+    uint32_t filename;  // AUDIT_NO_STRING if none
+};
+
+#define AUDIT_PAGE_SIZE 4096
+#define AUDIT_ALIGN_PAGE(size) (((size) + AUDIT_PAGE_SIZE - 1) / AUDIT_PAGE_SIZE * AUDIT_PAGE_SIZE)
+#define AUDIT_INDEX_OFFSET AUDIT_ALIGN_PAGE(sizeof(struct audit_segment_header))
+#define AUDIT_RECORDS_OFFSET (AUDIT_INDEX_OFFSET \
+    + AUDIT_ALIGN_PAGE(AUDIT_SEGMENT_RECORDS / AUDIT_INDEX_INTERVAL * sizeof(struct audit_index_entry)))
+#define AUDIT_STRINGS_OFFSET (AUDIT_RECORDS_OFFSET \
+    + AUDIT_ALIGN_PAGE((uint64_t)AUDIT_SEGMENT_RECORDS * sizeof(struct audit_log_record)))
+#define AUDIT_SEGMENT_SIZE (AUDIT_STRINGS_OFFSET + AUDIT_SEGMENT_STRINGS)
+
+// datetime format of the records (as sent by the servers and printed by rpc_server/audit_query)
+#define AUDIT_DATETIME_FORMAT "%d/%m/%Y %H:%M:%S"
+
+#endif
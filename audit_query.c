@@ -0,0 +1,298 @@
+#include "audit_log.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// struct to hold the query's filters, NULL strings match anything
+struct query {
+    const char *directory;
+    const char *username;
+    const char *operation;  // compared ignoring case
+    const char *filename;
+    uint32_t start;  // time range, inclusive
+    uint32_t end;
+    int count_only;
+};
+
+// struct to hold the filters resolved to a segment's string offsets
+struct segment_filter {
+    uint32_t username;
+    uint32_t operation;
+    uint32_t filename;
+};
+
+/**
+* @brief parse a query time: "today", "now", a date (dd/mm/yyyy) or a date and time (dd/mm/yyyy hh:mm:ss),
+*        in local time. a whole day is taken from its first second as a start and up to its last one as an end
+* @param text time to parse
+* @param end 1 if the time ends the range
+* @param seconds set to the seconds since the epoch
+* @return 0 if parsed
+* @return -1 if the time is invalid
+*/
+int parse_time(const char *text, int end, uint32_t *seconds) {
+    time_t now = time(NULL);
+    struct tm tm;
+    localtime_r(&now, &tm);
+    int whole_day = 1;
+
+    if (strcmp(text, "now") == 0) {
+        *seconds = (uint32_t)now;
+        return 0;
+    } else if (strcmp(text, "today") != 0) {
+        memset(&tm, 0, sizeof(tm));
+        const char *rest = strptime(text, "%d/%m/%Y", &tm);
+        if (rest != NULL && *rest != '\0') {
+            rest = strptime(text, AUDIT_DATETIME_FORMAT, &tm);
+            whole_day = 0;
+        }
+        if (rest == NULL || *rest != '\0')
+            return -1;
+    }
+
+    if (whole_day) {
+        tm.tm_hour = end ? 23 : 0;
+        tm.tm_min = end ? 59 : 0;
+        tm.tm_sec = end ? 59 : 0;
+    }
+    tm.tm_isdst = -1;
+    time_t parsed = mktime(&tm);
+    if (parsed < 0)
+        return -1;
+    *seconds = (uint32_t)parsed;
+    return 0;
+}
+
+/**
+* @brief check program arguments
+* @param argc number of arguments
+* @param argv arguments
+* @param query set to the query the arguments describe
+* @return 0 if valid
+* @return -1 if invalid
+*/
+int check_arguments(int argc, char *argv[], struct query *query) {
+    const char *usage = "Usage: ./audit_query -d <audit directory> [-u <username>] [-o <operation>] [-f <filename>] [-s <start>] [-e <end>] [-c]\n"
+                        "       <start>/<end>: today, now, dd/mm/yyyy or \"dd/mm/yyyy hh:mm:ss\"\n";
+    memset(query, 0, sizeof(*query));
+    query->end = UINT32_MAX;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "d:u:o:f:s:e:c")) != -1) {
+        switch (opt) {
+            case 'd':
+                query->directory = optarg;
+                break;
+            case 'u':
+                query->username = optarg;
+                break;
+            case 'o':
+                query->operation = optarg;
+                break;
+            case 'f':
+                query->filename = optarg;
+                break;
+            case 's':
+            case 'e':
+                if (parse_time(optarg, opt == 'e', opt == 's' ? &query->start : &query->end) < 0) {
+                    fprintf(stderr, "Invalid time: '%s'\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'c':
+                query->count_only = 1;
+                break;
+            default:
+                fprintf(stderr, "%s", usage);
+                return -1;
+        }
+    }
+    if (optind != argc || query->directory == NULL) {
+        fprintf(stderr, "%s", usage);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+* @brief find a string in a segment's string area
+* @param strings string area
+* @param string_bytes bytes used in the string area
+* @param string string to find, NULL to match any
+* @param ignore_case 1 to compare ignoring case
+* @return offset of the string
+* @return AUDIT_NO_STRING if string is NULL
+* @return -1 if the segment doesn't have the string
+*/
+int64_t find_string(const char *strings, uint32_t string_bytes, const char *string, int ignore_case) {
+    if (string == NULL)
+        return AUDIT_NO_STRING;
+    for (uint32_t offset = 0; offset < string_bytes; offset += strlen(strings + offset) + 1) {
+        if ((ignore_case ? strcasecmp(strings + offset, string) : strcmp(strings + offset, string)) == 0)
+            return offset;
+    }
+    return -1;
+}
+
+/**
+* @brief print the records of one segment that match the query
+* @param path segment file path
+* @param query query
+* @return number of matching records
+* @return -1 if the segment can't be read
+*/
+long query_segment(const char *path, const struct query *query) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror("open");
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        perror("fstat");
+        close(fd);
+        return -1;
+    }
+    if ((size_t)st.st_size < sizeof(struct audit_segment_header)) {
+        fprintf(stderr, "%s: not an audit segment\n", path);
+        close(fd);
+        return -1;
+    }
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+
+    const struct audit_segment_header *header = (const struct audit_segment_header *)map;
+    // strings are stored before the records using them, so read the count first
+    uint32_t record_count = __atomic_load_n(&header->record_count, __ATOMIC_ACQUIRE);
+    uint32_t string_bytes = __atomic_load_n(&header->string_bytes, __ATOMIC_ACQUIRE);
+    if (memcmp(header->magic, AUDIT_SEGMENT_MAGIC, sizeof(header->magic)) != 0 || header->version != AUDIT_SEGMENT_VERSION
+        || header->index_interval == 0 || record_count > header->record_capacity || string_bytes > header->string_capacity
+        || header->records_offset + (uint64_t)header->record_capacity * sizeof(struct audit_log_record) > (uint64_t)st.st_size
+        || header->strings_offset + header->string_capacity > (uint64_t)st.st_size
+        || header->index_offset + (uint64_t)header->record_capacity / header->index_interval * sizeof(struct audit_index_entry) > (uint64_t)st.st_size) {
+        fprintf(stderr, "%s: not an audit segment\n", path);
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    long matches = 0;
+    const char *strings = map + header->strings_offset;
+    const struct audit_index_entry *index = (const struct audit_index_entry *)(map + header->index_offset);
+    const struct audit_log_record *records = (const struct audit_log_record *)(map + header->records_offset);
+
+    // skip the segment if it's out of the time range or doesn't have one of the strings
+    int64_t username = find_string(strings, string_bytes, query->username, 0);
+    int64_t operation = find_string(strings, string_bytes, query->operation, 1);
+    int64_t filename = find_string(strings, string_bytes, query->filename, 0);
+    if (record_count == 0 || header->max_time < query->start || header->min_time > query->end
+        || username < 0 || operation < 0 || filename < 0) {
+        munmap(map, st.st_size);
+        return 0;
+    }
+    struct segment_filter filter = {(uint32_t)username, (uint32_t)operation, (uint32_t)filename};
+
+    for (uint32_t block = 0; block * header->index_interval < record_count; block++) {
+        if (index[block].max_time < query->start || index[block].min_time > query->end)
+            continue;
+
+        uint32_t last = (block + 1) * header->index_interval;
+        if (last > record_count)
+            last = record_count;
+        for (uint32_t i = block * header->index_interval; i < last; i++) {
+            const struct audit_log_record *record = &records[i];
+            if (record->time < query->start || record->time > query->end
+                || (filter.username != AUDIT_NO_STRING && record->username != filter.username)
+                || (filter.operation != AUDIT_NO_STRING && record->operation != filter.operation)
+                || (filter.filename != AUDIT_NO_STRING && record->filename != filter.filename))
+                continue;
+
+            matches++;
+            if (query->count_only)
+                continue;
+            // same lines as rpc_server prints to stdout
+            char datetime[32];
+            time_t seconds = record->time;
+            struct tm tm;
+            strftime(datetime, sizeof(datetime), AUDIT_DATETIME_FORMAT, localtime_r(&seconds, &tm));
+            if (record->filename == AUDIT_NO_STRING)
+                printf("%s\t%s\t%s\n", strings + record->username, strings + record->operation, datetime);
+            else
+                printf("%s\t%s\t%s\t%s\n", strings + record->username, strings + record->operation, strings + record->filename, datetime);
+        }
+    }
+
+    munmap(map, st.st_size);
+    return matches;
+}
+
+/**
+* @brief compare two segment sequence numbers, for qsort
+*/
+int compare_sequences(const void *a, const void *b) {
+    unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char *argv[]) {
+    struct query query;
+    if (check_arguments(argc, argv, &query) < 0)
+        exit(1);
+
+    // segments in the order they were written
+    DIR *dir = opendir(query.directory);
+    if (dir == NULL) {
+        perror("opendir");
+        exit(1);
+    }
+    unsigned int *sequences = NULL;
+    size_t count = 0, capacity = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        unsigned int sequence;
+        char suffix[8];
+        if (sscanf(entry->d_name, AUDIT_SEGMENT_PREFIX "%u%7s", &sequence, suffix) != 2 || strcmp(suffix, AUDIT_SEGMENT_SUFFIX) != 0)
+            continue;
+        if (count == capacity) {
+            capacity = capacity == 0 ? 64 : capacity * 2;
+            unsigned int *grown = realloc(sequences, capacity * sizeof(unsigned int));
+            if (grown == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+            sequences = grown;
+        }
+        sequences[count++] = sequence;
+    }
+    closedir(dir);
+    qsort(sequences, count, sizeof(unsigned int), compare_sequences);
+
+    long matches = 0;
+    int failed = 0;
+    for (size_t i = 0; i < count; i++) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/" AUDIT_SEGMENT_PREFIX "%08u" AUDIT_SEGMENT_SUFFIX, query.directory, sequences[i]);
+        long segment_matches = query_segment(path, &query);
+        if (segment_matches < 0)
+            failed = 1;
+        else
+            matches += segment_matches;
+    }
+    if (query.count_only)
+        printf("%ld\n", matches);
+    free(sequences);
+
+    return failed ? 2 : 0;
+}
@@ -0,0 +1,50 @@
+#ifndef AUDIT_RING_H
+#define AUDIT_RING_H
+
+#include <stdint.h>
+
+/*
+* shared-memory audit transport for servers running on the same host as rpc_server. rpc_server creates the ring
+* (shm_open, named by RPC_AUDIT_RING) and consumes it; every server started with -a <name> maps it and writes its
+* operations there instead of sending them over RPC.
+*
+* it is a bounded lock-free queue (Vyukov's): every slot carries a sequence number telling whether it is free for
+* the producer at enqueue position pos (sequence == pos) or holds a record for the consumer at dequeue position
+* pos (sequence == pos + 1). producers and consumers claim positions with a compare and swap on their cursor, and
+* hand slots over with release stores of the sequence, so no side ever waits on the other. rpc_server runs a
+* single consumer, so records come out in the order producers claimed their positions. the consumer updates
+* heartbeat_ns while it runs; producers stop using a ring that is closed or whose heartbeat is older than
+* AUDIT_RING_STALE_MS, and fall back to RPC
+*/
+
+#define AUDIT_RING_MAGIC "AUDRNG1"
+#define AUDIT_RING_VERSION 1
+#define AUDIT_RING_SLOTS 8192  // a power of 2
+#define AUDIT_RING_STALE_MS 1000
+#define AUDIT_RING_USERNAME_SIZE 256
+#define AUDIT_RING_OPERATION_SIZE 32
+#define AUDIT_RING_FILENAME_SIZE 256
+#define AUDIT_RING_DATETIME_SIZE 20
+#define AUDIT_RING_CACHE_LINE 64
+
+struct audit_ring_slot {
+    uint64_t sequence;
+    char username[AUDIT_RING_USERNAME_SIZE];
+    char operation[AUDIT_RING_OPERATION_SIZE];
+    char filename[AUDIT_RING_FILENAME_SIZE];  // empty if the operation isn't done on a file
+    char datetime[AUDIT_RING_DATETIME_SIZE];
+};
+
+struct audit_ring {
+    char magic[8];
+    uint32_t version;
+    uint32_t slots;  // AUDIT_RING_SLOTS
+    uint32_t closed;  // 1 once rpc_server stopped consuming, producers must map the ring again
+    uint64_t heartbeat_ns;  // CLOCK_MONOTONIC time the consumer last ran
+    // cursors on their own cache lines, producers only touch the first and the consumer the second
+    _Alignas(AUDIT_RING_CACHE_LINE) uint64_t enqueue_position;
+    _Alignas(AUDIT_RING_CACHE_LINE) uint64_t dequeue_position;
+    _Alignas(AUDIT_RING_CACHE_LINE) struct audit_ring_slot slot[AUDIT_RING_SLOTS];
+};
+
+#endif
@@ -0,0 +1,392 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#define PROTOCOL_V2 2
+#define MAX_CLIENT_COUNTS 16
+#define DEFAULT_REQUESTS 2000  // per client
+#define DEFAULT_READ_PERCENT 50
+#define REQUEST_BUFFER_SIZE 2048
+#define STRING_BUFFER_SIZE 1024
+
+const char *datetime = "01/01/2024 00:00:00";
+
+// v2 opcodes, as in server.c
+enum opcode {
+    OP_HELLO = 0,
+    OP_REGISTER,
+    OP_UNREGISTER,
+    OP_CONNECT,
+    OP_PUBLISH,
+    OP_DISCONNECT,
+    OP_DELETE,
+    OP_LIST_USERS,
+    OP_LIST_CONTENT
+};
+
+// program options
+struct bench_options {
+    const char *host;
+    const char *port;
+    int client_counts[MAX_CLIENT_COUNTS];  // a run for each number of clients
+    int runs;
+    int requests;
+    int read_percent;
+};
+
+// a benchmark client, each one working on its own user
+struct bench_client {
+    const struct bench_options *options;
+    pthread_barrier_t *start;
+    char username[64];
+    unsigned int seed;
+    int socket;
+    unsigned long requests;
+    unsigned long failed;
+    unsigned long long latency_ns;  // sum of every request's latency
+    unsigned long long max_latency_ns;
+};
+
+/**
+* @brief get a monotonic timestamp
+* @return nanoseconds since an arbitrary point
+*/
+unsigned long long monotonic_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+/**
+* @brief check and save the program arguments
+* @param argc number of arguments
+* @param argv arguments
+* @param options options to fill in
+* @return 0 if successful
+* @return -1 if error
+*/
+int check_arguments(int argc, char *argv[], struct bench_options *options) {
+    options->host = "127.0.0.1";
+    options->port = NULL;
+    options->runs = 0;
+    options->requests = DEFAULT_REQUESTS;
+    options->read_percent = DEFAULT_READ_PERCENT;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "s:p:c:n:r:")) != -1) {
+        switch (opt) {
+            case 's':
+                options->host = optarg;
+                break;
+            case 'p':
+                options->port = optarg;
+                break;
+            case 'c': {
+                // comma separated list of client counts
+                char *saveptr;
+                for (char *count = strtok_r(optarg, ",", &saveptr); count != NULL; count = strtok_r(NULL, ",", &saveptr)) {
+                    if (options->runs == MAX_CLIENT_COUNTS || atoi(count) <= 0) {
+                        fprintf(stderr, "invalid client counts\n");
+                        return -1;
+                    }
+                    options->client_counts[options->runs++] = atoi(count);
+                }
+                break;
+            }
+            case 'n':
+                options->requests = atoi(optarg);
+                break;
+            case 'r':
+                options->read_percent = atoi(optarg);
+                break;
+            default:
+                return -1;
+        }
+    }
+    if (options->port == NULL || options->requests <= 0 || options->read_percent < 0 || options->read_percent > 100) {
+        fprintf(stderr, "usage: %s -p <port> [-s <host>] [-c <clients>[,<clients>...]] [-n <requests per client>] [-r <read percent>]\n", argv[0]);
+        return -1;
+    }
+    if (options->runs == 0) {
+        int default_counts[] = {1, 2, 4, 8, 16, 32};
+        for (options->runs = 0; options->runs < 6; options->runs++)
+            options->client_counts[options->runs] = default_counts[options->runs];
+    }
+    return 0;
+}
+
+/**
+* @brief encode a v2 request: the opcode followed by each field as a varint length and its bytes
+* @param buffer buffer of REQUEST_BUFFER_SIZE bytes
+* @param opcode opcode
+* @param fields fields, NULL terminated
+* @return length of the request
+*/
+size_t encode_request(unsigned char *buffer, enum opcode opcode, const char *fields[]) {
+    size_t len = 0;
+    buffer[len++] = opcode;
+    for (int i = 0; fields[i] != NULL; i++) {
+        size_t field_len = strlen(fields[i]);
+        unsigned int value = field_len;
+        while (value >= 0x80) {
+            buffer[len++] = (value & 0x7f) | 0x80;
+            value >>= 7;
+        }
+        buffer[len++] = value;
+        memcpy(buffer + len, fields[i], field_len);
+        len += field_len;
+    }
+    return len;
+}
+
+/**
+* @brief receive exactly len bytes
+* @param socket socket
+* @param data where to store them
+* @param len number of bytes
+* @return 0 if successful
+* @return -1 if error or closed connection
+*/
+int recv_exact(int socket, void *data, size_t len) {
+    size_t received = 0;
+    while (received < len) {
+        ssize_t n = recv(socket, (char *)data + received, len - received, 0);
+        if (n <= 0)
+            return -1;
+        received += n;
+    }
+    return 0;
+}
+
+/**
+* @brief receive a varint
+* @param socket socket
+* @param value set to the value
+* @return 0 if successful
+* @return -1 if error
+*/
+int recv_varint(int socket, unsigned long long *value) {
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {  // up to 64 bits, as cursors are
+        unsigned char byte;
+        if (recv_exact(socket, &byte, 1) < 0)
+            return -1;
+        *value |= (unsigned long long)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return 0;
+    }
+    return -1;
+}
+
+/**
+* @brief receive a varint length prefixed string, dropping it
+* @param socket socket
+* @return 0 if successful
+* @return -1 if error
+*/
+int recv_string(int socket) {
+    unsigned long long len;
+    char string[STRING_BUFFER_SIZE];
+    if (recv_varint(socket, &len) < 0 || len > STRING_BUFFER_SIZE)
+        return -1;
+    return recv_exact(socket, string, len);
+}
+
+/**
+* @brief send a request and wait for its reply
+* @param client client
+* @param opcode opcode
+* @param fields fields, NULL terminated
+* @return status of the reply
+* @return -1 if error
+*/
+int client_request(struct bench_client *client, enum opcode opcode, const char *fields[]) {
+    unsigned char request[REQUEST_BUFFER_SIZE];
+    size_t len = encode_request(request, opcode, fields);
+    if (send(client->socket, request, len, MSG_NOSIGNAL) != (ssize_t)len)
+        return -1;
+
+    unsigned char status;
+    if (recv_exact(client->socket, &status, 1) < 0)
+        return -1;
+    if (opcode != OP_LIST_CONTENT || status != 0)
+        return status;
+
+    // count, filename and description of each file, next cursor
+    unsigned long long count, next_cursor;
+    if (recv_varint(client->socket, &count) < 0)
+        return -1;
+    for (unsigned long long i = 0; i < 2 * count; i++) {
+        if (recv_string(client->socket) < 0)
+            return -1;
+    }
+    if (recv_varint(client->socket, &next_cursor) < 0)
+        return -1;
+    return status;
+}
+
+/**
+* @brief open a v2 session with the server
+* @param options program options
+* @return socket if successful
+* @return -1 if error
+*/
+int open_session(const struct bench_options *options) {
+    struct addrinfo hints = {0};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *address;
+    if (getaddrinfo(options->host, options->port, &hints, &address) != 0) {
+        fprintf(stderr, "getaddrinfo: can't resolve %s\n", options->host);
+        return -1;
+    }
+    int sd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sd < 0 || connect(sd, address->ai_addr, address->ai_addrlen) < 0) {
+        perror("connect");
+        freeaddrinfo(address);
+        if (sd >= 0)
+            close(sd);
+        return -1;
+    }
+    freeaddrinfo(address);
+
+    int opt = 1;
+    setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+    unsigned char hello[] = {OP_HELLO, PROTOCOL_V2};
+    unsigned char hello_reply[2];
+    if (send(sd, hello, sizeof(hello), MSG_NOSIGNAL) != sizeof(hello) || recv_exact(sd, hello_reply, sizeof(hello_reply)) < 0 || hello_reply[0] != 0 || hello_reply[1] != PROTOCOL_V2) {
+        fprintf(stderr, "server doesn't support protocol v2\n");
+        close(sd);
+        return -1;
+    }
+    return sd;
+}
+
+/**
+* @brief client thread function. Registers and connects its user, then, once every client is ready, sends
+*        requests one at a time: LIST_CONTENT of its own files (read_percent of them) or PUBLISH and DELETE of
+*        a file, alternately
+* @param client_ptr client
+*/
+void *client_thread(void *client_ptr) {
+    struct bench_client *client = client_ptr;
+    const char *register_fields[] = {datetime, client->username, NULL};
+    const char *connect_fields[] = {datetime, client->username, "5555", NULL};
+    int ready = client->socket >= 0 && client_request(client, OP_REGISTER, register_fields) == 0 && client_request(client, OP_CONNECT, connect_fields) == 0;
+    pthread_barrier_wait(client->start);
+    if (!ready) {
+        client->failed = client->options->requests;
+        return NULL;
+    }
+
+    const char *list_fields[] = {datetime, client->username, client->username, "", "", "", NULL};
+    const char *publish_fields[] = {datetime, client->username, "bench.txt", "contention benchmark", "", NULL};
+    const char *delete_fields[] = {datetime, client->username, "bench.txt", NULL};
+    int published = 0;
+    for (int i = 0; i < client->options->requests; i++) {
+        unsigned long long start = monotonic_ns();
+        int status;
+        if ((int)(rand_r(&client->seed) % 100) < client->options->read_percent) {
+            status = client_request(client, OP_LIST_CONTENT, list_fields);
+        } else {
+            status = client_request(client, published ? OP_DELETE : OP_PUBLISH, published ? delete_fields : publish_fields);
+            published = !published;
+        }
+        unsigned long long latency = monotonic_ns() - start;
+
+        if (status < 0) {
+            client->failed += client->options->requests - i;
+            return NULL;
+        }
+        if (status != 0)
+            client->failed++;
+        client->requests++;
+        client->latency_ns += latency;
+        if (latency > client->max_latency_ns)
+            client->max_latency_ns = latency;
+    }
+
+    const char *unregister_fields[] = {datetime, client->username, NULL};
+    client_request(client, OP_UNREGISTER, unregister_fields);
+    return NULL;
+}
+
+/**
+* @brief run the benchmark with a number of clients and print its throughput and latency
+* @param options program options
+* @param run index of the run, to keep usernames of different runs apart
+* @param count number of clients
+* @return 0 if successful
+* @return -1 if error
+*/
+int run_clients(const struct bench_options *options, int run, int count) {
+    struct bench_client *clients = calloc(count, sizeof(struct bench_client));
+    pthread_t *threads = malloc(count * sizeof(pthread_t));
+    if (clients == NULL || threads == NULL) {
+        perror("malloc");
+        free(clients);
+        free(threads);
+        return -1;
+    }
+
+    // the barrier has one more party, so the clock starts once every client is ready
+    pthread_barrier_t start;
+    pthread_barrier_init(&start, NULL, count + 1);
+    for (int i = 0; i < count; i++) {
+        clients[i].options = options;
+        clients[i].start = &start;
+        clients[i].seed = i + 1;
+        snprintf(clients[i].username, sizeof(clients[i].username), "bench%d_%d_%d", (int)getpid(), run, i);
+        clients[i].socket = open_session(options);
+        if (pthread_create(&threads[i], NULL, client_thread, &clients[i]) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    pthread_barrier_wait(&start);
+    unsigned long long start_ns = monotonic_ns();
+
+    unsigned long requests = 0, failed = 0;
+    unsigned long long latency_ns = 0, max_latency_ns = 0;
+    for (int i = 0; i < count; i++) {
+        pthread_join(threads[i], NULL);
+        if (clients[i].socket >= 0)
+            close(clients[i].socket);
+        requests += clients[i].requests;
+        failed += clients[i].failed;
+        latency_ns += clients[i].latency_ns;
+        if (clients[i].max_latency_ns > max_latency_ns)
+            max_latency_ns = clients[i].max_latency_ns;
+    }
+    double elapsed = (monotonic_ns() - start_ns) / 1e9;
+    pthread_barrier_destroy(&start);
+    free(clients);
+    free(threads);
+
+    printf("%3d clients: %8lu requests in %6.2f s, %9.0f requests/s, mean latency %8.1f us, max %8.1f us, %lu failed\n",
+           count, requests, elapsed, requests / elapsed, requests > 0 ? latency_ns / 1e3 / requests : 0, max_latency_ns / 1e3, failed);
+    fflush(stdout);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    struct bench_options options;
+    if (check_arguments(argc, argv, &options) < 0)
+        exit(1);
+
+    printf("%d requests per client, %d%% LIST_CONTENT, the rest PUBLISH/DELETE\n", options.requests, options.read_percent);
+    for (int run = 0; run < options.runs; run++) {
+        if (run_clients(&options, run, options.client_counts[run]) < 0)
+            exit(1);
+    }
+
+    return 0;
+}
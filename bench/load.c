@@ -0,0 +1,1026 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#define PROTOCOL_V2 2
+#define DEFAULT_CLIENTS 1000
+#define DEFAULT_THREADS 4
+#define DEFAULT_DURATION 10  // seconds
+#define DEFAULT_WARMUP 1  // seconds
+#define DEFAULT_PAGE_LIMIT "100"
+#define DEFAULT_MIX "register=2,connect=3,publish=20,delete=15,list_users=10,list_content=50"
+#define REQUEST_BUFFER_SIZE 2048
+#define REPLY_BUFFER_INITIAL_SIZE 256
+#define NAME_SIZE 64
+#define MAX_CLIENT_FILES 32  // files a client keeps published, PUBLISH deletes one instead once there are this many
+#define MAX_STEPS 2  // requests an operation of the mix is sent as
+#define STATUSES 8  // reply statuses counted apart, above the highest one
+#define EPOLL_MAX_EVENTS 256
+#define STATS_OPCODE 10  // v2 opcode of STATS, only sent by abandoned sessions
+#define ABANDONED_BURST 3000  // STATS requests an abandoned session pipelines before closing
+#define EPOLL_TIMEOUT 100  // milliseconds
+#define HISTOGRAM_SUB_BITS 4  // latency histograms split every power of two in 1 << HISTOGRAM_SUB_BITS buckets
+#define HISTOGRAM_MAX_EXPONENT 40  // values from 2^40 ns (~18 minutes) up land in the last bucket
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_EXPONENT - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+const char *datetime = "01/01/2024 00:00:00";
+
+// v2 opcodes, as in server.c
+enum opcode {
+    OP_HELLO = 0,
+    OP_REGISTER,
+    OP_UNREGISTER,
+    OP_CONNECT,
+    OP_PUBLISH,
+    OP_DISCONNECT,
+    OP_DELETE,
+    OP_LIST_USERS,
+    OP_LIST_CONTENT,
+    OP_SEARCH,
+    OPCODES
+};
+
+const char *operation_names[OPCODES] = {"HELLO", "REGISTER", "UNREGISTER", "CONNECT", "PUBLISH", "DISCONNECT", "DELETE", "LIST_USERS", "LIST_CONTENT", "SEARCH"};
+
+// words files are described with and searched for
+const char *words[] = {"report", "draft", "photo", "music", "notes", "backup", "video", "slides", "thesis", "data"};
+#define WORDS (sizeof(words) / sizeof(words[0]))
+
+// phases of a run, set by the main thread
+enum phase {
+    PHASE_WARMUP,  // requests are sent but not recorded
+    PHASE_MEASURE,
+    PHASE_STOP  // no new requests are sent
+};
+
+int phase = PHASE_WARMUP;
+
+// program options
+struct bench_options {
+    const char *host;
+    const char *port;
+    int clients;
+    int idle_sessions;  // sessions kept open with no requests during the whole run
+    int abandoned_sessions;  // sessions closed with their replies unread while measuring
+    int threads;
+    int duration;
+    int warmup;
+    const char *page_limit;
+    int weights[OPCODES];  // weight of each operation in the mix, 0 if not in it
+    int total_weight;
+};
+
+struct histogram {
+    unsigned long counts[HISTOGRAM_BUCKETS];
+    unsigned long long sum_ns;
+    unsigned long long max_ns;
+};
+
+// results of an operation, kept by each thread and added up at the end
+struct operation_stats {
+    struct histogram latency;
+    unsigned long statuses[STATUSES];  // replies with each status, higher ones counted with the highest
+};
+
+// a simulated client, with its own user and session. It has one request in flight at a time
+struct load_client {
+    int socket;
+    char username[NAME_SIZE];
+    unsigned int seed;
+    int registered;  // users it registered, its own first, unregistered at the end
+    int files[MAX_CLIENT_FILES];  // ids of its published files
+    int file_count;
+    int next_file;
+    enum opcode steps[MAX_STEPS];  // requests left of the current operation of the mix
+    int step_count;
+    enum opcode opcode;  // request in flight
+    unsigned long long start_ns;
+    int recorded;  // whether the request in flight was sent while measuring
+    unsigned char request[REQUEST_BUFFER_SIZE];
+    size_t request_len;
+    size_t request_sent;
+    unsigned char *reply;
+    size_t reply_len;
+    size_t reply_size;
+    int writing;  // waiting for the socket to be writable
+    int active;
+};
+
+// a load thread, driving its share of the clients from an epoll event loop
+struct load_thread {
+    const struct bench_options *options;
+    pthread_barrier_t *start;
+    struct load_client *clients;
+    int count;
+    int epoll;
+    int active;  // clients with a request in flight
+    int failed_setups;
+    unsigned long lost;  // requests whose connection failed
+    struct operation_stats stats[OPCODES];
+};
+
+/**
+* @brief get a monotonic timestamp
+* @return nanoseconds since an arbitrary point
+*/
+unsigned long long monotonic_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+/**
+* @brief get the histogram bucket of a value: values below 1 << HISTOGRAM_SUB_BITS get a bucket each, and every
+*        power of two above them is split in 1 << HISTOGRAM_SUB_BITS buckets, so buckets are within 1/16 of their values
+* @param value value
+* @return bucket
+*/
+int histogram_bucket(unsigned long long value) {
+    if (value < (1 << HISTOGRAM_SUB_BITS))
+        return value;
+    int exponent = 63 - __builtin_clzll(value);
+    if (exponent >= HISTOGRAM_MAX_EXPONENT)
+        return HISTOGRAM_BUCKETS - 1;
+    int sub_bucket = (value >> (exponent - HISTOGRAM_SUB_BITS)) & ((1 << HISTOGRAM_SUB_BITS) - 1);
+    return ((exponent - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS) + sub_bucket;
+}
+
+/**
+* @brief get the highest value of a histogram bucket
+* @param bucket bucket
+* @return value
+*/
+unsigned long long histogram_bucket_max(int bucket) {
+    if (bucket < (1 << HISTOGRAM_SUB_BITS))
+        return bucket;
+    int exponent = (bucket >> HISTOGRAM_SUB_BITS) + HISTOGRAM_SUB_BITS - 1;
+    unsigned long long sub_bucket = bucket & ((1 << HISTOGRAM_SUB_BITS) - 1);
+    return (((1ULL << HISTOGRAM_SUB_BITS) + sub_bucket + 1) << (exponent - HISTOGRAM_SUB_BITS)) - 1;
+}
+
+/**
+* @brief record a value in a histogram
+* @param histogram histogram
+* @param value_ns value, in nanoseconds
+*/
+void histogram_record(struct histogram *histogram, unsigned long long value_ns) {
+    histogram->counts[histogram_bucket(value_ns)]++;
+    histogram->sum_ns += value_ns;
+    if (value_ns > histogram->max_ns)
+        histogram->max_ns = value_ns;
+}
+
+/**
+* @brief add a histogram to a total
+* @param total total histogram
+* @param histogram histogram to add
+*/
+void histogram_merge(struct histogram *total, const struct histogram *histogram) {
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+        total->counts[i] += histogram->counts[i];
+    total->sum_ns += histogram->sum_ns;
+    if (histogram->max_ns > total->max_ns)
+        total->max_ns = histogram->max_ns;
+}
+
+/**
+* @brief count the values of a histogram
+* @param histogram histogram
+* @return number of values
+*/
+unsigned long histogram_count(const struct histogram *histogram) {
+    unsigned long count = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+        count += histogram->counts[i];
+    return count;
+}
+
+/**
+* @brief get a quantile of a histogram, as the highest value of the bucket it falls in
+* @param histogram histogram
+* @param count number of values, from histogram_count()
+* @param quantile quantile, from 0 to 1
+* @return value, 0 if the histogram is empty
+*/
+unsigned long long histogram_quantile(const struct histogram *histogram, unsigned long count, double quantile) {
+    unsigned long rank = (unsigned long)(quantile * count + 0.999999);
+    if (rank == 0)
+        rank = 1;
+    unsigned long seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += histogram->counts[i];
+        if (seen >= rank) {
+            unsigned long long value = histogram_bucket_max(i);
+            return value < histogram->max_ns ? value : histogram->max_ns;
+        }
+    }
+    return 0;
+}
+
+/**
+* @brief parse the operation mix, a comma separated list of <operation>=<weight>
+* @param mix mix
+* @param options options to fill in
+* @return 0 if successful
+* @return -1 if error
+*/
+int parse_mix(char *mix, struct bench_options *options) {
+    memset(options->weights, 0, sizeof(options->weights));
+    options->total_weight = 0;
+    char *saveptr;
+    for (char *entry = strtok_r(mix, ",", &saveptr); entry != NULL; entry = strtok_r(NULL, ",", &saveptr)) {
+        char *weight = strchr(entry, '=');
+        if (weight == NULL)
+            return -1;
+        *weight++ = '\0';
+
+        // only the operations a client can repeat forever
+        int opcode;
+        for (opcode = OP_REGISTER; opcode < OPCODES; opcode++) {
+            if (strcasecmp(entry, operation_names[opcode]) == 0)
+                break;
+        }
+        if (opcode == OPCODES || opcode == OP_UNREGISTER || opcode == OP_DISCONNECT || atoi(weight) < 0) {
+            fprintf(stderr, "invalid mix entry %s\n", entry);
+            return -1;
+        }
+        options->weights[opcode] = atoi(weight);
+        options->total_weight += atoi(weight);
+    }
+    return options->total_weight > 0 ? 0 : -1;
+}
+
+/**
+* @brief check and save the program arguments
+* @param argc number of arguments
+* @param argv arguments
+* @param options options to fill in
+* @return 0 if successful
+* @return -1 if error
+*/
+int check_arguments(int argc, char *argv[], struct bench_options *options) {
+    static char default_mix[] = DEFAULT_MIX;
+    options->host = "127.0.0.1";
+    options->port = NULL;
+    options->clients = DEFAULT_CLIENTS;
+    options->idle_sessions = 0;
+    options->abandoned_sessions = 0;
+    options->threads = DEFAULT_THREADS;
+    options->duration = DEFAULT_DURATION;
+    options->warmup = DEFAULT_WARMUP;
+    options->page_limit = DEFAULT_PAGE_LIMIT;
+    char *mix = default_mix;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "s:p:c:i:a:t:d:w:l:m:")) != -1) {
+        switch (opt) {
+            case 's':
+                options->host = optarg;
+                break;
+            case 'p':
+                options->port = optarg;
+                break;
+            case 'c':
+                options->clients = atoi(optarg);
+                break;
+            case 'i':
+                options->idle_sessions = atoi(optarg);
+                break;
+            case 'a':
+                options->abandoned_sessions = atoi(optarg);
+                break;
+            case 't':
+                options->threads = atoi(optarg);
+                break;
+            case 'd':
+                options->duration = atoi(optarg);
+                break;
+            case 'w':
+                options->warmup = atoi(optarg);
+                break;
+            case 'l':
+                options->page_limit = optarg;
+                break;
+            case 'm':
+                mix = optarg;
+                break;
+            default:
+                options->port = NULL;
+                break;
+        }
+    }
+    if (options->port == NULL || options->clients <= 0 || options->idle_sessions < 0 || options->abandoned_sessions < 0 || options->threads <= 0 || options->duration <= 0 || options->warmup < 0 || parse_mix(mix, options) < 0) {
+        fprintf(stderr, "usage: %s -p <port> [-s <host>] [-c <clients>] [-i <idle sessions>] [-a <abandoned sessions>] [-t <threads>] [-d <seconds>] [-w <warmup seconds>] [-l <list page limit>] [-m <operation>=<weight>[,...]]\n", argv[0]);
+        fprintf(stderr, "default mix: %s\n", DEFAULT_MIX);
+        return -1;
+    }
+    if (options->threads > options->clients)
+        options->threads = options->clients;
+    return 0;
+}
+
+/**
+* @brief encode a v2 request: the opcode followed by each field as a varint length and its bytes
+* @param buffer buffer of REQUEST_BUFFER_SIZE bytes
+* @param opcode opcode
+* @param fields fields, NULL terminated
+* @return length of the request
+*/
+size_t encode_request(unsigned char *buffer, enum opcode opcode, const char *fields[]) {
+    size_t len = 0;
+    buffer[len++] = opcode;
+    for (int i = 0; fields[i] != NULL; i++) {
+        size_t field_len = strlen(fields[i]);
+        unsigned int value = field_len;
+        while (value >= 0x80) {
+            buffer[len++] = (value & 0x7f) | 0x80;
+            value >>= 7;
+        }
+        buffer[len++] = value;
+        memcpy(buffer + len, fields[i], field_len);
+        len += field_len;
+    }
+    return len;
+}
+
+/**
+* @brief decode a varint
+* @param data data
+* @param len length of data
+* @param offset offset of the varint, moved past it
+* @param value set to the value
+* @return 1 if successful
+* @return 0 if data ends before the varint does
+* @return -1 if the varint is too long
+*/
+int decode_varint(const unsigned char *data, size_t len, size_t *offset, unsigned long long *value) {
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {  // up to 64 bits, as cursors are
+        if (*offset >= len)
+            return 0;
+        unsigned char byte = data[(*offset)++];
+        *value |= (unsigned long long)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return 1;
+    }
+    return -1;
+}
+
+/**
+* @brief find the end of a reply: its status and, for a list with status 0, the entry count, each entry's
+*        strings and the next cursor
+* @param opcode opcode of the request
+* @param data received data
+* @param len length of data
+* @return length of the reply if it's complete
+* @return 0 if more data is needed
+* @return -1 if malformed
+*/
+ssize_t reply_length(enum opcode opcode, const unsigned char *data, size_t len) {
+    if (len == 0)
+        return 0;
+    int strings;
+    if (opcode == OP_LIST_USERS || opcode == OP_SEARCH)
+        strings = 3;  // username, ip and port, or username, filename and description
+    else if (opcode == OP_LIST_CONTENT)
+        strings = 2;  // filename and description
+    else
+        return 1;
+    if (data[0] != 0)
+        return 1;
+
+    size_t offset = 1;
+    unsigned long long count, string_len, next_cursor;
+    int decoded = decode_varint(data, len, &offset, &count);
+    if (decoded <= 0)
+        return decoded;
+    for (unsigned long long i = 0; i < count * strings; i++) {
+        decoded = decode_varint(data, len, &offset, &string_len);
+        if (decoded <= 0)
+            return decoded;
+        offset += string_len;
+    }
+    decoded = decode_varint(data, len, &offset, &next_cursor);
+    if (decoded <= 0)
+        return decoded;
+    return offset;
+}
+
+/**
+* @brief get the username of a client
+* @param buffer buffer of NAME_SIZE bytes
+* @param index index of the client
+*/
+void client_username(char *buffer, int index) {
+    snprintf(buffer, NAME_SIZE, "load%d_%d", (int)getpid(), index);
+}
+
+/**
+* @brief pick the next operation of the mix and plan the requests it is sent as. The client stays connected
+*        between operations, so CONNECT is sent as a DISCONNECT and a CONNECT, PUBLISH deletes a file instead once
+*        the client has MAX_CLIENT_FILES published and DELETE publishes one instead when it has none
+* @param client client
+* @param options program options
+*/
+void client_plan(struct load_client *client, const struct bench_options *options) {
+    int pick = rand_r(&client->seed) % options->total_weight;
+    enum opcode opcode;
+    for (opcode = OP_REGISTER; pick >= options->weights[opcode]; opcode++)
+        pick -= options->weights[opcode];
+
+    if (opcode == OP_PUBLISH && client->file_count == MAX_CLIENT_FILES)
+        opcode = OP_DELETE;
+    else if (opcode == OP_DELETE && client->file_count == 0)
+        opcode = OP_PUBLISH;
+
+    // steps are taken from the end
+    client->step_count = 0;
+    client->steps[client->step_count++] = opcode;
+    if (opcode == OP_CONNECT)
+        client->steps[client->step_count++] = OP_DISCONNECT;
+}
+
+/**
+* @brief encode the client's next request. Its files are updated as the request is encoded, since a failed one
+*        shows up in the statuses either way
+* @param client client
+* @param options program options
+* @param opcode opcode
+*/
+void client_encode(struct load_client *client, const struct bench_options *options, enum opcode opcode) {
+    char name[NAME_SIZE], description[NAME_SIZE];
+    int file;
+    switch (opcode) {
+        case OP_REGISTER: {
+            // the client's own user, then extra users named after it
+            if (client->registered == 0)
+                snprintf(name, sizeof(name), "%s", client->username);
+            else
+                snprintf(name, sizeof(name), "%s_%d", client->username, client->registered);
+            client->registered++;
+            const char *fields[] = {datetime, name, NULL};
+            client->request_len = encode_request(client->request, opcode, fields);
+            break;
+        }
+        case OP_DISCONNECT:
+            // the server deletes the files of users that disconnect
+            client->file_count = 0;
+            // fall through
+        case OP_UNREGISTER: {
+            const char *fields[] = {datetime, client->username, NULL};
+            client->request_len = encode_request(client->request, opcode, fields);
+            break;
+        }
+        case OP_CONNECT: {
+            const char *fields[] = {datetime, client->username, "5555", NULL};
+            client->request_len = encode_request(client->request, opcode, fields);
+            break;
+        }
+        case OP_PUBLISH: {
+            file = client->next_file++;
+            client->files[client->file_count++] = file;
+            snprintf(name, sizeof(name), "file%d.txt", file);
+            snprintf(description, sizeof(description), "%s %s %d", words[rand_r(&client->seed) % WORDS], words[rand_r(&client->seed) % WORDS], file);
+            const char *fields[] = {datetime, client->username, name, description, "", NULL};
+            client->request_len = encode_request(client->request, opcode, fields);
+            break;
+        }
+        case OP_DELETE: {
+            // a random file, replaced by the last one
+            int slot = rand_r(&client->seed) % client->file_count;
+            file = client->files[slot];
+            client->files[slot] = client->files[--client->file_count];
+            snprintf(name, sizeof(name), "file%d.txt", file);
+            const char *fields[] = {datetime, client->username, name, NULL};
+            client->request_len = encode_request(client->request, opcode, fields);
+            break;
+        }
+        case OP_LIST_USERS: {
+            const char *fields[] = {datetime, client->username, "", options->page_limit, NULL};
+            client->request_len = encode_request(client->request, opcode, fields);
+            break;
+        }
+        case OP_LIST_CONTENT: {
+            // files of a random client
+            client_username(name, rand_r(&client->seed) % options->clients);
+            const char *fields[] = {datetime, client->username, name, "", options->page_limit, "", NULL};
+            client->request_len = encode_request(client->request, opcode, fields);
+            break;
+        }
+        case OP_SEARCH: {
+            const char *fields[] = {datetime, client->username, words[rand_r(&client->seed) % WORDS], "", options->page_limit, NULL};
+            client->request_len = encode_request(client->request, opcode, fields);
+            break;
+        }
+        default:
+            client->request_len = 0;
+            break;
+    }
+    client->opcode = opcode;
+    client->request_sent = 0;
+    client->reply_len = 0;
+}
+
+/**
+* @brief receive until a whole reply is buffered, in blocking mode
+* @param client client
+* @return status of the reply
+* @return -1 if error or closed connection
+*/
+int client_receive_reply(struct load_client *client) {
+    while (1) {
+        ssize_t len = reply_length(client->opcode, client->reply, client->reply_len);
+        if (len < 0)
+            return -1;
+        if (len > 0)
+            return client->reply[0];
+        if (client->reply_len == client->reply_size) {
+            unsigned char *reply = realloc(client->reply, client->reply_size * 2);
+            if (reply == NULL)
+                return -1;
+            client->reply = reply;
+            client->reply_size *= 2;
+        }
+        ssize_t n = recv(client->socket, client->reply + client->reply_len, client->reply_size - client->reply_len, 0);
+        if (n <= 0)
+            return -1;
+        client->reply_len += n;
+    }
+}
+
+/**
+* @brief send a request and wait for its reply, in blocking mode. Used to set up and tear down sessions
+* @param client client
+* @param options program options
+* @param opcode opcode
+* @return status of the reply
+* @return -1 if error
+*/
+int client_request(struct load_client *client, const struct bench_options *options, enum opcode opcode) {
+    client_encode(client, options, opcode);
+    if (send(client->socket, client->request, client->request_len, MSG_NOSIGNAL) != (ssize_t)client->request_len)
+        return -1;
+    return client_receive_reply(client);
+}
+
+/**
+* @brief open a v2 session with the server, negotiating the protocol with HELLO
+* @param options program options
+* @return socket of the session
+* @return -1 if error
+*/
+int session_open(const struct bench_options *options) {
+    struct addrinfo hints = {0};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *address;
+    if (getaddrinfo(options->host, options->port, &hints, &address) != 0) {
+        fprintf(stderr, "getaddrinfo: can't resolve %s\n", options->host);
+        return -1;
+    }
+    int session = socket(AF_INET, SOCK_STREAM, 0);
+    if (session < 0 || connect(session, address->ai_addr, address->ai_addrlen) < 0) {
+        perror("connect");
+        freeaddrinfo(address);
+        if (session >= 0)
+            close(session);
+        return -1;
+    }
+    freeaddrinfo(address);
+
+    int opt = 1;
+    setsockopt(session, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+    unsigned char hello[] = {OP_HELLO, PROTOCOL_V2};
+    unsigned char hello_reply[2];
+    if (send(session, hello, sizeof(hello), MSG_NOSIGNAL) != sizeof(hello) || recv(session, hello_reply, sizeof(hello_reply), MSG_WAITALL) != sizeof(hello_reply) || hello_reply[0] != 0 || hello_reply[1] != PROTOCOL_V2) {
+        fprintf(stderr, "server doesn't support protocol v2\n");
+        close(session);
+        return -1;
+    }
+    return session;
+}
+
+/**
+* @brief abandoned sessions thread function. Every session pipelines ABANDONED_BURST STATS requests and closes
+*        without reading a reply, so the server writes to a closed socket while the clients are measured; a
+*        server that doesn't survive it shows up as lost requests
+* @param options program options
+*/
+void *abandon_thread(void *options_ptr) {
+    const struct bench_options *options = options_ptr;
+    static unsigned char burst[2 * ABANDONED_BURST];
+    for (int i = 0; i < ABANDONED_BURST; i++) {
+        burst[2 * i] = STATS_OPCODE;
+        burst[2 * i + 1] = 0;  // empty datetime
+    }
+
+    for (int i = 0; i < options->abandoned_sessions && __atomic_load_n(&phase, __ATOMIC_RELAXED) != PHASE_STOP; i++) {
+        int session = session_open(options);
+        if (session < 0)
+            return NULL;
+        if (send(session, burst, sizeof(burst), MSG_NOSIGNAL) != sizeof(burst))
+            perror("send");
+        close(session);
+    }
+    return NULL;
+}
+
+/**
+* @brief open a v2 session with the server, and register and connect the client's user
+* @param client client
+* @param options program options
+* @return 0 if successful
+* @return -1 if error
+*/
+int client_open(struct load_client *client, const struct bench_options *options) {
+    client->socket = session_open(options);
+    if (client->socket < 0)
+        return -1;
+
+    // the client's own user first, then the rest of the session takes its requests from the mix
+    if (client_request(client, options, OP_REGISTER) != 0 || client_request(client, options, OP_CONNECT) != 0)
+        return -1;
+    return 0;
+}
+
+/**
+* @brief send as much of the request in flight as the socket takes, waiting for it to be writable if needed
+* @param thread thread of the client
+* @param client client
+* @return 0 if successful
+* @return -1 if error
+*/
+int client_send(struct load_thread *thread, struct load_client *client) {
+    while (client->request_sent < client->request_len) {
+        ssize_t n = send(client->socket, client->request + client->request_sent, client->request_len - client->request_sent, MSG_NOSIGNAL);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n <= 0)
+            return -1;
+        client->request_sent += n;
+    }
+    int writing = client->request_sent < client->request_len;
+    if (writing != client->writing) {
+        struct epoll_event event = {.events = EPOLLIN | (writing ? EPOLLOUT : 0), .data.ptr = client};
+        if (epoll_ctl(thread->epoll, EPOLL_CTL_MOD, client->socket, &event) < 0)
+            return -1;
+        client->writing = writing;
+    }
+    return 0;
+}
+
+/**
+* @brief start the client's next request, planning a new operation of the mix if the last one is done
+* @param thread thread of the client
+* @param client client
+* @return 0 if successful
+* @return -1 if error
+*/
+int client_start(struct load_thread *thread, struct load_client *client) {
+    if (client->step_count == 0)
+        client_plan(client, thread->options);
+    client_encode(client, thread->options, client->steps[--client->step_count]);
+    client->start_ns = monotonic_ns();
+    client->recorded = __atomic_load_n(&phase, __ATOMIC_RELAXED) == PHASE_MEASURE;
+    return client_send(thread, client);
+}
+
+/**
+* @brief drop a client whose connection failed
+* @param thread thread of the client
+* @param client client
+*/
+void client_fail(struct load_thread *thread, struct load_client *client) {
+    if (client->recorded)
+        thread->lost++;
+    epoll_ctl(thread->epoll, EPOLL_CTL_DEL, client->socket, NULL);
+    close(client->socket);
+    client->socket = -1;
+    client->active = 0;
+    thread->active--;
+}
+
+/**
+* @brief handle an epoll event of a client: send the rest of its request, or receive its reply, record its
+*        latency and start the next request unless the run is over
+* @param thread thread of the client
+* @param client client
+* @param events epoll events
+*/
+void client_event(struct load_thread *thread, struct load_client *client, unsigned int events) {
+    if ((events & EPOLLOUT) && client_send(thread, client) < 0) {
+        client_fail(thread, client);
+        return;
+    }
+    if (!(events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+        return;
+
+    while (1) {
+        if (client->reply_len == client->reply_size) {
+            unsigned char *reply = realloc(client->reply, client->reply_size * 2);
+            if (reply == NULL) {
+                client_fail(thread, client);
+                return;
+            }
+            client->reply = reply;
+            client->reply_size *= 2;
+        }
+        ssize_t n = recv(client->socket, client->reply + client->reply_len, client->reply_size - client->reply_len, 0);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n <= 0) {
+            client_fail(thread, client);
+            return;
+        }
+        client->reply_len += n;
+    }
+
+    ssize_t len = reply_length(client->opcode, client->reply, client->reply_len);
+    if (len == 0)
+        return;
+    if (len < 0 || (size_t)len != client->reply_len) {
+        // malformed, or data past the reply of the only request in flight
+        client_fail(thread, client);
+        return;
+    }
+    if (client->recorded) {
+        struct operation_stats *stats = &thread->stats[client->opcode];
+        histogram_record(&stats->latency, monotonic_ns() - client->start_ns);
+        stats->statuses[client->reply[0] < STATUSES ? client->reply[0] : STATUSES - 1]++;
+    }
+
+    // finish the operation of the mix being sent, so the client ends connected
+    if (__atomic_load_n(&phase, __ATOMIC_RELAXED) == PHASE_STOP && client->step_count == 0) {
+        client->active = 0;
+        thread->active--;
+        return;
+    }
+    if (client_start(thread, client) < 0)
+        client_fail(thread, client);
+}
+
+/**
+* @brief set a socket blocking or non-blocking
+* @param socket socket
+* @param blocking whether to block
+* @return 0 if successful
+* @return -1 if error
+*/
+int set_blocking(int socket, int blocking) {
+    int flags = fcntl(socket, F_GETFL, 0);
+    if (flags < 0)
+        return -1;
+    return fcntl(socket, F_SETFL, blocking ? flags & ~O_NONBLOCK : flags | O_NONBLOCK);
+}
+
+/**
+* @brief load thread function. Opens a session for each of its clients, registering and connecting its user,
+*        then, once every thread is ready, keeps a request of each client in flight until the run is over, and
+*        finally unregisters every user its clients registered
+* @param thread_ptr thread
+*/
+void *load_thread(void *thread_ptr) {
+    struct load_thread *thread = thread_ptr;
+    const struct bench_options *options = thread->options;
+
+    thread->epoll = epoll_create1(0);
+    for (int i = 0; i < thread->count; i++) {
+        struct load_client *client = &thread->clients[i];
+        int ready = client_open(client, options) == 0 && set_blocking(client->socket, 0) == 0;
+        struct epoll_event event = {.events = EPOLLIN, .data.ptr = client};
+        if (!ready || thread->epoll < 0 || epoll_ctl(thread->epoll, EPOLL_CTL_ADD, client->socket, &event) < 0) {
+            // the rest would most likely fail the same way
+            thread->failed_setups = thread->count - i;
+            for (; i < thread->count; i++) {
+                if (thread->clients[i].socket >= 0)
+                    close(thread->clients[i].socket);
+                thread->clients[i].socket = -1;
+            }
+        }
+    }
+    pthread_barrier_wait(thread->start);
+
+    for (int i = 0; i < thread->count; i++) {
+        struct load_client *client = &thread->clients[i];
+        if (client->socket < 0)
+            continue;
+        client->active = 1;
+        thread->active++;
+        if (client_start(thread, client) < 0)
+            client_fail(thread, client);
+    }
+
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+    while (thread->active > 0) {
+        int n = epoll_wait(thread->epoll, events, EPOLL_MAX_EVENTS, EPOLL_TIMEOUT);
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            struct load_client *client = events[i].data.ptr;
+            if (client->active)
+                client_event(thread, client, events[i].events);
+        }
+    }
+
+    // unregister the extra users, then the client's own
+    for (int i = 0; i < thread->count; i++) {
+        struct load_client *client = &thread->clients[i];
+        if (client->socket < 0 || client->active || set_blocking(client->socket, 1) < 0)
+            continue;
+        char username[NAME_SIZE];
+        memcpy(username, client->username, NAME_SIZE);
+        int registered = client->registered;
+        for (int j = 1; j < registered; j++) {
+            snprintf(client->username, NAME_SIZE, "%s_%d", username, j);
+            client_request(client, options, OP_UNREGISTER);
+        }
+        memcpy(client->username, username, NAME_SIZE);
+        client_request(client, options, OP_DISCONNECT);
+        client_request(client, options, OP_UNREGISTER);
+    }
+    if (thread->epoll >= 0)
+        close(thread->epoll);
+    return NULL;
+}
+
+/**
+* @brief print a result of the run as a JSON object
+* @param name name of the operation, empty for the total
+* @param histogram latencies
+* @param statuses replies with each status
+* @param elapsed seconds measured
+* @param last whether it's the last one of its JSON object
+*/
+void print_result(const char *name, const struct histogram *histogram, const unsigned long *statuses, double elapsed, int last) {
+    unsigned long count = histogram_count(histogram);
+    const char *indent = name[0] == '\0' ? "" : "  ";
+    printf("  %s\"%s\": {\"requests\": %lu, \"statuses\": {", indent, name[0] == '\0' ? "total" : name, count);
+    for (int status = 0, first = 1; status < STATUSES; status++) {
+        if (statuses[status] > 0) {
+            printf("%s\"%d\": %lu", first ? "" : ", ", status, statuses[status]);
+            first = 0;
+        }
+    }
+    printf("}, \"throughput\": %.1f, \"mean_us\": %.1f, "
+           "\"p50_us\": %.1f, \"p99_us\": %.1f, \"p999_us\": %.1f, \"max_us\": %.1f}%s\n",
+           count / elapsed, count > 0 ? histogram->sum_ns / 1e3 / count : 0,
+           histogram_quantile(histogram, count, 0.5) / 1e3, histogram_quantile(histogram, count, 0.99) / 1e3,
+           histogram_quantile(histogram, count, 0.999) / 1e3, histogram->max_ns / 1e3, last ? "" : ",");
+}
+
+int main(int argc, char *argv[]) {
+    struct bench_options options;
+    if (check_arguments(argc, argv, &options) < 0)
+        exit(1);
+
+    // a socket per client
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    struct load_client *clients = calloc(options.clients, sizeof(struct load_client));
+    struct load_thread *threads = calloc(options.threads, sizeof(struct load_thread));
+    pthread_t *thread_ids = malloc(options.threads * sizeof(pthread_t));
+    int *idle_sessions = malloc((options.idle_sessions + 1) * sizeof(int));
+    if (clients == NULL || threads == NULL || thread_ids == NULL || idle_sessions == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    // sessions that only negotiate the protocol, opened first so the clients' requests have to be served
+    // while the server holds them (a server that keeps a thread per session runs out of threads)
+    for (int i = 0; i < options.idle_sessions; i++) {
+        idle_sessions[i] = session_open(&options);
+        if (idle_sessions[i] < 0) {
+            fprintf(stderr, "%d of %d idle sessions couldn't be opened\n", options.idle_sessions - i, options.idle_sessions);
+            exit(1);
+        }
+    }
+    for (int i = 0; i < options.clients; i++) {
+        clients[i].socket = -1;
+        clients[i].seed = i + 1;
+        client_username(clients[i].username, i);
+        clients[i].reply_size = REPLY_BUFFER_INITIAL_SIZE;
+        clients[i].reply = malloc(clients[i].reply_size);
+        if (clients[i].reply == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+    }
+
+    // the barrier has one more party, so the clock starts once every session is open
+    pthread_barrier_t start;
+    pthread_barrier_init(&start, NULL, options.threads + 1);
+    for (int i = 0, first = 0; i < options.threads; i++) {
+        threads[i].options = &options;
+        threads[i].start = &start;
+        threads[i].clients = &clients[first];
+        threads[i].count = options.clients / options.threads + (i < options.clients % options.threads);
+        first += threads[i].count;
+        if (pthread_create(&thread_ids[i], NULL, load_thread, &threads[i]) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    pthread_barrier_wait(&start);
+
+    int failed_setups = 0;
+    for (int i = 0; i < options.threads; i++)
+        failed_setups += threads[i].failed_setups;
+    if (failed_setups > 0) {
+        fprintf(stderr, "%d of %d sessions couldn't be opened\n", failed_setups, options.clients);
+        __atomic_store_n(&phase, PHASE_STOP, __ATOMIC_RELAXED);
+        for (int i = 0; i < options.threads; i++)
+            pthread_join(thread_ids[i], NULL);
+        exit(1);
+    }
+
+    sleep(options.warmup);
+    __atomic_store_n(&phase, PHASE_MEASURE, __ATOMIC_RELAXED);
+    unsigned long long start_ns = monotonic_ns();
+    pthread_t abandon_id;
+    if (options.abandoned_sessions > 0 && pthread_create(&abandon_id, NULL, abandon_thread, &options) != 0) {
+        perror("pthread_create");
+        exit(1);
+    }
+    sleep(options.duration);
+    __atomic_store_n(&phase, PHASE_STOP, __ATOMIC_RELAXED);
+    double elapsed = (monotonic_ns() - start_ns) / 1e9;
+    if (options.abandoned_sessions > 0)
+        pthread_join(abandon_id, NULL);
+
+    struct operation_stats *stats = calloc(OPCODES, sizeof(struct operation_stats));
+    struct histogram *total = calloc(1, sizeof(struct histogram));
+    if (stats == NULL || total == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    unsigned long lost = 0, statuses[STATUSES] = {0};
+    for (int i = 0; i < options.threads; i++) {
+        pthread_join(thread_ids[i], NULL);
+        lost += threads[i].lost;
+        for (int opcode = 0; opcode < OPCODES; opcode++) {
+            histogram_merge(&stats[opcode].latency, &threads[i].stats[opcode].latency);
+            for (int status = 0; status < STATUSES; status++)
+                stats[opcode].statuses[status] += threads[i].stats[opcode].statuses[status];
+        }
+    }
+    for (int opcode = 0; opcode < OPCODES; opcode++) {
+        histogram_merge(total, &stats[opcode].latency);
+        for (int status = 0; status < STATUSES; status++)
+            statuses[status] += stats[opcode].statuses[status];
+    }
+
+    // machine readable results, one line per operation
+    printf("{\n  \"clients\": %d,\n  \"idle_sessions\": %d,\n  \"abandoned_sessions\": %d,\n  \"threads\": %d,\n  \"duration_s\": %.3f,\n  \"page_limit\": \"%s\",\n  \"mix\": {",
+           options.clients, options.idle_sessions, options.abandoned_sessions, options.threads, elapsed, options.page_limit);
+    for (int opcode = 0, first = 1; opcode < OPCODES; opcode++) {
+        if (options.weights[opcode] > 0) {
+            printf("%s\"%s\": %d", first ? "" : ", ", operation_names[opcode], options.weights[opcode]);
+            first = 0;
+        }
+    }
+    printf("},\n  \"lost_requests\": %lu,\n  \"operations\": {\n", lost);
+    int last = 0;
+    for (int opcode = 0; opcode < OPCODES; opcode++) {
+        if (histogram_count(&stats[opcode].latency) > 0)
+            last = opcode;
+    }
+    for (int opcode = 0; opcode < OPCODES; opcode++) {
+        if (histogram_count(&stats[opcode].latency) > 0)
+            print_result(operation_names[opcode], &stats[opcode].latency, stats[opcode].statuses, elapsed, opcode == last);
+    }
+    printf("  },\n");
+    print_result("", total, statuses, elapsed, 1);
+    printf("}\n");
+
+    pthread_barrier_destroy(&start);
+    for (int i = 0; i < options.idle_sessions; i++)
+        close(idle_sessions[i]);
+    free(idle_sessions);
+    for (int i = 0; i < options.clients; i++)
+        free(clients[i].reply);
+    free(clients);
+    free(threads);
+    free(thread_ids);
+    free(stats);
+    free(total);
+    return lost > 0;
+}
@@ -0,0 +1,385 @@
+// microbenchmarks of the registry and catalog functions of server.c, built into the same program so they run
+// without sockets, the RPC server or the log (which stays closed, so nothing is written to disk)
+#define main server_main
+#include "../server.c"
+#undef main
+
+#define DEFAULT_MAX_RECORDS 10000000
+#define DEFAULT_OPERATIONS 100000  // measured calls of each function at each dataset size
+#define MIN_RECORDS 1000
+#define SAMPLE_SIZE 65536  // existing keys looked up, picked at random from the whole dataset
+#define KEY_SIZE 32
+#define BATCH_PERCENT 10  // records added (then removed) per batch, so the dataset size stays within 10%
+#define CONNECTED_USERS 1024  // users kept connected, as connecting copies the connected view of a stripe
+#define OWNER_USERNAME "micro_owner"
+
+// every allocation goes through these, so they can be counted
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *pointer, size_t size);
+extern void __libc_free(void *pointer);
+
+unsigned long micro_allocations;
+
+void *malloc(size_t size) {
+    micro_allocations++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    micro_allocations++;
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *pointer, size_t size) {
+    micro_allocations++;
+    return __libc_realloc(pointer, size);
+}
+
+void free(void *pointer) {
+    __libc_free(pointer);
+}
+
+// program options
+struct micro_options {
+    unsigned long max_records;
+    unsigned long operations;
+    int users;  // run the registry benchmarks
+    int files;  // run the catalog benchmarks
+};
+
+// a measurement in progress
+struct micro_timer {
+    unsigned long long start_ns;
+    unsigned long start_allocations;
+    unsigned long long elapsed_ns;
+    unsigned long allocations;
+    unsigned long operations;
+};
+
+const char *micro_words[] = {"report", "draft", "photo", "music", "notes", "backup", "video", "slides", "thesis", "data"};
+#define MICRO_WORDS (sizeof(micro_words) / sizeof(micro_words[0]))
+
+/**
+* @brief check and save the program arguments
+* @param argc number of arguments
+* @param argv arguments
+* @param options options to fill in
+* @return 0 if successful
+* @return -1 if error
+*/
+int micro_arguments(int argc, char *argv[], struct micro_options *options) {
+    options->max_records = DEFAULT_MAX_RECORDS;
+    options->operations = DEFAULT_OPERATIONS;
+    options->users = 1;
+    options->files = 1;
+
+    int opt, valid = 1;
+    while ((opt = getopt(argc, argv, "n:o:b:")) != -1) {
+        switch (opt) {
+            case 'n':
+                options->max_records = strtoul(optarg, NULL, 10);
+                break;
+            case 'o':
+                options->operations = strtoul(optarg, NULL, 10);
+                break;
+            case 'b':
+                options->users = strcmp(optarg, "users") == 0;
+                options->files = strcmp(optarg, "files") == 0;
+                valid = options->users || options->files;
+                break;
+            default:
+                valid = 0;
+                break;
+        }
+    }
+    if (!valid || options->max_records < MIN_RECORDS || options->operations == 0) {
+        fprintf(stderr, "usage: %s [-n <max records, at least %d>] [-o <operations per measurement>] [-b users|files]\n", argv[0], MIN_RECORDS);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+* @brief start timing a batch of calls
+* @param timer timer
+*/
+void micro_start(struct micro_timer *timer) {
+    timer->start_allocations = micro_allocations;
+    timer->start_ns = monotonic_ns();
+}
+
+/**
+* @brief stop timing a batch of calls, adding it to the measurement
+* @param timer timer
+* @param operations calls in the batch
+*/
+void micro_stop(struct micro_timer *timer, unsigned long operations) {
+    timer->elapsed_ns += monotonic_ns() - timer->start_ns;
+    timer->allocations += micro_allocations - timer->start_allocations;
+    timer->operations += operations;
+}
+
+/**
+* @brief print a measurement
+* @param function name of the function measured
+* @param records dataset size
+* @param timer measurement
+*/
+void micro_report(const char *function, unsigned long records, struct micro_timer *timer) {
+    printf("%-42s %10lu %10lu %12.1f %12.2f\n", function, records, timer->operations,
+           (double)timer->elapsed_ns / timer->operations, (double)timer->allocations / timer->operations);
+    fflush(stdout);
+}
+
+/**
+* @brief fill an array of keys from a format and their indexes
+* @param keys keys, KEY_SIZE bytes each
+* @param count number of keys
+* @param format format, with an unsigned long conversion
+* @param first index of the first key
+* @param range if not 0, indexes are picked at random below it instead of following first
+* @param seed random seed
+*/
+void micro_keys(char *keys, unsigned long count, const char *format, unsigned long first, unsigned long range, unsigned int *seed) {
+    for (unsigned long i = 0; i < count; i++) {
+        unsigned long index = range == 0 ? first + i : (((unsigned long)rand_r(seed) << 31) | rand_r(seed)) % range;
+        snprintf(keys + i * KEY_SIZE, KEY_SIZE, format, index);
+    }
+}
+
+/**
+* @brief look a file up the way publish_file() checks if it was published: in the file index of its user, with
+*        their stripe locked (check_published_file_existance() before the file index)
+* @param username username
+* @param filename filename
+* @return 1 if published, 0 if not
+* @return -1 if the user doesn't exist or is not connected
+*/
+int micro_file_lookup(USERNAME username, FILENAME filename) {
+    struct state_stripe *stripe;
+    struct registered_user *user;
+    if (lock_connected_user(username, 0, &stripe, &user) != 0)
+        return -1;
+    int published = file_index_lookup(&user->published, filename) != NULL;
+    pthread_rwlock_unlock(&stripe->lock);
+    return published;
+}
+
+/**
+* @brief time calls of a function on existing keys, then on missing ones
+* @param name name of the function
+* @param function function
+* @param records dataset size
+* @param operations number of calls
+* @param sample existing keys
+* @param missing missing keys
+* @param expected what the function returns for existing keys, -1 if it varies
+*/
+void micro_lookups(const char *name, int (*function)(USERNAME), unsigned long records, unsigned long operations, char *sample, char *missing, int expected) {
+    struct micro_timer timer = {0};
+    char label[64];
+    unsigned long unexpected = 0;
+    micro_start(&timer);
+    for (unsigned long i = 0; i < operations; i++) {
+        int result = function(sample + (i % SAMPLE_SIZE) * KEY_SIZE);
+        unexpected += expected >= 0 && result != expected;
+    }
+    micro_stop(&timer, operations);
+    micro_report(name, records, &timer);
+
+    memset(&timer, 0, sizeof(timer));
+    micro_start(&timer);
+    for (unsigned long i = 0; i < operations; i++)
+        unexpected += function(missing + (i % SAMPLE_SIZE) * KEY_SIZE) != 0;
+    micro_stop(&timer, operations);
+    snprintf(label, sizeof(label), "%s (missing)", name);
+    micro_report(label, records, &timer);
+
+    if (unexpected > 0)
+        fprintf(stderr, "%s: %lu unexpected results\n", name, unexpected);
+}
+
+/**
+* @brief run the registry benchmarks: check_username_existence(), check_user_connection(), register_user() and
+*        unregister_user() with from MIN_RECORDS up to max_records registered users, 10 times more each time
+* @param options program options
+* @return 0 if successful
+* @return -1 if error
+*/
+int micro_users(const struct micro_options *options) {
+    char *sample = malloc(SAMPLE_SIZE * KEY_SIZE);
+    char *missing = malloc(SAMPLE_SIZE * KEY_SIZE);
+    unsigned long batch_capacity = options->max_records * BATCH_PERCENT / 100;
+    char *batch = malloc((batch_capacity < options->operations ? batch_capacity : options->operations) * KEY_SIZE);
+    if (sample == NULL || missing == NULL || batch == NULL) {
+        perror("malloc");
+        free(sample);
+        free(missing);
+        free(batch);
+        return -1;
+    }
+
+    unsigned int seed = 1;
+    unsigned long records = 0, next_batch = 0;
+    char username[KEY_SIZE], ip[IP_ADDRESS_SIZE] = "127.0.0.1", port[PORT_SIZE] = "5555";
+    for (unsigned long size = MIN_RECORDS; size <= options->max_records; size *= 10) {
+        // grow the registry, connecting the first users
+        for (; records < size; records++) {
+            snprintf(username, sizeof(username), "micro_user_%lu", records);
+            if (register_user(username) != 0 || (records < CONNECTED_USERS && connect_user(username, ip, port) != 0)) {
+                fprintf(stderr, "can't register %s\n", username);
+                return -1;
+            }
+        }
+
+        micro_keys(sample, SAMPLE_SIZE, "micro_user_%lu", 0, records, &seed);
+        micro_keys(missing, SAMPLE_SIZE, "micro_missing_%lu", 0, records, &seed);
+        micro_lookups("check_username_existence", check_username_existence, records, options->operations, sample, missing, 1);
+        // only the first CONNECTED_USERS are connected
+        micro_lookups("check_user_connection", check_user_connection, records, options->operations, sample, missing, -1);
+
+        // register a batch of new users, then unregister them, until there were enough calls
+        struct micro_timer register_timer = {0}, unregister_timer = {0};
+        unsigned long batch_size = records * BATCH_PERCENT / 100;
+        while (register_timer.operations < options->operations) {
+            unsigned long count = options->operations - register_timer.operations < batch_size ? options->operations - register_timer.operations : batch_size;
+            micro_keys(batch, count, "micro_new_%lu", next_batch, 0, &seed);
+            next_batch += count;
+
+            int failed = 0;
+            micro_start(&register_timer);
+            for (unsigned long i = 0; i < count; i++)
+                failed |= register_user(batch + i * KEY_SIZE);
+            micro_stop(&register_timer, count);
+            micro_start(&unregister_timer);
+            for (unsigned long i = 0; i < count; i++)
+                failed |= unregister_user(batch + i * KEY_SIZE);
+            micro_stop(&unregister_timer, count);
+            if (failed) {
+                fprintf(stderr, "register_user/unregister_user failed\n");
+                return -1;
+            }
+        }
+        micro_report("register_user", records, &register_timer);
+        micro_report("unregister_user", records, &unregister_timer);
+    }
+
+    // leave the memory to the catalog benchmarks
+    while (records > 0) {
+        snprintf(username, sizeof(username), "micro_user_%lu", --records);
+        unregister_user(username);
+    }
+    free(sample);
+    free(missing);
+    free(batch);
+    return 0;
+}
+
+/**
+* @brief run the catalog benchmarks: publish_file(), delete() and the lookup of a published file, with from
+*        MIN_RECORDS up to max_records files published by a single connected user, 10 times more each time
+* @param options program options
+* @return 0 if successful
+* @return -1 if error
+*/
+int micro_files(const struct micro_options *options) {
+    char *sample = malloc(SAMPLE_SIZE * KEY_SIZE);
+    char *missing = malloc(SAMPLE_SIZE * KEY_SIZE);
+    unsigned long batch_capacity = options->max_records * BATCH_PERCENT / 100;
+    char *batch = malloc((batch_capacity < options->operations ? batch_capacity : options->operations) * KEY_SIZE);
+    if (sample == NULL || missing == NULL || batch == NULL) {
+        perror("malloc");
+        free(sample);
+        free(missing);
+        free(batch);
+        return -1;
+    }
+
+    char owner[] = OWNER_USERNAME, ip[IP_ADDRESS_SIZE] = "127.0.0.1", port[PORT_SIZE] = "5555";
+    if (register_user(owner) != 0 || connect_user(owner, ip, port) != 0) {
+        fprintf(stderr, "can't register %s\n", owner);
+        return -1;
+    }
+
+    unsigned int seed = 1;
+    unsigned long records = 0, next_batch = 0;
+    char filename[KEY_SIZE], description[DESCRIPTION_SIZE];
+    for (unsigned long size = MIN_RECORDS; size <= options->max_records; size *= 10) {
+        // grow the catalog, with descriptions of a few common words each
+        for (; records < size; records++) {
+            snprintf(filename, sizeof(filename), "file_%lu.txt", records);
+            snprintf(description, sizeof(description), "%s %s", micro_words[rand_r(&seed) % MICRO_WORDS], micro_words[rand_r(&seed) % MICRO_WORDS]);
+            if (publish_file(owner, filename, description, "") != 0) {
+                fprintf(stderr, "can't publish %s\n", filename);
+                return -1;
+            }
+        }
+
+        micro_keys(sample, SAMPLE_SIZE, "file_%lu.txt", 0, records, &seed);
+        micro_keys(missing, SAMPLE_SIZE, "missing_%lu.txt", 0, records, &seed);
+        struct micro_timer timer = {0};
+        unsigned long unexpected = 0;
+        micro_start(&timer);
+        for (unsigned long i = 0; i < options->operations; i++)
+            unexpected += micro_file_lookup(owner, sample + (i % SAMPLE_SIZE) * KEY_SIZE) != 1;
+        micro_stop(&timer, options->operations);
+        micro_report("check_published_file_existance", records, &timer);
+        memset(&timer, 0, sizeof(timer));
+        micro_start(&timer);
+        for (unsigned long i = 0; i < options->operations; i++)
+            unexpected += micro_file_lookup(owner, missing + (i % SAMPLE_SIZE) * KEY_SIZE) != 0;
+        micro_stop(&timer, options->operations);
+        micro_report("check_published_file_existance (missing)", records, &timer);
+        if (unexpected > 0)
+            fprintf(stderr, "file lookup: %lu unexpected results\n", unexpected);
+
+        // publish a batch of new files, then delete them, until there were enough calls
+        struct micro_timer publish_timer = {0}, delete_timer = {0};
+        unsigned long batch_size = records * BATCH_PERCENT / 100;
+        while (publish_timer.operations < options->operations) {
+            unsigned long count = options->operations - publish_timer.operations < batch_size ? options->operations - publish_timer.operations : batch_size;
+            micro_keys(batch, count, "new_%lu.txt", next_batch, 0, &seed);
+            next_batch += count;
+
+            int failed = 0;
+            snprintf(description, sizeof(description), "%s %s", micro_words[rand_r(&seed) % MICRO_WORDS], micro_words[rand_r(&seed) % MICRO_WORDS]);
+            micro_start(&publish_timer);
+            for (unsigned long i = 0; i < count; i++)
+                failed |= publish_file(owner, batch + i * KEY_SIZE, description, "");
+            micro_stop(&publish_timer, count);
+            micro_start(&delete_timer);
+            for (unsigned long i = 0; i < count; i++)
+                failed |= delete(owner, batch + i * KEY_SIZE);
+            micro_stop(&delete_timer, count);
+            if (failed) {
+                fprintf(stderr, "publish_file/delete failed\n");
+                return -1;
+            }
+        }
+        micro_report("publish_file", records, &publish_timer);
+        micro_report("delete", records, &delete_timer);
+    }
+
+    unregister_user(owner);
+    free(sample);
+    free(missing);
+    free(batch);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    struct micro_options options;
+    if (micro_arguments(argc, argv, &options) < 0)
+        exit(1);
+    if (state_init() < 0)
+        exit(1);
+
+    printf("%-42s %10s %10s %12s %12s\n", "function", "records", "operations", "ns/op", "allocs/op");
+    if (options.users && micro_users(&options) < 0)
+        exit(1);
+    if (options.files && micro_files(&options) < 0)
+        exit(1);
+
+    return 0;
+}
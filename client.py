@@ -2,14 +2,17 @@ from enum import Enum
 import argparse
 import socket
 import threading
+import subprocess
 import json
 import os
 import errno
 import io
-from time import sleep
+from time import sleep, monotonic
 import signal
-import zeep
-import requests
+import select
+import contextlib
+import hashlib
+import collections
 
 
 # messages size in bytes
@@ -22,7 +25,38 @@ DESCRIPTION_SIZE = 256
 IP_ADDRESS_SIZE = 16
 PORT_SIZE = 6
 CLIENT_CONNECTIONS = 1
-WS_PORT = 8000
+OPERATION_SIZE = 11  # client-client operation (GET_FILE, GET_RANGE, GET_HASHES) and its '\0'
+RANGE_FIELD_SIZE = 21  # decimal offset, length, size or modification time and its '\0'
+GET_FILE_CONNECTIONS = 4  # ranges of a file downloaded in parallel
+GET_FILE_SEGMENT_MIN = 8 * 1024 * 1024  # smallest range worth its own connection
+GET_FILE_BUFFER_SIZE = 1024 * 1024
+GET_FILE_STATE_SUFFIX = ".getfile"  # sidecar of a partial download (<local_filename>.getfile), its "Mode" is the one that resumes it
+GET_FILE_STATE_INTERVAL = 8 * 1024 * 1024  # bytes of a range received between sidecar saves
+SWARM_CHUNK_SIZE = 4 * 1024 * 1024  # chunks hashed at PUBLISH, downloaded from any user publishing the same content
+SWARM_DIGEST_SIZE = 32  # SHA-256
+SWARM_CONNECTIONS = 8  # chunks of a swarm download fetched at once, spread over the users publishing the file
+SWARM_DUPLICATES = 2  # copies of a chunk fetched at once from different users, once no chunk is left to start
+SWARM_PEER_FAILURES = 2  # failed chunks before a user is left out of the download (at once if a chunk is wrong)
+SWARM_TIMEOUT = 10  # seconds a user may take to connect or to send more of a chunk
+# empty datetime field, the server stamps the operation with its own clock
+SERVER_DATETIME = ""
+# native GET_FILE server (make peer), serves the published files instead of a thread when built
+PEER_SERVER = os.path.join(os.path.dirname(os.path.abspath(__file__)), "peer")
+
+# protocol v2 (1 byte opcode, varint length prefixed fields), negotiated with HELLO
+PROTOCOL_VERSION = 2
+OP_HELLO = 0
+OP_REGISTER = 1
+OP_UNREGISTER = 2
+OP_CONNECT = 3
+OP_PUBLISH = 4
+OP_DISCONNECT = 5
+OP_DELETE = 6
+OP_LIST_USERS = 7
+OP_LIST_CONTENT = 8
+OP_SEARCH = 9
+OP_STATS = 10
+OP_SOURCES = 11
 
 
 class client:
@@ -30,6 +64,8 @@ class client:
         self.__username = ""
         self.__server_socket = None
         self.__server_thread = None
+        self.__server_process = None  # peer server serving GET_FILE instead of __server_thread
+        self.__session = None  # persistent connection to the server, shared by every request
     
     # ******************** TYPES *********************
     # *
@@ -44,15 +80,110 @@ class client:
     _port = -1
 
     # ******************** METHODS *******************
-    def __datetime(self) -> str:
-        # CLIENT-WEB SERVER CONNECTION
+    @staticmethod
+    def __encode_varint(value: int) -> bytes:
+        # 7 BITS PER BYTE, LEAST SIGNIFICANT FIRST, HIGH BIT SET IF MORE BYTES FOLLOW
+        encoded = bytearray()
+        while True:
+            byte = value & 0x7F
+            value >>= 7
+            if value:
+                encoded.append(byte | 0x80)
+            else:
+                encoded.append(byte)
+                return bytes(encoded)
+
+    @staticmethod
+    def __recv_exact(client_socket: socket.socket, size: int) -> bytes:
+        data = b""
+        while len(data) < size:
+            chunk = client_socket.recv(size - len(data))
+            if not chunk:
+                raise socket.error("connection closed by server")
+            data += chunk
+        return data
+
+    def __recv_varint(self, client_socket: socket.socket) -> int:
+        value = 0
+        shift = 0
+        while True:
+            byte = self.__recv_exact(client_socket, 1)[0]
+            value |= (byte & 0x7F) << shift
+            if not byte & 0x80:
+                return value
+            shift += 7
+
+    def __recv_string(self, client_socket: socket.socket) -> str:
+        return self.__recv_exact(client_socket, self.__recv_varint(client_socket)).decode()
+
+    def __recv_field(self, client_socket: socket.socket, size: int) -> str:
+        # '\0' TERMINATED FIELD OF A CLIENT-CLIENT MESSAGE, AT MOST size BYTES
+        field = b""
+        while len(field) < size:
+            byte = client_socket.recv(1)
+            if not byte or byte == b"\0":
+                break
+            field += byte
+        return field.decode()
+
+    def __recv_status(self, client_socket: socket.socket) -> str:
+        return str(self.__recv_exact(client_socket, EXECUTION_STATUS_SIZE)[0])
+
+    def __close_session(self):
+        if self.__session is not None:
+            self.__session.close()
+            self.__session = None
+
+    def __stop_sharing(self):
+        self.__server_socket.close()
+        self.__server_socket = None
+        if self.__server_process is not None:
+            self.__server_process.terminate()
+            self.__server_process.wait()
+            self.__server_process = None
+        else:
+            self.__server_thread.join()
+            self.__server_thread = None
+
+    def __session_closed(self) -> bool:
+        # A SESSION THE SERVER CLOSED (E.G. ON RESTART) SHOWS AS A READABLE SOCKET WITH NOTHING TO READ
+        try:
+            readable, _, _ = select.select([self.__session], [], [], 0)
+            return bool(readable) and not self.__session.recv(1, socket.MSG_PEEK)
+        except (socket.error, ValueError):
+            return True
+
+    @contextlib.contextmanager
+    def __pipeline(self, *requests: tuple):
+        # EVERY (opcode, field, ...) REQUEST IN A SINGLE WRITE, REPLIES COME BACK IN THE SAME ORDER
+        message = bytearray()
+        if self.__session is not None and self.__session_closed():
+            self.__close_session()
+        new_session = self.__session is None
         try:
-            client = zeep.Client(f"http://localhost:{WS_PORT}/?wsdl")
-            result = client.service.datetime()
-            print(result)
-            return result
-        except (zeep.exceptions.Fault, zeep.exceptions.ValidationError, requests.exceptions.ConnectionError):
-            return ""
+            if new_session:
+                # CLIENT-SERVER CONNECTION, NEGOTIATING PROTOCOL V2 WITH THE FIRST REQUESTS
+                self.__session = socket.create_connection((client._server, client._port))
+                message += bytes([OP_HELLO]) + self.__encode_varint(PROTOCOL_VERSION)  # HELLO <version>
+            for opcode, *fields in requests:
+                message.append(opcode)  # <opcode> ...
+                for field in fields:
+                    encoded = field.encode()
+                    message += self.__encode_varint(len(encoded)) + encoded  # ... <length> <field>
+            self.__session.sendall(message)
+
+            # CHECK NEGOTIATED VERSION
+            if new_session and (self.__recv_exact(self.__session, 1)[0] != OP_HELLO or self.__recv_varint(self.__session) != PROTOCOL_VERSION):
+                raise socket.error("protocol v2 not supported by server")
+
+            yield self.__session
+        except BaseException:
+            # THE SESSION CAN'T BE TRUSTED TO BE IN SYNC ANYMORE
+            self.__close_session()
+            raise
+
+    def __request(self, opcode: int, *fields: str):
+        return self.__pipeline((opcode, *fields))
 
     def register(self, username: str) -> int:
         # INPUT VALIDATION
@@ -60,26 +191,12 @@ class client:
             print("REGISTER FAIL")
             return client.RC.ERROR
         
-        # GET DATETIME
-        datetime = self.__datetime()
-        if datetime == "":
-            print("REGISTER FAIL")
-            return client.RC.ERROR
-
         # CLIENT-SERVER CONNECTION
         try:
-            with socket.socket(socket.AF_INET, socket.SOCK_STREAM) as client_socket:
-                client_socket.connect((client._server, client._port))
-
-                # SEND REQUEST TO SERVER
-                client_socket.sendall("REGISTER\0".encode())  # REGISTER ...
-                sleep(0.1)
-                client_socket.sendall(f"{datetime}\0".encode())  # ... Datetime ...
-                sleep(0.1)
-                client_socket.sendall(f"{username}\0".encode())  # ... <username>
-
+            # SEND REQUEST TO SERVER
+            with self.__request(OP_REGISTER, SERVER_DATETIME, username) as client_socket:
                 # RECEIVE RESPONSE FROM SERVER
-                response = client_socket.recv(EXECUTION_STATUS_SIZE).decode()  # Execution status
+                response = self.__recv_status(client_socket)  # Execution status
                 
                 # CHECK RESPONSE FROM SERVER
                 if response == '0':
@@ -102,26 +219,12 @@ class client:
             print("UNREGISTER FAIL")
             return client.RC.ERROR
         
-        # GET DATETIME
-        datetime = self.__datetime()
-        if datetime == "":
-            print("UNREGISTER FAIL")
-            return client.RC.ERROR
-
         # CLIENT-SERVER CONNECTION
         try:
-            with socket.socket(socket.AF_INET, socket.SOCK_STREAM) as client_socket:
-                client_socket.connect((client._server, client._port))
-
-                # SEND REQUEST TO SERVER
-                client_socket.sendall("UNREGISTER\0".encode())  # UNREGISTER ...
-                sleep(0.1)
-                client_socket.sendall(f"{datetime}\0".encode())  # ... Datetime ...
-                sleep(0.1)
-                client_socket.sendall(f"{username}\0".encode())  # ... <username>
-
+            # SEND REQUEST TO SERVER
+            with self.__request(OP_UNREGISTER, SERVER_DATETIME, username) as client_socket:
                 # RECEIVE RESPONSE FROM SERVER
-                response = client_socket.recv(EXECUTION_STATUS_SIZE).decode()  # Execution status
+                response = self.__recv_status(client_socket)  # Execution status
                 
                 # CHECK RESPONSE FROM SERVER
                 if response == '0':
@@ -145,8 +248,15 @@ class client:
                 try:
                     client_socket = self.__server_socket.accept()[0]
                     with client_socket:
-                        if client_socket.recv(9).decode().rstrip('\0') == "GET_FILE":  # GET_FILE ...
-                            filename = client_socket.recv(FILENAME_SIZE).decode().rstrip('\0')  # ... Filename
+                        operation = self.__recv_field(client_socket, OPERATION_SIZE)  # GET_FILE/GET_RANGE ...
+                        if operation in ("GET_FILE", "GET_RANGE", "GET_HASHES"):
+                            filename = self.__recv_field(client_socket, FILENAME_SIZE)  # ... Filename
+                            if operation == "GET_RANGE":
+                                offset = self.__recv_field(client_socket, RANGE_FIELD_SIZE)  # ... Offset
+                                length = self.__recv_field(client_socket, RANGE_FIELD_SIZE)  # ... Length
+                                if not (offset.isdigit() and length.isdigit()):
+                                    client_socket.sendall("2".encode())  # "2"
+                                    continue
                             try:
                                 # CHECK IF FILE IS PUBLISHED
                                 with open(f"published-{self.__username}.json", "r") as file:  # read from published files
@@ -157,7 +267,22 @@ class client:
                                     if exists:
                                         break
                                 
-                                if exists:
+                                if exists and operation == "GET_HASHES":
+                                    # SEND SIZE AND CHUNK HASHES TO CLIENT, IF THE FILE WAS HASHED WHEN PUBLISHED
+                                    if "Chunks" in file:
+                                        client_socket.sendall(f"0{os.stat(filename).st_size}\0{file['Chunks']}\0".encode())  # "0" Size Chunks
+                                    else:
+                                        client_socket.sendall("1".encode())  # "1"
+                                elif exists and operation == "GET_RANGE":
+                                    # SEND SIZE, MODIFICATION TIME AND RANGE (CUT TO THE FILE) TO CLIENT
+                                    with open(filename, "rb") as file:
+                                        stat = os.fstat(file.fileno())
+                                        offset = min(int(offset), stat.st_size)
+                                        length = min(int(length), stat.st_size - offset)
+                                        client_socket.sendall(f"0{stat.st_size}\0{stat.st_mtime_ns}\0".encode())  # "0" Size Modified
+                                        if length > 0:
+                                            client_socket.sendfile(file, offset, length)
+                                elif exists:
                                     # SEND FILE TO CLIENT
                                     with open(filename, "rb") as file:
                                         client_socket.sendall("0".encode())  # "0"
@@ -183,12 +308,6 @@ class client:
             print("CONNECT FAIL")
             return client.RC.ERROR
         
-        # GET DATETIME
-        datetime = self.__datetime()
-        if datetime == "":
-            print("CONNECT FAIL")
-            return client.RC.ERROR
-
         # CLIENT-CLIENT CONNECTION
         if self.__server_socket is None:
             try:
@@ -199,9 +318,15 @@ class client:
                 self.__server_socket.bind(("localhost", 0))  # OS assigns a free port
                 port = self.__server_socket.getsockname()[1]
 
-                # CREATE THREAD TO LISTEN FOR REQUESTS
-                self.__server_thread = threading.Thread(target=self.__sharefile)
-                self.__server_thread.start()
+                # LISTEN FOR REQUESTS FROM THE PEER SERVER IF BUILT (ZERO-COPY, CONCURRENT), ELSE FROM A THREAD
+                if os.access(PEER_SERVER, os.X_OK):
+                    fd = self.__server_socket.fileno()
+                    self.__server_process = subprocess.Popen(
+                        [PEER_SERVER, "-s", str(fd), "-f", f"published-{self.__username}.json"],
+                        pass_fds=(fd,), start_new_session=True)  # own session, so terminal signals go to the client only
+                else:
+                    self.__server_thread = threading.Thread(target=self.__sharefile)
+                    self.__server_thread.start()
             except (socket.error):
                 print("CONNECT FAIL")
                 return client.RC.ERROR
@@ -211,20 +336,10 @@ class client:
 
         # CLIENT-SERVER CONNECTION
         try:
-            with socket.socket(socket.AF_INET, socket.SOCK_STREAM) as client_socket:
-                client_socket.connect((client._server, client._port))
-
-                # SEND REQUEST TO SERVER
-                client_socket.sendall("CONNECT\0".encode())  # CONNECT ...
-                sleep(0.1)
-                client_socket.sendall(f"{datetime}\0".encode())  # ... Datetime ...
-                sleep(0.1)
-                client_socket.sendall(f"{username}\0".encode())  # ... <username> ...
-                sleep(0.1)
-                client_socket.sendall(f"{port}\0".encode())  # ... Port
-
+            # SEND REQUEST TO SERVER
+            with self.__request(OP_CONNECT, SERVER_DATETIME, username, str(port)) as client_socket:
                 # RECEIVE RESPONSE FROM SERVER
-                response = client_socket.recv(EXECUTION_STATUS_SIZE).decode()  # Execution status
+                response = self.__recv_status(client_socket)  # Execution status
                 
                 # CHECK RESPONSE
                 if response == '0':
@@ -249,37 +364,20 @@ class client:
             print("DISCONNECT FAIL")
             return client.RC.ERROR
         
-        # GET DATETIME
-        datetime = self.__datetime()
-        if datetime == "":
-            print("DISCONNECT FAIL")
-            return client.RC.ERROR
-
         # CLIENT-CLIENT CONNECTION
         if self.__server_socket is not None:
             try:
-                self.__server_socket.close()
-                self.__server_socket = None
-                self.__server_thread.join()
-                self.__server_thread = None
+                self.__stop_sharing()
             except (socket.error):
                 print("DISCONNECT FAIL")
                 return client.RC.ERROR
 
         # CLIENT-SERVER CONNECTION
         try:
-            with socket.socket(socket.AF_INET, socket.SOCK_STREAM) as client_socket:
-                client_socket.connect((client._server, client._port))
-
-                # SEND REQUEST TO SERVER
-                client_socket.sendall("DISCONNECT\0".encode())  # DISCONNECT ...
-                sleep(0.1)
-                client_socket.sendall(f"{datetime}\0".encode())  # ... Datetime ...
-                sleep(0.1)
-                client_socket.sendall(f"{username}\0".encode())  # ... <username>
-
+            # SEND REQUEST TO SERVER
+            with self.__request(OP_DISCONNECT, SERVER_DATETIME, username) as client_socket:
                 # RECEIVE RESPONSE FROM SERVER
-                response = client_socket.recv(EXECUTION_STATUS_SIZE).decode()  # Execution status
+                response = self.__recv_status(client_socket)  # Execution status
                 
                 # CHECK RESPONSE
                 if response == '0':
@@ -306,31 +404,19 @@ class client:
         if len(description) > DESCRIPTION_SIZE:
             print("PUBLISH FAIL")
             return client.RC.ERROR
-        
-        # GET DATETIME
-        datetime = self.__datetime()
-        if datetime == "":
-            print("PUBLISH FAIL")
-            return client.RC.ERROR
 
+        # CONTENT ID AND CHUNK HASHES, SO OTHER USERS CAN DOWNLOAD THE FILE FROM EVERY USER PUBLISHING THE SAME CONTENT
+        try:
+            content, chunks = self.__hash_chunks(filename)
+        except IOError:
+            content, chunks = "", ""  # NOT A LOCAL FILE, PUBLISHED BY NAME ONLY
+        
         # CLIENT-SERVER CONNECTION
         try:
-            with socket.socket(socket.AF_INET, socket.SOCK_STREAM) as client_socket:
-                client_socket.connect((client._server, client._port))
-
-                # SEND REQUEST TO SERVER
-                client_socket.sendall("PUBLISH\0".encode())  # PUBLISH ...
-                sleep(0.1)
-                client_socket.sendall(f"{datetime}\0".encode())  # ... Datetime ...
-                sleep(0.1)
-                client_socket.sendall(f"{self.__username}\0".encode())  # ... Username ...
-                sleep(0.1)
-                client_socket.sendall(f"{filename}\0".encode())  # ... <filename> ...
-                sleep(0.1)
-                client_socket.sendall(f"{description}\0".encode())  # ... <description>
-
+            # SEND REQUEST TO SERVER
+            with self.__request(OP_PUBLISH, SERVER_DATETIME, self.__username, filename, description, content) as client_socket:
                 # RECEIVE RESPONSE FROM SERVER
-                response = client_socket.recv(EXECUTION_STATUS_SIZE).decode()  # Execution status
+                response = self.__recv_status(client_socket)  # Execution status
 
                 # CHECK RESPONSE FROM SERVER
                 if response == '0':
@@ -340,7 +426,10 @@ class client:
                             published = json.load(file)
                     except (FileNotFoundError, json.JSONDecodeError):
                         published = []
-                    published.append({"Filename": filename, "Description": description})  # update published files
+                    entry = {"Filename": filename, "Description": description}
+                    if content:
+                        entry.update({"Content": content, "Chunks": chunks})  # served to swarm downloads (GET_HASHES)
+                    published.append(entry)  # update published files
                     with open(f"published-{self.__username}.json", "w") as file:  # write to published files
                         json.dump(published, file, indent=4)
                     print("PUBLISH OK")
@@ -361,39 +450,30 @@ class client:
             print("PUBLISH FAIL")
             return client.RC.ERROR
 
+    @staticmethod
+    def __hash_chunks(filename: str) -> tuple:
+        # SHA-256 OF EVERY SWARM_CHUNK_SIZE CHUNK, AND THE CONTENT ID: SHA-256 OF THE CHUNK DIGESTS ONE AFTER THE OTHER
+        digests = bytearray()
+        with open(filename, "rb") as file:
+            while True:
+                chunk = file.read(SWARM_CHUNK_SIZE)
+                if not chunk:
+                    break
+                digests += hashlib.sha256(chunk).digest()
+        return hashlib.sha256(digests).hexdigest(), digests.hex()
+
     def delete(self, filename: str) -> int:
         # INPUT VALIDATION
         if " " in filename or len(filename) > FILENAME_SIZE:
             print("DELETE FAIL")
             return client.RC.ERROR
         
-        # GET DATETIME
-        datetime = self.__datetime()
-        if datetime == "":
-            print("DELETE FAIL")
-            return client.RC.ERROR
-
         # CLIENT-SERVER CONNECTION
         try:
-            with socket.socket(socket.AF_INET, socket.SOCK_STREAM) as client_socket:
-                client_socket.connect((client._server, client._port))
-
-                # SEND REQUEST TO SERVER
-                client_socket.sendall("DELETE\0".encode())  # DELETE ...
-                sleep(0.1)
-                client_socket.sendall(f"{datetime}\0".encode())  # ... Datetime ...
-                sleep(0.1)
-                client_socket.sendall(f"{self.__username}\0".encode())  # ... Username ...
-                sleep(0.1)
-                client_socket.sendall(f"{filename}\0".encode())  # ... <filename>
-
-                # RECEIVE RESPONSE FROM SERVER
-                try:
-                    response = client_socket.recv(EXECUTION_STATUS_SIZE).decode()  # Execution status
-                except socket.error:
-                    print("DELETE FAIL")
-                    client_socket.close()
-                    return client.RC.ERROR
+            # SEND REQUEST TO SERVER
+            with self.__request(OP_DELETE, SERVER_DATETIME, self.__username, filename) as client_socket:
+                # RECEIVE RESPONSE FROM SERVER (A FAILURE DROPS THE SESSION IN __pipeline)
+                response = self.__recv_status(client_socket)  # Execution status
                 
                 # CHECK RESPONSE FROM SERVER
                 if response == '0':
@@ -429,124 +509,187 @@ class client:
             return client.RC.ERROR
 
     def listusers(self) -> int:
-        # GET DATETIME
-        datetime = self.__datetime()
-        if datetime == "":
-            print("LIST_USERS FAIL")
-            return client.RC.ERROR
-        
         # CLIENT-SERVER CONNECTION
         try:
-            with socket.socket(socket.AF_INET, socket.SOCK_STREAM) as client_socket:
-                client_socket.connect((client._server, client._port))
-
+            # GET LIST OF USERS, PAGE BY PAGE
+            users_list = []
+            output = "LIST_USERS OK\n"
+            cursor = ""
+            while True:
                 # SEND REQUEST TO SERVER
-                client_socket.sendall("LIST_USERS\0".encode())  # LIST_USERS ...
-                sleep(0.1)
-                client_socket.sendall(f"{datetime}\0".encode())  # ... Datetime ...
-                sleep(0.1)
-                client_socket.sendall(f"{self.__username}\0".encode())  # ... Username
-
-                # RECEIVE RESPONSE FROM SERVER
-                response = client_socket.recv(EXECUTION_STATUS_SIZE).decode()  # Execution status
+                with self.__request(OP_LIST_USERS, SERVER_DATETIME, self.__username, cursor, "") as client_socket:
+                    # RECEIVE RESPONSE FROM SERVER
+                    response = self.__recv_status(client_socket)  # Execution status
+                    if response != '0':
+                        break
 
-                # CHECK RESPONSE FROM SERVER
-                if response == '0':
-                    try:
-                        # GET LIST OF USERS
-                        users_list = []
-                        output = "LIST_USERS OK\n"
-                        number_users = int(client_socket.recv(NUMBER_USERS_SIZE).decode())
-                        for _ in range(number_users):
-                            user_info = {
-                                "Username": client_socket.recv(USERNAME_SIZE).decode().rstrip('\0'),  # Username
-                                "IP address": client_socket.recv(IP_ADDRESS_SIZE).decode().rstrip('\0'),  # IP address
-                                "Port": client_socket.recv(PORT_SIZE).decode().rstrip('\0\n')   # Port
-                            }
-                            users_list.append(user_info)
-                            output += f"{user_info['Username']} {user_info['IP address']} {user_info['Port']}\n"
-                        
-                        # SAVE LIST OF USERS TO FILE
-                        with open(f"listusers-{self.__username}.json", "w") as file:
-                            json.dump(users_list, file, indent=4)
-                        
-                        print(output)
-                        return client.RC.OK
-                    except (FileNotFoundError, json.JSONDecodeError):
-                        print("LIST_USERS FAIL")
-                        return client.RC.ERROR
-                if response == '1':
-                    print("LIST_USERS FAIL, USER DOES NOT EXIST")
-                    return client.RC.USER_ERROR
-                elif response == '2':
-                    print("LIST_USERS FAIL, USER NOT CONNECTED")
-                    return client.RC.USER_ERROR
-                else:
+                    number_users = self.__recv_varint(client_socket)  # Number of users
+                    for _ in range(number_users):
+                        user_info = {
+                            "Username": self.__recv_string(client_socket),  # Username
+                            "IP address": self.__recv_string(client_socket),  # IP address
+                            "Port": self.__recv_string(client_socket)  # Port
+                        }
+                        users_list.append(user_info)
+                        output += f"{user_info['Username']} {user_info['IP address']} {user_info['Port']}\n"
+                    cursor = str(self.__recv_varint(client_socket))  # Next page, 0 once there are no more users
+                if cursor == "0":
+                    break
+
+            # CHECK RESPONSE FROM SERVER
+            if response == '0':
+                try:
+                    # SAVE LIST OF USERS TO FILE
+                    with open(f"listusers-{self.__username}.json", "w") as file:
+                        json.dump(users_list, file, indent=4)
+                    
+                    print(output)
+                    return client.RC.OK
+                except (FileNotFoundError, json.JSONDecodeError):
                     print("LIST_USERS FAIL")
                     return client.RC.ERROR
+            if response == '1':
+                print("LIST_USERS FAIL, USER DOES NOT EXIST")
+                return client.RC.USER_ERROR
+            elif response == '2':
+                print("LIST_USERS FAIL, USER NOT CONNECTED")
+                return client.RC.USER_ERROR
+            else:
+                print("LIST_USERS FAIL")
+                return client.RC.ERROR
         except (socket.error, ConnectionRefusedError, ValueError):
             print("LIST_USERS FAIL")
             return client.RC.ERROR
 
-    def listcontent(self, username: str) -> int:
+    def listcontent(self, *usernames: str, prefix: str = "") -> int:
         # INPUT VALIDATION
-        if " " in username or len(username) > USERNAME_SIZE:
+        for username in usernames:
+            if " " in username or len(username) > USERNAME_SIZE:
+                print("LIST_CONTENT FAIL")
+                return client.RC.ERROR
+        if " " in prefix or len(prefix) > FILENAME_SIZE:
             print("LIST_CONTENT FAIL")
             return client.RC.ERROR
         
-        # GET DATETIME
-        datetime = self.__datetime()
-        if datetime == "":
-            print("LIST_CONTENT FAIL")
-            return client.RC.ERROR
-
         # CLIENT-SERVER CONNECTION
         try:
-            with socket.socket(socket.AF_INET, socket.SOCK_STREAM) as client_socket:
-                client_socket.connect((client._server, client._port))
-
-                # SEND REQUEST TO SERVER
-                client_socket.sendall("LIST_CONTENT\0".encode())  # LIST_CONTENT ...
-                sleep(0.1)
-                client_socket.sendall(f"{datetime}\0".encode())  # ... Datetime ...
-                sleep(0.1)
-                client_socket.sendall(f"{self.__username}\0".encode())  # ... Username ...
-                sleep(0.1)
-                client_socket.sendall(f"{username}\0".encode())  # ... <username>
-
-                # RECEIVE RESPONSE FROM SERVER
-                response = client_socket.recv(EXECUTION_STATUS_SIZE).decode()  # Execution status
-
-                # CHECK RESPONSE FROM SERVER
+            # SEND EVERY USER'S NEXT PAGE REQUEST TO SERVER AT ONCE, UNTIL EVERY LIST IS OVER
+            responses = {}
+            outputs = {username: "LIST_CONTENT OK\n" if len(usernames) == 1 else f"LIST_CONTENT {username} OK\n" for username in usernames}
+            cursors = {username: "" for username in dict.fromkeys(usernames)}
+            while cursors:
+                with self.__pipeline(*[(OP_LIST_CONTENT, SERVER_DATETIME, self.__username, username, cursor, "", prefix) for username, cursor in cursors.items()]) as client_socket:
+                    for username in list(cursors):
+                        # RECEIVE RESPONSE FROM SERVER
+                        responses[username] = self.__recv_status(client_socket)  # Execution status
+                        if responses[username] != '0':
+                            del cursors[username]
+                            continue
+
+                        # GET LIST OF CONTENTS
+                        number_files = self.__recv_varint(client_socket)  # Number of files
+                        for _ in range(number_files):
+                            file_info = {
+                                "Filename": self.__recv_string(client_socket),  # Filename
+                                "Description": self.__recv_string(client_socket),  # Description
+                            }
+                            outputs[username] += f"{file_info['Filename']} \"{file_info['Description']}\"\n"
+                        cursors[username] = str(self.__recv_varint(client_socket))  # Next page, 0 once there are no more files
+                        if cursors[username] == "0":
+                            del cursors[username]
+
+            # CHECK RESPONSE FROM SERVER
+            rc = client.RC.OK
+            for username in usernames:
+                response = responses[username]
                 if response == '0':
-                    # GET LIST OF CONTENTS
-                    output = "LIST_CONTENT OK\n"
-                    number_files = int(client_socket.recv(NUMBER_USERS_SIZE).decode())  # Number of files
-                    for _ in range(number_files):
-                        file_info = {
-                            "Filename": client_socket.recv(FILENAME_SIZE).decode().rstrip('\0\n'),  # Filename
-                            "Description": client_socket.recv(DESCRIPTION_SIZE).decode().rstrip('\0\n'),  # Description
-                        }
-                        output += f"{file_info['Filename']} \"{file_info['Description']}\"\n"
-
-                    print(output)
-                    return client.RC.OK
-                if response == '1':
+                    print(outputs[username])
+                elif response == '1':
                     print("LIST_CONTENT FAIL, USER DOES NOT EXIST")
-                    return client.RC.USER_ERROR
+                    rc = client.RC.USER_ERROR
                 elif response == '2':
                     print("LIST_CONTENT FAIL, USER NOT CONNECTED")
-                    return client.RC.USER_ERROR
+                    rc = client.RC.USER_ERROR
                 elif response == '3':
                     print("LIST_CONTENT FAIL, REMOTE USER DOES NOT EXIST")
-                    return client.RC.USER_ERROR
+                    rc = client.RC.USER_ERROR
                 else:
                     print("LIST_CONTENT FAIL")
-                    return client.RC.ERROR
+                    rc = client.RC.ERROR
+            return rc
         except (socket.error, ConnectionRefusedError, ValueError):
             print("LIST_CONTENT FAIL")
             return client.RC.ERROR
 
+    def search(self, query: str) -> int:
+        # INPUT VALIDATION
+        if len(query) > DESCRIPTION_SIZE:
+            print("SEARCH FAIL")
+            return client.RC.ERROR
+
+        # CLIENT-SERVER CONNECTION
+        try:
+            # GET RANKED MATCHES, PAGE BY PAGE
+            output = "SEARCH OK\n"
+            cursor = ""
+            while True:
+                # SEND REQUEST TO SERVER
+                with self.__request(OP_SEARCH, SERVER_DATETIME, self.__username, query, cursor, "") as client_socket:
+                    # RECEIVE RESPONSE FROM SERVER
+                    response = self.__recv_status(client_socket)  # Execution status
+                    if response != '0':
+                        break
+
+                    number_files = self.__recv_varint(client_socket)  # Number of matches
+                    for _ in range(number_files):
+                        username = self.__recv_string(client_socket)  # Owner
+                        filename = self.__recv_string(client_socket)  # Filename
+                        description = self.__recv_string(client_socket)  # Description
+                        output += f"{username} {filename} \"{description}\"\n"
+                    cursor = str(self.__recv_varint(client_socket))  # Next page, 0 once there are no more matches
+                if cursor == "0":
+                    break
+
+            # CHECK RESPONSE FROM SERVER
+            if response == '0':
+                print(output)
+                return client.RC.OK
+            if response == '1':
+                print("SEARCH FAIL, USER DOES NOT EXIST")
+                return client.RC.USER_ERROR
+            elif response == '2':
+                print("SEARCH FAIL, USER NOT CONNECTED")
+                return client.RC.USER_ERROR
+            else:
+                print("SEARCH FAIL")
+                return client.RC.ERROR
+        except (socket.error, ConnectionRefusedError, ValueError):
+            print("SEARCH FAIL")
+            return client.RC.ERROR
+
+    def stats(self) -> int:
+        # CLIENT-SERVER CONNECTION
+        try:
+            # SEND REQUEST TO SERVER
+            with self.__request(OP_STATS, SERVER_DATETIME) as client_socket:
+                # RECEIVE RESPONSE FROM SERVER
+                response = self.__recv_status(client_socket)  # Execution status
+                if response != '0':
+                    print("STATS FAIL")
+                    return client.RC.ERROR
+
+                output = "STATS OK\n"
+                number_lines = self.__recv_varint(client_socket)  # Number of lines
+                for _ in range(number_lines):
+                    output += self.__recv_string(client_socket) + "\n"  # Metrics line
+                self.__recv_varint(client_socket)  # Next page, always 0
+
+            print(output)
+            return client.RC.OK
+        except (socket.error, ConnectionRefusedError, ValueError):
+            print("STATS FAIL")
+            return client.RC.ERROR
+
     def getfile(self, username: str, remote_filename: str, local_filename: str) -> int:
         # INPUT VALIDATION
         if " " in username or len(username) > USERNAME_SIZE:
@@ -558,6 +701,24 @@ class client:
         if " " in local_filename or len(local_filename) > FILENAME_SIZE:
             print("GET_FILE FAIL")
             return client.RC.ERROR
+
+        # DOWNLOAD FROM EVERY USER PUBLISHING THE SAME CONTENT AT ONCE, IF THE SERVER KNOWS IT AND THEY SERVE CHUNK HASHES.
+        # FROM A SINGLE USER, RANGES ARE AS FAST WITHOUT HASHING EVERY CHUNK
+        try:
+            content, sources = self.__sources(username, remote_filename)
+        except (socket.error, ConnectionRefusedError, ValueError):
+            content, sources = "", []
+        sources = [source for source in sources if source["Username"] != self.__username]
+
+        # A PARTIAL DOWNLOAD TO THE LOCAL FILE GOES ON IN THE MODE THAT STARTED IT, THE OTHER ONE WOULD TRUNCATE IT
+        partial = self.__load_getfile_state(local_filename)
+        if content and len(sources) > 1 and (partial is None or partial["Mode"] == "swarm"):
+            rc = self.__getfile_swarm(content, sources, local_filename, partial)
+            if rc is not None:
+                return rc
+        if partial is not None and partial["Mode"] == "swarm":
+            print("GET_FILE FAIL, PARTIAL DOWNLOAD CAN'T BE RESUMED")
+            return client.RC.USER_ERROR
         
         # GET REMOTE USER INFO
         try:
@@ -576,9 +737,27 @@ class client:
             return client.RC.ERROR
 
         # CLIENT-CLIENT CONNECTION
+        address = (user_info["IP address"], int(user_info["Port"]))
+        try:
+            # FILE SIZE AND MODIFICATION TIME, ASKED AS AN EMPTY RANGE
+            probe, response, size, modified = self.__request_range(address, remote_filename, 0, 0)
+            probe.close()
+            if response == '0':
+                return self.__getfile_ranges(address, username, remote_filename, local_filename, size, modified, partial)
+            elif response == '1':
+                print("GET_FILE FAIL, FILE DOES NOT EXIST")
+                return client.RC.USER_ERROR
+        except (socket.error, ConnectionRefusedError, ValueError):
+            print("GET_FILE FAIL")
+            return client.RC.ERROR
+
+        # PEER WITHOUT RANGES, WHOLE FILE OVER ONE CONNECTION
+        if partial is not None:
+            print("GET_FILE FAIL, PARTIAL DOWNLOAD CAN'T BE RESUMED")
+            return client.RC.USER_ERROR
         try:
             with socket.socket(socket.AF_INET, socket.SOCK_STREAM) as client_socket:
-                client_socket.connect((user_info["IP address"], int(user_info["Port"])))
+                client_socket.connect(address)
 
                 # SEND REQUEST TO CLIENT
                 client_socket.sendall("GET_FILE\0".encode())  # GET_FILE ...
@@ -586,7 +765,7 @@ class client:
                 client_socket.sendall(f"{remote_filename}\0".encode())  # ... <remote_filename>
 
                 # RECEIVE RESPONSE FROM CLIENT
-                response = client_socket.recv(EXECUTION_STATUS_SIZE).decode()  # Execution status
+                response = self.__recv_exact(client_socket, EXECUTION_STATUS_SIZE).decode()  # Execution status, still "0"/"1"/"2" text between clients
 
                 # CHECK RESPONSE FROM CLIENT
                 if response == '0':
@@ -615,12 +794,315 @@ class client:
             print("GET_FILE FAIL")
             return client.RC.ERROR
 
+    def __request_range(self, address: tuple, remote_filename: str, offset: int, length: int, timeout: float = None) -> tuple:
+        # GET_RANGE REQUEST, RETURNS (socket at the range's first byte, status, size, modification time)
+        client_socket = socket.create_connection(address, timeout)
+        try:
+            client_socket.sendall(f"GET_RANGE\0{remote_filename}\0{offset}\0{length}\0".encode())
+            response = self.__recv_exact(client_socket, EXECUTION_STATUS_SIZE).decode()  # Execution status
+            if response != '0':
+                return client_socket, response, 0, 0
+            size = int(self.__recv_field(client_socket, RANGE_FIELD_SIZE))  # Size
+            modified = int(self.__recv_field(client_socket, RANGE_FIELD_SIZE))  # Modification time
+            return client_socket, response, size, modified
+        except BaseException:
+            client_socket.close()
+            raise
+
+    def __load_getfile_state(self, local_filename: str):
+        # SIDECAR OF A PARTIAL DOWNLOAD TO THE LOCAL FILE, NONE IF THERE IS NO PARTIAL DOWNLOAD
+        try:
+            with open(local_filename + GET_FILE_STATE_SUFFIX, "r") as file:
+                state = json.load(file)
+            if not isinstance(state, dict) or not os.path.exists(local_filename):
+                return None
+            state.setdefault("Mode", "swarm" if "Content" in state else "ranges")  # sidecars written before "Mode"
+            return state
+        except (FileNotFoundError, IOError, json.JSONDecodeError):
+            return None
+
+    def __save_getfile_state(self, state_filename: str, state: dict, lock: threading.Lock):
+        # WRITTEN AFTER THE DATA IT DESCRIBES, AND REPLACED AT ONCE SO IT'S NEVER SEEN HALF WRITTEN
+        with lock:
+            with open(state_filename + ".tmp", "w") as file:
+                json.dump(state, file)
+            os.replace(state_filename + ".tmp", state_filename)
+
+    def __getfile_range(self, address: tuple, fd: int, state: dict, index: int, lock: threading.Lock,
+                        state_filename: str, failed: list):
+        offset, end = state["Ranges"][index]
+        try:
+            client_socket, response, size, modified = self.__request_range(address, state["Filename"], offset, end - offset)
+            with client_socket:
+                if response != '0' or size != state["Size"] or modified != state["Modified"]:
+                    raise IOError("remote file changed")
+                buffer = memoryview(bytearray(GET_FILE_BUFFER_SIZE))
+                unsaved = 0
+                while offset < end:
+                    received = client_socket.recv_into(buffer[:min(GET_FILE_BUFFER_SIZE, end - offset)])
+                    if not received:
+                        raise socket.error("connection closed by peer")
+                    os.pwrite(fd, buffer[:received], offset)
+                    offset += received
+                    unsaved += received
+                    with lock:
+                        state["Ranges"][index][0] = offset
+                    if unsaved >= GET_FILE_STATE_INTERVAL:
+                        self.__save_getfile_state(state_filename, state, lock)
+                        unsaved = 0
+        except (socket.error, IOError, ValueError):
+            failed.append(index)
+
+    def __getfile_ranges(self, address: tuple, username: str, remote_filename: str, local_filename: str,
+                         size: int, modified: int, partial: dict) -> int:
+        # RESUME THE PARTIAL DOWNLOAD IF IT'S FOR THE SAME VERSION OF THE FILE, ELSE SPLIT THE FILE INTO RANGES
+        state_filename = local_filename + GET_FILE_STATE_SUFFIX
+        state = partial
+        try:
+            if [state["User"], state["Filename"], state["Size"], state["Modified"]] != [username, remote_filename, size, modified]:
+                state = None
+        except (KeyError, TypeError):
+            state = None
+        resume = state is not None
+        if not resume:
+            count = max(1, min(GET_FILE_CONNECTIONS, size // GET_FILE_SEGMENT_MIN))
+            step = max(1, -(-size // count))
+            state = {"Mode": "ranges", "User": username, "Filename": remote_filename, "Size": size, "Modified": modified,
+                     "Ranges": [[start, min(start + step, size)] for start in range(0, size, step)]}  # [next byte, end]
+
+        # EVERY UNFINISHED RANGE OVER ITS OWN CONNECTION, WRITTEN IN PLACE
+        lock = threading.Lock()
+        failed = []
+        try:
+            with open(local_filename, "r+b" if resume else "wb") as file:
+                file.truncate(size)
+                self.__save_getfile_state(state_filename, state, lock)
+                workers = [threading.Thread(target=self.__getfile_range, daemon=True,
+                                            args=(address, file.fileno(), state, index, lock, state_filename, failed))
+                           for index, (offset, end) in enumerate(state["Ranges"]) if offset < end]
+                for worker in workers:
+                    worker.start()
+                for worker in workers:
+                    worker.join()
+            if failed:
+                # KEEP THE PARTIAL FILE AND ITS SIDECAR, THE NEXT GET_FILE RESUMES THEM
+                self.__save_getfile_state(state_filename, state, lock)
+                print("GET_FILE FAIL")
+                return client.RC.ERROR
+            os.remove(state_filename)
+        except IOError:
+            print("GET_FILE FAIL")
+            return client.RC.ERROR
+
+        print("GET_FILE OK")
+        return client.RC.OK
+
+    def __sources(self, username: str, remote_filename: str) -> tuple:
+        # CONTENT ID OF THE FILE ("" IF UNKNOWN) AND EVERY USER PUBLISHING THE SAME CONTENT, THE REQUESTED ONE FIRST
+        with self.__request(OP_SOURCES, SERVER_DATETIME, self.__username, username, remote_filename) as client_socket:
+            # RECEIVE RESPONSE FROM SERVER
+            response = self.__recv_status(client_socket)  # Execution status
+            if response != '0':
+                return "", []
+            content = self.__recv_string(client_socket)  # Content id
+            sources = []
+            number_sources = self.__recv_varint(client_socket)  # Number of sources
+            for _ in range(number_sources):
+                sources.append({
+                    "Username": self.__recv_string(client_socket),  # Username
+                    "IP address": self.__recv_string(client_socket),  # IP address
+                    "Port": self.__recv_string(client_socket),  # Port
+                    "Filename": self.__recv_string(client_socket)  # Filename they published it as
+                })
+            self.__recv_varint(client_socket)  # Next page, always 0
+            return content, sources
+
+    def __request_hashes(self, source: dict, content: str) -> tuple:
+        # GET_HASHES REQUEST, RETURNS (size, chunk digests) IF THEY ARE THE ONES OF THE CONTENT
+        with socket.create_connection((source["IP address"], int(source["Port"])), SWARM_TIMEOUT) as client_socket:
+            client_socket.sendall(f"GET_HASHES\0{source['Filename']}\0".encode())
+            if self.__recv_exact(client_socket, EXECUTION_STATUS_SIZE).decode() != '0':  # Execution status
+                raise ValueError("no chunk hashes")
+            size = int(self.__recv_field(client_socket, RANGE_FIELD_SIZE))  # Size
+            hashes = bytearray()
+            while True:
+                data = client_socket.recv(GET_FILE_BUFFER_SIZE)  # Chunk hashes, up to the connection's end
+                if not data:
+                    break
+                hashes += data
+        if not hashes.endswith(b"\0"):
+            raise ValueError("chunk hashes cut short")
+        digests = bytes.fromhex(hashes[:-1].decode())
+        if hashlib.sha256(digests).hexdigest() != content or len(digests) != SWARM_DIGEST_SIZE * -(-size // SWARM_CHUNK_SIZE):
+            raise ValueError("chunk hashes of another content")
+        return size, digests
+
+    @staticmethod
+    def __swarm_load(source: dict) -> tuple:
+        # A CHUNK TO EVERY USER NOT MEASURED YET, THEN THE ONE THAT WOULD SEND ONE MORE CHUNK SOONEST AT ITS MEASURED RATE,
+        # THEN MORE CHUNKS TO THE ONES STILL NOT MEASURED
+        if source["Seconds"]:
+            return (1, (source["Active"] + 1) * source["Seconds"] / source["Bytes"])
+        return (0 if source["Active"] == 0 else 2, source["Active"])
+
+    @staticmethod
+    def __swarm_pick(swarm: dict) -> tuple:
+        # NEXT PENDING CHUNK OR, ONCE NONE IS LEFT, ANOTHER COPY OF THE CHUNK DOWNLOADING THE LONGEST (A SLOW USER'S),
+        # FROM THE USER EXPECTED TO SEND IT SOONEST AMONG THE ONES NOT FETCHING IT. RETURNS (chunk, source index)
+        if swarm["Pending"]:
+            chunks = [swarm["Pending"][0]]
+        else:
+            chunks = sorted((chunk for chunk, running in swarm["Running"].items() if len(running) < SWARM_DUPLICATES and not swarm["Done"][chunk]),
+                            key=lambda chunk: swarm["Started"][chunk])
+        for chunk in chunks:
+            running = swarm["Running"].get(chunk, [])
+            candidates = [index for index, source in enumerate(swarm["Sources"]) if not source["Dropped"] and index not in running]
+            if candidates:
+                return chunk, min(candidates, key=lambda index: client.__swarm_load(swarm["Sources"][index]))
+        return None, None
+
+    def __getfile_chunk(self, swarm: dict, fd: int, state_filename: str):
+        buffer = memoryview(bytearray(SWARM_CHUNK_SIZE))
+        condition = swarm["Condition"]
+        unsaved = 0
+        while True:
+            # NEXT CHUNK, WAITING WHILE EVERY CHUNK LEFT IS BEING FETCHED BY AS MANY USERS AS IT CAN
+            with condition:
+                while True:
+                    if swarm["Left"] == 0:
+                        return
+                    chunk, index = self.__swarm_pick(swarm)
+                    if chunk is not None:
+                        break
+                    if not swarm["Running"]:
+                        return  # EVERY USER LEFT OUT
+                    condition.wait()
+                if chunk not in swarm["Running"]:
+                    swarm["Pending"].popleft()
+                    swarm["Running"][chunk] = []
+                    swarm["Started"][chunk] = monotonic()
+                swarm["Running"][chunk].append(index)
+                source = swarm["Sources"][index]
+                source["Active"] += 1
+
+            # FETCH THE CHUNK AND WRITE IT IN PLACE IF ITS HASH MATCHES, UNLESS ANOTHER COPY GETS THERE FIRST
+            offset = chunk * SWARM_CHUNK_SIZE
+            length = min(SWARM_CHUNK_SIZE, swarm["Size"] - offset)
+            start = monotonic()
+            verified = wrong = False
+            try:
+                address = (source["IP address"], int(source["Port"]))
+                client_socket, response, size, _ = self.__request_range(address, source["Filename"], offset, length, SWARM_TIMEOUT)
+                with client_socket:
+                    if response != '0' or size != swarm["Size"]:
+                        wrong = True
+                        raise IOError("remote file changed")
+                    received = 0
+                    while received < length and not swarm["Done"][chunk]:
+                        received_now = client_socket.recv_into(buffer[received:length])
+                        if not received_now:
+                            raise socket.error("connection closed by peer")
+                        received += received_now
+                if received == length:
+                    digest = swarm["Digests"][chunk * SWARM_DIGEST_SIZE:(chunk + 1) * SWARM_DIGEST_SIZE]
+                    verified = hashlib.sha256(buffer[:length]).digest() == digest
+                    wrong = not verified
+                    if verified:
+                        os.pwrite(fd, buffer[:length], offset)
+            except (socket.error, IOError, ValueError):
+                verified = False
+
+            # COUNT THE CHUNK DONE, OR FETCH IT AGAIN FROM ANOTHER USER
+            with condition:
+                source["Active"] -= 1
+                running = swarm["Running"][chunk]
+                running.remove(index)
+                if verified:
+                    source["Bytes"] += length
+                    source["Seconds"] += monotonic() - start
+                    if not swarm["Done"][chunk]:
+                        swarm["Done"][chunk] = True
+                        swarm["Left"] -= 1
+                        unsaved += length
+                elif not swarm["Done"][chunk]:
+                    source["Failures"] += 1
+                    source["Dropped"] = wrong or source["Failures"] >= SWARM_PEER_FAILURES
+                    if not running:
+                        swarm["Pending"].appendleft(chunk)
+                if not running:
+                    del swarm["Running"][chunk]
+                    del swarm["Started"][chunk]
+                condition.notify_all()
+                if unsaved >= GET_FILE_STATE_INTERVAL:
+                    state = dict(swarm["State"], Done="".join("1" if done else "0" for done in swarm["Done"]))
+                    unsaved = 0
+                else:
+                    state = None
+            if state is not None:
+                self.__save_getfile_state(state_filename, state, swarm["Lock"])
+
+    def __getfile_swarm(self, content: str, sources: list, local_filename: str, partial: dict) -> int:
+        # CHUNK HASHES FROM THE FIRST USER THAT SERVES THEM, THEY ARE CHECKED AGAINST THE CONTENT ID THE SERVER HAS
+        size = digests = None
+        for source in sources:
+            try:
+                size, digests = self.__request_hashes(source, content)
+                break
+            except (socket.error, ValueError):
+                continue
+        if digests is None:
+            return None  # DOWNLOAD FROM THE REQUESTED USER ONLY
+        count = len(digests) // SWARM_DIGEST_SIZE
+
+        # RESUME THE PARTIAL DOWNLOAD IF IT'S FOR THE SAME CONTENT
+        state_filename = local_filename + GET_FILE_STATE_SUFFIX
+        state = partial
+        try:
+            if [state["Content"], state["Size"], len(state["Done"])] != [content, size, count]:
+                state = None
+        except (KeyError, TypeError):
+            state = None
+        resume = state is not None
+        if not resume:
+            state = {"Mode": "swarm", "Content": content, "Size": size, "Done": "0" * count}  # "1" for every chunk written
+        done = [flag == "1" for flag in state["Done"]]
+        swarm = {
+            "State": state, "Size": size, "Digests": digests, "Done": done, "Left": done.count(False),
+            "Pending": collections.deque(chunk for chunk in range(count) if not done[chunk]),
+            "Running": {}, "Started": {},  # chunk -> source indexes fetching it, time the first one started
+            "Sources": [dict(source, Active=0, Bytes=0, Seconds=0.0, Failures=0, Dropped=False) for source in sources],
+            "Condition": threading.Condition(), "Lock": threading.Lock()
+        }
+
+        # WORKERS TAKE CHUNKS IN ORDER, EACH FROM THE USER EXPECTED TO SEND IT SOONEST, SO FAST USERS SEND MORE OF THEM
+        try:
+            with open(local_filename, "r+b" if resume else "wb") as file:
+                file.truncate(size)
+                self.__save_getfile_state(state_filename, state, swarm["Lock"])
+                workers = [threading.Thread(target=self.__getfile_chunk, daemon=True, args=(swarm, file.fileno(), state_filename))
+                           for _ in range(min(SWARM_CONNECTIONS, swarm["Left"]))]
+                for worker in workers:
+                    worker.start()
+                for worker in workers:
+                    worker.join()
+            if swarm["Left"] > 0:
+                # KEEP THE PARTIAL FILE AND ITS SIDECAR, THE NEXT GET_FILE RESUMES THEM
+                state["Done"] = "".join("1" if flag else "0" for flag in done)
+                self.__save_getfile_state(state_filename, state, swarm["Lock"])
+                print("GET_FILE FAIL")
+                return client.RC.ERROR
+            os.remove(state_filename)
+        except IOError:
+            print("GET_FILE FAIL")
+            return client.RC.ERROR
+
+        print("GET_FILE OK")
+        return client.RC.OK
+
     def quit(self, _signum=None, _frame=None) -> int:
+        self.__close_session()
         if self.__server_socket is not None:
-            self.__server_socket.close()
-            self.__server_socket = None
-            self.__server_thread.join()
-            self.__server_thread = None
+            self.__stop_sharing()
         print("\n+++ FINISHED +++")
         exit(0)
 
@@ -675,10 +1157,23 @@ class client:
                             print("Syntax error. Usage: LIST_USERS")
 
                     elif(line[0]=="LIST_CONTENT"):
-                        if (len(line) == 2):
-                            self.listcontent(line[1])
+                        prefix = line.pop()[len("--prefix="):] if line[-1].startswith("--prefix=") else ""
+                        if (len(line) >= 2):
+                            self.listcontent(*line[1:], prefix=prefix)
+                        else:
+                            print("Syntax error. Usage: LIST_CONTENT <username> [<username> ...] [--prefix=<prefix>]")
+
+                    elif(line[0]=="SEARCH"):
+                        if (len(line) >= 2):
+                            self.search(" ".join(line[1:]))
+                        else:
+                            print("Syntax error. Usage: SEARCH <term> [<term> ...]")
+
+                    elif(line[0]=="STATS"):
+                        if (len(line) == 1):
+                            self.stats()
                         else:
-                            print("Syntax error. Usage: LIST_CONTENT <username>")
+                            print("Syntax error. Usage: STATS")
 
                     elif(line[0]=="DISCONNECT"):
                         if (len(line) == 2):
@@ -1,20 +1,32 @@
 const VERNUM = 1;
 const PRINTOPERATIONVER = 1;
 const PRINTFILEOPERATIONVER = 2;
+const PRINTOPERATIONSBATCHVER = 3;
 
 const OPERATION_SIZE = 256;
 const USERNAME_SIZE = 256;
 const DATETIME_SIZE = 20;
 const FILENAME_SIZE = 256;
+const AUDIT_BATCH_MAX = 1024;
 
 typedef string OPERATION<OPERATION_SIZE>;
 typedef string USERNAME<USERNAME_SIZE>;
 typedef string DATETIME<DATETIME_SIZE>;
 typedef string FILENAME<FILENAME_SIZE>;
 
+struct audit_record {
+    USERNAME username;
+    OPERATION operation;
+    FILENAME filename;  /* empty if the operation isn't done on a file */
+    DATETIME datetime;
+};
+
+typedef audit_record audit_batch<AUDIT_BATCH_MAX>;
+
 program filemanager {
     version VERNUM {
         int print_operation(USERNAME username, OPERATION operation, DATETIME datetime) = PRINTOPERATIONVER;
         int print_file_operation(USERNAME username, OPERATION operation, FILENAME filename, DATETIME datetime) = PRINTFILEOPERATIONVER;
+        int print_operations_batch(audit_batch records) = PRINTOPERATIONSBATCHVER;
     } = 1;
 } = 1;
@@ -0,0 +1,789 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/prctl.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+/*
+* peer file server for client.py: serves the GET_FILE requests of other clients on the client's listening socket,
+* from a single epoll loop. files are sent with sendfile(), so their bytes go from the page cache to the socket
+* without being copied through the process, and a download only takes a few hundred bytes of memory while it waits
+* for its socket. every download gets at most PEER_SEND_CHUNK bytes per turn, so large files don't starve the others.
+* as client.py did, a file is only sent if it's in the client's published list (published-<username>.json, read
+* again whenever it changes) and is opened relative to the working directory.
+*
+*   GET_FILE\0<filename>\0                      -> <status>[<file>]
+*   GET_RANGE\0<filename>\0<offset>\0<length>\0 -> <status>[<size>\0<modified>\0<file bytes offset to offset + length>]
+*   GET_HASHES\0<filename>\0                    -> <status>[<size>\0<chunk hashes>\0]
+*
+* statuses are "0" (ok), "1" (not published) and "2" (bad request). <modified> is the file's modification time in
+* nanoseconds, which downloaders compare before resuming; a range past the end of the file is cut to it. <chunk
+* hashes> are the hex SHA-256 of every 4 MiB chunk of the file, as client.py stored them in the published list when
+* it published the file ("Chunks"), so swarm downloads can check every chunk they get from any of its publishers.
+* a file published without them is answered "1"
+*/
+
+#define FILENAME_SIZE 256
+#define GET_FILE_OPERATION "GET_FILE"  // followed by the filename
+#define GET_RANGE_OPERATION "GET_RANGE"  // followed by the filename, the offset and the length of the range
+#define GET_HASHES_OPERATION "GET_HASHES"  // followed by the filename
+#define OPERATION_SIZE 11  // longest operation and its '\0'
+#define RANGE_FIELD_SIZE 21  // decimal 64 bit number and its '\0'
+#define FILE_FIELDS 2  // '\0' terminated fields of the requests
+#define RANGE_FIELDS 4
+#define PEER_MAX_EVENTS 64
+#define PEER_SEND_CHUNK (4 << 20)  // bytes sent to a download before serving the others
+#define PEER_IDLE_TIMEOUT 30  // seconds a download may go without progress before it's closed
+
+// execution status of a GET_FILE reply, followed by the file if STATUS_OK
+#define STATUS_OK '0'
+#define STATUS_NOT_PUBLISHED '1'
+#define STATUS_ERROR '2'
+
+// struct to hold the program options
+struct peer_options {
+    int port;  // port to listen on, if no socket is given
+    int socket;  // listening socket inherited from client.py, -1 if none
+    const char *published_filename;  // client.py's list of published files
+};
+
+// struct to hold a file that may be downloaded
+struct published_file {
+    char *filename;
+    char *chunks;  // hex SHA-256 of every chunk of the file, NULL if it was published without them
+};
+
+// struct to hold the files that may be downloaded
+struct published_list {
+    const char *filename;  // published list file
+    struct published_file *files;  // sorted by filename
+    size_t count;
+    struct stat loaded;  // published list file when it was last read, st_ino 0 if it didn't exist
+};
+
+// struct to hold a download in progress
+struct transfer {
+    struct transfer *prev;  // list of open downloads, to close the idle ones
+    struct transfer *next;
+    int socket;
+    int file;  // -1 until the request is read
+    char request[OPERATION_SIZE + FILENAME_SIZE + 2 * RANGE_FIELD_SIZE];  // request bytes received so far
+    size_t request_len;
+    char header[1 + 2 * RANGE_FIELD_SIZE];  // status, then for GET_RANGE the file's size and modification time
+    char *reply;  // header, or an allocated GET_HASHES reply
+    size_t reply_len;  // 0 until the request is read
+    size_t reply_sent;
+    off_t offset;  // next file byte to send
+    off_t end;
+    time_t progress;  // last time the download moved
+};
+
+struct published_list published = {0};
+struct transfer *transfers = NULL;
+int listening_socket = -1;
+int accepting = 1;  // 0 while out of file descriptors
+volatile sig_atomic_t stopping = 0;
+
+/**
+* @brief check program arguments
+* @param argc number of program arguments
+* @param argv program arguments
+* @param options set to the program options
+* @return 0 if valid
+* @return -1 if invalid
+*/
+int check_arguments(int argc, char *argv[], struct peer_options *options) {
+    const char *usage = "Usage: ./peer -f <published list> (-p <port> | -s <listening socket>)\n";
+    options->port = -1;
+    options->socket = -1;
+    options->published_filename = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "f:p:s:")) != -1) {
+        switch (opt) {
+            case 'f':
+                options->published_filename = optarg;
+                break;
+            case 'p':
+                options->port = atoi(optarg);
+                if (options->port < 1024 || options->port > 65535) {
+                    fprintf(stderr, "Invalid port: '%s'\n", optarg);
+                    return -1;
+                }
+                break;
+            case 's':
+                options->socket = atoi(optarg);
+                if (options->socket < 0) {
+                    fprintf(stderr, "Invalid socket: '%s'\n", optarg);
+                    return -1;
+                }
+                break;
+            default:
+                fprintf(stderr, "%s", usage);
+                return -1;
+        }
+    }
+    if (optind != argc || options->published_filename == NULL || (options->port == -1) == (options->socket == -1)) {
+        fprintf(stderr, "%s", usage);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+* @brief parse 4 hexadecimal digits
+* @param digits digits to parse
+* @param value set to their value
+* @return 0 if parsed
+* @return -1 if one isn't a hexadecimal digit
+*/
+int parse_hex4(const char *digits, unsigned int *value) {
+    *value = 0;
+    for (int i = 0; i < 4; i++) {
+        char c = digits[i];
+        unsigned int digit;
+        if (c >= '0' && c <= '9')
+            digit = c - '0';
+        else if (c >= 'a' && c <= 'f')
+            digit = c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F')
+            digit = c - 'A' + 10;
+        else
+            return -1;
+        *value = *value << 4 | digit;
+    }
+    return 0;
+}
+
+/**
+* @brief decode a JSON string into UTF-8 (json.dump writes non-ASCII characters as \u escapes)
+* @param data JSON text, at the string's opening quote
+* @param end end of the JSON text
+* @param string set to the decoded string
+* @param size size of string
+* @param next set to just after the string's closing quote
+* @return length of the decoded string
+* @return -1 if the string is malformed
+* @return -2 if the string doesn't fit in size bytes (next is still set)
+*/
+int json_string(const char *data, const char *end, char *string, size_t size, const char **next) {
+    size_t len = 0;
+    int fits = 1;
+    const char *c = data + 1;
+    while (c < end && *c != '"') {
+        unsigned char bytes[4];
+        int count = 1;
+        bytes[0] = *c++;
+        if (bytes[0] == '\\') {
+            if (c >= end)
+                return -1;
+            char escape = *c++;
+            unsigned int code_point;
+            switch (escape) {
+                case 'b': code_point = '\b'; break;
+                case 'f': code_point = '\f'; break;
+                case 'n': code_point = '\n'; break;
+                case 'r': code_point = '\r'; break;
+                case 't': code_point = '\t'; break;
+                case 'u':
+                    if (end - c < 4 || parse_hex4(c, &code_point) < 0)
+                        return -1;
+                    c += 4;
+                    // characters above U+FFFF are escaped as a surrogate pair
+                    unsigned int low;
+                    if (code_point >= 0xD800 && code_point < 0xDC00 && end - c >= 6 && c[0] == '\\' && c[1] == 'u'
+                        && parse_hex4(c + 2, &low) == 0 && low >= 0xDC00 && low < 0xE000) {
+                        code_point = 0x10000 + ((code_point - 0xD800) << 10) + (low - 0xDC00);
+                        c += 6;
+                    }
+                    break;
+                default: code_point = (unsigned char)escape; break;
+            }
+
+            if (code_point < 0x80) {
+                bytes[0] = code_point;
+            } else if (code_point < 0x800) {
+                bytes[0] = 0xC0 | code_point >> 6;
+                bytes[1] = 0x80 | (code_point & 0x3F);
+                count = 2;
+            } else if (code_point < 0x10000) {
+                bytes[0] = 0xE0 | code_point >> 12;
+                bytes[1] = 0x80 | (code_point >> 6 & 0x3F);
+                bytes[2] = 0x80 | (code_point & 0x3F);
+                count = 3;
+            } else {
+                bytes[0] = 0xF0 | code_point >> 18;
+                bytes[1] = 0x80 | (code_point >> 12 & 0x3F);
+                bytes[2] = 0x80 | (code_point >> 6 & 0x3F);
+                bytes[3] = 0x80 | (code_point & 0x3F);
+                count = 4;
+            }
+        }
+
+        if (len + count < size)
+            memcpy(string + len, bytes, count);
+        else
+            fits = 0;
+        len += count;
+    }
+    if (c >= end)
+        return -1;
+
+    *next = c + 1;
+    if (!fits)
+        return -2;
+    string[len] = '\0';
+    return (int)len;
+}
+
+/**
+* @brief compare two published files by filename, for qsort and bsearch
+*/
+int compare_filenames(const void *a, const void *b) {
+    return strcmp(((const struct published_file *)a)->filename, ((const struct published_file *)b)->filename);
+}
+
+/**
+* @brief free the published files
+* @param list published list
+*/
+void published_clear(struct published_list *list) {
+    for (size_t i = 0; i < list->count; i++) {
+        free(list->files[i].filename);
+        free(list->files[i].chunks);
+    }
+    free(list->files);
+    list->files = NULL;
+    list->count = 0;
+}
+
+/**
+* @brief read the published list again if its file changed since it was last read. only the "Filename" and
+*        "Chunks" members of the objects are needed, so the JSON is scanned for them instead of parsed into a tree
+* @param list published list
+* @return 0 if the list is up to date
+* @return -1 if the file can't be read (the list is then empty)
+*/
+int published_load(struct published_list *list) {
+    struct stat st;
+    if (stat(list->filename, &st) < 0) {
+        // nothing published yet
+        published_clear(list);
+        memset(&list->loaded, 0, sizeof(list->loaded));
+        return errno == ENOENT ? 0 : -1;
+    }
+    if (st.st_ino == list->loaded.st_ino && st.st_dev == list->loaded.st_dev && st.st_size == list->loaded.st_size
+        && st.st_mtim.tv_sec == list->loaded.st_mtim.tv_sec && st.st_mtim.tv_nsec == list->loaded.st_mtim.tv_nsec)
+        return 0;
+
+    published_clear(list);
+    memset(&list->loaded, 0, sizeof(list->loaded));
+    int fd = open(list->filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror("open");
+        return -1;
+    }
+    char *data = malloc(st.st_size > 0 ? st.st_size : 1);
+    if (data == NULL) {
+        perror("malloc");
+        close(fd);
+        return -1;
+    }
+    ssize_t size = 0;
+    while (size < st.st_size) {
+        ssize_t bytes = read(fd, data + size, st.st_size - size);
+        if (bytes < 0 && errno == EINTR)
+            continue;
+        if (bytes <= 0)
+            break;
+        size += bytes;
+    }
+    close(fd);
+
+    // strings are skipped whole, so braces outside them start and end the published files. a key is a string
+    // followed by ':', so "Filename" as a description isn't taken for one
+    size_t capacity = 0;
+    struct published_file file = {NULL, NULL};
+    const char *c = data, *end = data + size;
+    while (c < end) {
+        if (*c == '{' || *c == '}') {
+            if (*c == '}' && file.filename != NULL) {
+                if (list->count == capacity) {
+                    capacity = capacity == 0 ? 64 : capacity * 2;
+                    struct published_file *grown = realloc(list->files, capacity * sizeof(struct published_file));
+                    if (grown == NULL) {
+                        perror("realloc");
+                        break;
+                    }
+                    list->files = grown;
+                }
+                list->files[list->count++] = file;
+            } else {
+                free(file.filename);
+                free(file.chunks);
+            }
+            file.filename = NULL;
+            file.chunks = NULL;
+        }
+        if (*c != '"') {
+            c++;
+            continue;
+        }
+        char key[16];
+        const char *next;
+        int key_len = json_string(c, end, key, sizeof(key), &next);
+        if (key_len == -1)
+            break;
+        for (c = next; c < end && (*c == ' ' || *c == '\t' || *c == '\r' || *c == '\n'); c++);
+        if (key_len < 0 || c >= end || *c != ':' || (strcmp(key, "Filename") != 0 && strcmp(key, "Chunks") != 0))
+            continue;
+        int chunks = strcmp(key, "Chunks") == 0;
+        for (c++; c < end && (*c == ' ' || *c == '\t' || *c == '\r' || *c == '\n'); c++);
+        if (c >= end || *c != '"')
+            continue;
+
+        // chunk hashes grow with the file, they can't be longer than the rest of the list
+        size_t value_size = chunks ? (size_t)(end - c) : FILENAME_SIZE;
+        char *value = malloc(value_size);
+        if (value == NULL) {
+            perror("malloc");
+            break;
+        }
+        int value_len = json_string(c, end, value, value_size, &next);
+        if (value_len == -1) {
+            free(value);
+            break;
+        }
+        c = next;
+        if (value_len < 0) {
+            free(value);
+            continue;  // too long to be requested
+        }
+        char **member = chunks ? &file.chunks : &file.filename;
+        free(*member);
+        *member = value;
+    }
+    free(file.filename);
+    free(file.chunks);
+    free(data);
+
+    qsort(list->files, list->count, sizeof(struct published_file), compare_filenames);
+    list->loaded = st;
+    return 0;
+}
+
+/**
+* @brief find a published file
+* @param list published list
+* @param filename file to find
+* @return file, valid until the list is read again
+* @return NULL if it isn't published
+*/
+struct published_file *published_find(struct published_list *list, const char *filename) {
+    if (published_load(list) < 0 || list->count == 0)
+        return NULL;
+    struct published_file key = {(char *)filename, NULL};
+    return bsearch(&key, list->files, list->count, sizeof(struct published_file), compare_filenames);
+}
+
+/**
+* @brief close a download
+* @param epoll epoll instance
+* @param transfer download to close
+*/
+void transfer_close(int epoll, struct transfer *transfer) {
+    epoll_ctl(epoll, EPOLL_CTL_DEL, transfer->socket, NULL);
+    // closing with unread bytes resets the connection, which may drop the end of the reply
+    char unread[512];
+    while (recv(transfer->socket, unread, sizeof(unread), MSG_DONTWAIT) > 0);
+    close(transfer->socket);
+    if (transfer->file >= 0)
+        close(transfer->file);
+    if (transfer->reply != transfer->header)
+        free(transfer->reply);
+    if (transfer->prev != NULL)
+        transfer->prev->next = transfer->next;
+    else
+        transfers = transfer->next;
+    if (transfer->next != NULL)
+        transfer->next->prev = transfer->prev;
+    free(transfer);
+
+    // a descriptor was freed, take connections again
+    if (!accepting) {
+        struct epoll_event event = {.events = EPOLLIN, .data.ptr = NULL};
+        if (epoll_ctl(epoll, EPOLL_CTL_MOD, listening_socket, &event) == 0)
+            accepting = 1;
+    }
+}
+
+/**
+* @brief accept every pending connection
+* @param epoll epoll instance
+*/
+void transfer_accept(int epoll) {
+    while (1) {
+        int socket = accept4(listening_socket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (socket < 0) {
+            if (errno == EMFILE || errno == ENFILE) {
+                // stop polling the listening socket until a download is closed
+                struct epoll_event event = {.events = 0, .data.ptr = NULL};
+                if (epoll_ctl(epoll, EPOLL_CTL_MOD, listening_socket, &event) == 0)
+                    accepting = 0;
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED) {
+                perror("accept4");
+            }
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            return;
+        }
+
+        struct transfer *transfer = calloc(1, sizeof(struct transfer));
+        if (transfer == NULL) {
+            perror("calloc");
+            close(socket);
+            continue;
+        }
+        transfer->socket = socket;
+        transfer->file = -1;
+        transfer->reply = transfer->header;
+        transfer->progress = time(NULL);
+        struct epoll_event event = {.events = EPOLLIN | EPOLLRDHUP, .data.ptr = transfer};
+        if (epoll_ctl(epoll, EPOLL_CTL_ADD, socket, &event) < 0) {
+            perror("epoll_ctl");
+            close(socket);
+            free(transfer);
+            continue;
+        }
+        transfer->next = transfers;
+        if (transfers != NULL)
+            transfers->prev = transfer;
+        transfers = transfer;
+    }
+}
+
+/**
+* @brief parse a range field (a decimal number)
+* @param field field to parse
+* @param value set to its value
+* @return 0 if parsed
+* @return -1 if it isn't a number
+*/
+int parse_range_field(const char *field, off_t *value) {
+    if (*field < '0' || *field > '9')
+        return -1;
+    char *end;
+    errno = 0;
+    long long parsed = strtoll(field, &end, 10);
+    if (*end != '\0' || errno != 0)
+        return -1;
+    *value = parsed;
+    return 0;
+}
+
+/**
+* @brief set a reply made of a status only
+* @param transfer download
+* @param status execution status
+* @return 1 (the request is complete)
+*/
+int transfer_status(struct transfer *transfer, char status) {
+    transfer->reply[0] = status;
+    transfer->reply_len = 1;
+    return 1;
+}
+
+/**
+* @brief read the request of a download and open the file, setting the reply
+* @param transfer download
+* @return 1 if the request is complete
+* @return 0 if more of it is needed
+* @return -1 if the connection closed or failed
+*/
+int transfer_read(struct transfer *transfer) {
+    while (transfer->request_len < sizeof(transfer->request)) {
+        ssize_t bytes = recv(transfer->socket, transfer->request + transfer->request_len,
+                             sizeof(transfer->request) - transfer->request_len, 0);
+        if (bytes < 0 && errno == EINTR)
+            continue;
+        if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (bytes <= 0)
+            return -1;
+        transfer->request_len += bytes;
+    }
+
+    // '\0' terminated fields received so far
+    char *fields[RANGE_FIELDS];
+    int count = 0;
+    for (char *field = transfer->request, *end = transfer->request + transfer->request_len; count < RANGE_FIELDS && field < end; count++) {
+        char *terminator = memchr(field, '\0', end - field);
+        if (terminator == NULL)
+            break;
+        fields[count] = field;
+        field = terminator + 1;
+    }
+
+    // GET_FILE/GET_RANGE/GET_HASHES ...
+    if (count == 0)
+        return transfer->request_len < OPERATION_SIZE ? 0 : transfer_status(transfer, STATUS_ERROR);
+    int ranged = strcmp(fields[0], GET_RANGE_OPERATION) == 0;
+    int hashes = strcmp(fields[0], GET_HASHES_OPERATION) == 0;
+    if (!ranged && !hashes && strcmp(fields[0], GET_FILE_OPERATION) != 0)
+        return transfer_status(transfer, STATUS_ERROR);
+    // ... Filename (... Offset Length)
+    if (count < (ranged ? RANGE_FIELDS : FILE_FIELDS)) {
+        if (transfer->request_len < sizeof(transfer->request))
+            return 0;
+        return transfer_status(transfer, STATUS_NOT_PUBLISHED);  // longer than any published filename
+    }
+    char *filename = fields[1];
+    off_t offset = 0, length = 0;
+    if (ranged && (parse_range_field(fields[2], &offset) < 0 || parse_range_field(fields[3], &length) < 0))
+        return transfer_status(transfer, STATUS_ERROR);
+
+    struct published_file *published_file = strlen(filename) < FILENAME_SIZE ? published_find(&published, filename) : NULL;
+    if (published_file == NULL || (hashes && published_file->chunks == NULL))
+        return transfer_status(transfer, STATUS_NOT_PUBLISHED);
+    int file = open(filename, O_RDONLY | O_CLOEXEC);
+    if (file < 0)
+        return transfer_status(transfer, STATUS_NOT_PUBLISHED);
+    struct stat st;
+    if (fstat(file, &st) < 0 || !S_ISREG(st.st_mode)) {
+        close(file);
+        return transfer_status(transfer, STATUS_NOT_PUBLISHED);
+    }
+    if (hashes) {
+        // size and chunk hashes, nothing of the file itself
+        close(file);
+        size_t chunks_len = strlen(published_file->chunks);
+        char *reply = malloc(1 + RANGE_FIELD_SIZE + chunks_len + 1);
+        if (reply == NULL) {
+            perror("malloc");
+            return transfer_status(transfer, STATUS_ERROR);
+        }
+        reply[0] = STATUS_OK;
+        transfer->reply_len = 1 + snprintf(reply + 1, RANGE_FIELD_SIZE, "%lld", (long long)st.st_size) + 1;
+        memcpy(reply + transfer->reply_len, published_file->chunks, chunks_len + 1);
+        transfer->reply_len += chunks_len + 1;
+        transfer->reply = reply;
+        return 1;
+    }
+    transfer->file = file;
+    transfer_status(transfer, STATUS_OK);
+    transfer->offset = 0;
+    transfer->end = st.st_size;
+    if (ranged) {
+        // the range is cut to the file, and preceded by what the downloader needs to split and resume it
+        transfer->offset = offset < st.st_size ? offset : st.st_size;
+        if (length < st.st_size - transfer->offset)
+            transfer->end = transfer->offset + length;
+        long long modified = (long long)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+        transfer->reply_len += snprintf(transfer->reply + 1, sizeof(transfer->header) - 1, "%lld", (long long)st.st_size) + 1;
+        transfer->reply_len += snprintf(transfer->reply + transfer->reply_len, sizeof(transfer->header) - transfer->reply_len, "%lld", modified) + 1;
+    }
+    posix_fadvise(file, transfer->offset, transfer->end - transfer->offset, POSIX_FADV_SEQUENTIAL);
+    return 1;
+}
+
+/**
+* @brief send the rest of the reply header and up to PEER_SEND_CHUNK bytes of the file
+* @param transfer download
+* @return 1 if the reply is complete
+* @return 0 if the socket is full
+* @return -1 if the connection failed
+*/
+int transfer_write(struct transfer *transfer) {
+    while (transfer->reply_sent < transfer->reply_len) {
+        // corked with the first bytes of the file
+        int more = transfer->file >= 0 && transfer->offset < transfer->end ? MSG_MORE : 0;
+        ssize_t bytes = send(transfer->socket, transfer->reply + transfer->reply_sent,
+                             transfer->reply_len - transfer->reply_sent, MSG_NOSIGNAL | more);
+        if (bytes < 0 && errno == EINTR)
+            continue;
+        if (bytes < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        transfer->reply_sent += bytes;
+    }
+
+    size_t sent = 0;
+    while (transfer->file >= 0 && transfer->offset < transfer->end && sent < PEER_SEND_CHUNK) {
+        size_t count = transfer->end - transfer->offset;
+        if (count > PEER_SEND_CHUNK - sent)
+            count = PEER_SEND_CHUNK - sent;
+        ssize_t bytes = sendfile(transfer->socket, transfer->file, &transfer->offset, count);
+        if (bytes < 0 && errno == EINTR)
+            continue;
+        if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        if (bytes < 0)
+            return -1;
+        if (bytes == 0)
+            return 1;  // the file was truncated while it was sent
+        sent += bytes;
+    }
+    // with a chunk sent and more to go, the socket stays polled for writing
+    return transfer->file < 0 || transfer->offset >= transfer->end ? 1 : 0;
+}
+
+/**
+* @brief handle an event of a download
+* @param epoll epoll instance
+* @param transfer download
+* @param events epoll events
+*/
+void transfer_event(int epoll, struct transfer *transfer, uint32_t events) {
+    if (events & EPOLLERR) {
+        transfer_close(epoll, transfer);
+        return;
+    }
+    transfer->progress = time(NULL);
+
+    if (transfer->reply_len == 0) {
+        int result = transfer_read(transfer);
+        if (result < 0 || (result == 0 && (events & (EPOLLRDHUP | EPOLLHUP)))) {
+            transfer_close(epoll, transfer);
+            return;
+        }
+        if (result == 0)
+            return;
+        // the reply is written right away, the socket is only polled for writing once it's full
+    } else if (events & EPOLLHUP) {
+        transfer_close(epoll, transfer);
+        return;
+    }
+
+    int result = transfer_write(transfer);
+    if (result != 0) {
+        transfer_close(epoll, transfer);
+        return;
+    }
+    if (events & EPOLLOUT)
+        return;
+    struct epoll_event event = {.events = EPOLLOUT, .data.ptr = transfer};
+    if (epoll_ctl(epoll, EPOLL_CTL_MOD, transfer->socket, &event) < 0) {
+        perror("epoll_ctl");
+        transfer_close(epoll, transfer);
+    }
+}
+
+/**
+* @brief close the downloads that made no progress in PEER_IDLE_TIMEOUT seconds
+* @param epoll epoll instance
+*/
+void transfer_expire(int epoll) {
+    time_t now = time(NULL);
+    struct transfer *transfer = transfers;
+    while (transfer != NULL) {
+        struct transfer *next = transfer->next;
+        if (now - transfer->progress > PEER_IDLE_TIMEOUT)
+            transfer_close(epoll, transfer);
+        transfer = next;
+    }
+}
+
+/**
+* @brief signal handler to stop the server
+* @param signum signal number
+*/
+void stop_server(int signum) {
+    (void)signum;
+    stopping = 1;
+}
+
+int main(int argc, char *argv[]) {
+    struct peer_options options;
+    if (check_arguments(argc, argv, &options) < 0)
+        exit(1);
+    published.filename = options.published_filename;
+
+    struct sigaction action = {0};
+    action.sa_handler = stop_server;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    if (options.socket >= 0) {
+        // socket bound by client.py, which stops this server when it disconnects (or exits, however it does)
+        listening_socket = options.socket;
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        if (getppid() == 1)
+            exit(0);
+    } else {
+        listening_socket = socket(AF_INET, SOCK_STREAM, 0);
+        if (listening_socket < 0) {
+            perror("socket");
+            exit(1);
+        }
+        int reuse = 1;
+        setsockopt(listening_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        struct sockaddr_in address = {0};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_ANY);
+        address.sin_port = htons(options.port);
+        if (bind(listening_socket, (struct sockaddr *)&address, sizeof(address)) < 0) {
+            perror("bind");
+            exit(1);
+        }
+    }
+    if (listen(listening_socket, SOMAXCONN) < 0) {
+        perror("listen");
+        exit(1);
+    }
+    int flags = fcntl(listening_socket, F_GETFL);
+    if (flags < 0 || fcntl(listening_socket, F_SETFL, flags | O_NONBLOCK) < 0) {
+        perror("fcntl");
+        exit(1);
+    }
+
+    int epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll < 0) {
+        perror("epoll_create1");
+        exit(1);
+    }
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = NULL};
+    if (epoll_ctl(epoll, EPOLL_CTL_ADD, listening_socket, &event) < 0) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+
+    time_t expired = time(NULL);
+    struct epoll_event events[PEER_MAX_EVENTS];
+    while (!stopping) {
+        int count = epoll_wait(epoll, events, PEER_MAX_EVENTS, 1000);
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < count; i++) {
+            if (events[i].data.ptr == NULL)
+                transfer_accept(epoll);
+            else
+                transfer_event(epoll, events[i].data.ptr, events[i].events);
+        }
+        if (time(NULL) != expired) {
+            expired = time(NULL);
+            transfer_expire(epoll);
+        }
+    }
+
+    while (transfers != NULL)
+        transfer_close(epoll, transfers);
+    close(epoll);
+    close(listening_socket);
+    published_clear(&published);
+    return 0;
+}
@@ -1,9 +1,737 @@
 #include "filemanager.h"
+#include "audit_log.h"
+#include "audit_ring.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// bytes per output buffer, the writer flushes one while calls fill the other
+#define AUDIT_BUFFER_SIZE (1 << 20)
+// longest line a record can produce (four fields, their separators and the newline)
+#define AUDIT_LINE_SIZE (USERNAME_SIZE + OPERATION_SIZE + FILENAME_SIZE + DATETIME_SIZE + 4)
+// initial slots of a segment's string intern table (a power of 2, doubled at half load)
+#define AUDIT_INTERN_SLOTS (1 << 16)
+// records a ring consumer takes before appending them all at once
+#define AUDIT_RING_BATCH 64
+// longest a ring consumer sleeps while the ring is empty, in microseconds
+#define AUDIT_RING_IDLE_MAX 1000
+// worker threads serving calls when RPC_SERVER_THREADS isn't set
+#define SVC_DEFAULT_THREADS 8
+
+struct audit_buffer {
+    char *data;
+    size_t used;
+};
+
+struct audit_writer {
+    pthread_mutex_t lock;
+    pthread_cond_t pending;  // signaled when the active buffer gets its first line
+    pthread_cond_t space;  // broadcast when the buffers are swapped or a flush ends
+    struct audit_buffer buffers[2];
+    int active;  // buffer lines are appended to
+    int writing;  // 1 while the other buffer is being written out
+};
+
+struct audit_writer audit_writer = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .pending = PTHREAD_COND_INITIALIZER,
+    .space = PTHREAD_COND_INITIALIZER,
+};
+
+struct audit_log {
+    const char *directory;  // NULL when records go to stdout
+    unsigned int sequence;  // sequence number of the open segment
+    int fd;
+    char *map;
+    struct audit_segment_header *header;
+    struct audit_index_entry *index;
+    struct audit_log_record *records;
+    char *strings;
+    uint32_t *interned;  // open addressing table of string offsets + 1 (0 marks an empty slot)
+    uint32_t interned_slots;
+    uint32_t interned_count;
+    char last_datetime[DATETIME_SIZE];  // last parsed datetime, batches mostly repeat the same second
+    uint32_t last_time;
+};
+
+struct audit_log audit_log = {.fd = -1};
+
+struct audit_ring *audit_ring = NULL;  // ring consumed by this server, if RPC_AUDIT_RING is set
+const char *audit_ring_name = NULL;
+
+struct svc_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    int sockets[FD_SETSIZE];  // ring of sockets with a call waiting, each at most once
+    int head;
+    int count;
+    char busy[FD_SETSIZE];  // 1 while a socket is queued or being served, so it isn't polled
+    char listening[FD_SETSIZE];  // 1 for rendezvous sockets, accepted on the polling thread
+    int wakeup;  // eventfd written by workers when they give a socket back
+};
+
+struct svc_pool svc_pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .ready = PTHREAD_COND_INITIALIZER,
+    .wakeup = -1,
+};
+
+volatile sig_atomic_t svc_stopping = 0;
+
+/**
+* @brief FNV-1a hash of a string
+* @param string string to hash
+* @return hash
+*/
+uint32_t audit_log_hash(const char *string) {
+    uint32_t hash = 2166136261u;
+    for (const unsigned char *c = (const unsigned char *)string; *c != '\0'; c++)
+        hash = (hash ^ *c) * 16777619u;
+    return hash;
+}
+
+/**
+* @brief double the intern table, rehashing the strings already in the segment
+* @return 0 if grown
+* @return -1 if an error occurred
+*/
+int audit_log_grow_interned() {
+    uint32_t slots = audit_log.interned_slots * 2;
+    uint32_t *interned = calloc(slots, sizeof(uint32_t));
+    if (interned == NULL) {
+        perror("calloc");
+        return -1;
+    }
+    for (uint32_t i = 0; i < audit_log.interned_slots; i++) {
+        if (audit_log.interned[i] == 0)
+            continue;
+        uint32_t slot = audit_log_hash(audit_log.strings + audit_log.interned[i] - 1) & (slots - 1);
+        while (interned[slot] != 0)
+            slot = (slot + 1) & (slots - 1);
+        interned[slot] = audit_log.interned[i];
+    }
+    free(audit_log.interned);
+    audit_log.interned = interned;
+    audit_log.interned_slots = slots;
+    return 0;
+}
+
+/**
+* @brief find a string in the segment's string area, adding it if it isn't there yet;
+*        the caller made sure the area has room for it
+* @param string string to intern
+* @return offset of the string in the string area
+*/
+uint32_t audit_log_intern(const char *string) {
+    uint32_t slot = audit_log_hash(string) & (audit_log.interned_slots - 1);
+    while (audit_log.interned[slot] != 0) {
+        if (strcmp(audit_log.strings + audit_log.interned[slot] - 1, string) == 0)
+            return audit_log.interned[slot] - 1;
+        slot = (slot + 1) & (audit_log.interned_slots - 1);
+    }
+
+    uint32_t offset = audit_log.header->string_bytes;
+    size_t length = strlen(string) + 1;
+    memcpy(audit_log.strings + offset, string, length);
+    __atomic_store_n(&audit_log.header->string_bytes, offset + length, __ATOMIC_RELEASE);
+    audit_log.interned[slot] = offset + 1;
+
+    // a failed grow is retried with the next new string
+    if (++audit_log.interned_count * 2 > audit_log.interned_slots)
+        audit_log_grow_interned();
+    return offset;
+}
+
+/**
+* @brief create and map the next segment file
+* @return 0 if opened
+* @return -1 if an error occurred
+*/
+int audit_log_open_segment() {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/" AUDIT_SEGMENT_PREFIX "%08u" AUDIT_SEGMENT_SUFFIX, audit_log.directory, audit_log.sequence);
+    int fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("open");
+        return -1;
+    }
+    // sparse, only the pages records and strings are written to take space
+    if (ftruncate(fd, AUDIT_SEGMENT_SIZE) < 0) {
+        perror("ftruncate");
+        close(fd);
+        return -1;
+    }
+    char *map = mmap(NULL, AUDIT_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        close(fd);
+        return -1;
+    }
+
+    uint32_t *interned = calloc(AUDIT_INTERN_SLOTS, sizeof(uint32_t));
+    if (interned == NULL) {
+        perror("calloc");
+        munmap(map, AUDIT_SEGMENT_SIZE);
+        close(fd);
+        return -1;
+    }
+    free(audit_log.interned);
+    audit_log.interned = interned;
+    audit_log.interned_slots = AUDIT_INTERN_SLOTS;
+    audit_log.interned_count = 0;
+
+    audit_log.fd = fd;
+    audit_log.map = map;
+    audit_log.header = (struct audit_segment_header *)map;
+    audit_log.index = (struct audit_index_entry *)(map + AUDIT_INDEX_OFFSET);
+    audit_log.records = (struct audit_log_record *)(map + AUDIT_RECORDS_OFFSET);
+    audit_log.strings = map + AUDIT_STRINGS_OFFSET;
+
+    struct audit_segment_header *header = audit_log.header;
+    memcpy(header->magic, AUDIT_SEGMENT_MAGIC, sizeof(header->magic));
+    header->version = AUDIT_SEGMENT_VERSION;
+    header->record_capacity = AUDIT_SEGMENT_RECORDS;
+    header->string_capacity = AUDIT_SEGMENT_STRINGS;
+    header->index_interval = AUDIT_INDEX_INTERVAL;
+    header->index_offset = AUDIT_INDEX_OFFSET;
+    header->records_offset = AUDIT_RECORDS_OFFSET;
+    header->strings_offset = AUDIT_STRINGS_OFFSET;
+    return 0;
+}
+
+/**
+* @brief mark the open segment as sealed and unmap it
+*/
+void audit_log_close_segment() {
+    audit_log.header->sealed = 1;
+    munmap(audit_log.map, AUDIT_SEGMENT_SIZE);
+    close(audit_log.fd);
+    audit_log.map = NULL;
+    audit_log.fd = -1;
+}
+
+/**
+* @brief write records to segment files in a directory (created if missing), starting after the last
+*        segment already there
+* @param directory audit log directory
+* @return 0 if started
+* @return -1 if an error occurred
+*/
+int audit_log_start(const char *directory) {
+    if (mkdir(directory, 0755) < 0 && errno != EEXIST) {
+        perror("mkdir");
+        return -1;
+    }
+    DIR *dir = opendir(directory);
+    if (dir == NULL) {
+        perror("opendir");
+        return -1;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        unsigned int sequence;
+        if (sscanf(entry->d_name, AUDIT_SEGMENT_PREFIX "%u" AUDIT_SEGMENT_SUFFIX, &sequence) == 1 && sequence >= audit_log.sequence)
+            audit_log.sequence = sequence + 1;
+    }
+    closedir(dir);
+
+    audit_log.directory = directory;
+    return audit_log_open_segment();
+}
+
+/**
+* @brief seconds since the epoch of a record's datetime, the time it arrived if it can't be parsed
+* @param datetime datetime in AUDIT_DATETIME_FORMAT (local time)
+* @return seconds since the epoch
+*/
+uint32_t audit_log_time(const char *datetime) {
+    if (strcmp(datetime, audit_log.last_datetime) == 0)
+        return audit_log.last_time;
+
+    struct tm tm = {.tm_isdst = -1};
+    const char *end = strptime(datetime, AUDIT_DATETIME_FORMAT, &tm);
+    time_t seconds = end != NULL && *end == '\0' ? mktime(&tm) : -1;
+    if (seconds < 0)
+        return (uint32_t)time(NULL);
+
+    snprintf(audit_log.last_datetime, DATETIME_SIZE, "%s", datetime);
+    audit_log.last_time = (uint32_t)seconds;
+    return audit_log.last_time;
+}
+
+/**
+* @brief append one record to the open segment, moving on to a new one when it is full;
+*        the caller holds audit_writer.lock
+* @param username username that did the operation
+* @param operation operation name
+* @param filename file the operation was done on, NULL or empty if none
+* @param datetime datetime of the operation
+*/
+void audit_log_append_locked(const char *username, const char *operation, const char *filename, const char *datetime) {
+    if (audit_log.map == NULL)
+        return;
+    if (filename != NULL && filename[0] == '\0')
+        filename = NULL;
+
+    // rotate unless there is room for the record and its strings, whether or not they are already interned
+    struct audit_segment_header *header = audit_log.header;
+    size_t strings = strlen(username) + strlen(operation) + (filename != NULL ? strlen(filename) : 0) + 3;
+    if (header->record_count == AUDIT_SEGMENT_RECORDS || header->string_bytes + strings > AUDIT_SEGMENT_STRINGS) {
+        audit_log_close_segment();
+        audit_log.sequence++;
+        if (audit_log_open_segment() < 0)
+            return;
+        header = audit_log.header;
+    }
+
+    uint32_t count = header->record_count;
+    struct audit_log_record *record = &audit_log.records[count];
+    record->time = audit_log_time(datetime);
+    record->username = audit_log_intern(username);
+    record->operation = audit_log_intern(operation);
+    record->filename = filename != NULL ? audit_log_intern(filename) : AUDIT_NO_STRING;
+
+    struct audit_index_entry *block = &audit_log.index[count / AUDIT_INDEX_INTERVAL];
+    if (count % AUDIT_INDEX_INTERVAL == 0) {
+        block->min_time = record->time;
+        block->max_time = record->time;
+    } else if (record->time < block->min_time) {
+        block->min_time = record->time;
+    } else if (record->time > block->max_time) {
+        block->max_time = record->time;
+    }
+    if (count == 0 || record->time < header->min_time)
+        header->min_time = record->time;
+    if (count == 0 || record->time > header->max_time)
+        header->max_time = record->time;
+
+    // readers only look at records below record_count
+    __atomic_store_n(&header->record_count, count + 1, __ATOMIC_RELEASE);
+}
+
+/**
+* @brief append one record to the audit log segment, or as a line to the active output buffer
+*        (waiting while it has no room); the caller holds audit_writer.lock
+* @param username username that did the operation
+* @param operation operation name
+* @param filename file the operation was done on, NULL or empty if none
+* @param datetime datetime of the operation
+*/
+void audit_append_locked(const char *username, const char *operation, const char *filename, const char *datetime) {
+    if (audit_log.directory != NULL) {
+        audit_log_append_locked(username, operation, filename, datetime);
+        return;
+    }
+
+    while (audit_writer.buffers[audit_writer.active].used + AUDIT_LINE_SIZE > AUDIT_BUFFER_SIZE)
+        pthread_cond_wait(&audit_writer.space, &audit_writer.lock);
+
+    struct audit_buffer *buffer = &audit_writer.buffers[audit_writer.active];
+    int length;
+    if (filename == NULL || filename[0] == '\0')
+        length = snprintf(buffer->data + buffer->used, AUDIT_LINE_SIZE, "%s\t%s\t%s\n", username, operation, datetime);
+    else
+        length = snprintf(buffer->data + buffer->used, AUDIT_LINE_SIZE, "%s\t%s\t%s\t%s\n", username, operation, filename, datetime);
+    if (length >= AUDIT_LINE_SIZE)
+        length = AUDIT_LINE_SIZE - 1;
+
+    // wake the writer for the first line only, later ones ride along with its next flush
+    if (buffer->used == 0)
+        pthread_cond_signal(&audit_writer.pending);
+    buffer->used += length;
+}
+
+/**
+* @brief append one record to the audit log segment, or as a line to stdout, written asynchronously
+* @param username username that did the operation
+* @param operation operation name
+* @param filename file the operation was done on, NULL or empty if none
+* @param datetime datetime of the operation
+*/
+void audit_append(const char *username, const char *operation, const char *filename, const char *datetime) {
+    pthread_mutex_lock(&audit_writer.lock);
+    audit_append_locked(username, operation, filename, datetime);
+    pthread_mutex_unlock(&audit_writer.lock);
+}
+
+/**
+* @brief writer thread function, swapping out the active buffer whenever it has lines and writing it to stdout
+* @return never returns
+*/
+void *audit_writer_thread(void *arg) {
+    pthread_mutex_lock(&audit_writer.lock);
+    while (1) {
+        while (audit_writer.buffers[audit_writer.active].used == 0)
+            pthread_cond_wait(&audit_writer.pending, &audit_writer.lock);
+
+        // calls keep appending to the other (empty) buffer while this one is written
+        struct audit_buffer *full = &audit_writer.buffers[audit_writer.active];
+        audit_writer.active ^= 1;
+        audit_writer.writing = 1;
+        pthread_cond_broadcast(&audit_writer.space);
+        pthread_mutex_unlock(&audit_writer.lock);
+
+        if (fwrite(full->data, 1, full->used, stdout) != full->used || fflush(stdout) != 0)
+            perror("fwrite");
+
+        pthread_mutex_lock(&audit_writer.lock);
+        full->used = 0;
+        audit_writer.writing = 0;
+        pthread_cond_broadcast(&audit_writer.space);
+    }
+    return NULL;
+}
+
+/**
+* @brief wait until every appended line has been written to stdout
+*/
+void audit_flush() {
+    pthread_mutex_lock(&audit_writer.lock);
+    while (audit_writer.buffers[audit_writer.active].used > 0 || audit_writer.writing)
+        pthread_cond_wait(&audit_writer.space, &audit_writer.lock);
+    pthread_mutex_unlock(&audit_writer.lock);
+}
+
+/**
+* @brief allocate the output buffers and start the writer thread
+* @return 0 if started
+* @return -1 if an error occurred
+*/
+int audit_writer_start() {
+    for (int i = 0; i < 2; i++) {
+        audit_writer.buffers[i].data = malloc(AUDIT_BUFFER_SIZE);
+        if (audit_writer.buffers[i].data == NULL) {
+            perror("malloc");
+            return -1;
+        }
+    }
+
+    pthread_t writer;
+    if (pthread_create(&writer, NULL, audit_writer_thread, NULL) != 0) {
+        perror("pthread_create");
+        return -1;
+    }
+    pthread_detach(writer);
+    return 0;
+}
+
+/**
+* @brief get the monotonic time, comparable with other processes' on this host
+* @return monotonic time in nanoseconds
+*/
+unsigned long long monotonic_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/**
+* @brief take the record at the ring's dequeue position, if a producer finished writing it
+* @param ring ring
+* @param record set to a copy of the record
+* @return 1 if a record was taken
+* @return 0 if the ring is empty
+*/
+int audit_ring_pop(struct audit_ring *ring, struct audit_ring_slot *record) {
+    uint64_t position = __atomic_load_n(&ring->dequeue_position, __ATOMIC_RELAXED);
+    struct audit_ring_slot *slot;
+    while (1) {
+        slot = &ring->slot[position & (AUDIT_RING_SLOTS - 1)];
+        int64_t difference = (int64_t)(__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - (position + 1));
+        if (difference == 0) {
+            if (__atomic_compare_exchange_n(&ring->dequeue_position, &position, position + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (difference < 0) {
+            return 0;
+        } else {
+            position = __atomic_load_n(&ring->dequeue_position, __ATOMIC_RELAXED);
+        }
+    }
+
+    memcpy(record->username, slot->username, AUDIT_RING_USERNAME_SIZE);
+    memcpy(record->operation, slot->operation, AUDIT_RING_OPERATION_SIZE);
+    memcpy(record->filename, slot->filename, AUDIT_RING_FILENAME_SIZE);
+    memcpy(record->datetime, slot->datetime, AUDIT_RING_DATETIME_SIZE);
+    // free the slot for the producer that reaches it on the next lap
+    __atomic_store_n(&slot->sequence, position + AUDIT_RING_SLOTS, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/**
+* @brief take up to AUDIT_RING_BATCH records from the ring and append them to the output
+* @param records room for AUDIT_RING_BATCH records
+* @return number of records appended
+*/
+int audit_ring_drain(struct audit_ring_slot *records) {
+    int count = 0;
+    while (count < AUDIT_RING_BATCH && audit_ring_pop(audit_ring, &records[count]))
+        count++;
+    if (count == 0)
+        return 0;
+
+    pthread_mutex_lock(&audit_writer.lock);
+    for (int i = 0; i < count; i++)
+        audit_append_locked(records[i].username, records[i].operation, records[i].filename, records[i].datetime);
+    pthread_mutex_unlock(&audit_writer.lock);
+    return count;
+}
+
+/**
+* @brief ring consumer thread function, appending the ring's records to the output forever. It polls the ring,
+*        sleeping longer (up to AUDIT_RING_IDLE_MAX) the longer it stays empty, so producers never make a call to
+*        wake it up; the heartbeat tells them it runs
+* @return never returns
+*/
+void *audit_ring_consumer_thread(void *arg) {
+    struct audit_ring_slot *records = malloc(AUDIT_RING_BATCH * sizeof(struct audit_ring_slot));
+    if (records == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    unsigned int idle_us = 0;
+    while (1) {
+        __atomic_store_n(&audit_ring->heartbeat_ns, monotonic_ns(), __ATOMIC_RELAXED);
+        if (audit_ring_drain(records) > 0) {
+            idle_us = 0;
+            continue;
+        }
+        idle_us = idle_us == 0 ? 10 : idle_us * 2;
+        if (idle_us > AUDIT_RING_IDLE_MAX)
+            idle_us = AUDIT_RING_IDLE_MAX;
+        usleep(idle_us);
+    }
+    return NULL;
+}
+
+/**
+* @brief create the shared-memory ring (replacing one left by a previous run) and start its consumer. There is
+*        only one, so records are appended in the order producers claimed their slots; consumers draining it
+*        in parallel would append their batches interleaved
+* @param name shared memory object name, starting with '/'
+* @return 0 if started
+* @return -1 if an error occurred
+*/
+int audit_ring_start(const char *name) {
+    shm_unlink(name);
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        perror("shm_open");
+        return -1;
+    }
+    if (ftruncate(fd, sizeof(struct audit_ring)) < 0) {
+        perror("ftruncate");
+        close(fd);
+        return -1;
+    }
+    struct audit_ring *ring = mmap(NULL, sizeof(struct audit_ring), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ring == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+
+    ring->version = AUDIT_RING_VERSION;
+    ring->slots = AUDIT_RING_SLOTS;
+    ring->heartbeat_ns = monotonic_ns();
+    for (uint64_t i = 0; i < AUDIT_RING_SLOTS; i++)
+        ring->slot[i].sequence = i;
+    // producers only use the ring once they see the magic
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(ring->magic, AUDIT_RING_MAGIC, sizeof(ring->magic));
+    audit_ring = ring;
+    audit_ring_name = name;
+
+    pthread_t consumer;
+    if (pthread_create(&consumer, NULL, audit_ring_consumer_thread, NULL) != 0) {
+        perror("pthread_create");
+        return -1;
+    }
+    pthread_detach(consumer);
+    return 0;
+}
+
+/**
+* @brief close the ring, so producers go back to RPC, and append the records still in it
+*/
+void audit_ring_stop() {
+    __atomic_store_n(&audit_ring->closed, 1, __ATOMIC_RELEASE);
+    shm_unlink(audit_ring_name);
+
+    struct audit_ring_slot *records = malloc(AUDIT_RING_BATCH * sizeof(struct audit_ring_slot));
+    if (records == NULL) {
+        perror("malloc");
+        return;
+    }
+    while (audit_ring_drain(records) > 0)
+        ;
+    free(records);
+}
+
+/**
+* @brief worker thread function, serving the calls waiting on queued sockets forever
+* @return never returns
+*/
+void *svc_worker_thread(void *arg) {
+    uint64_t one = 1;
+    while (1) {
+        pthread_mutex_lock(&svc_pool.lock);
+        while (svc_pool.count == 0)
+            pthread_cond_wait(&svc_pool.ready, &svc_pool.lock);
+        int socket = svc_pool.sockets[svc_pool.head];
+        svc_pool.head = (svc_pool.head + 1) % FD_SETSIZE;
+        svc_pool.count--;
+        pthread_mutex_unlock(&svc_pool.lock);
+
+        // decodes, dispatches to filemanager_1 and replies; destroys the transport if the client left
+        svc_getreq_common(socket);
+
+        // hand the socket back to the polling thread
+        __atomic_store_n(&svc_pool.busy[socket], 0, __ATOMIC_RELEASE);
+        if (write(svc_pool.wakeup, &one, sizeof(one)) < 0)
+            perror("write");
+    }
+    return NULL;
+}
+
+/**
+* @brief stop serving on SIGINT/SIGTERM, once the polling thread wakes up
+*/
+void handle_stop() {
+    svc_stopping = 1;
+}
+
+/**
+* @brief serve the registered transports on a pool of worker threads; replaces the library's
+*        single-threaded svc_run, which the rpcgen generated main calls after registering the program.
+*        the calling thread polls every transport and accepts connections itself (registering new
+*        transports grows svc_pollfd, so only this thread may do it), while ready sockets are handed to
+*        the workers, one worker per socket at a time. RPC_SERVER_THREADS sets the number of workers
+*/
+void svc_run() {
+    int threads = SVC_DEFAULT_THREADS;
+    const char *threads_env = getenv("RPC_SERVER_THREADS");
+    if (threads_env != NULL && atoi(threads_env) > 0)
+        threads = atoi(threads_env);
+
+    // records go to segment files in RPC_AUDIT_DIR if set, as text lines to stdout otherwise
+    const char *audit_directory = getenv("RPC_AUDIT_DIR");
+    if (audit_directory != NULL && audit_directory[0] != '\0') {
+        if (audit_log_start(audit_directory) < 0)
+            exit(1);
+    } else if (audit_writer_start() < 0) {
+        exit(1);
+    }
+
+    // co-located servers write their records to the shared-memory ring named by RPC_AUDIT_RING, if set
+    const char *ring_name = getenv("RPC_AUDIT_RING");
+    if (ring_name != NULL && ring_name[0] != '\0' && audit_ring_start(ring_name) < 0)
+        exit(1);
+
+    svc_pool.wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (svc_pool.wakeup < 0) {
+        perror("eventfd");
+        exit(1);
+    }
+
+    // the transports registered so far are the program's own; rendezvous ones never close,
+    // so their descriptors can't be reused by an accepted connection
+    for (int i = 0; i < svc_max_pollfd; i++) {
+        int socket = svc_pollfd[i].fd;
+        int listening = 0;
+        socklen_t length = sizeof(listening);
+        if (socket >= 0 && socket < FD_SETSIZE
+            && getsockopt(socket, SOL_SOCKET, SO_ACCEPTCONN, &listening, &length) == 0 && listening)
+            svc_pool.listening[socket] = 1;
+    }
+
+    for (int i = 0; i < threads; i++) {
+        pthread_t worker;
+        if (pthread_create(&worker, NULL, svc_worker_thread, NULL) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+        pthread_detach(worker);
+    }
+
+    struct sigaction stop = {.sa_handler = handle_stop};
+    sigaction(SIGINT, &stop, NULL);
+    sigaction(SIGTERM, &stop, NULL);
+
+    struct pollfd *polled = malloc((FD_SETSIZE + 1) * sizeof(struct pollfd));
+    if (polled == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    while (!svc_stopping) {
+        int count = 0;
+        polled[count++] = (struct pollfd){.fd = svc_pool.wakeup, .events = POLLIN};
+        for (int i = 0; i < svc_max_pollfd; i++) {
+            int socket = svc_pollfd[i].fd;
+            if (socket < 0 || socket >= FD_SETSIZE || __atomic_load_n(&svc_pool.busy[socket], __ATOMIC_ACQUIRE))
+                continue;
+            polled[count++] = (struct pollfd){.fd = socket, .events = svc_pollfd[i].events};
+        }
+
+        if (poll(polled, count, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            break;
+        }
+
+        if (polled[0].revents) {
+            uint64_t returned;
+            if (read(svc_pool.wakeup, &returned, sizeof(returned)) < 0 && errno != EAGAIN)
+                perror("read");
+        }
+        for (int i = 1; i < count; i++) {
+            if (polled[i].revents == 0)
+                continue;
+            int socket = polled[i].fd;
+            if (svc_pool.listening[socket]) {
+                svc_getreq_common(socket);
+                continue;
+            }
+
+            __atomic_store_n(&svc_pool.busy[socket], 1, __ATOMIC_RELAXED);
+            pthread_mutex_lock(&svc_pool.lock);
+            svc_pool.sockets[(svc_pool.head + svc_pool.count) % FD_SETSIZE] = socket;
+            svc_pool.count++;
+            pthread_cond_signal(&svc_pool.ready);
+            pthread_mutex_unlock(&svc_pool.lock);
+        }
+    }
+
+    // drain what was already accepted into the output before leaving
+    if (audit_ring != NULL)
+        audit_ring_stop();
+    audit_flush();
+    pthread_mutex_lock(&audit_writer.lock);
+    if (audit_log.map != NULL)
+        audit_log_close_segment();
+    pmap_unset(filemanager, VERNUM);
+    exit(svc_stopping ? 0 : 1);
+}
 
 bool_t
 print_operation_1_svc(USERNAME username, OPERATION operation, DATETIME datetime, int *result,  struct svc_req *rqstp)
 {
-	printf("%s\t%s\t%s\n", username, operation, datetime);
+	audit_append(username, operation, NULL, datetime);
     *result = 0;
     
 	return TRUE;
@@ -12,7 +740,22 @@ print_operation_1_svc(USERNAME username, OPERATION operation, DATETIME datetime,
 bool_t
 print_file_operation_1_svc(USERNAME username, OPERATION operation, FILENAME filename, DATETIME datetime, int *result,  struct svc_req *rqstp)
 {
-	printf("%s\t%s\t%s\t%s\n", username, operation, filename, datetime);
+	audit_append(username, operation, filename, datetime);
+    *result = 0;
+
+	return TRUE;
+}
+
+bool_t
+print_operations_batch_1_svc(audit_batch records, int *result,  struct svc_req *rqstp)
+{
+	// same lines as print_operation/print_file_operation, one per record
+	pthread_mutex_lock(&audit_writer.lock);
+	for (u_int i = 0; i < records.audit_batch_len; i++) {
+		audit_record *record = &records.audit_batch_val[i];
+		audit_append_locked(record->username, record->operation, record->filename, record->datetime);
+	}
+	pthread_mutex_unlock(&audit_writer.lock);
     *result = 0;
 
 	return TRUE;
@@ -2,15 +2,24 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <limits.h>
 #include <unistd.h>
 #include <string.h>
 #include <netdb.h>
 #include <pthread.h>
-#include <dirent.h>
 #include <signal.h>
 #include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <dirent.h>
 #include "filemanager.h"
+#include "audit_ring.h"
 
 #define OPERATION_SIZE 256
 #define EXECUTION_STATUS_SIZE 1
@@ -22,38 +31,154 @@
 #define IP_ADDRESS_SIZE 16
 #define PORT_SIZE 6
 #define DATETIME_SIZE 20
+#define CONTENT_SIZE 65  // content id of a published file (hex SHA-256, see client.py), empty if unknown
+#define CURSOR_SIZE 21  // cursor and limit fields, up to 20 decimal digits
+#define REQUEST_BUFFER_SIZE 2048  // longest request (PUBLISH) is ~1120 bytes
+#define VARINT_MAX_SIZE 5
+#define CURSOR_VARINT_MAX_SIZE 10  // cursors are 64 bits
+
+// wire protocols. v1: operation name and fields as '\0' terminated strings, replies as fixed size fields.
+// v2: negotiated with HELLO, 1 byte opcode and varint length prefixed fields
+#define PROTOCOL_V1 1
+#define PROTOCOL_V2 2
+#define PROTOCOL_VERSION PROTOCOL_V2  // highest version supported
+#define EPOLL_MAX_EVENTS 256
+#define SESSION_REPLY_LIMIT 65536  // pipelined requests wait while this many reply bytes are unsent
+#define LIST_PAGE_SIZE 1024  // entries per list page when the client doesn't set a limit
+#define LIST_PAGE_MAX 16384
+#define V1_LIST_MAX 9999  // v1 counts are 4 ASCII digits, so v1 lists are cut there
+
+#define DEFAULT_WORKER_THREADS 8
+#define DEFAULT_QUEUE_SIZE 64
+#define POOL_REPORT_INTERVAL 10  // seconds
+#define REGISTRY_INITIAL_CAPACITY 1024  // must be a power of two
+#define REGISTRY_MAX_LOAD_PERCENT 70
+#define FILE_INDEX_INITIAL_CAPACITY 16  // must be a power of two
+#define CATALOG_INITIAL_CAPACITY 16
+#define CONTENT_INDEX_INITIAL_CAPACITY 64  // must be a power of two
+#define SOURCES_MAX 64  // publishers a SOURCES reply lists
+#define SEARCH_TOKEN_SIZE 64  // longer words are cut to SEARCH_TOKEN_SIZE - 1 characters
+#define SEARCH_MAX_TOKENS 256  // distinct tokens indexed per file (a filename and a description hold at most ~256)
+#define SEARCH_MAX_TERMS 8
+#define SEARCH_MAX_RESULTS 1000  // ranked matches a query can page through
+#define STATE_STRIPE_BITS 6  // the state is split in 1 << STATE_STRIPE_BITS independently locked stripes
+#define STATE_STRIPES (1 << STATE_STRIPE_BITS)
+#define AUDIT_QUEUE_SIZE 16384  // operations waiting for the RPC server, more are dropped
+#define AUDIT_BATCH_SIZE 256  // operations per RPC call, at most AUDIT_BATCH_MAX (filemanager.x)
+#define AUDIT_FLUSH_INTERVAL 50  // milliseconds an operation waits for its batch to fill up
+#define AUDIT_REPORT_INTERVAL 10  // seconds
+#define AUDIT_RPC_TIMEOUT 5  // seconds connecting to the RPC server or an RPC call may take
+#define AUDIT_RPC_ATTEMPTS 4  // times a batch is sent before it's counted as failed
+#define AUDIT_BACKOFF_MIN 100  // milliseconds between failed connections to the RPC server, doubled every time
+#define AUDIT_BACKOFF_MAX 10000  // milliseconds
+#define AUDIT_DRAIN_TIMEOUT 5  // seconds shutdown waits for the queued operations to reach the RPC server
+#define SNAPSHOT_INTERVAL 100000  // logged operations between snapshots
+#define SNAPSHOT_BUFFER_SIZE (1 << 20)
+#define WAL_SEGMENT_PREFIX "server-"  // the log is written in segments server-<8 digit sequence>.wal
+#define WAL_SEGMENT_SUFFIX ".wal"
+#define WAL_SEGMENT_PATH_SIZE 32
+#define ARENA_BLOCK_SIZE 65536  // first block of a request arena
+#define ARENA_KEEP_SIZE (1 << 20)  // largest block a request arena keeps between requests
+#define CONNECTION_CACHE_SIZE 64  // closed connections a thread keeps to reuse for the next ones
+#define CONNECTION_REPLY_KEEP (4 * SESSION_REPLY_LIMIT)  // largest reply buffer a cached connection keeps
+#define METRICS_OPCODES 16  // opcodes with metrics, above the highest one
+#define METRICS_STATUSES 8  // reply statuses with metrics, above the highest one
+#define HISTOGRAM_SUB_BITS 4  // latency histograms split every power of two in 1 << HISTOGRAM_SUB_BITS buckets
+#define HISTOGRAM_MAX_EXPONENT 40  // values from 2^40 ns (~18 minutes) up land in the last bucket
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_EXPONENT - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+#define STATS_LINE_SIZE 256  // v1 size of every line of a STATS reply
 
 const char *users_filename = "users.csv";
-const char *connected_filename = "connected.csv";
-const char *files_foldername = "files/";
-pthread_mutex_t users_file_lock = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t connected_file_lock = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t files_folder_lock = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t socket_lock = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t socket_cond = PTHREAD_COND_INITIALIZER;
-int socket_copied = 0;
+const char *wal_filename = "server.wal";  // log of servers before segments, recovered as segment 0
+const char *snapshot_filename = "server.snapshot";
+
+const char *rpc_host;  // host of the RPC service, the audit sender thread has its own client for it
+
+// server modes, selected with -m
+enum server_mode {
+    MODE_THREADS,  // blocking sockets, handled by the worker thread pool
+    MODE_EPOLL     // non-blocking sockets, handled by a single epoll event loop
+};
 
-CLIENT *clnt;  // RPC service client
+// program options
+struct server_options {
+    int port;
+    int workers;
+    int queue_size;
+    enum server_mode mode;
+    int metrics_port;  // local port serving the metrics over HTTP, 0 if none
+    const char *audit_ring;  // shared-memory ring of an rpc_server on this host, NULL to only use RPC
+};
 
 /**
 * @brief check program arguments
 * @param argc number of program arguments
 * @param argv program arguments
-* @return port number
+* @param options options to fill
+* @return 0 if successful
 * @return -1 if error
 */
-unsigned int check_arguments(int argc, char *argv[]) {
+int check_arguments(int argc, char *argv[], struct server_options *options) {
+    const char *usage = "Usage: ./server -p <port> [-m threads|epoll] [-t <worker threads>] [-q <queue size>] [-s <metrics port>] [-a <audit ring>]\n";
+    options->port = -1;
+    options->workers = DEFAULT_WORKER_THREADS;
+    options->queue_size = DEFAULT_QUEUE_SIZE;
+    options->mode = MODE_THREADS;
+    options->metrics_port = 0;
+    options->audit_ring = NULL;
+
     // check program arguments
-    if (argc != 3) {
-        fprintf(stderr, "Usage: ./server -p <port>\n");
+    int opt;
+    while ((opt = getopt(argc, argv, "p:m:t:q:s:a:")) != -1) {
+        switch (opt) {
+            case 'p':
+                options->port = atoi(optarg);
+                break;
+            case 'm':
+                if (strcmp(optarg, "threads") == 0) {
+                    options->mode = MODE_THREADS;
+                } else if (strcmp(optarg, "epoll") == 0) {
+                    options->mode = MODE_EPOLL;
+                } else {
+                    fprintf(stderr, "%s", usage);
+                    return -1;
+                }
+                break;
+            case 't':
+                options->workers = atoi(optarg);
+                break;
+            case 'q':
+                options->queue_size = atoi(optarg);
+                break;
+            case 's':
+                options->metrics_port = atoi(optarg);
+                break;
+            case 'a':
+                options->audit_ring = optarg;
+                break;
+            default:
+                fprintf(stderr, "%s", usage);
+                return -1;
+        }
+    }
+    if (optind != argc || options->port == -1) {
+        fprintf(stderr, "%s", usage);
+        return -1;
+    }
+    if (options->port < 1024 || options->port > 65535) {
+        fprintf(stderr, "Invalid port: '%d'\n", options->port);
         return -1;
     }
-    if (strcmp(argv[1], "-p") != 0) {
-        fprintf(stderr, "Usage: ./server -p <port>\n");
+    if (options->metrics_port != 0 && (options->metrics_port < 1024 || options->metrics_port > 65535 || options->metrics_port == options->port)) {
+        fprintf(stderr, "Invalid metrics port: '%d'\n", options->metrics_port);
+        return -1;
+    }
+    if (options->workers < 1 || options->queue_size < 1) {
+        fprintf(stderr, "Invalid worker threads or queue size\n");
         return -1;
     }
 
-    return atoi(argv[2]);
+    return 0;
 }
 
 // struct to hold server's local ip and error code
@@ -90,1119 +215,5121 @@ struct local_ip_info get_local_ip() {
     return return_ip;
 }
 
+// memory block of an arena
+struct arena_block {
+    struct arena_block *next;  // block filled before this one
+    size_t capacity;
+    size_t used;
+    _Alignas(16) char data[];
+};
+
+// bump allocator for the memory a request only needs until its reply is built (list pages, search results).
+// Nothing is freed on its own: the arena is reset after every request, keeping a single block as large as the
+// last requests needed (up to ARENA_KEEP_SIZE), so once it has grown, handling a request doesn't call malloc
+struct arena {
+    struct arena_block *block;  // block being filled, NULL until the first allocation
+    size_t total;  // capacity of every block
+    size_t next_capacity;  // capacity of the first block after a reset, 0 for ARENA_BLOCK_SIZE
+    char *last;  // last allocation, the only one that can grow in place
+};
+
+__thread struct arena request_arena;  // arena of the requests handled by the calling thread
+
 /**
-* @brief check if username exists in users.csv
-* @param username username to check
-* @return 1 if exists, 0 otherwise
-* @return -1 if error
+* @brief allocate memory from an arena, aligned to 16 bytes
+* @param arena arena
+* @param size number of bytes
+* @return pointer to the memory, valid until the arena is reset
+* @return NULL if error
 */
-int check_username_existence(USERNAME username) {
-    // open users.csv file
-    pthread_mutex_lock(&users_file_lock);
-    FILE *users_file = fopen(users_filename, "r");
-    if (users_file == NULL) {
-        pthread_mutex_unlock(&users_file_lock);
-        perror("fopen");
-        return -1;
-    }
-
-    // go line by line, checking if the line matches the username
-    const long MAXLINE = 4096;
-    char line[MAXLINE];
-    while (fgets(line, MAXLINE, users_file) != NULL) {
-        line[strlen(line)-1] = '\0';  // fgets keeps the newline, so we need to remove it
-        if (strcmp(line, username) == 0) {
-            // username exists
-            fclose(users_file);
-            pthread_mutex_unlock(&users_file_lock);
-            return 1;
+void *arena_alloc(struct arena *arena, size_t size) {
+    size = (size + 15) & ~(size_t)15;
+    struct arena_block *block = arena->block;
+    if (block == NULL || block->used + size > block->capacity) {
+        size_t capacity = block != NULL ? 2 * block->capacity : arena->next_capacity != 0 ? arena->next_capacity : ARENA_BLOCK_SIZE;
+        while (capacity < size)
+            capacity *= 2;
+        struct arena_block *grown = malloc(sizeof(struct arena_block) + capacity);
+        if (grown == NULL) {
+            perror("malloc");
+            return NULL;
         }
+        grown->next = block;
+        grown->capacity = capacity;
+        grown->used = 0;
+        arena->block = block = grown;
+        arena->total += capacity;
     }
 
-    // username doesn't exist
-    fclose(users_file);
-    pthread_mutex_unlock(&users_file_lock);
-    return 0;
+    char *allocated = block->data + block->used;
+    block->used += size;
+    arena->last = allocated;
+    return allocated;
 }
 
 /**
-* @brief check if user is connected (if username in connected.csv)
-* @param username username to check
-* @return 1 if connected, 0 otherwise
-* @return -1 if error
+* @brief grow memory allocated from an arena, in place if it is the last allocation and fits its block
+* @param arena arena
+* @param pointer memory to grow, NULL to allocate
+* @param old_size bytes of it to keep
+* @param size new size
+* @return pointer to the memory
+* @return NULL if error
 */
-int check_user_connection(USERNAME username) {
-    // open connected file
-    pthread_mutex_lock(&connected_file_lock);
-    FILE *connected_file = fopen(connected_filename, "r");
-    if (connected_file == NULL) {
-        perror("fopen");
-        pthread_mutex_unlock(&connected_file_lock);
-        return -1;
-    }
-
-    // go line by line, checking if the line's username matches the username
-    const long MAXLINE = 4096;
-    char line[MAXLINE];
-    while (fgets(line, MAXLINE, connected_file) != 0) {
-        char *possible_username = strtok(line, ";");
-        if (strcmp(possible_username, username) == 0) {
-            // username exists
-            fclose(connected_file);
-            pthread_mutex_unlock(&connected_file_lock);
-            return 1;
+void *arena_realloc(struct arena *arena, void *pointer, size_t old_size, size_t size) {
+    if (pointer != NULL && pointer == arena->last) {
+        size_t offset = (char *)pointer - arena->block->data;
+        size_t rounded = (size + 15) & ~(size_t)15;
+        if (offset + rounded <= arena->block->capacity) {
+            arena->block->used = offset + rounded;
+            return pointer;
         }
     }
-
-    // username doesn't exist
-    fclose(connected_file);
-    pthread_mutex_unlock(&connected_file_lock);
-    return 0;
+    void *moved = arena_alloc(arena, size);
+    if (moved != NULL && pointer != NULL)
+        memcpy(moved, pointer, old_size);
+    return moved;
 }
 
 /**
-* @brief register user, adding it to users.csv file
-* @param username username to register
-* @return 0 if successful
-* @return 1 if username already exists
-* @return -1 if error
+* @brief free everything allocated from an arena. A request that needed more than its block frees every block,
+*        so the next one gets a single block as large as all of them
+* @param arena arena
 */
-int register_user(USERNAME username) {
-    // check if username exists in users.csv
-    int check_username_existence_rvalue = check_username_existence(username);
-    if (check_username_existence_rvalue == 1) {
-        return 1;
-    } else if (check_username_existence_rvalue < 0) {
-        return -1;
+void arena_reset(struct arena *arena) {
+    struct arena_block *block = arena->block;
+    arena->last = NULL;
+    if (block == NULL)
+        return;
+    if (block->next == NULL && block->capacity <= ARENA_KEEP_SIZE) {
+        block->used = 0;
+        return;
     }
 
-    // open users.csv
-    pthread_mutex_lock(&users_file_lock);
-    FILE *users_file = fopen(users_filename, "a");
-    if (users_file == NULL) {
-        pthread_mutex_unlock(&users_file_lock);
-        perror("fopen");
-        return -1;
+    arena->next_capacity = arena->total < ARENA_KEEP_SIZE ? arena->total : ARENA_KEEP_SIZE;
+    while (block != NULL) {
+        struct arena_block *next = block->next;
+        free(block);
+        block = next;
     }
+    arena->block = NULL;
+    arena->total = 0;
+}
 
-    // write username to users.csv
-    fprintf(users_file, "%s\n", username);
-    fclose(users_file);
-    pthread_mutex_unlock(&users_file_lock);
+struct published_file;
+struct registered_user;
+
+// node of a ternary search tree of the tokens in published filenames and descriptions, one character per node
+struct search_node {
+    char c;
+    struct search_node *lo, *eq, *hi;
+    struct search_node *parent;
+    struct search_posting *postings[2];  // files containing the token that ends here, newest first. Indexed
+                                         // by in_filename, as filename tokens rank higher
+    unsigned long long newest[2];  // newest sequence in postings[] of this node and of its lo, eq and hi subtrees
+    size_t posting_count;
+    size_t prefix_count;  // postings of every token starting with the characters up to this one
+};
 
-    return 0;
+// a file in the posting list of one of its tokens
+struct search_posting {
+    struct published_file *file;
+    struct registered_user *owner;
+    int position;  // index of the token among the distinct tokens of the file, see search_tokenize()
+    int in_filename;  // 1 if the token is in the filename (it may be in the description too)
+    struct search_node *node;
+    struct search_posting *prev;
+    struct search_posting *next;
+    struct search_posting *next_of_file;
+};
+
+// published file, allocated with its strings. Shared by every version of the catalog that lists it
+struct published_file {
+    unsigned long long deleted;  // catalog change that deleted it, ULLONG_MAX while published
+    unsigned long long sequence;  // order of publication among every user's files, newer ones rank first
+    struct search_posting *postings;  // while published
+    struct registered_user *owner;
+    struct published_file *content_prev;  // other published files of the stripe with the same content, while
+    struct published_file *content_next;  // published and if the content is known
+    char *description;  // stored after filename
+    char *content;  // stored after description
+    char filename[];
+};
+
+// slot of a file index, empty if file is NULL
+struct file_slot {
+    unsigned int hash;
+    struct published_file *file;
+};
+
+// open addressing (linear probing) hash table of the files a user has published, by filename
+struct file_index {
+    struct file_slot *slots;
+    size_t capacity;  // always a power of two
+    size_t count;
+};
+
+// slot of a content index, empty if files is NULL
+struct content_slot {
+    unsigned int hash;
+    struct published_file *files;  // first of the files with the content, linked by content_next
+};
+
+// open addressing (linear probing) hash table of the published files of a stripe, by content
+struct content_index {
+    struct content_slot *slots;
+    size_t capacity;  // always a power of two
+    size_t count;
+};
+
+// version of the files published by a user, in publication order. Publishing appends to it while there is
+// room and deleting only marks the file deleted, so a list request reads its first count files, skipping
+// files deleted before the change it saw, with no lock held. The live files move to a new version when
+// this one is full or when half of its files are deleted
+struct catalog {
+    int refs;  // atomic, one for the user while this is their current version, one per list request, one
+               // for the previous version (which still lists files of this one)
+    unsigned long long changes;  // publish and delete operations since the user connected
+    unsigned long long superseded;  // changes when the next version replaced this one, ULLONG_MAX before
+    struct catalog *next;
+    size_t count;  // files appended, deleted ones included
+    size_t deleted;
+    size_t capacity;
+    struct published_file *files[];
+};
+
+// registered user, owned by the users registry of its stripe
+struct registered_user {
+    char username[USERNAME_SIZE];
+    int connected;
+    char ip[IP_ADDRESS_SIZE];  // where their files are served, while connected
+    char port[PORT_SIZE];
+    struct catalog *catalog;  // while connected
+    struct file_index published;  // published files of catalog that aren't deleted
+};
+
+// where a connected user serves their files
+struct connected_user {
+    char username[USERNAME_SIZE];
+    char ip[IP_ADDRESS_SIZE];
+    char port[PORT_SIZE];
+    unsigned long long sequence;  // order of connection among the stripe's users, LIST_USERS cursors name it
+};
+
+// immutable copy of the connected users of a stripe, in connection order. Connecting and disconnecting
+// publish a new copy instead of changing it, so list requests read it without holding the stripe lock, and
+// whoever drops the last reference frees it
+struct connected_view {
+    int refs;  // protected by the view_lock of the stripe
+    unsigned long count;
+    struct connected_user users[];
+};
+
+// slot of the users registry, empty if user is NULL
+struct registry_slot {
+    unsigned int hash;
+    struct registered_user *user;
+};
+
+// open addressing (linear probing) hash table of registered users
+struct user_registry {
+    struct registry_slot *slots;
+    size_t capacity;  // always a power of two
+    size_t count;
+};
+
+// part of the server state: the users whose username hash falls in the stripe, their connections and their
+// published files (files/<username>). Operations lock only the stripe of the user they change, so operations
+// on users of different stripes don't wait for each other, and operations that only read share the lock
+struct state_stripe {
+    pthread_rwlock_t lock;
+    struct user_registry users;
+    pthread_mutex_t view_lock;  // only held to swap the connected view or to take a reference to it
+    struct connected_view *connected;  // replaced while holding lock for writing, never NULL
+    unsigned long long connections;  // users connected so far, the sequence of the last one
+    struct search_node *search_root;  // tokens of the files published by the stripe's users
+    struct content_index contents;  // files published by the stripe's users whose content is known
+};
+
+struct state_stripe stripes[STATE_STRIPES];
+unsigned long long search_sequence = 0;  // sequence of the last file indexed
+
+/**
+* @brief hash a username or a filename (32 bit FNV-1a)
+* @param string string to hash
+* @return hash of the string
+*/
+unsigned int hash_string(const char *string) {
+    unsigned int hash = 2166136261u;
+    for (const unsigned char *c = (const unsigned char *)string; *c != '\0'; c++) {
+        hash ^= *c;
+        hash *= 16777619u;
+    }
+    return hash;
 }
 
 /**
-* @brief register operation handler. Calls register_user() and sends error code to client
-* @param client_socket socket of client
+* @brief allocate an empty registry
+* @param registry registry to initialize
+* @param capacity number of slots, must be a power of two
 * @return 0 if successful
 * @return -1 if error
 */
-int handle_register(int client_socket) {
-    // get datetime from client socket
-    char datetime[DATETIME_SIZE];
-    if (read(client_socket, datetime, DATETIME_SIZE) < 0) {
-        perror("read");
-        return -1;
-    }
-    
-    // get username from client socket
-    char username[USERNAME_SIZE];
-    if (read(client_socket, username, USERNAME_SIZE) < 0) {
-        perror("read");
+int registry_init(struct user_registry *registry, size_t capacity) {
+    registry->slots = calloc(capacity, sizeof(struct registry_slot));
+    if (registry->slots == NULL) {
+        perror("calloc");
         return -1;
     }
+    registry->capacity = capacity;
+    registry->count = 0;
+    return 0;
+}
 
-    // attempt to register user
-    int register_user_rvalue = register_user(username);
-    
-    // send error code to client
-    if (register_user_rvalue < 0) {
-        // in case there was an error
-        write(client_socket, "2", EXECUTION_STATUS_SIZE);
-        return -1;
-    } else if (register_user_rvalue == 1) {
-        // in case username already exists
-        write(client_socket, "1", EXECUTION_STATUS_SIZE);
-    } else
-        write(client_socket, "0", EXECUTION_STATUS_SIZE);
-
-    printf("OPERATION FROM %s\n", username);
-        
-    // send info to RPC server
-    int rpc_server_result;
-    if (print_operation_1(username, "REGISTER", datetime, &rpc_server_result, clnt) < 0) {
-        clnt_perror(clnt, "list_content");
+/**
+* @brief find the slot holding username, or the empty slot where it would be inserted
+* @param registry registry to search
+* @param username username to find
+* @param hash hash of the username
+* @return index of the slot
+*/
+size_t registry_find_slot(struct user_registry *registry, const char *username, unsigned int hash) {
+    size_t mask = registry->capacity - 1;
+    size_t i = hash & mask;
+    while (registry->slots[i].user != NULL) {
+        if (registry->slots[i].hash == hash && strcmp(registry->slots[i].user->username, username) == 0)
+            return i;
+        i = (i + 1) & mask;
     }
-    
-    return 0;
+    return i;
 }
 
 /**
-* @brief disconnect user, deleting it from connected.csv file and deleting username from files folder
-* @param username username to disconnect
+* @brief double the registry capacity, rehashing every user
+* @param registry registry to grow
 * @return 0 if successful
-* @return 1 if user doesn't exist
-* @return 2 if user is not connected
 * @return -1 if error
 */
-int disconnect_user(USERNAME username) {
-    // check is user exists
-    int check_username_existence_rvalue = check_username_existence(username);
-    if (check_username_existence_rvalue == 0) {
-        return 1;
-    } else if (check_username_existence_rvalue < 0) {
-        return -1;
-    }
-
-    // check if user is connected
-    int check_user_connection_rvalue = check_user_connection(username);
-    if (check_user_connection_rvalue == 0) {
-        return 2;
-    } else if (check_user_connection_rvalue < 0) {
+int registry_grow(struct user_registry *registry) {
+    struct user_registry grown;
+    if (registry_init(&grown, registry->capacity * 2) < 0)
         return -1;
-    }
 
-    // delete username line from connected.csv
-    pthread_mutex_lock(&connected_file_lock);
-    FILE *connected_file = fopen(connected_filename, "r+");
-    if (connected_file == NULL) {
-        pthread_mutex_unlock(&connected_file_lock);
-        perror("fopen");
-        return -1;
-    }
-    int MAXLINE = 4096;
-    char line[MAXLINE];
-    FILE *temp_connected_file = fopen("temp_connected.csv", "w");
-    if (temp_connected_file == NULL) {
-        pthread_mutex_unlock(&connected_file_lock);
-        perror("fopen");
-        return -1;
-    }
-    char modified_line[MAXLINE];
-    while (fgets(line, MAXLINE, connected_file) != 0) {
-        strcpy(modified_line, line);
-        char *possible_username = strtok(modified_line, ";");
-        if (strcmp(possible_username, username) != 0) {  // if user is not the line's username, write line into temp_file
-            fprintf(temp_connected_file, "%s", line);
-        }
+    for (size_t i = 0; i < registry->capacity; i++) {
+        if (registry->slots[i].user == NULL)
+            continue;
+        size_t mask = grown.capacity - 1;
+        size_t j = registry->slots[i].hash & mask;
+        while (grown.slots[j].user != NULL)
+            j = (j + 1) & mask;
+        grown.slots[j] = registry->slots[i];
     }
-    fclose(connected_file);
-    fclose(temp_connected_file);
-    remove(connected_filename);
-    rename("temp_connected.csv", connected_filename);
-    pthread_mutex_unlock(&connected_file_lock);
+    grown.count = registry->count;
 
-    // delete username file from files folder
-    pthread_mutex_lock(&files_folder_lock);
-    char *username_filename = malloc(strlen(files_foldername) + strlen(username) + 2);
-    asprintf(&username_filename, "%s%s", files_foldername, username);
-    remove(username_filename);
-    pthread_mutex_unlock(&files_folder_lock);
-    free(username_filename);
-    
+    free(registry->slots);
+    *registry = grown;
     return 0;
 }
 
 /**
-* @brief disconnect operation handler. Calls disconnect_user() and sends error code to client
-* @param client_socket socket of client
+* @brief look up a registered user
+* @param registry registry to search
+* @param username username to find
+* @return user if registered, NULL otherwise
+*/
+struct registered_user *registry_lookup(struct user_registry *registry, const char *username) {
+    if (registry->capacity == 0)
+        return NULL;
+    return registry->slots[registry_find_slot(registry, username, hash_string(username))].user;
+}
+
+/**
+* @brief insert a user into the registry
+* @param registry registry to insert into
+* @param username username to insert
 * @return 0 if successful
+* @return 1 if username already exists
 * @return -1 if error
 */
-int handle_disconnect(int client_socket) {
-    // get datetime from client socket
-    char datetime[DATETIME_SIZE];
-    if (read(client_socket, datetime, DATETIME_SIZE) < 0) {
-        perror("read");
+int registry_insert(struct user_registry *registry, const char *username) {
+    if (registry->capacity == 0 && registry_init(registry, REGISTRY_INITIAL_CAPACITY) < 0)
         return -1;
+
+    unsigned int hash = hash_string(username);
+    size_t i = registry_find_slot(registry, username, hash);
+    if (registry->slots[i].user != NULL)
+        return 1;
+
+    // keep load factor under REGISTRY_MAX_LOAD_PERCENT, so probe sequences stay short
+    if ((registry->count + 1) * 100 > registry->capacity * REGISTRY_MAX_LOAD_PERCENT) {
+        if (registry_grow(registry) < 0)
+            return -1;
+        i = registry_find_slot(registry, username, hash);
     }
-    
-    // get username from client socket
-    char username[USERNAME_SIZE];
-    if (read(client_socket, username, USERNAME_SIZE) < 0) {
-        perror("read");
+
+    struct registered_user *user = calloc(1, sizeof(struct registered_user));
+    if (user == NULL) {
+        perror("calloc");
         return -1;
     }
+    strncpy(user->username, username, USERNAME_SIZE - 1);
 
-    // attempt to disconnect user
-    int disconnect_user_rvalue = disconnect_user(username);
-    
-    // send error code to client
-    if (disconnect_user_rvalue < 0) {
-        // in case there was an error
-        write(client_socket, "3", EXECUTION_STATUS_SIZE);
-        return -1;
-    } else if (disconnect_user_rvalue == 1) {
-        // in case username doesn't exist
-        write(client_socket, "1", EXECUTION_STATUS_SIZE);
-    } else if (disconnect_user_rvalue == 2) {
-        // in case user is not connected
-        write(client_socket, "2", EXECUTION_STATUS_SIZE);
-    } else
-        write(client_socket, "0", EXECUTION_STATUS_SIZE);
+    registry->slots[i].hash = hash;
+    registry->slots[i].user = user;
+    registry->count++;
+    return 0;
+}
 
-    printf("OPERATION FROM %s\n", username);
-        
-    // send info to RPC server
-    int rpc_server_result;
-    if (print_operation_1(username, "DISCONNECT", datetime, &rpc_server_result, clnt) < 0) {
-        clnt_perror(clnt, "list_content");
+/**
+* @brief find the slot holding filename, or the empty slot where it would be inserted
+* @param index file index to search
+* @param filename filename to find
+* @param hash hash of the filename
+* @return index of the slot
+*/
+size_t file_index_find_slot(struct file_index *index, const char *filename, unsigned int hash) {
+    size_t mask = index->capacity - 1;
+    size_t i = hash & mask;
+    while (index->slots[i].file != NULL) {
+        if (index->slots[i].hash == hash && strcmp(index->slots[i].file->filename, filename) == 0)
+            return i;
+        i = (i + 1) & mask;
     }
-    
-    return 0;
+    return i;
 }
 
 /**
-* @brief unregister user, deleting it from users.csv file and disconnecting them if they are connected
-* @param username username to unregister
+* @brief look up a published file
+* @param index file index to search
+* @param filename filename to find
+* @return file if published, NULL otherwise
+*/
+struct published_file *file_index_lookup(struct file_index *index, const char *filename) {
+    if (index->capacity == 0)
+        return NULL;
+    return index->slots[file_index_find_slot(index, filename, hash_string(filename))].file;
+}
+
+/**
+* @brief insert a file that isn't in the index yet, growing it like the users registry
+* @param index file index
+* @param file file to insert
 * @return 0 if successful
-* @return 1 if username doesn't exist
 * @return -1 if error
 */
-int unregister_user(USERNAME username) {
-    // check if username exists
-    int check_username_existence_rvalue = check_username_existence(username);
-    if (check_username_existence_rvalue == 0) {
-        return 1;
-    } else if (check_username_existence_rvalue < 0) {
-        return -1;
+int file_index_insert(struct file_index *index, struct published_file *file) {
+    if ((index->count + 1) * 100 > index->capacity * REGISTRY_MAX_LOAD_PERCENT) {
+        size_t capacity = index->capacity == 0 ? FILE_INDEX_INITIAL_CAPACITY : index->capacity * 2;
+        struct file_slot *slots = calloc(capacity, sizeof(struct file_slot));
+        if (slots == NULL) {
+            perror("calloc");
+            return -1;
+        }
+        for (size_t i = 0; i < index->capacity; i++) {
+            if (index->slots[i].file == NULL)
+                continue;
+            size_t j = index->slots[i].hash & (capacity - 1);
+            while (slots[j].file != NULL)
+                j = (j + 1) & (capacity - 1);
+            slots[j] = index->slots[i];
+        }
+        free(index->slots);
+        index->slots = slots;
+        index->capacity = capacity;
     }
 
-    // disconnect user if they are connected
-    int disconnect_user_rvalue = disconnect_user(username);
-    if (disconnect_user_rvalue < 0) {
-        return -1;
-    }
+    unsigned int hash = hash_string(file->filename);
+    size_t i = file_index_find_slot(index, file->filename, hash);
+    index->slots[i].hash = hash;
+    index->slots[i].file = file;
+    index->count++;
+    return 0;
+}
 
-    // delete username from users.csv
-    pthread_mutex_lock(&users_file_lock);
-    FILE *users_file = fopen(users_filename, "r");
-    if (users_file == NULL) {
-        pthread_mutex_unlock(&users_file_lock);
-        perror("fopen");
-        return -1;
+/**
+* @brief remove a file from the index (the file itself is freed with the catalog)
+* @param index file index
+* @param filename filename to remove
+* @return file if it was published, NULL otherwise
+*/
+struct published_file *file_index_remove(struct file_index *index, const char *filename) {
+    if (index->capacity == 0)
+        return NULL;
+
+    size_t i = file_index_find_slot(index, filename, hash_string(filename));
+    struct published_file *file = index->slots[i].file;
+    if (file == NULL)
+        return NULL;
+    index->slots[i].file = NULL;
+    index->count--;
+
+    // backward shift deletion, as in registry_remove()
+    size_t mask = index->capacity - 1;
+    size_t hole = i;
+    size_t j = (i + 1) & mask;
+    while (index->slots[j].file != NULL) {
+        size_t home = index->slots[j].hash & mask;
+        if (((j - home) & mask) >= ((j - hole) & mask)) {
+            index->slots[hole] = index->slots[j];
+            index->slots[j].file = NULL;
+            hole = j;
+        }
+        j = (j + 1) & mask;
     }
+    return file;
+}
 
-    FILE *temp_users_file = fopen("temp_users.csv", "w");
-    if (temp_users_file == NULL) {
-        pthread_mutex_unlock(&users_file_lock);
-        perror("fopen");
-        return -1;
+/**
+* @brief find the slot holding the files with a content, or the empty slot where they would be inserted
+* @param index content index to search
+* @param content content id to find
+* @param hash hash of the content id
+* @return index of the slot
+*/
+size_t content_index_find_slot(struct content_index *index, const char *content, unsigned int hash) {
+    size_t mask = index->capacity - 1;
+    size_t i = hash & mask;
+    while (index->slots[i].files != NULL) {
+        if (index->slots[i].hash == hash && strcmp(index->slots[i].files->content, content) == 0)
+            return i;
+        i = (i + 1) & mask;
     }
+    return i;
+}
+
+/**
+* @brief look up the published files with a content
+* @param index content index to search
+* @param content content id to find
+* @return first file, linked to the others by content_next, NULL if there is none
+*/
+struct published_file *content_index_lookup(struct content_index *index, const char *content) {
+    if (index->capacity == 0)
+        return NULL;
+    return index->slots[content_index_find_slot(index, content, hash_string(content))].files;
+}
 
-    char line[USERNAME_SIZE];
-    while (fgets(line, USERNAME_SIZE, users_file) != NULL) {
-        line[strlen(username)] = '\0';  // fgets includes \n in buffer, we don't want that
-        if (strcmp(line, username) != 0) {
-            line[strlen(username)] = '\n';  // we need the \n back to put it into the input file
-            fprintf(temp_users_file, "%s", line);
+/**
+* @brief add a file with a known content to the index, first of the files with the same content. The stripe
+*        must be write locked
+* @param index content index of the owner's stripe
+* @param file file to add
+* @return 0 if successful
+* @return -1 if error
+*/
+int content_index_add(struct content_index *index, struct published_file *file) {
+    if ((index->count + 1) * 100 > index->capacity * REGISTRY_MAX_LOAD_PERCENT) {
+        size_t capacity = index->capacity == 0 ? CONTENT_INDEX_INITIAL_CAPACITY : index->capacity * 2;
+        struct content_slot *slots = calloc(capacity, sizeof(struct content_slot));
+        if (slots == NULL) {
+            perror("calloc");
+            return -1;
+        }
+        for (size_t i = 0; i < index->capacity; i++) {
+            if (index->slots[i].files == NULL)
+                continue;
+            size_t j = index->slots[i].hash & (capacity - 1);
+            while (slots[j].files != NULL)
+                j = (j + 1) & (capacity - 1);
+            slots[j] = index->slots[i];
         }
+        free(index->slots);
+        index->slots = slots;
+        index->capacity = capacity;
     }
 
-    // close files and mutex
-    fclose(users_file);
-    fclose(temp_users_file);
-    remove(users_filename);
-    rename("temp_users.csv", users_filename);
-    pthread_mutex_unlock(&users_file_lock);
-
+    unsigned int hash = hash_string(file->content);
+    size_t i = content_index_find_slot(index, file->content, hash);
+    file->content_prev = NULL;
+    file->content_next = index->slots[i].files;
+    if (file->content_next != NULL)
+        file->content_next->content_prev = file;
+    else
+        index->count++;
+    index->slots[i].hash = hash;
+    index->slots[i].files = file;
     return 0;
 }
 
 /**
-* @brief unregister operation handler. Calls unregister_user() and sends error code to client
-* @param client_socket socket of client
-* @return 0 if successful
-* @return -1 if error
+* @brief remove a file from the content index, if its content is known. The stripe must be write locked
+* @param index content index of the owner's stripe
+* @param file file to remove
 */
-int handle_unregister(int client_socket) {
-    // get datetime from client socket
-    char datetime[DATETIME_SIZE];
-    if (read(client_socket, datetime, DATETIME_SIZE) < 0) {
-        perror("read");
-        return -1;
+void content_index_remove(struct content_index *index, struct published_file *file) {
+    if (file->content[0] == '\0')
+        return;
+
+    // files with the same content stay in the slot
+    if (file->content_next != NULL)
+        file->content_next->content_prev = file->content_prev;
+    if (file->content_prev != NULL) {
+        file->content_prev->content_next = file->content_next;
+        return;
     }
-    
-    // get username from client socket
-    char username[USERNAME_SIZE];
-    if (read(client_socket, username, USERNAME_SIZE) < 0) {
-        perror("read");
-        return -1;
+    size_t i = content_index_find_slot(index, file->content, hash_string(file->content));
+    index->slots[i].files = file->content_next;
+    if (file->content_next != NULL)
+        return;
+    index->count--;
+
+    // backward shift deletion, as in registry_remove()
+    size_t mask = index->capacity - 1;
+    size_t hole = i;
+    size_t j = (i + 1) & mask;
+    while (index->slots[j].files != NULL) {
+        size_t home = index->slots[j].hash & mask;
+        if (((j - home) & mask) >= ((j - hole) & mask)) {
+            index->slots[hole] = index->slots[j];
+            index->slots[j].files = NULL;
+            hole = j;
+        }
+        j = (j + 1) & mask;
     }
+}
 
-    // attempt to unregister user
-    int unregister_user_rvalue = unregister_user(username);
-    
-    // send error code to client
-    if (unregister_user_rvalue < 0) {
-        // in case there was an error
-        write(client_socket, "2", EXECUTION_STATUS_SIZE);
-        return -1;
-    } else if (unregister_user_rvalue == 1) {
-        // in case username doesn't exist
-        write(client_socket, "1", EXECUTION_STATUS_SIZE);
-    } else {
-        write(client_socket, "0", EXECUTION_STATUS_SIZE);
+/**
+* @brief allocate an empty catalog version
+* @param capacity number of files it can hold
+* @param changes changes of the user's catalog so far
+* @return catalog, with one reference, NULL if error
+*/
+struct catalog *catalog_create(size_t capacity, unsigned long long changes) {
+    struct catalog *catalog = malloc(sizeof(struct catalog) + capacity * sizeof(struct published_file *));
+    if (catalog == NULL) {
+        perror("malloc");
+        return NULL;
     }
-    printf("OPERATION FROM %s\n", username);
-        
-    // send info to RPC server
-    int rpc_server_result;
-    if (print_operation_1(username, "UNREGISTER", datetime, &rpc_server_result, clnt) < 0) {
-        clnt_perror(clnt, "list_content");
+    catalog->refs = 1;
+    catalog->changes = changes;
+    catalog->superseded = ULLONG_MAX;
+    catalog->next = NULL;
+    catalog->count = 0;
+    catalog->deleted = 0;
+    catalog->capacity = capacity;
+    return catalog;
+}
+
+/**
+* @brief drop a reference to a catalog version, freeing it if it was the last one. A version frees the files
+*        that weren't moved to the next version (every file, if it is the last one)
+* @param catalog catalog
+*/
+void catalog_release(struct catalog *catalog) {
+    while (catalog != NULL && __atomic_sub_fetch(&catalog->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        for (size_t i = 0; i < catalog->count; i++) {
+            if (__atomic_load_n(&catalog->files[i]->deleted, __ATOMIC_RELAXED) <= catalog->superseded)
+                free(catalog->files[i]);
+        }
+        struct catalog *next = catalog->next;
+        free(catalog);
+        catalog = next;
     }
-    
-    return 0;
 }
 
 /**
-* @brief check if filename exists in username file in files folder
-* @param username username
-* @param filename filename
+* @brief move the live files of a user's catalog to a new version with room for as many more. The stripe
+*        must be write locked
+* @param user connected user
+* @return 0 if successful
 * @return -1 if error
-* @return 1 if filename exists
-* @return 0 if filename doesn't exist
-*/
-int check_published_file_existance(USERNAME username, FILENAME filename) {
-    // open username
-    char *username_filename = malloc(strlen(files_foldername) + strlen(username) + 2);
-    asprintf(&username_filename, "%s%s", files_foldername, username);
-    pthread_mutex_lock(&files_folder_lock);
-    FILE *username_file = fopen(username_filename, "r");
-    free(username_filename);
-    if (username_file == NULL) {
-        pthread_mutex_unlock(&files_folder_lock);
-        perror("fopen");
+*/
+int catalog_compact(struct registered_user *user) {
+    struct catalog *catalog = user->catalog;
+    size_t live = catalog->count - catalog->deleted;
+    struct catalog *next = catalog_create(live < CATALOG_INITIAL_CAPACITY / 2 ? CATALOG_INITIAL_CAPACITY : live * 2, catalog->changes);
+    if (next == NULL)
         return -1;
+    for (size_t i = 0; i < catalog->count; i++) {
+        if (catalog->files[i]->deleted == ULLONG_MAX)
+            next->files[next->count++] = catalog->files[i];
     }
 
-    // check if filename is in any line in username
-    const long MAXLINE = 4096;
-    char line[MAXLINE];
-    while (fgets(line, MAXLINE, username_file) != NULL) {
-        char *possible_filename = strtok(line, ";");
-        if (strcmp(possible_filename, filename) == 0) {
-            // filename exists
-            fclose(username_file);
-            pthread_mutex_unlock(&files_folder_lock);
-            return 1;
-        }
-    }
-
-    // filename doesn't exist
-    fclose(username_file);
-    pthread_mutex_unlock(&files_folder_lock);
+    // the previous version keeps the new one alive while list requests still read files they share
+    catalog->superseded = catalog->changes;
+    catalog->next = next;
+    next->refs++;
+    user->catalog = next;
+    catalog_release(catalog);
     return 0;
 }
 
 /**
-* @brief publish file, adding it to the username file in files folder
-* @param username username
+* @brief append a file to a user's catalog. The stripe must be write locked, and the file not published yet
+* @param user connected user
 * @param filename filename
 * @param description description
+* @param content content id, empty if unknown
+* @return file, NULL if error
 */
-int publish_file(USERNAME username, FILENAME filename, char description[DESCRIPTION_SIZE]) {
-    // check if user is registered
-    int check_username_existence_rvalue = check_username_existence(username);
-    if (check_username_existence_rvalue == 0) {
-        return 1;
-    } else if (check_username_existence_rvalue < 0) {
-        return -1;
+struct published_file *catalog_publish(struct registered_user *user, const char *filename, const char *description, const char *content) {
+    if (user->catalog->count == user->catalog->capacity && catalog_compact(user) < 0)
+        return NULL;
+
+    size_t filename_len = strlen(filename);
+    size_t description_len = strlen(description);
+    struct published_file *file = malloc(sizeof(struct published_file) + filename_len + description_len + strlen(content) + 3);
+    if (file == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    file->deleted = ULLONG_MAX;
+    file->postings = NULL;
+    file->owner = user;
+    file->content_prev = NULL;
+    file->content_next = NULL;
+    strcpy(file->filename, filename);
+    file->description = file->filename + filename_len + 1;
+    strcpy(file->description, description);
+    file->content = file->description + description_len + 1;
+    strcpy(file->content, content);
+    if (file_index_insert(&user->published, file) < 0) {
+        free(file);
+        return NULL;
     }
 
-    // check if user is connected
-    int check_user_connection_rvalue = check_user_connection(username);
-    if (check_user_connection_rvalue == 0) {
-        return 2;
-    } else if (check_user_connection_rvalue < 0) {
+    // list requests read up to the count they saw, so the file is visible once count includes it
+    struct catalog *catalog = user->catalog;
+    catalog->files[catalog->count++] = file;
+    catalog->changes++;
+    return file;
+}
+
+/**
+* @brief delete a file from a user's catalog. The stripe must be write locked
+* @param user connected user
+* @param filename filename
+* @return 0 if successful
+* @return 1 if the file isn't published
+*/
+int catalog_delete(struct registered_user *user, const char *filename) {
+    struct published_file *file = file_index_remove(&user->published, filename);
+    if (file == NULL)
+        return 1;
+
+    struct catalog *catalog = user->catalog;
+    catalog->changes++;
+    __atomic_store_n(&file->deleted, catalog->changes, __ATOMIC_RELAXED);
+    catalog->deleted++;
+
+    // keep deleted files under half of the version, the new one only takes live files
+    if (catalog->deleted * 2 > catalog->count && catalog->count >= CATALOG_INITIAL_CAPACITY)
+        catalog_compact(user);
+    return 0;
+}
+
+/**
+* @brief remove a user from the registry
+* @param registry registry to remove from
+* @param username username to remove
+* @return 0 if successful
+* @return 1 if username doesn't exist
+*/
+int registry_remove(struct user_registry *registry, const char *username) {
+    if (registry->capacity == 0)
+        return 1;
+
+    size_t i = registry_find_slot(registry, username, hash_string(username));
+    if (registry->slots[i].user == NULL)
+        return 1;
+    free(registry->slots[i].user);
+    registry->slots[i].user = NULL;
+    registry->count--;
+
+    // backward shift deletion: move up every following entry whose probe sequence crossed the hole
+    size_t mask = registry->capacity - 1;
+    size_t hole = i;
+    size_t j = (i + 1) & mask;
+    while (registry->slots[j].user != NULL) {
+        size_t home = registry->slots[j].hash & mask;
+        if (((j - home) & mask) >= ((j - hole) & mask)) {
+            registry->slots[hole] = registry->slots[j];
+            registry->slots[j].user = NULL;
+            hole = j;
+        }
+        j = (j + 1) & mask;
+    }
+    return 0;
+}
+
+/**
+* @brief initialize the state stripes. Their locks prefer writers, so a steady stream of list requests can't
+*        hold back operations that change the stripe
+* @return 0 if successful
+* @return -1 if error
+*/
+int state_init() {
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    for (int i = 0; i < STATE_STRIPES; i++) {
+        if (pthread_rwlock_init(&stripes[i].lock, &attr) != 0 || pthread_mutex_init(&stripes[i].view_lock, NULL) != 0) {
+            perror("pthread_rwlock_init");
+            pthread_rwlockattr_destroy(&attr);
+            return -1;
+        }
+        stripes[i].connected = calloc(1, sizeof(struct connected_view));
+        if (stripes[i].connected == NULL) {
+            perror("calloc");
+            pthread_rwlockattr_destroy(&attr);
+            return -1;
+        }
+        stripes[i].connected->refs = 1;  // the stripe's own reference
+    }
+    pthread_rwlockattr_destroy(&attr);
+    return 0;
+}
+
+// distinct token of a published file, and where it appears
+struct search_token {
+    char text[SEARCH_TOKEN_SIZE];
+    int in_filename;
+    int in_description;
+};
+
+// term of a search query
+struct search_term {
+    char text[SEARCH_TOKEN_SIZE];
+    size_t len;
+    int prefix;  // 1 if it matches every token starting with it (written with a trailing '*'), 0 if one token
+};
+
+/**
+* @brief check if a byte belongs to a search token
+* @param c byte
+* @return 1 if it does (ASCII letters and digits, and every non-ASCII byte), 0 otherwise
+*/
+int search_token_char(unsigned char c) {
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c >= 0x80;
+}
+
+/**
+* @brief get the next token of a string: a run of search token bytes, ASCII lowercased
+* @param string position to search from, moved past the token
+* @param token set to the token, cut at SEARCH_TOKEN_SIZE - 1 characters
+* @return length of the token, 0 if there are no more
+*/
+size_t search_next_token(const char **string, char token[SEARCH_TOKEN_SIZE]) {
+    const unsigned char *c = (const unsigned char *)*string;
+    while (*c != '\0' && !search_token_char(*c))
+        c++;
+    size_t len = 0;
+    for (; *c != '\0' && search_token_char(*c); c++) {
+        if (len < SEARCH_TOKEN_SIZE - 1)
+            token[len++] = (*c >= 'A' && *c <= 'Z') ? *c - 'A' + 'a' : *c;
+    }
+    token[len] = '\0';
+    *string = (const char *)c;
+    return len;
+}
+
+/**
+* @brief get the distinct tokens of a published file, in order: the filename ones, then the description ones
+* @param file file
+* @param tokens set to the tokens
+* @return number of tokens
+*/
+int search_tokenize(struct published_file *file, struct search_token tokens[SEARCH_MAX_TOKENS]) {
+    int count = 0;
+    for (int in_filename = 1; in_filename >= 0; in_filename--) {
+        const char *string = in_filename ? file->filename : file->description;
+        char text[SEARCH_TOKEN_SIZE];
+        while (search_next_token(&string, text) > 0) {
+            int i = 0;
+            while (i < count && strcmp(tokens[i].text, text) != 0)
+                i++;
+            if (i == count) {
+                if (count == SEARCH_MAX_TOKENS)
+                    return count;
+                strcpy(tokens[i].text, text);
+                tokens[i].in_filename = tokens[i].in_description = 0;
+                count++;
+            }
+            if (in_filename)
+                tokens[i].in_filename = 1;
+            else
+                tokens[i].in_description = 1;
+        }
+    }
+    return count;
+}
+
+/**
+* @brief find the node of a token in a ternary search tree
+* @param root root of the tree
+* @param token token
+* @param create 1 to create the missing nodes
+* @return node, NULL if it doesn't exist (or if error)
+*/
+struct search_node *search_node_find(struct search_node **root, const char *token, int create) {
+    struct search_node **link = root;
+    struct search_node *parent = NULL;
+    const char *c = token;
+    while (1) {
+        struct search_node *node = *link;
+        if (node == NULL) {
+            if (!create)
+                return NULL;
+            node = calloc(1, sizeof(struct search_node));
+            if (node == NULL) {
+                perror("calloc");
+                return NULL;
+            }
+            node->c = *c;
+            node->parent = parent;
+            *link = node;
+        }
+        parent = node;
+        if (*c < node->c) {
+            link = &node->lo;
+        } else if (*c > node->c) {
+            link = &node->hi;
+        } else if (c[1] == '\0') {
+            return node;
+        } else {
+            link = &node->eq;
+            c++;
+        }
+    }
+}
+
+/**
+* @brief add to the posting count of a token node and to the prefix counts of the tokens it starts with
+* @param node token node
+* @param delta postings added (or removed, if negative)
+*/
+void search_node_count(struct search_node *node, long delta) {
+    node->posting_count += delta;
+    node->prefix_count += delta;
+    for (struct search_node *child = node, *parent = node->parent; parent != NULL; child = parent, parent = parent->parent) {
+        if (parent->eq == child)
+            parent->prefix_count += delta;
+    }
+}
+
+/**
+* @brief recompute the newest sequence of a node's subtrees after its postings changed, and of its parents
+*        while it changes too
+* @param node node
+* @param in_filename posting list that changed
+*/
+void search_node_newest(struct search_node *node, int in_filename) {
+    for (; node != NULL; node = node->parent) {
+        // posting lists are kept newest first
+        unsigned long long newest = node->postings[in_filename] == NULL ? 0 : node->postings[in_filename]->file->sequence;
+        struct search_node *children[3] = {node->lo, node->eq, node->hi};
+        for (int i = 0; i < 3; i++) {
+            if (children[i] != NULL && children[i]->newest[in_filename] > newest)
+                newest = children[i]->newest[in_filename];
+        }
+        if (node->newest[in_filename] == newest)
+            return;
+        node->newest[in_filename] = newest;
+    }
+}
+
+/**
+* @brief free a node without postings or children, and its parents while they are left the same way
+* @param root root of the tree
+* @param node node
+*/
+void search_node_prune(struct search_node **root, struct search_node *node) {
+    while (node != NULL && node->postings[0] == NULL && node->postings[1] == NULL && node->lo == NULL && node->eq == NULL && node->hi == NULL) {
+        struct search_node *parent = node->parent;
+        if (parent == NULL)
+            *root = NULL;
+        else if (parent->lo == node)
+            parent->lo = NULL;
+        else if (parent->eq == node)
+            parent->eq = NULL;
+        else
+            parent->hi = NULL;
+        free(node);
+        node = parent;
+    }
+}
+
+/**
+* @brief remove a file from the search index of a stripe. The stripe must be write locked
+* @param stripe stripe of the file's owner
+* @param file file
+*/
+void search_remove_file(struct state_stripe *stripe, struct published_file *file) {
+    struct search_posting *posting = file->postings;
+    while (posting != NULL) {
+        struct search_posting *next_of_file = posting->next_of_file;
+        struct search_node *node = posting->node;
+        if (posting->prev != NULL)
+            posting->prev->next = posting->next;
+        else
+            node->postings[posting->in_filename] = posting->next;
+        if (posting->next != NULL)
+            posting->next->prev = posting->prev;
+        search_node_count(node, -1);
+        search_node_newest(node, posting->in_filename);
+        free(posting);
+        search_node_prune(&stripe->search_root, node);
+        posting = next_of_file;
+    }
+    file->postings = NULL;
+}
+
+/**
+* @brief add a file to the search index of a stripe, under each of its distinct tokens. The stripe must be write
+*        locked
+* @param stripe stripe of the file's owner
+* @param owner owner of the file
+* @param file file
+* @return 0 if successful
+* @return -1 if error
+*/
+int search_add_file(struct state_stripe *stripe, struct registered_user *owner, struct published_file *file) {
+    // the stripe lock keeps the posting lists of the stripe ordered by sequence
+    file->sequence = __atomic_add_fetch(&search_sequence, 1, __ATOMIC_RELAXED);
+
+    struct search_token tokens[SEARCH_MAX_TOKENS];
+    int count = search_tokenize(file, tokens);
+    for (int i = 0; i < count; i++) {
+        struct search_node *node = search_node_find(&stripe->search_root, tokens[i].text, 1);
+        struct search_posting *posting = node == NULL ? NULL : malloc(sizeof(struct search_posting));
+        if (posting == NULL) {
+            if (node != NULL)
+                search_node_prune(&stripe->search_root, node);
+            search_remove_file(stripe, file);
+            return -1;
+        }
+        posting->file = file;
+        posting->owner = owner;
+        posting->position = i;
+        posting->in_filename = tokens[i].in_filename;
+        posting->node = node;
+        posting->prev = NULL;
+        posting->next = node->postings[posting->in_filename];
+        if (posting->next != NULL)
+            posting->next->prev = posting;
+        node->postings[posting->in_filename] = posting;
+        search_node_count(node, 1);
+        search_node_newest(node, posting->in_filename);
+        posting->next_of_file = file->postings;
+        file->postings = posting;
+    }
+    return 0;
+}
+
+/**
+* @brief split a query into terms: the tokens of each word, the last one being a prefix term if the word ends
+*        with '*'
+* @param query query
+* @param terms set to the terms
+* @return number of terms
+*/
+int search_parse_query(const char *query, struct search_term terms[SEARCH_MAX_TERMS]) {
+    int count = 0;
+    const char *word = query;
+    while (*word != '\0' && count < SEARCH_MAX_TERMS) {
+        while (*word == ' ')
+            word++;
+        size_t word_len = strcspn(word, " ");
+        const char *string = word;
+        int word_terms = 0;
+        while (count < SEARCH_MAX_TERMS && search_next_token(&string, terms[count].text) > 0 && string <= word + word_len) {
+            terms[count].len = strlen(terms[count].text);
+            terms[count].prefix = 0;
+            count++;
+            word_terms++;
+        }
+        if (word_terms > 0 && word[word_len - 1] == '*')
+            terms[count - 1].prefix = 1;
+        word += word_len;
+    }
+    return count;
+}
+
+/**
+* @brief score a file against a query. Each term adds its best match among the file's tokens: 4 for a whole
+*        filename token, 2 for the start of one (prefix terms), half that in the description. A file is only
+*        scored through the first of its tokens that gives the best match of the term its posting was found
+*        by, so files with several matching tokens aren't scored twice
+* @param file file
+* @param terms query terms
+* @param term_count number of terms
+* @param driver term the posting was found by
+* @param position position of the posting's token
+* @return score, 0 if some term doesn't match (or if the file is scored through another token)
+*/
+int search_score(struct published_file *file, struct search_term *terms, int term_count, int driver, int position) {
+    struct search_token tokens[SEARCH_MAX_TOKENS];
+    int count = search_tokenize(file, tokens);
+
+    int score = 0;
+    for (int t = 0; t < term_count; t++) {
+        int best = 0;
+        int best_position = -1;
+        for (int i = 0; i < count; i++) {
+            int exact = strcmp(tokens[i].text, terms[t].text) == 0;
+            if (!exact && !(terms[t].prefix && strncmp(tokens[i].text, terms[t].text, terms[t].len) == 0))
+                continue;
+            int weight = (tokens[i].in_filename ? 2 : 1) * (exact ? 2 : 1);
+            if (weight > best) {
+                best = weight;
+                best_position = i;
+            }
+        }
+        if (best == 0 || (t == driver && best_position != position))
+            return 0;
+        score += best;
+    }
+    return score;
+}
+
+// ranked match of a search
+struct search_result {
+    int score;
+    unsigned long long sequence;
+    char username[USERNAME_SIZE];
+    char filename[FILENAME_SIZE];
+    char description[DESCRIPTION_SIZE];
+};
+
+// the best matches found so far, as a heap with the worst one on top
+struct search_heap {
+    struct search_result *results;
+    size_t capacity;
+    size_t count;
+};
+
+/**
+* @brief check if a match ranks before another: higher score first, then newer first
+* @param score score of the match
+* @param sequence sequence of the match
+* @param other other match
+* @return 1 if it does, 0 otherwise
+*/
+int search_result_before(int score, unsigned long long sequence, const struct search_result *other) {
+    if (score != other->score)
+        return score > other->score;
+    return sequence > other->sequence;
+}
+
+/**
+* @brief qsort comparator, best match first
+*/
+int search_result_compare(const void *a, const void *b) {
+    const struct search_result *result = a;
+    return search_result_before(result->score, result->sequence, b) ? -1 : 1;
+}
+
+/**
+* @brief offer a match to the heap, keeping it if it ranks among the best capacity matches
+* @param heap heap
+* @param score score of the match
+* @param posting posting the file was found by
+*/
+void search_heap_offer(struct search_heap *heap, int score, struct search_posting *posting) {
+    unsigned long long sequence = posting->file->sequence;
+    size_t i;
+    if (heap->count < heap->capacity) {
+        // add as a leaf, moving down the better matches above it
+        i = heap->count++;
+        while (i > 0 && !search_result_before(score, sequence, &heap->results[(i - 1) / 2])) {
+            heap->results[i] = heap->results[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+    } else {
+        // replace the worst match on top, moving up the worse matches below it
+        if (!search_result_before(score, sequence, &heap->results[0]))
+            return;
+        i = 0;
+        while (2 * i + 1 < heap->count) {
+            size_t worst = 2 * i + 1;
+            struct search_result *other = &heap->results[worst + 1];
+            if (worst + 1 < heap->count && !search_result_before(other->score, other->sequence, &heap->results[worst]))
+                worst++;
+            if (!search_result_before(score, sequence, &heap->results[worst]))
+                break;
+            heap->results[i] = heap->results[worst];
+            i = worst;
+        }
+    }
+    struct search_result *result = &heap->results[i];
+    result->score = score;
+    result->sequence = sequence;
+    strncpy(result->username, posting->owner->username, USERNAME_SIZE - 1);
+    result->username[USERNAME_SIZE - 1] = '\0';
+    strncpy(result->filename, posting->file->filename, FILENAME_SIZE - 1);
+    result->filename[FILENAME_SIZE - 1] = '\0';
+    strncpy(result->description, posting->file->description, DESCRIPTION_SIZE - 1);
+    result->description[DESCRIPTION_SIZE - 1] = '\0';
+}
+
+// walk of the postings of a query's driver term, the term with the fewest postings
+struct search_walk {
+    struct search_term *terms;
+    int term_count;
+    int driver;
+    int bound;  // best score the postings being walked can reach
+    int in_filename;  // posting lists being walked
+    struct search_heap *heap;
+    struct arena *arena;  // where the queue is allocated
+    struct search_node **queue;  // nodes to walk, as a heap with the newest on top
+    size_t queue_count;
+    size_t queue_capacity;
+};
+
+/**
+* @brief check if the rest of a walk can be skipped: the heap is full and its worst match ranks before any
+*        match the walk can still find
+* @param walk walk
+* @param newest newest sequence the walk can still find, 0 if none
+* @return 1 if it can, 0 otherwise
+*/
+int search_walk_done(struct search_walk *walk, unsigned long long newest) {
+    if (newest == 0)
+        return 1;
+    return walk->heap->count == walk->heap->capacity && !search_result_before(walk->bound, newest, &walk->heap->results[0]);
+}
+
+/**
+* @brief score the files of a posting list (newest first) until the rest can be skipped
+* @param walk walk
+* @param posting first posting
+*/
+void search_walk_list(struct search_walk *walk, struct search_posting *posting) {
+    for (; posting != NULL && !search_walk_done(walk, posting->file->sequence); posting = posting->next) {
+        int score = search_score(posting->file, walk->terms, walk->term_count, walk->driver, posting->position);
+        if (score > 0)
+            search_heap_offer(walk->heap, score, posting);
+    }
+}
+
+/**
+* @brief add a node to the walk's queue, unless its subtrees can be skipped
+* @param walk walk
+* @param node node, may be NULL
+* @return 0 if successful
+* @return -1 if error
+*/
+int search_walk_push(struct search_walk *walk, struct search_node *node) {
+    if (node == NULL || search_walk_done(walk, node->newest[walk->in_filename]))
+        return 0;
+    if (walk->queue_count == walk->queue_capacity) {
+        size_t capacity = walk->queue_capacity == 0 ? 64 : 2 * walk->queue_capacity;
+        struct search_node **queue = arena_realloc(walk->arena, walk->queue, walk->queue_count * sizeof(struct search_node *), capacity * sizeof(struct search_node *));
+        if (queue == NULL)
+            return -1;
+        walk->queue = queue;
+        walk->queue_capacity = capacity;
+    }
+
+    // add as a leaf, moving down the older nodes above it
+    unsigned long long newest = node->newest[walk->in_filename];
+    size_t i = walk->queue_count++;
+    while (i > 0 && walk->queue[(i - 1) / 2]->newest[walk->in_filename] < newest) {
+        walk->queue[i] = walk->queue[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    walk->queue[i] = node;
+    return 0;
+}
+
+/**
+* @brief take the node with the newest subtrees from the walk's queue
+* @param walk walk
+* @return node
+*/
+struct search_node *search_walk_pop(struct search_walk *walk) {
+    struct search_node *node = walk->queue[0];
+    struct search_node *last = walk->queue[--walk->queue_count];
+    unsigned long long newest = last->newest[walk->in_filename];
+
+    // move the last node down from the top, past the newer ones
+    size_t i = 0;
+    while (2 * i + 1 < walk->queue_count) {
+        size_t child = 2 * i + 1;
+        if (child + 1 < walk->queue_count && walk->queue[child + 1]->newest[walk->in_filename] > walk->queue[child]->newest[walk->in_filename])
+            child++;
+        if (walk->queue[child]->newest[walk->in_filename] <= newest)
+            break;
+        walk->queue[i] = walk->queue[child];
+        i = child;
+    }
+    walk->queue[i] = last;
+    return node;
+}
+
+/**
+* @brief score the files of every node of a subtree, visiting first the nodes whose subtrees hold newer postings,
+*        until the rest can be skipped
+* @param walk walk
+* @param root root of the subtree
+* @return 0 if successful
+* @return -1 if error
+*/
+int search_walk_tree(struct search_walk *walk, struct search_node *root) {
+    walk->queue_count = 0;
+    if (search_walk_push(walk, root) < 0)
+        return -1;
+    while (walk->queue_count > 0) {
+        struct search_node *node = search_walk_pop(walk);
+        if (search_walk_done(walk, node->newest[walk->in_filename]))
+            break;  // the nodes left are older
+        search_walk_list(walk, node->postings[walk->in_filename]);
+        if (search_walk_push(walk, node->lo) < 0 || search_walk_push(walk, node->eq) < 0 || search_walk_push(walk, node->hi) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/**
+* @brief search the files of a stripe, offering its best matches to the heap. Only the postings of the term
+*        matching the fewest tokens are walked, the other terms are checked on their files. They are walked by
+*        decreasing weight of the term, so the walk can stop once the heap is full of matches that rank before
+*        anything left. The stripe must be read locked
+* @param stripe stripe
+* @param terms query terms
+* @param term_count number of terms
+* @param heap heap of the best matches
+* @param arena arena of the request
+* @return 0 if successful
+* @return -1 if error
+*/
+int search_stripe(struct state_stripe *stripe, struct search_term *terms, int term_count, struct search_heap *heap, struct arena *arena) {
+    struct search_walk walk = {terms, term_count, -1, 0, 0, heap, arena, NULL, 0, 0};
+    size_t driver_count = 0;
+    struct search_node *driver_node = NULL;
+    for (int t = 0; t < term_count; t++) {
+        struct search_node *node = search_node_find(&stripe->search_root, terms[t].text, 0);
+        size_t count = node == NULL ? 0 : terms[t].prefix ? node->prefix_count : node->posting_count;
+        if (count == 0)
+            return 0;  // no file of the stripe matches the term
+        if (walk.driver < 0 || count < driver_count) {
+            walk.driver = t;
+            driver_count = count;
+            driver_node = node;
+        }
+    }
+
+    // the driver term adds 4 for its token in filenames, then 2 for longer tokens (prefix terms) in filenames
+    // and for its token in descriptions, then 1 for longer tokens in descriptions. The others add up to 4 each
+    int others = 4 * (term_count - 1);
+    walk.bound = 4 + others;
+    walk.in_filename = 1;
+    search_walk_list(&walk, driver_node->postings[1]);
+    walk.bound = 2 + others;
+    int search_walk_tree_rvalue = terms[walk.driver].prefix ? search_walk_tree(&walk, driver_node->eq) : 0;
+    walk.in_filename = 0;
+    search_walk_list(&walk, driver_node->postings[0]);
+    if (terms[walk.driver].prefix && search_walk_tree_rvalue == 0) {
+        walk.bound = 1 + others;
+        search_walk_tree_rvalue = search_walk_tree(&walk, driver_node->eq);
+    }
+    return search_walk_tree_rvalue;
+}
+
+/**
+* @brief get the stripe of a user. It is picked with the high bits of the hash, as the registry uses the low
+*        ones for slots
+* @param username username
+* @return stripe
+*/
+struct state_stripe *user_stripe(const char *username) {
+    return &stripes[hash_string(username) >> (32 - STATE_STRIPE_BITS)];
+}
+
+/**
+* @brief take a reference to the current connected view of a stripe. Doesn't wait for the stripe lock
+* @param stripe stripe
+* @return view, to be released with connected_view_release()
+*/
+struct connected_view *connected_view_acquire(struct state_stripe *stripe) {
+    pthread_mutex_lock(&stripe->view_lock);
+    struct connected_view *view = stripe->connected;
+    view->refs++;
+    pthread_mutex_unlock(&stripe->view_lock);
+    return view;
+}
+
+/**
+* @brief drop a reference to a connected view of a stripe, freeing it if it was the last one
+* @param stripe stripe the view belongs to
+* @param view view
+*/
+void connected_view_release(struct state_stripe *stripe, struct connected_view *view) {
+    pthread_mutex_lock(&stripe->view_lock);
+    int refs = --view->refs;
+    pthread_mutex_unlock(&stripe->view_lock);
+    if (refs == 0)
+        free(view);
+}
+
+/**
+* @brief allocate a copy of the connected view of a stripe, with room for one more user. The stripe must be
+*        write locked
+* @param stripe stripe
+* @param skip username to leave out of the copy, NULL to copy every user
+* @return copy, NULL if error
+*/
+struct connected_view *connected_view_copy(struct state_stripe *stripe, const char *skip) {
+    struct connected_view *view = stripe->connected;
+    struct connected_view *copy = malloc(sizeof(struct connected_view) + (view->count + 1) * sizeof(struct connected_user));
+    if (copy == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    copy->refs = 1;
+    copy->count = 0;
+    for (unsigned long i = 0; i < view->count; i++) {
+        if (skip == NULL || strcmp(view->users[i].username, skip) != 0)
+            copy->users[copy->count++] = view->users[i];
+    }
+    return copy;
+}
+
+/**
+* @brief make a view the connected view of a stripe, releasing the previous one (list requests that still
+*        read it keep it alive). The stripe must be write locked
+* @param stripe stripe
+* @param view view, whose reference passes to the stripe
+*/
+void connected_view_publish(struct state_stripe *stripe, struct connected_view *view) {
+    pthread_mutex_lock(&stripe->view_lock);
+    struct connected_view *previous = stripe->connected;
+    stripe->connected = view;
+    pthread_mutex_unlock(&stripe->view_lock);
+    connected_view_release(stripe, previous);
+}
+
+/**
+* @brief export registered users to users.csv (through a temporary file, so it is replaced atomically)
+* @return 0 if successful
+* @return -1 if error
+*/
+int export_users() {
+    FILE *temp_users_file = fopen("temp_users.csv", "w");
+    if (temp_users_file == NULL) {
+        perror("fopen");
+        return -1;
+    }
+
+    for (int i = 0; i < STATE_STRIPES; i++) {
+        struct state_stripe *stripe = &stripes[i];
+        pthread_rwlock_rdlock(&stripe->lock);
+        for (size_t j = 0; j < stripe->users.capacity; j++) {
+            if (stripe->users.slots[j].user != NULL)
+                fprintf(temp_users_file, "%s\n", stripe->users.slots[j].user->username);
+        }
+        pthread_rwlock_unlock(&stripe->lock);
+    }
+
+    if (fclose(temp_users_file) < 0 || rename("temp_users.csv", users_filename) < 0) {
+        perror("export_users");
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+* @brief get monotonic clock in nanoseconds
+* @return nanoseconds
+*/
+unsigned long long monotonic_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// clock stamping the operations whose client left the datetime empty: the real time read once, advanced with the
+// (coarse) monotonic clock, so stamps never go back if the system time is stepped while the server runs
+struct datetime_clock {
+    pthread_once_t once;
+    unsigned long long realtime_ns;  // real time when the clock started
+    unsigned long long monotonic_ns;  // monotonic time when the clock started
+} datetime_clock = {
+    .once = PTHREAD_ONCE_INIT
+};
+
+// last second every thread formatted, operations in the same second reuse it
+__thread long long datetime_cached_second = -1;
+__thread char datetime_cached[DATETIME_SIZE];
+
+/**
+* @brief start the datetime clock
+*/
+void datetime_clock_start() {
+    struct timespec realtime, monotonic;
+    clock_gettime(CLOCK_REALTIME, &realtime);
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &monotonic);
+    datetime_clock.realtime_ns = (unsigned long long)realtime.tv_sec * 1000000000ULL + realtime.tv_nsec;
+    datetime_clock.monotonic_ns = (unsigned long long)monotonic.tv_sec * 1000000000ULL + monotonic.tv_nsec;
+}
+
+/**
+* @brief get the current datetime, formatted like the clients' (dd/mm/yyyy hh:mm:ss, local time)
+* @param datetime set to the datetime, DATETIME_SIZE long
+*/
+void server_datetime(char *datetime) {
+    pthread_once(&datetime_clock.once, datetime_clock_start);
+    struct timespec monotonic;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &monotonic);
+    unsigned long long now_ns = datetime_clock.realtime_ns
+        + ((unsigned long long)monotonic.tv_sec * 1000000000ULL + monotonic.tv_nsec - datetime_clock.monotonic_ns);
+    long long second = now_ns / 1000000000ULL;
+
+    if (second != datetime_cached_second) {
+        time_t seconds = second;
+        struct tm tm;
+        strftime(datetime_cached, DATETIME_SIZE, "%d/%m/%Y %H:%M:%S", localtime_r(&seconds, &tm));
+        datetime_cached_second = second;
+    }
+    memcpy(datetime, datetime_cached, DATETIME_SIZE);
+}
+
+// latency histogram with HDR-style log-linear buckets: one per nanosecond below 1 << HISTOGRAM_SUB_BITS, then
+// 1 << HISTOGRAM_SUB_BITS per power of two, so every value is within 1/16 of the bounds of its bucket
+struct histogram {
+    unsigned long counts[HISTOGRAM_BUCKETS];
+    unsigned long long sum_ns;
+    unsigned long long max_ns;
+};
+
+// metrics recorded by one thread. Only that thread writes them, with relaxed atomic stores rather than atomic
+// read-modify-writes, so recording never bounces a cache line between threads. Scrapes add up every thread's
+struct metrics_shard {
+    struct metrics_shard *next;
+    unsigned long requests[METRICS_OPCODES][METRICS_STATUSES];  // requests handled, by opcode and reply status
+    struct histogram latency[METRICS_OPCODES];  // time handling requests until their reply is ready, by opcode
+    unsigned long malformed;  // requests that couldn't be parsed, closing their connection
+    struct histogram audit_rpc;  // RPC calls sending an audit batch
+    struct histogram audit_wait;  // time operations waited in the audit queue
+    unsigned long audit_ring;  // operations written to the shared-memory ring instead of the audit queue
+    struct histogram wal_commit;  // log writes and fsyncs
+};
+
+struct metrics_shard *metrics_shards = NULL;  // shard of every thread that recorded metrics, never freed
+const char *metrics_operation_names[METRICS_OPCODES];  // name of every opcode recorded so far
+pthread_mutex_t metrics_shards_lock = PTHREAD_MUTEX_INITIALIZER;
+__thread struct metrics_shard *metrics_thread_shard = NULL;
+
+/**
+* @brief get the calling thread's metrics shard, creating it the first time
+* @return shard, NULL if error
+*/
+struct metrics_shard *metrics_shard() {
+    if (metrics_thread_shard == NULL) {
+        struct metrics_shard *shard = calloc(1, sizeof(struct metrics_shard));
+        if (shard == NULL) {
+            perror("calloc");
+            return NULL;
+        }
+        pthread_mutex_lock(&metrics_shards_lock);
+        shard->next = metrics_shards;
+        metrics_shards = shard;
+        pthread_mutex_unlock(&metrics_shards_lock);
+        metrics_thread_shard = shard;
+    }
+    return metrics_thread_shard;
+}
+
+/**
+* @brief add to a counter of the calling thread's shard
+* @param counter counter
+* @param value value to add
+*/
+void metrics_add(unsigned long *counter, unsigned long value) {
+    __atomic_store_n(counter, *counter + value, __ATOMIC_RELAXED);
+}
+
+/**
+* @brief get the histogram bucket of a value
+* @param value value
+* @return bucket
+*/
+int histogram_bucket(unsigned long long value) {
+    if (value < (1 << HISTOGRAM_SUB_BITS))
+        return value;
+    int exponent = 63 - __builtin_clzll(value);
+    if (exponent >= HISTOGRAM_MAX_EXPONENT)
+        return HISTOGRAM_BUCKETS - 1;
+    int sub_bucket = (value >> (exponent - HISTOGRAM_SUB_BITS)) & ((1 << HISTOGRAM_SUB_BITS) - 1);
+    return ((exponent - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS) + sub_bucket;
+}
+
+/**
+* @brief get the highest value of a histogram bucket
+* @param bucket bucket
+* @return value
+*/
+unsigned long long histogram_bucket_max(int bucket) {
+    if (bucket < (1 << HISTOGRAM_SUB_BITS))
+        return bucket;
+    int exponent = (bucket >> HISTOGRAM_SUB_BITS) + HISTOGRAM_SUB_BITS - 1;
+    unsigned long long sub_bucket = bucket & ((1 << HISTOGRAM_SUB_BITS) - 1);
+    return (((1ULL << HISTOGRAM_SUB_BITS) + sub_bucket + 1) << (exponent - HISTOGRAM_SUB_BITS)) - 1;
+}
+
+/**
+* @brief record a value in a histogram of the calling thread's shard
+* @param histogram histogram
+* @param value_ns value, in nanoseconds
+*/
+void histogram_record(struct histogram *histogram, unsigned long long value_ns) {
+    metrics_add(&histogram->counts[histogram_bucket(value_ns)], 1);
+    __atomic_store_n(&histogram->sum_ns, histogram->sum_ns + value_ns, __ATOMIC_RELAXED);
+    if (value_ns > histogram->max_ns)
+        __atomic_store_n(&histogram->max_ns, value_ns, __ATOMIC_RELAXED);
+}
+
+/**
+* @brief add a histogram, possibly being recorded by another thread, to a total
+* @param total total histogram
+* @param histogram histogram to add
+*/
+void histogram_merge(struct histogram *total, struct histogram *histogram) {
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+        total->counts[i] += __atomic_load_n(&histogram->counts[i], __ATOMIC_RELAXED);
+    total->sum_ns += __atomic_load_n(&histogram->sum_ns, __ATOMIC_RELAXED);
+    unsigned long long max_ns = __atomic_load_n(&histogram->max_ns, __ATOMIC_RELAXED);
+    if (max_ns > total->max_ns)
+        total->max_ns = max_ns;
+}
+
+/**
+* @brief count the values of a histogram
+* @param histogram histogram
+* @return number of values
+*/
+unsigned long histogram_count(struct histogram *histogram) {
+    unsigned long count = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+        count += histogram->counts[i];
+    return count;
+}
+
+/**
+* @brief get a quantile of a histogram, as the highest value of the bucket it falls in
+* @param histogram histogram
+* @param count number of values, from histogram_count()
+* @param quantile quantile, from 0 to 1
+* @return value, 0 if the histogram is empty
+*/
+unsigned long long histogram_quantile(struct histogram *histogram, unsigned long count, double quantile) {
+    unsigned long rank = (unsigned long)(quantile * count + 0.999999);
+    if (rank == 0)
+        rank = 1;
+    unsigned long seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += histogram->counts[i];
+        if (seen >= rank) {
+            unsigned long long value = histogram_bucket_max(i);
+            return value < histogram->max_ns ? value : histogram->max_ns;
+        }
+    }
+    return 0;
+}
+
+// operation waiting to be sent to the RPC server
+struct audit_entry {
+    char username[USERNAME_SIZE];
+    const char *operation;  // operation name, from the operations table
+    char filename[FILENAME_SIZE];  // empty if the operation isn't done on a file
+    char datetime[DATETIME_SIZE];
+    unsigned long long enqueued_ns;
+};
+
+// bounded FIFO of audit entries, filled by the handlers and drained in batches by the audit sender thread.
+// Handlers never wait on it: entries that don't fit are dropped and counted. There is a single sender, which
+// sends a batch only once the previous one is done, so the RPC server gets the entries in the order they were
+// queued
+struct audit_queue {
+    struct audit_entry *entries;
+    int capacity;
+    int head;
+    int count;
+    unsigned long enqueued;
+    unsigned long dropped;  // entries that didn't fit in the queue
+    unsigned long sent;
+    unsigned long failed;  // entries lost in batches the RPC server didn't take
+    unsigned long batches;
+    unsigned long reconnects;  // RPC clients connected again after failing
+    unsigned long long max_lag_ns;  // longest an entry waited in the queue since the last report
+    pthread_mutex_t lock;
+    pthread_cond_t ready;  // signaled when the queue stops being empty and when a full batch is waiting
+    pthread_cond_t done;  // signaled when a batch has been sent (or has failed)
+} audit = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .ready = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER
+};
+
+struct connection;
+
+// petition waiting for a worker thread: a socket just accepted, or a session with bytes to read
+struct petition {
+    int socket;
+    struct connection *connection;  // NULL for a socket just accepted
+};
+
+// bounded queue of petitions, consumed by the worker threads. Workers don't wait for the next request of a
+// session: they hand its socket to epoll_fd, and the session poller thread queues it again once it is readable
+struct socket_queue {
+    struct petition *petitions;
+    int epoll_fd;  // idle sessions, registered one shot
+    int capacity;
+    int head;
+    int count;
+    int max_count;  // highest queue depth since last report
+    int workers;
+    int busy_workers;
+    unsigned long served;
+    unsigned long long busy_ns;  // time spent by workers handling petitions
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+};
+
+struct socket_queue pending_sockets = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .not_empty = PTHREAD_COND_INITIALIZER,
+    .not_full = PTHREAD_COND_INITIALIZER
+};
+
+/**
+* @brief add an operation to the audit queue, without waiting for the RPC server
+* @param queue audit queue
+* @param username username that did the operation
+* @param operation operation name
+* @param filename file the operation was done on, empty if none
+* @param datetime datetime of the operation
+* @return 0 if queued
+* @return -1 if the queue is full and the operation was dropped
+*/
+int audit_queue_push(struct audit_queue *queue, const char *username, const char *operation, const char *filename, const char *datetime) {
+    pthread_mutex_lock(&queue->lock);
+    if (queue->count == queue->capacity) {
+        queue->dropped++;
+        pthread_mutex_unlock(&queue->lock);
+        return -1;
+    }
+
+    struct audit_entry *entry = &queue->entries[(queue->head + queue->count) % queue->capacity];
+    snprintf(entry->username, USERNAME_SIZE, "%s", username);
+    entry->operation = operation;
+    snprintf(entry->filename, FILENAME_SIZE, "%s", filename);
+    snprintf(entry->datetime, DATETIME_SIZE, "%s", datetime);
+    entry->enqueued_ns = monotonic_ns();
+    queue->count++;
+    queue->enqueued++;
+
+    // wake the sender for the first entry (starting its flush timer) and for full batches only
+    if (queue->count == 1 || queue->count == AUDIT_BATCH_SIZE)
+        pthread_cond_signal(&queue->ready);
+    pthread_mutex_unlock(&queue->lock);
+    return 0;
+}
+
+// producer side of the shared-memory ring of a co-located rpc_server (audit_ring.h)
+struct audit_ring_producer {
+    const char *name;  // NULL if audit records only go through RPC
+    struct audit_ring *ring;  // NULL while not mapped
+    pthread_mutex_t attach_lock;
+    unsigned long long next_attach_ns;  // monotonic time the ring may be mapped again
+} audit_ring_producer = {
+    .attach_lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+/**
+* @brief check whether a ring's consumer is running
+* @param ring ring
+* @param now_ns current monotonic time
+* @return 1 if records written to it will be consumed
+* @return 0 if not
+*/
+int audit_ring_alive(struct audit_ring *ring, unsigned long long now_ns) {
+    if (__atomic_load_n(&ring->closed, __ATOMIC_RELAXED))
+        return 0;
+    unsigned long long heartbeat_ns = __atomic_load_n(&ring->heartbeat_ns, __ATOMIC_RELAXED);
+    return now_ns < heartbeat_ns + AUDIT_RING_STALE_MS * 1000000ULL;
+}
+
+/**
+* @brief map the ring rpc_server created under the producer's name. A previous mapping is left in place, as
+*        other threads may still be writing to it; it only happens when rpc_server restarted
+* @return 0 if mapped
+* @return -1 if there is no usable ring
+*/
+int audit_ring_attach() {
+    int fd = shm_open(audit_ring_producer.name, O_RDWR | O_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct audit_ring)) {
+        close(fd);
+        return -1;
+    }
+    struct audit_ring *ring = mmap(NULL, sizeof(struct audit_ring), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ring == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    // rpc_server writes the magic last, once the slots are ready
+    if (memcmp(ring->magic, AUDIT_RING_MAGIC, sizeof(ring->magic)) != 0 || ring->version != AUDIT_RING_VERSION
+        || ring->slots != AUDIT_RING_SLOTS || !audit_ring_alive(ring, monotonic_ns())) {
+        munmap(ring, sizeof(struct audit_ring));
+        return -1;
+    }
+
+    __atomic_store_n(&audit_ring_producer.ring, ring, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/**
+* @brief copy a string into a fixed size field, truncating it
+* @param field field
+* @param string string
+* @param size field size
+*/
+void audit_ring_copy(char *field, const char *string, size_t size) {
+    size_t len = strnlen(string, size - 1);
+    memcpy(field, string, len);
+    field[len] = '\0';
+}
+
+/**
+* @brief write an operation to the shared-memory ring, without waiting. If the ring is down (rpc_server
+*        stopped or restarted), one caller a second tries to map it again
+* @param username username that did the operation
+* @param operation operation name
+* @param filename file the operation was done on, empty if none
+* @param datetime datetime of the operation
+* @return 0 if written
+* @return -1 if there is no usable ring or it is full, the operation must go through RPC
+*/
+int audit_ring_push(const char *username, const char *operation, const char *filename, const char *datetime) {
+    if (audit_ring_producer.name == NULL)
+        return -1;
+    // the heartbeat only needs millisecond precision, and the coarse clock is much cheaper to read
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    unsigned long long now_ns = now.tv_sec * 1000000000ULL + now.tv_nsec;
+    struct audit_ring *ring = __atomic_load_n(&audit_ring_producer.ring, __ATOMIC_ACQUIRE);
+    if (ring == NULL || !audit_ring_alive(ring, now_ns)) {
+        if (now_ns < __atomic_load_n(&audit_ring_producer.next_attach_ns, __ATOMIC_RELAXED)
+            || pthread_mutex_trylock(&audit_ring_producer.attach_lock) != 0)
+            return -1;
+        __atomic_store_n(&audit_ring_producer.next_attach_ns, now_ns + AUDIT_RING_STALE_MS * 1000000ULL, __ATOMIC_RELAXED);
+        int attached = audit_ring_attach();
+        pthread_mutex_unlock(&audit_ring_producer.attach_lock);
+        if (attached < 0)
+            return -1;
+        ring = __atomic_load_n(&audit_ring_producer.ring, __ATOMIC_ACQUIRE);
+    }
+
+    // claim the slot at the enqueue position, if the consumer freed it
+    uint64_t position = __atomic_load_n(&ring->enqueue_position, __ATOMIC_RELAXED);
+    struct audit_ring_slot *slot;
+    while (1) {
+        slot = &ring->slot[position & (AUDIT_RING_SLOTS - 1)];
+        int64_t difference = (int64_t)(__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - position);
+        if (difference == 0) {
+            if (__atomic_compare_exchange_n(&ring->enqueue_position, &position, position + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (difference < 0) {
+            return -1;
+        } else {
+            position = __atomic_load_n(&ring->enqueue_position, __ATOMIC_RELAXED);
+        }
+    }
+
+    audit_ring_copy(slot->username, username, AUDIT_RING_USERNAME_SIZE);
+    audit_ring_copy(slot->operation, operation, AUDIT_RING_OPERATION_SIZE);
+    audit_ring_copy(slot->filename, filename, AUDIT_RING_FILENAME_SIZE);
+    audit_ring_copy(slot->datetime, datetime, AUDIT_RING_DATETIME_SIZE);
+    __atomic_store_n(&slot->sequence, position + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/**
+* @brief wait until a batch is ready (AUDIT_BATCH_SIZE entries, or the oldest one waited AUDIT_FLUSH_INTERVAL)
+*        and take it out of the queue
+* @param queue audit queue
+* @param batch set to the batch's entries, at least AUDIT_BATCH_SIZE long
+* @return number of entries in the batch
+*/
+int audit_queue_pop_batch(struct audit_queue *queue, struct audit_entry *batch) {
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0)
+        pthread_cond_wait(&queue->ready, &queue->lock);
+
+    // give a partial batch until the oldest entry's flush interval ends to fill up
+    unsigned long long flush_ns = queue->entries[queue->head].enqueued_ns + AUDIT_FLUSH_INTERVAL * 1000000ULL;
+    unsigned long long now_ns = monotonic_ns();
+    if (queue->count < AUDIT_BATCH_SIZE && now_ns < flush_ns) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        unsigned long long deadline_ns = deadline.tv_nsec + (flush_ns - now_ns);
+        deadline.tv_sec += deadline_ns / 1000000000ULL;
+        deadline.tv_nsec = deadline_ns % 1000000000ULL;
+        while (queue->count < AUDIT_BATCH_SIZE) {
+            if (pthread_cond_timedwait(&queue->ready, &queue->lock, &deadline) == ETIMEDOUT)
+                break;
+        }
+    }
+
+    int batch_size = queue->count < AUDIT_BATCH_SIZE ? queue->count : AUDIT_BATCH_SIZE;
+    unsigned long long lag_ns = monotonic_ns() - queue->entries[queue->head].enqueued_ns;
+    if (lag_ns > queue->max_lag_ns)
+        queue->max_lag_ns = lag_ns;
+    for (int i = 0; i < batch_size; i++) {
+        batch[i] = queue->entries[queue->head];
+        queue->head = (queue->head + 1) % queue->capacity;
+    }
+    queue->count -= batch_size;
+    pthread_mutex_unlock(&queue->lock);
+    return batch_size;
+}
+
+/**
+* @brief print the audit queue counters, if anything happened since the last report
+* @param queue audit queue
+* @param last_enqueued enqueued count at the last report, updated
+*/
+void audit_queue_report(struct audit_queue *queue, unsigned long *last_enqueued) {
+    pthread_mutex_lock(&queue->lock);
+    unsigned long enqueued = queue->enqueued;
+    unsigned long dropped = queue->dropped;
+    unsigned long sent = queue->sent;
+    unsigned long failed = queue->failed;
+    unsigned long batches = queue->batches;
+    unsigned long reconnects = queue->reconnects;
+    int depth = queue->count;
+    unsigned long long max_lag_ns = queue->max_lag_ns;
+    queue->max_lag_ns = 0;
+    pthread_mutex_unlock(&queue->lock);
+
+    if (enqueued != *last_enqueued) {
+        printf("audit: %lu queued, %lu sent in %lu batches, %lu dropped, %lu failed, %lu reconnects, queue depth %d/%d, max lag %.1f ms\n",
+               enqueued, sent, batches, dropped, failed, reconnects, depth, queue->capacity, max_lag_ns / 1e6);
+        fflush(stdout);
+    }
+    *last_enqueued = enqueued;
+}
+
+/**
+* @brief wait until every queued operation has been sent to the RPC server (or has failed)
+* @param queue audit queue
+* @param timeout seconds to wait at most
+* @return 0 if the queue is drained
+* @return -1 if operations are still waiting after timeout seconds
+*/
+int audit_queue_drain(struct audit_queue *queue, int timeout) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout;
+    pthread_mutex_lock(&queue->lock);
+    while (queue->sent + queue->failed < queue->enqueued) {
+        if (pthread_cond_timedwait(&queue->done, &queue->lock, &deadline) == ETIMEDOUT)
+            break;
+    }
+    int drained = queue->sent + queue->failed == queue->enqueued;
+    pthread_mutex_unlock(&queue->lock);
+    return drained ? 0 : -1;
+}
+
+// RPC client of the audit sender thread, ONC RPC client handles can't be used by several threads at once
+struct rpc_client {
+    const char *host;
+    CLIENT *clnt;  // NULL while disconnected
+    unsigned long long backoff_ms;  // wait after the last failed connection, 0 after a successful one
+    unsigned long long retry_ns;  // monotonic time of the next connection attempt
+    int failures;  // failed connections in a row, only the first one is reported
+};
+
+/**
+* @brief connect an RPC client if it isn't, waiting out its backoff first. The RPC server must answer the
+*        null procedure before the client is used
+* @param client RPC client
+* @param queue audit queue, counting reconnects
+* @return 0 if connected
+* @return -1 if the RPC server can't be reached (the backoff grows)
+*/
+int rpc_client_connect(struct rpc_client *client, struct audit_queue *queue) {
+    if (client->clnt != NULL)
+        return 0;
+    unsigned long long now_ns = monotonic_ns();
+    if (now_ns < client->retry_ns) {
+        struct timespec wait = {(client->retry_ns - now_ns) / 1000000000ULL, (client->retry_ns - now_ns) % 1000000000ULL};
+        nanosleep(&wait, NULL);
+    }
+
+    struct timeval timeout = {AUDIT_RPC_TIMEOUT, 0};
+    client->clnt = clnt_create_timed(client->host, filemanager, VERNUM, "tcp", &timeout);
+    if (client->clnt == NULL) {
+        if (client->failures == 0)
+            clnt_pcreateerror(client->host);
+    } else {
+        clnt_control(client->clnt, CLSET_TIMEOUT, (char *)&timeout);
+        if (clnt_call(client->clnt, NULLPROC, (xdrproc_t)xdr_void, NULL, (xdrproc_t)xdr_void, NULL, timeout) != RPC_SUCCESS) {
+            if (client->failures == 0)
+                clnt_perror(client->clnt, "audit: RPC server health check");
+            clnt_destroy(client->clnt);
+            client->clnt = NULL;
+        }
+    }
+
+    if (client->clnt == NULL) {
+        // exponential backoff, jittered so the sender threads of many servers don't retry in step
+        client->failures++;
+        client->backoff_ms = client->backoff_ms == 0 ? AUDIT_BACKOFF_MIN : client->backoff_ms * 2;
+        if (client->backoff_ms > AUDIT_BACKOFF_MAX)
+            client->backoff_ms = AUDIT_BACKOFF_MAX;
+        unsigned long long wait_ms = client->backoff_ms / 2 + random() % (client->backoff_ms / 2 + 1);
+        client->retry_ns = monotonic_ns() + wait_ms * 1000000ULL;
+        return -1;
+    }
+
+    if (client->failures > 0) {
+        printf("audit: connected to the RPC server again after %d failed attempts\n", client->failures);
+        fflush(stdout);
+    }
+    if (client->retry_ns != 0) {
+        pthread_mutex_lock(&queue->lock);
+        queue->reconnects++;
+        pthread_mutex_unlock(&queue->lock);
+    }
+    client->failures = 0;
+    client->backoff_ms = 0;
+    return 0;
+}
+
+/**
+* @brief drop an RPC client's connection after a failed call, the next connection is tried right away
+* @param client RPC client
+*/
+void rpc_client_reset(struct rpc_client *client) {
+    clnt_destroy(client->clnt);
+    client->clnt = NULL;
+    client->retry_ns = monotonic_ns();
+}
+
+/**
+* @brief audit sender thread function, sending the queued operations to the RPC server in batches, one at a
+*        time and in queue order. A slow or unreachable RPC server only delays the sender; a batch that fails is
+*        sent again (reconnecting first) up to AUDIT_RPC_ATTEMPTS times before the next one, so a batch whose
+*        reply was lost can arrive twice but never after a later one
+* @param queue audit queue
+*/
+void *audit_sender_thread(void *queue_ptr) {
+    struct audit_queue *queue = queue_ptr;
+    struct audit_entry *batch = malloc(AUDIT_BATCH_SIZE * sizeof(struct audit_entry));
+    audit_record *records = malloc(AUDIT_BATCH_SIZE * sizeof(audit_record));
+    if (batch == NULL || records == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    struct rpc_client client = {.host = rpc_host};
+    rpc_client_connect(&client, queue);
+
+    unsigned long last_enqueued = 0;
+    unsigned long long last_report = monotonic_ns();
+    while (1) {
+        int batch_size = audit_queue_pop_batch(queue, batch);
+        struct metrics_shard *shard = metrics_shard();
+        unsigned long long start_ns = monotonic_ns();
+        for (int i = 0; i < batch_size; i++) {
+            records[i].username = batch[i].username;
+            records[i].operation = (OPERATION)batch[i].operation;
+            records[i].filename = batch[i].filename;
+            records[i].datetime = batch[i].datetime;
+            if (shard != NULL)
+                histogram_record(&shard->audit_wait, start_ns - batch[i].enqueued_ns);
+        }
+
+        // send info to RPC server
+        audit_batch records_batch = {.audit_batch_len = batch_size, .audit_batch_val = records};
+        int rpc_server_result;
+        int sent = 0;
+        for (int attempt = 0; attempt < AUDIT_RPC_ATTEMPTS && !sent; attempt++) {
+            if (rpc_client_connect(&client, queue) < 0)
+                continue;
+            sent = print_operations_batch_1(records_batch, &rpc_server_result, client.clnt) == RPC_SUCCESS;
+            if (!sent) {
+                clnt_perror(client.clnt, "print_operations_batch");
+                rpc_client_reset(&client);
+            }
+        }
+        if (shard != NULL)
+            histogram_record(&shard->audit_rpc, monotonic_ns() - start_ns);
+
+        pthread_mutex_lock(&queue->lock);
+        if (sent) {
+            queue->sent += batch_size;
+            queue->batches++;
+        } else {
+            queue->failed += batch_size;
+        }
+        pthread_cond_broadcast(&queue->done);
+        pthread_mutex_unlock(&queue->lock);
+
+        if (monotonic_ns() - last_report >= AUDIT_REPORT_INTERVAL * 1000000000ULL) {
+            audit_queue_report(queue, &last_enqueued);
+            last_report = monotonic_ns();
+        }
+    }
+
+    return NULL;
+}
+
+// growable byte buffer, used to assemble replies before sending them
+struct buffer {
+    char *data;
+    size_t len;
+    size_t capacity;
+    struct arena *arena;  // if not NULL, data is allocated from it and never freed on its own
+};
+
+/**
+* @brief make room for len more bytes at the end of a buffer, growing it if needed
+* @param buffer buffer to grow
+* @param len number of bytes
+* @return pointer to the new bytes
+* @return NULL if error
+*/
+char *buffer_reserve(struct buffer *buffer, size_t len) {
+    if (buffer->len + len > buffer->capacity) {
+        size_t capacity = buffer->capacity == 0 ? 256 : buffer->capacity;
+        while (capacity < buffer->len + len)
+            capacity *= 2;
+        char *grown;
+        if (buffer->arena != NULL)
+            grown = arena_realloc(buffer->arena, buffer->data, buffer->len, capacity);
+        else if ((grown = realloc(buffer->data, capacity)) == NULL)
+            perror("realloc");
+        if (grown == NULL)
+            return NULL;
+        buffer->data = grown;
+        buffer->capacity = capacity;
+    }
+    char *reserved = buffer->data + buffer->len;
+    buffer->len += len;
+    return reserved;
+}
+
+/**
+* @brief append bytes to a buffer
+* @param buffer buffer to append to
+* @param data bytes to append
+* @param len number of bytes
+* @return 0 if successful
+* @return -1 if error
+*/
+int buffer_append(struct buffer *buffer, const void *data, size_t len) {
+    char *reserved = buffer_reserve(buffer, len);
+    if (reserved == NULL)
+        return -1;
+    memcpy(reserved, data, len);
+    return 0;
+}
+
+/**
+* @brief append a string to a buffer as a fixed size field, padded with '\0'
+* @param buffer buffer to append to
+* @param string string to append
+* @param size field size
+* @return 0 if successful
+* @return -1 if error
+*/
+int buffer_append_padded(struct buffer *buffer, const char *string, size_t size) {
+    char *reserved = buffer_reserve(buffer, size);
+    if (reserved == NULL)
+        return -1;
+    size_t len = strnlen(string, size);
+    memcpy(reserved, string, len);
+    memset(reserved + len, '\0', size - len);
+    return 0;
+}
+
+/**
+* @brief append an unsigned integer to a buffer as a varint (7 bits per byte, least significant first)
+* @param buffer buffer to append to
+* @param value value to append
+* @return 0 if successful
+* @return -1 if error
+*/
+int buffer_append_varint(struct buffer *buffer, unsigned long long value) {
+    char bytes[CURSOR_VARINT_MAX_SIZE];
+    int len = 0;
+    do {
+        bytes[len] = value & 0x7F;
+        value >>= 7;
+        if (value != 0)
+            bytes[len] |= 0x80;
+        len++;
+    } while (value != 0);
+    return buffer_append(buffer, bytes, len);
+}
+
+/**
+* @brief append printf formatted text to a buffer, without its '\0'
+* @param buffer buffer to append to
+* @param format printf format
+* @return 0 if successful
+* @return -1 if error
+*/
+int buffer_printf(struct buffer *buffer, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+
+    char *reserved = buffer_reserve(buffer, len + 1);
+    if (reserved == NULL)
+        return -1;
+    va_start(args, format);
+    vsnprintf(reserved, len + 1, format, args);
+    va_end(args);
+    buffer->len--;
+    return 0;
+}
+
+struct operation;
+
+// request from a client, already read from the socket
+struct request {
+    const struct operation *operation;
+    int protocol;  // PROTOCOL_V1 or PROTOCOL_V2, replies are encoded the same way
+    char datetime[DATETIME_SIZE];  // empty if the client leaves stamping the operation to the server
+    char username[USERNAME_SIZE];
+    char requested_username[USERNAME_SIZE];
+    char filename[FILENAME_SIZE];
+    char description[DESCRIPTION_SIZE];
+    char port[PORT_SIZE];
+    char cursor[CURSOR_SIZE];  // position to resume a list from, empty for the first page
+    char limit[CURSOR_SIZE];  // maximum entries per list page, empty for the default
+    char prefix[FILENAME_SIZE];  // only list files whose name starts with it, empty for every file
+    char query[DESCRIPTION_SIZE];  // search terms, separated by spaces
+    char content[CONTENT_SIZE];  // content id of a published file, empty if unknown
+    char ip[IP_ADDRESS_SIZE];  // not sent by the client, taken from the socket
+    int status;  // execution status of the reply, once added
+    struct arena *arena;  // memory the handler only needs until the reply is built, reset after each request
+};
+
+/**
+* @brief add the execution status to the reply (an ASCII digit in v1, a byte in v2)
+* @param request request being replied
+* @param reply reply to the client
+* @param status execution status
+* @return 0 if successful
+* @return -1 if error
+*/
+int reply_status(struct request *request, struct buffer *reply, int status) {
+    request->status = status;
+    char status_byte = request->protocol == PROTOCOL_V1 ? '0' + status : status;
+    return buffer_append(reply, &status_byte, EXECUTION_STATUS_SIZE);
+}
+
+/**
+* @brief add a number of list entries to the reply (ASCII padded with spaces to v1_size in v1, a varint in v2)
+* @param request request being replied
+* @param reply reply to the client
+* @param count number of entries
+* @param v1_size field size in v1
+* @return 0 if successful
+* @return -1 if error
+*/
+int reply_count(struct request *request, struct buffer *reply, unsigned int count, size_t v1_size) {
+    if (request->protocol == PROTOCOL_V2)
+        return buffer_append_varint(reply, count);
+
+    // padded with spaces, so the list doesn't get mixed into it
+    char count_str[16];
+    int count_len = snprintf(count_str, sizeof(count_str), "%-*u", (int)v1_size, count);
+    return buffer_append(reply, count_str, count_len);
+}
+
+/**
+* @brief add a string to the reply (padded with '\0' to v1_size in v1, varint length prefixed in v2)
+* @param request request being replied
+* @param reply reply to the client
+* @param string string to add
+* @param v1_size field size in v1
+* @return 0 if successful
+* @return -1 if error
+*/
+int reply_string(struct request *request, struct buffer *reply, const char *string, size_t v1_size) {
+    if (request->protocol == PROTOCOL_V1)
+        return buffer_append_padded(reply, string, v1_size);
+
+    size_t len = strnlen(string, v1_size);
+    if (buffer_append_varint(reply, len) < 0)
+        return -1;
+    return buffer_append(reply, string, len);
+}
+
+// operations that change server state, as recorded in the write-ahead log. Snapshots are written as
+// REGISTER, CONNECT and PUBLISH (or PUBLISH_CONTENT) records too, every stripe after a STRIPE record
+enum wal_type {
+    WAL_REGISTER = 1,
+    WAL_UNREGISTER,
+    WAL_CONNECT,
+    WAL_DISCONNECT,
+    WAL_PUBLISH,
+    WAL_DELETE,
+    WAL_PUBLISH_CONTENT,  // a PUBLISH whose content is known, logs written before it existed only have PUBLISH
+    WAL_STRIPE  // only in snapshots, the records after it are the state of a stripe up to its lsn
+};
+
+#define WAL_HEADER_SIZE 8  // payload length and payload crc32, 4 bytes each
+#define WAL_MAX_FIELDS 4
+
+// number of fields of every record type
+const int wal_field_counts[] = {
+    [WAL_REGISTER] = 1,  // username
+    [WAL_UNREGISTER] = 1,  // username
+    [WAL_CONNECT] = 3,  // username, ip, port
+    [WAL_DISCONNECT] = 1,  // username
+    [WAL_PUBLISH] = 3,  // username, filename, description
+    [WAL_DELETE] = 2,  // username, filename
+    [WAL_PUBLISH_CONTENT] = 4,  // username, filename, description, content
+    [WAL_STRIPE] = 2  // stripe, number of stripes
+};
+
+// record read back from the log or a snapshot, its fields point into the bytes it was decoded from
+struct wal_record {
+    enum wal_type type;
+    unsigned long long lsn;
+    const char *fields[WAL_MAX_FIELDS];
+};
+
+// write-ahead log of the operations that change server state. Handlers append records to pending and wait
+// for the writer thread, which writes and fsyncs everything pending at once, so concurrent writers share fsyncs
+struct wal {
+    int fd;  // -1 while recovering, so replayed operations aren't logged again
+    struct buffer pending;  // records appended and not written yet
+    unsigned long long next_lsn;  // log sequence number of the next record
+    unsigned long long durable_lsn;  // every record up to it is on disk
+    unsigned long records;  // records in the log since the last snapshot started
+    unsigned long commits;  // fsyncs, each one commits a group of records
+    unsigned int segment;  // sequence number of the segment records are written to
+    unsigned int snapshot_segment;  // first segment the running snapshot doesn't cover, 0 while none runs
+    int event_fd;  // written after every commit while the epoll loop waits on it, -1 otherwise
+    pthread_mutex_t lock;
+    pthread_cond_t pending_ready;
+    pthread_cond_t durable;
+    pthread_cond_t snapshot_due;  // signaled when the writer thread starts a segment for a snapshot
+} wal = {
+    .fd = -1,
+    .next_lsn = 1,
+    .event_fd = -1,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .pending_ready = PTHREAD_COND_INITIALIZER,
+    .durable = PTHREAD_COND_INITIALIZER,
+    .snapshot_due = PTHREAD_COND_INITIALIZER
+};
+
+__thread unsigned long long wal_thread_lsn;  // lsn of the last record appended by this thread
+
+unsigned int crc32_table[256];
+pthread_once_t crc32_table_once = PTHREAD_ONCE_INIT;
+
+/**
+* @brief fill the CRC-32 lookup table
+*/
+void crc32_init_table() {
+    for (unsigned int i = 0; i < 256; i++) {
+        unsigned int crc = i;
+        for (int bit = 0; bit < 8; bit++)
+            crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+        crc32_table[i] = crc;
+    }
+}
+
+/**
+* @brief compute the CRC-32 (IEEE 802.3) of some bytes
+* @param data bytes
+* @param len number of bytes
+* @return crc
+*/
+unsigned int crc32(const unsigned char *data, size_t len) {
+    pthread_once(&crc32_table_once, crc32_init_table);
+    unsigned int crc = 0xFFFFFFFF;
+    for (size_t i = 0; i < len; i++)
+        crc = crc32_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return crc ^ 0xFFFFFFFF;
+}
+
+/**
+* @brief append a record to a buffer: payload length and crc32, then the payload (type byte, lsn and the
+*        '\0' terminated fields)
+* @param buffer buffer to append to
+* @param type record type
+* @param lsn log sequence number
+* @param fields record fields, as many as wal_field_counts says
+* @return 0 if successful
+* @return -1 if error
+*/
+int wal_encode(struct buffer *buffer, enum wal_type type, unsigned long long lsn, const char *fields[]) {
+    size_t payload_len = 1 + sizeof(lsn);
+    for (int i = 0; i < wal_field_counts[type]; i++)
+        payload_len += strlen(fields[i]) + 1;
+
+    char *record = buffer_reserve(buffer, WAL_HEADER_SIZE + payload_len);
+    if (record == NULL)
+        return -1;
+    unsigned char *payload = (unsigned char *)record + WAL_HEADER_SIZE;
+    payload[0] = type;
+    memcpy(payload + 1, &lsn, sizeof(lsn));
+    size_t used = 1 + sizeof(lsn);
+    for (int i = 0; i < wal_field_counts[type]; i++) {
+        size_t field_len = strlen(fields[i]) + 1;
+        memcpy(payload + used, fields[i], field_len);
+        used += field_len;
+    }
+
+    unsigned int header[2] = {payload_len, crc32(payload, payload_len)};
+    memcpy(record, header, WAL_HEADER_SIZE);
+    return 0;
+}
+
+/**
+* @brief decode the record at the start of data
+* @param data bytes read from the log or a snapshot
+* @param len number of bytes
+* @param record record to fill
+* @return record size if complete and valid
+* @return 0 if data ends before the record does (a write cut short by a crash)
+* @return -1 if the record is corrupt
+*/
+long wal_decode(const char *data, size_t len, struct wal_record *record) {
+    unsigned int header[2];
+    if (len < WAL_HEADER_SIZE)
+        return 0;
+    memcpy(header, data, WAL_HEADER_SIZE);
+    if (len - WAL_HEADER_SIZE < header[0])
+        return 0;
+    const unsigned char *payload = (const unsigned char *)data + WAL_HEADER_SIZE;
+    if (header[0] < 1 + sizeof(record->lsn) || crc32(payload, header[0]) != header[1])
+        return -1;
+
+    record->type = payload[0];
+    if (record->type < WAL_REGISTER || record->type > WAL_STRIPE)
+        return -1;
+    memcpy(&record->lsn, payload + 1, sizeof(record->lsn));
+
+    // every field has to be '\0' terminated inside the payload
+    size_t used = 1 + sizeof(record->lsn);
+    for (int i = 0; i < wal_field_counts[record->type]; i++) {
+        const char *end = memchr(payload + used, '\0', header[0] - used);
+        if (end == NULL)
+            return -1;
+        record->fields[i] = (const char *)payload + used;
+        used = end - (const char *)payload + 1;
+    }
+    return WAL_HEADER_SIZE + header[0];
+}
+
+/**
+* @brief append an operation to the log. Must be called with the lock of the state the operation changed held,
+*        so records of the same state are logged in the order they were applied. The operation isn't durable
+*        until wal_wait() returns for the returned lsn
+* @param type record type
+* @param field0 first field
+* @param field1 second field, NULL if the type has less fields
+* @param field2 third field, NULL if the type has less fields
+* @param field3 fourth field, NULL if the type has less fields
+* @return lsn of the record
+* @return 0 if the log isn't open yet (while recovering)
+*/
+unsigned long long wal_append(enum wal_type type, const char *field0, const char *field1, const char *field2, const char *field3) {
+    if (wal.fd < 0)
+        return 0;
+
+    const char *fields[WAL_MAX_FIELDS] = {field0, field1, field2, field3};
+    pthread_mutex_lock(&wal.lock);
+    unsigned long long lsn = wal.next_lsn++;
+    if (wal_encode(&wal.pending, type, lsn, fields) < 0) {
+        // the operation is already applied, it can't be acknowledged without being logged
+        exit(1);
+    }
+    pthread_cond_signal(&wal.pending_ready);
+    pthread_mutex_unlock(&wal.lock);
+
+    wal_thread_lsn = lsn;
+    return lsn;
+}
+
+/**
+* @brief check if a record is durable
+* @param lsn lsn of the record
+* @return 1 if it is on disk, 0 otherwise
+*/
+int wal_durable(unsigned long long lsn) {
+    pthread_mutex_lock(&wal.lock);
+    int durable = wal.durable_lsn >= lsn;
+    pthread_mutex_unlock(&wal.lock);
+    return durable;
+}
+
+/**
+* @brief wait until a record is durable
+* @param lsn lsn of the record
+*/
+void wal_wait(unsigned long long lsn) {
+    pthread_mutex_lock(&wal.lock);
+    while (wal.durable_lsn < lsn)
+        pthread_cond_wait(&wal.durable, &wal.lock);
+    pthread_mutex_unlock(&wal.lock);
+}
+
+/**
+* @brief check if username is registered
+* @param username username to check
+* @return 1 if exists, 0 otherwise
+*/
+int check_username_existence(USERNAME username) {
+    struct state_stripe *stripe = user_stripe(username);
+    pthread_rwlock_rdlock(&stripe->lock);
+    int exists = registry_lookup(&stripe->users, username) != NULL;
+    pthread_rwlock_unlock(&stripe->lock);
+
+    return exists;
+}
+
+/**
+* @brief check if user is connected
+* @param username username to check
+* @return 1 if connected, 0 otherwise (also if username isn't registered)
+*/
+int check_user_connection(USERNAME username) {
+    struct state_stripe *stripe = user_stripe(username);
+    pthread_rwlock_rdlock(&stripe->lock);
+    struct registered_user *user = registry_lookup(&stripe->users, username);
+    int connected = user != NULL && user->connected;
+    pthread_rwlock_unlock(&stripe->lock);
+
+    return connected;
+}
+
+/**
+* @brief lock the stripe of a user that must be registered and connected, so what is checked holds until
+*        the stripe is unlocked
+* @param username username
+* @param write 1 to lock the stripe for writing, 0 for reading
+* @param stripe set to the user's stripe, left locked if successful
+* @param user set to the user if successful
+* @return 0 if successful
+* @return 1 if user doesn't exist
+* @return 2 if user is not connected
+*/
+int lock_connected_user(USERNAME username, int write, struct state_stripe **stripe, struct registered_user **user) {
+    *stripe = user_stripe(username);
+    if (write)
+        pthread_rwlock_wrlock(&(*stripe)->lock);
+    else
+        pthread_rwlock_rdlock(&(*stripe)->lock);
+
+    *user = registry_lookup(&(*stripe)->users, username);
+    if (*user == NULL || !(*user)->connected) {
+        pthread_rwlock_unlock(&(*stripe)->lock);
+        return *user == NULL ? 1 : 2;
+    }
+    return 0;
+}
+
+/**
+* @brief register user, adding it to the users registry
+* @param username username to register
+* @return 0 if successful
+* @return 1 if username already exists
+* @return -1 if error
+*/
+int register_user(USERNAME username) {
+    // insert fails with 1 if username exists, so no separate existence check is needed
+    struct state_stripe *stripe = user_stripe(username);
+    pthread_rwlock_wrlock(&stripe->lock);
+    int registry_insert_rvalue = registry_insert(&stripe->users, username);
+    if (registry_insert_rvalue == 0)
+        wal_append(WAL_REGISTER, username, NULL, NULL, NULL);
+    pthread_rwlock_unlock(&stripe->lock);
+
+    return registry_insert_rvalue;
+}
+
+/**
+* @brief register operation handler. Calls register_user() and sends error code to client
+* @param request parsed request
+* @param reply reply to the client
+* @return 0 if successful
+* @return -1 if error
+*/
+int handle_register(struct request *request, struct buffer *reply) {
+    // attempt to register user
+    int register_user_rvalue = register_user(request->username);
+    
+    // send error code to client
+    if (register_user_rvalue < 0) {
+        // in case there was an error
+        reply_status(request, reply, 2);
+        return -1;
+    } else if (register_user_rvalue == 1) {
+        // in case username already exists
+        reply_status(request, reply, 1);
+    } else
+        reply_status(request, reply, 0);
+
+    return 0;
+}
+
+/**
+* @brief disconnect a connected user, publishing the connected users of their stripe without them and dropping
+*        their published files. The stripe must be write locked
+* @param stripe stripe of the user
+* @param user user to disconnect
+* @return 0 if successful
+* @return -1 if error
+*/
+int stripe_disconnect(struct state_stripe *stripe, struct registered_user *user) {
+    struct connected_view *view = connected_view_copy(stripe, user->username);
+    if (view == NULL)
+        return -1;
+    connected_view_publish(stripe, view);
+    user->connected = 0;
+
+    struct catalog *catalog = user->catalog;
+    for (size_t i = 0; i < catalog->count; i++) {
+        if (catalog->files[i]->deleted == ULLONG_MAX) {
+            search_remove_file(stripe, catalog->files[i]);
+            content_index_remove(&stripe->contents, catalog->files[i]);
+        }
+    }
+
+    // list requests still reading the catalog keep it until they are done
+    catalog_release(user->catalog);
+    user->catalog = NULL;
+    free(user->published.slots);
+    memset(&user->published, 0, sizeof(struct file_index));
+
+    wal_append(WAL_DISCONNECT, user->username, NULL, NULL, NULL);
+    return 0;
+}
+
+/**
+* @brief disconnect user, deleting their connection and their published files
+* @param username username to disconnect
+* @return 0 if successful
+* @return 1 if user doesn't exist
+* @return 2 if user is not connected
+* @return -1 if error
+*/
+int disconnect_user(USERNAME username) {
+    // check if user exists and is connected
+    struct state_stripe *stripe;
+    struct registered_user *user;
+    int lock_connected_user_rvalue = lock_connected_user(username, 1, &stripe, &user);
+    if (lock_connected_user_rvalue != 0)
+        return lock_connected_user_rvalue;
+
+    int stripe_disconnect_rvalue = stripe_disconnect(stripe, user);
+    pthread_rwlock_unlock(&stripe->lock);
+    
+    return stripe_disconnect_rvalue;
+}
+
+/**
+* @brief disconnect operation handler. Calls disconnect_user() and sends error code to client
+* @param request parsed request
+* @param reply reply to the client
+* @return 0 if successful
+* @return -1 if error
+*/
+int handle_disconnect(struct request *request, struct buffer *reply) {
+    // attempt to disconnect user
+    int disconnect_user_rvalue = disconnect_user(request->username);
+    
+    // send error code to client
+    if (disconnect_user_rvalue < 0) {
+        // in case there was an error
+        reply_status(request, reply, 3);
+        return -1;
+    } else if (disconnect_user_rvalue == 1) {
+        // in case username doesn't exist
+        reply_status(request, reply, 1);
+    } else if (disconnect_user_rvalue == 2) {
+        // in case user is not connected
+        reply_status(request, reply, 2);
+    } else
+        reply_status(request, reply, 0);
+
+    return 0;
+}
+
+/**
+* @brief unregister user, deleting it from the users registry and disconnecting them if they are connected
+* @param username username to unregister
+* @return 0 if successful
+* @return 1 if username doesn't exist
+* @return -1 if error
+*/
+int unregister_user(USERNAME username) {
+    // check if username exists
+    struct state_stripe *stripe = user_stripe(username);
+    pthread_rwlock_wrlock(&stripe->lock);
+    struct registered_user *user = registry_lookup(&stripe->users, username);
+    if (user == NULL) {
+        pthread_rwlock_unlock(&stripe->lock);
+        return 1;
+    }
+
+    // disconnect user if they are connected
+    if (user->connected && stripe_disconnect(stripe, user) < 0) {
+        pthread_rwlock_unlock(&stripe->lock);
+        return -1;
+    }
+
+    // delete username from the users registry
+    registry_remove(&stripe->users, username);
+    wal_append(WAL_UNREGISTER, username, NULL, NULL, NULL);
+    pthread_rwlock_unlock(&stripe->lock);
+
+    return 0;
+}
+
+/**
+* @brief unregister operation handler. Calls unregister_user() and sends error code to client
+* @param request parsed request
+* @param reply reply to the client
+* @return 0 if successful
+* @return -1 if error
+*/
+int handle_unregister(struct request *request, struct buffer *reply) {
+    // attempt to unregister user
+    int unregister_user_rvalue = unregister_user(request->username);
+    
+    // send error code to client
+    if (unregister_user_rvalue < 0) {
+        // in case there was an error
+        reply_status(request, reply, 2);
+        return -1;
+    } else if (unregister_user_rvalue == 1) {
+        // in case username doesn't exist
+        reply_status(request, reply, 1);
+    } else {
+        reply_status(request, reply, 0);
+    }
+
+    return 0;
+}
+
+/**
+* @brief publish file, adding it to the user's catalog
+* @param username username
+* @param filename filename
+* @param description description
+* @param content content id, empty if the publisher didn't compute it
+*/
+int publish_file(USERNAME username, FILENAME filename, char description[DESCRIPTION_SIZE], const char *content) {
+    // check if user is registered and connected
+    struct state_stripe *stripe;
+    struct registered_user *user;
+    int lock_connected_user_rvalue = lock_connected_user(username, 1, &stripe, &user);
+    if (lock_connected_user_rvalue != 0)
+        return lock_connected_user_rvalue;
+    
+    // check if file has been published by user
+    if (file_index_lookup(&user->published, filename) != NULL) {
+        pthread_rwlock_unlock(&stripe->lock);
+        return 3;
+    }
+
+    // add filename and description after the files published before, and index them for searches and, if
+    // its content is known, for SOURCES requests
+    struct published_file *file = catalog_publish(user, filename, description, content);
+    if (file == NULL) {
+        pthread_rwlock_unlock(&stripe->lock);
+        return -1;
+    }
+    if (search_add_file(stripe, user, file) < 0) {
+        catalog_delete(user, filename);
+        pthread_rwlock_unlock(&stripe->lock);
+        return -1;
+    }
+    if (content[0] != '\0' && content_index_add(&stripe->contents, file) < 0) {
+        search_remove_file(stripe, file);
+        catalog_delete(user, filename);
+        pthread_rwlock_unlock(&stripe->lock);
+        return -1;
+    }
+    if (content[0] != '\0')
+        wal_append(WAL_PUBLISH_CONTENT, username, filename, description, content);
+    else
+        wal_append(WAL_PUBLISH, username, filename, description, NULL);
+    pthread_rwlock_unlock(&stripe->lock);
+
+    return 0;
+}
+
+/**
+* @brief publish operation handler. Calls publish_file() and sends error code to client
+* @param request parsed request
+* @param reply reply to the client
+* @return 0 if successful
+* @return -1 if error
+*/
+int handle_publish(struct request *request, struct buffer *reply) {
+    // attempt to publish file
+    int publish_file_rvalue = publish_file(request->username, request->filename, request->description, request->content);
+    
+    // send error code to client
+    if (publish_file_rvalue < 0) {
+        // in case there was an error
+        reply_status(request, reply, 4);
+        return -1;
+    } else if (publish_file_rvalue == 1) {
+        // in case username doesn't exist
+        reply_status(request, reply, 1);
+    } else if (publish_file_rvalue == 2) {
+        // in case user is not connected
+        reply_status(request, reply, 2);
+    } else if (publish_file_rvalue == 3) {
+        // in case file has already been published
+        reply_status(request, reply, 3);
+    } else {
+        reply_status(request, reply, 0);
+    }
+
+    return 0;
+}
+
+/**
+* @brief connects user from ip and port, appending them to the connected users of their stripe, and creates
+*        their empty catalog
+* @param client_socket socket of client
+* @return 0 if successful
+* @return 1 if user doesn't exist
+* @return 2 if user is ubt already connected
+* @return -1 if error
+*/
+int connect_user(USERNAME username, char ip[IP_ADDRESS_SIZE], char port[PORT_SIZE]) {
+    // check if user is registered
+    struct state_stripe *stripe = user_stripe(username);
+    pthread_rwlock_wrlock(&stripe->lock);
+    struct registered_user *user = registry_lookup(&stripe->users, username);
+    if (user == NULL) {
+        pthread_rwlock_unlock(&stripe->lock);
+        return 1;
+    }
+
+    // check if user is connected already
+    if (user->connected) {
+        pthread_rwlock_unlock(&stripe->lock);
+        return 2;
+    }
+
+    // add client's username, ip and port after the users that connected before
+    struct connected_view *view = connected_view_copy(stripe, NULL);
+    if (view == NULL) {
+        pthread_rwlock_unlock(&stripe->lock);
+        return -1;
+    }
+    struct connected_user *connected = &view->users[view->count++];
+    memset(connected, 0, sizeof(struct connected_user));
+    strncpy(connected->username, username, USERNAME_SIZE - 1);
+    strncpy(connected->ip, ip, IP_ADDRESS_SIZE - 1);
+    strncpy(connected->port, port, PORT_SIZE - 1);
+    connected->sequence = ++stripe->connections;
+
+    // create an empty catalog
+    user->catalog = catalog_create(CATALOG_INITIAL_CAPACITY, 0);
+    if (user->catalog == NULL) {
+        pthread_rwlock_unlock(&stripe->lock);
+        free(view);
         return -1;
     }
-    
-    // check if file has been published by user
-    int check_file_existance_rvalue = check_published_file_existance(username, filename);
-    if (check_file_existance_rvalue == 1) {
+
+    connected_view_publish(stripe, view);
+    user->connected = 1;
+    memcpy(user->ip, connected->ip, IP_ADDRESS_SIZE);
+    memcpy(user->port, connected->port, PORT_SIZE);
+    wal_append(WAL_CONNECT, username, ip, port, NULL);
+    pthread_rwlock_unlock(&stripe->lock);
+
+    return 0;
+}
+
+/**
+* @brief connect operation handler. Calls connect_user() and sends error code to client
+* @param request parsed request
+* @param reply reply to the client
+* @return 0 if successful
+* @return -1 if error
+*/
+int handle_connect(struct request *request, struct buffer *reply) {
+    // attempt to connect
+    int connect_rvalue = connect_user(request->username, request->ip, request->port);
+
+    // send execution status
+    if (connect_rvalue < 0) {
+        // in case there was an error
+        reply_status(request, reply, 3);
+        return -1;
+    } else if (connect_rvalue == 1) {
+        // in case username doesn't exist
+        reply_status(request, reply, 1);
+    } else if (connect_rvalue == 2) {
+        // in case user is already connected
+        reply_status(request, reply, 2);
+    } else {
+        reply_status(request, reply, 0);
+    }
+
+    return 0;
+}
+
+/**
+* @brief deletes a file from the user's catalog
+* @param client_socket socket of client
+* @return 0 if successful
+* @return 1 if user doesn't exist
+* @return 2 if user is not connected
+* @return 3 if the file has not been published by user
+* @return -1 if error
+*/
+int delete(USERNAME username, FILENAME filename) {
+    // check if user exists and is connected
+    struct state_stripe *stripe;
+    struct registered_user *user;
+    int lock_connected_user_rvalue = lock_connected_user(username, 1, &stripe, &user);
+    if (lock_connected_user_rvalue != 0)
+        return lock_connected_user_rvalue;
+
+    // remove the file from the search index and the user's catalog, if the user published it
+    struct published_file *file = file_index_lookup(&user->published, filename);
+    if (file == NULL) {
+        pthread_rwlock_unlock(&stripe->lock);
         return 3;
-    } else if (check_file_existance_rvalue < 0) {
+    }
+    search_remove_file(stripe, file);
+    content_index_remove(&stripe->contents, file);
+    catalog_delete(user, filename);
+    wal_append(WAL_DELETE, username, filename, NULL, NULL);
+    pthread_rwlock_unlock(&stripe->lock);
+    
+    return 0;
+}
+
+/**
+* @brief delete operation handler. Calls delete() and sends error code to client
+* @param request parsed request
+* @param reply reply to the client
+* @return 0 if successful
+* @return -1 if error
+*/
+int handle_delete(struct request *request, struct buffer *reply) {
+    // delete the file and send error code to client
+    int delete_rvalue = delete(request->username, request->filename);
+    if (delete_rvalue < 0) {
+        reply_status(request, reply, 4);
+        return -1;
+    } else if (delete_rvalue == 1) {
+        // in case username doesn't exist
+        reply_status(request, reply, 1);
+    } else if (delete_rvalue == 2) {
+        // in case user is not connected
+        reply_status(request, reply, 2);
+    } else if (delete_rvalue == 3) {
+        // in case file has not been published by user
+        reply_status(request, reply, 3);
+    } else {
+        reply_status(request, reply, 0);
+    }
+
+    return 0;
+}
+
+/**
+* @brief write and fsync every pending record, then wake up the handlers waiting for them
+* @param wal write-ahead log
+* @param writing empty buffer, swapped with the pending one while it is written
+*/
+void wal_commit(struct wal *wal, struct buffer *writing) {
+    pthread_mutex_lock(&wal->lock);
+    struct buffer swap = wal->pending;
+    wal->pending = *writing;
+    *writing = swap;
+    unsigned long long lsn = wal->next_lsn - 1;
+    pthread_mutex_unlock(&wal->lock);
+
+    // a failed write or fsync can't be retried safely, and replies can't be sent without it
+    unsigned long long start_ns = monotonic_ns();
+    size_t written = 0;
+    while (written < writing->len) {
+        ssize_t n = write(wal->fd, writing->data + written, writing->len - written);
+        if (n < 0) {
+            perror("write");
+            exit(1);
+        }
+        written += n;
+    }
+    if (writing->len > 0 && fdatasync(wal->fd) < 0) {
+        perror("fdatasync");
+        exit(1);
+    }
+    struct metrics_shard *shard = metrics_shard();
+    if (writing->len > 0 && shard != NULL)
+        histogram_record(&shard->wal_commit, monotonic_ns() - start_ns);
+    writing->len = 0;
+
+    pthread_mutex_lock(&wal->lock);
+    wal->records += lsn - wal->durable_lsn;
+    wal->durable_lsn = lsn;
+    wal->commits++;
+    pthread_cond_broadcast(&wal->durable);
+    pthread_mutex_unlock(&wal->lock);
+
+    if (wal->event_fd >= 0) {
+        unsigned long long one = 1;
+        if (write(wal->event_fd, &one, sizeof(one)) < 0)
+            perror("write");
+    }
+}
+
+/**
+* @brief fsync the working directory, so the files created, renamed or removed in it stay that way after a crash
+* @return 0 if successful
+* @return -1 if error
+*/
+int sync_directory() {
+    int fd = open(".", O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        perror("open");
+        return -1;
+    }
+    int rvalue = fsync(fd);
+    if (rvalue < 0)
+        perror("fsync");
+    close(fd);
+    return rvalue;
+}
+
+/**
+* @brief compare two segment sequence numbers, for qsort
+*/
+int compare_sequences(const void *a, const void *b) {
+    unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+* @brief list the log segments in the working directory, in the order they were written
+* @param sequences set to the sequence numbers of the segments, to be freed
+* @param count set to the number of segments
+* @return 0 if successful
+* @return -1 if error
+*/
+int wal_list_segments(unsigned int **sequences, size_t *count) {
+    *sequences = NULL;
+    *count = 0;
+    DIR *dir = opendir(".");
+    if (dir == NULL) {
+        perror("opendir");
+        return -1;
+    }
+    size_t capacity = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        unsigned int sequence;
+        char suffix[8];
+        if (sscanf(entry->d_name, WAL_SEGMENT_PREFIX "%u%7s", &sequence, suffix) != 2 || strcmp(suffix, WAL_SEGMENT_SUFFIX) != 0)
+            continue;
+        if (*count == capacity) {
+            capacity = capacity == 0 ? 16 : capacity * 2;
+            unsigned int *grown = realloc(*sequences, capacity * sizeof(unsigned int));
+            if (grown == NULL) {
+                perror("realloc");
+                free(*sequences);
+                *sequences = NULL;
+                closedir(dir);
+                return -1;
+            }
+            *sequences = grown;
+        }
+        (*sequences)[(*count)++] = sequence;
+    }
+    closedir(dir);
+    qsort(*sequences, *count, sizeof(unsigned int), compare_sequences);
+    return 0;
+}
+
+/**
+* @brief create the next log segment and write records to it from then on. Only called between commits, so
+*        every record up to the durable lsn is in the earlier segments and every later one goes to the new one
+* @param wal write-ahead log
+* @return 0 if successful
+* @return -1 if error, records keep going to the current segment
+*/
+int wal_open_segment(struct wal *wal) {
+    char path[WAL_SEGMENT_PATH_SIZE];
+    snprintf(path, sizeof(path), WAL_SEGMENT_PREFIX "%08u" WAL_SEGMENT_SUFFIX, wal->segment + 1);
+    int fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_APPEND, 0644);
+    if (fd < 0) {
+        perror("open");
+        return -1;
+    }
+    if (sync_directory() < 0) {
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+
+    pthread_mutex_lock(&wal->lock);
+    int previous_fd = wal->fd;
+    wal->fd = fd;
+    wal->segment++;
+    pthread_mutex_unlock(&wal->lock);
+    if (previous_fd >= 0)
+        close(previous_fd);
+    return 0;
+}
+
+/**
+* @brief write a buffer to a file, emptying the buffer
+* @param file file
+* @param buffer buffer
+* @return 0 if successful
+* @return -1 if error
+*/
+int snapshot_flush(FILE *file, struct buffer *buffer) {
+    if (fwrite(buffer->data, 1, buffer->len, file) != buffer->len) {
+        perror("fwrite");
+        return -1;
+    }
+    buffer->len = 0;
+    return 0;
+}
+
+/**
+* @brief write a snapshot of the server state, then remove the log segments it covers. Stripes are copied one
+*        at a time as a STRIPE record and REGISTER, CONNECT and PUBLISH records, under the stripe's read lock
+*        only, and records of a stripe are appended under its write lock, so each copy is exactly the state of
+*        its stripe up to the lsn in its STRIPE record. The file is written and synced with no lock held
+* @param wal write-ahead log
+* @param segment segment started for the snapshot, every record in the ones before it is older than any stripe
+* @return 0 if successful
+* @return -1 if error
+*/
+int snapshot_write(struct wal *wal, unsigned int segment) {
+    unsigned long long start = monotonic_ns();
+    FILE *snapshot_file = fopen("temp_server.snapshot", "w");
+    if (snapshot_file == NULL) {
+        perror("fopen");
+        return -1;
+    }
+
+    struct buffer records = {0};
+    unsigned long count = 0;
+    unsigned long long first_lsn = 0;
+    unsigned long long lsn = 0;
+    int failed = 0;
+    for (int i = 0; i < STATE_STRIPES && !failed; i++) {
+        struct state_stripe *stripe = &stripes[i];
+        pthread_rwlock_rdlock(&stripe->lock);
+        pthread_mutex_lock(&wal->lock);
+        lsn = wal->next_lsn - 1;
+        pthread_mutex_unlock(&wal->lock);
+        if (i == 0)
+            first_lsn = lsn;
+        char stripe_index[12];
+        char stripe_count[12];
+        snprintf(stripe_index, sizeof(stripe_index), "%d", i);
+        snprintf(stripe_count, sizeof(stripe_count), "%d", STATE_STRIPES);
+        const char *stripe_fields[] = {stripe_index, stripe_count};
+        failed = wal_encode(&records, WAL_STRIPE, lsn, stripe_fields) < 0;
+
+        // registered users
+        struct user_registry *users = &stripe->users;
+        for (size_t j = 0; j < users->capacity && !failed; j++) {
+            if (users->slots[j].user == NULL)
+                continue;
+            const char *fields[] = {users->slots[j].user->username};
+            failed = wal_encode(&records, WAL_REGISTER, lsn, fields) < 0;
+            count++;
+        }
+
+        // connected users, each followed by its published files
+        struct connected_view *view = stripe->connected;
+        for (unsigned long j = 0; j < view->count && !failed; j++) {
+            struct connected_user *connected = &view->users[j];
+            const char *connect_fields[] = {connected->username, connected->ip, connected->port};
+            failed = wal_encode(&records, WAL_CONNECT, lsn, connect_fields) < 0;
+            count++;
+
+            struct catalog *catalog = registry_lookup(users, connected->username)->catalog;
+            for (size_t k = 0; k < catalog->count && !failed; k++) {
+                struct published_file *file = catalog->files[k];
+                if (file->deleted != ULLONG_MAX)
+                    continue;
+                const char *publish_fields[] = {connected->username, file->filename, file->description, file->content};
+                failed = wal_encode(&records, file->content[0] != '\0' ? WAL_PUBLISH_CONTENT : WAL_PUBLISH, lsn, publish_fields) < 0;
+                count++;
+            }
+        }
+        pthread_rwlock_unlock(&stripe->lock);
+
+        if (!failed && records.len >= SNAPSHOT_BUFFER_SIZE)
+            failed = snapshot_flush(snapshot_file, &records) < 0;
+    }
+    if (!failed)
+        failed = snapshot_flush(snapshot_file, &records) < 0 || fflush(snapshot_file) != 0 || fsync(fileno(snapshot_file)) < 0;
+    free(records.data);
+    if (fclose(snapshot_file) != 0 || failed) {
+        perror("snapshot");
+        return -1;
+    }
+
+    // the snapshot can't get ahead of the log, its records may not be durable yet
+    pthread_mutex_lock(&wal->lock);
+    while (wal->durable_lsn < lsn)
+        pthread_cond_wait(&wal->durable, &wal->lock);
+    pthread_mutex_unlock(&wal->lock);
+
+    // replace the previous snapshot only once this one is on disk, then the segments it covers can go
+    if (rename("temp_server.snapshot", snapshot_filename) < 0) {
+        perror("rename");
+        return -1;
+    }
+    if (sync_directory() < 0)
+        return -1;
+    unsigned int *sequences;
+    size_t segments;
+    if (wal_list_segments(&sequences, &segments) == 0) {
+        for (size_t i = 0; i < segments && sequences[i] < segment; i++) {
+            char path[WAL_SEGMENT_PATH_SIZE];
+            snprintf(path, sizeof(path), WAL_SEGMENT_PREFIX "%08u" WAL_SEGMENT_SUFFIX, sequences[i]);
+            if (unlink(path) < 0)
+                perror("unlink");
+        }
+        free(sequences);
+    }
+
+    printf("snapshot: %lu records at lsns %llu to %llu in %.1f ms\n", count, first_lsn, lsn, (monotonic_ns() - start) / 1e6);
+    fflush(stdout);
+    return 0;
+}
+
+/**
+* @brief read a whole file into memory
+* @param fd file descriptor
+* @param len set to the file size
+* @return file contents, NULL if error (or if the file is empty)
+*/
+char *read_whole_file(int fd, size_t *len) {
+    struct stat file_stat;
+    *len = 0;
+    if (fstat(fd, &file_stat) < 0) {
+        perror("fstat");
+        return NULL;
+    }
+    if (file_stat.st_size == 0)
+        return NULL;
+
+    char *data = malloc(file_stat.st_size);
+    if (data == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    while (*len < (size_t)file_stat.st_size) {
+        ssize_t n = pread(fd, data + *len, file_stat.st_size - *len, *len);
+        if (n <= 0) {
+            perror("read");
+            free(data);
+            return NULL;
+        }
+        *len += n;
+    }
+    return data;
+}
+
+/**
+* @brief load the snapshot: for every stripe, a STRIPE record with the lsn it was copied at, a REGISTER record
+*        for every user and a CONNECT record for every connected user followed by a PUBLISH record for each of
+*        their files. Snapshots written before STRIPE records existed have the same lsn for every stripe
+* @param stripe_lsns set to the lsn of every stripe in the snapshot, 0 if there isn't one
+* @param records set to the number of records loaded, besides STRIPE records
+* @return 0 if successful
+* @return -1 if error
+*/
+int snapshot_load(unsigned long long stripe_lsns[], unsigned long *records) {
+    *records = 0;
+    for (int i = 0; i < STATE_STRIPES; i++)
+        stripe_lsns[i] = 0;
+    int fd = open(snapshot_filename, O_RDONLY);
+    if (fd < 0) {
+        if (errno == ENOENT)
+            return 0;
+        perror("open");
+        return -1;
+    }
+    size_t len;
+    char *data = read_whole_file(fd, &len);
+    close(fd);
+    if (data == NULL)
+        return 0;
+
+    int rvalue = 0;
+    int striped = 0;
+    size_t used = 0;
+    while (used < len) {
+        struct wal_record record;
+        long record_len = wal_decode(data + used, len - used, &record);
+        if (record_len <= 0) {
+            // snapshots are renamed into place once complete, so this isn't a crash but a damaged file
+            fprintf(stderr, "snapshot: corrupt record at offset %zu\n", used);
+            rvalue = -1;
+            break;
+        }
+        used += record_len;
+
+        if (record.type == WAL_STRIPE) {
+            // users would be in other stripes, with other lsns, if the number of stripes changed
+            int stripe = atoi(record.fields[0]);
+            if (atoi(record.fields[1]) != STATE_STRIPES || stripe < 0 || stripe >= STATE_STRIPES) {
+                fprintf(stderr, "snapshot: stripe %s of %s, the server has %d stripes\n", record.fields[0], record.fields[1], STATE_STRIPES);
+                rvalue = -1;
+                break;
+            }
+            stripe_lsns[stripe] = record.lsn;
+            striped = 1;
+            continue;
+        }
+        if (!striped) {
+            for (int i = 0; i < STATE_STRIPES; i++)
+                stripe_lsns[i] = record.lsn;
+        }
+        (*records)++;
+
+        int apply_rvalue = 0;
+        if (record.type == WAL_REGISTER)
+            apply_rvalue = register_user((char *)record.fields[0]);
+        else if (record.type == WAL_CONNECT)
+            apply_rvalue = connect_user((char *)record.fields[0], (char *)record.fields[1], (char *)record.fields[2]);
+        else if (record.type == WAL_PUBLISH || record.type == WAL_PUBLISH_CONTENT)
+            apply_rvalue = publish_file((char *)record.fields[0], (char *)record.fields[1], (char *)record.fields[2],
+                                        record.type == WAL_PUBLISH_CONTENT ? (char *)record.fields[3] : "");
+        if (apply_rvalue < 0) {
+            rvalue = -1;
+            break;
+        }
+    }
+
+    free(data);
+    return rvalue;
+}
+
+/**
+* @brief apply a logged operation again, through the same functions the handlers use
+* @param record record
+* @return 0 if the operation succeeded like it did when it was logged
+* @return other values from the operation's function otherwise
+*/
+int wal_apply(struct wal_record *record) {
+    char *username = (char *)record->fields[0];
+    switch (record->type) {
+        case WAL_REGISTER:
+            return register_user(username);
+        case WAL_UNREGISTER:
+            return unregister_user(username);
+        case WAL_CONNECT:
+            return connect_user(username, (char *)record->fields[1], (char *)record->fields[2]);
+        case WAL_DISCONNECT:
+            return disconnect_user(username);
+        case WAL_PUBLISH:
+            return publish_file(username, (char *)record->fields[1], (char *)record->fields[2], "");
+        case WAL_PUBLISH_CONTENT:
+            return publish_file(username, (char *)record->fields[1], (char *)record->fields[2], (char *)record->fields[3]);
+        case WAL_STRIPE:
+            // snapshots only, never logged
+            return 0;
+        case WAL_DELETE:
+        default:
+            return delete(username, (char *)record->fields[1]);
+    }
+}
+
+/**
+* @brief replay the records of a log segment newer than the snapshot of their user's stripe (older ones are
+*        left when a crash comes before the segments a snapshot covers are removed)
+* @param sequence sequence number of the segment
+* @param last 1 for the last segment, the only one a crash can leave a record cut short in. It is truncated there
+* @param stripe_lsns lsn of every stripe in the snapshot
+* @param last_lsn raised to the highest lsn in the segment
+* @param replayed incremented for every record replayed
+* @param failed incremented for every replayed record whose operation didn't succeed again
+* @return 0 if successful
+* @return -1 if error
+*/
+int wal_replay_segment(unsigned int sequence, int last, const unsigned long long stripe_lsns[], unsigned long long *last_lsn,
+                       unsigned long *replayed, unsigned long *failed) {
+    char path[WAL_SEGMENT_PATH_SIZE];
+    snprintf(path, sizeof(path), WAL_SEGMENT_PREFIX "%08u" WAL_SEGMENT_SUFFIX, sequence);
+    int fd = open(path, O_RDWR);
+    if (fd < 0) {
+        perror("open");
+        return -1;
+    }
+    size_t len;
+    char *data = read_whole_file(fd, &len);
+
+    int rvalue = 0;
+    size_t used = 0;
+    while (used < len) {
+        struct wal_record record;
+        long record_len = wal_decode(data + used, len - used, &record);
+        if (record_len <= 0 && !last) {
+            // segments are synced before the next one is started, so this isn't a crash but a damaged file
+            fprintf(stderr, "wal: corrupt record at offset %zu of %s\n", used, path);
+            rvalue = -1;
+            break;
+        }
+        if (record_len <= 0) {
+            fprintf(stderr, "wal: %s record at offset %zu of %s, dropping the last %zu bytes\n", record_len == 0 ? "incomplete" : "corrupt", used, path, len - used);
+            if (ftruncate(fd, used) < 0) {
+                perror("ftruncate");
+                rvalue = -1;
+            }
+            break;
+        }
+        used += record_len;
+        if (record.lsn > *last_lsn)
+            *last_lsn = record.lsn;
+        if (record.lsn <= stripe_lsns[user_stripe(record.fields[0]) - stripes])
+            continue;
+        if (wal_apply(&record) != 0)
+            (*failed)++;
+        (*replayed)++;
+    }
+
+    free(data);
+    close(fd);
+    return rvalue;
+}
+
+/**
+* @brief rebuild the server state from the snapshot and the log segments, then start a new segment for new
+*        records
+* @param wal write-ahead log
+* @return 0 if successful
+* @return -1 if error
+*/
+int wal_recover(struct wal *wal) {
+    unsigned long long start = monotonic_ns();
+    unsigned long long stripe_lsns[STATE_STRIPES];
+    unsigned long snapshot_records;
+    if (snapshot_load(stripe_lsns, &snapshot_records) < 0)
+        return -1;
+
+    // the log of a server from before segments is the oldest one
+    char path[WAL_SEGMENT_PATH_SIZE];
+    snprintf(path, sizeof(path), WAL_SEGMENT_PREFIX "%08u" WAL_SEGMENT_SUFFIX, 0);
+    if (rename(wal_filename, path) < 0 && errno != ENOENT) {
+        perror("rename");
+        return -1;
+    }
+    unsigned int *sequences;
+    size_t segments;
+    if (wal_list_segments(&sequences, &segments) < 0)
+        return -1;
+
+    // new records can't reuse the lsn of a stripe in the snapshot, even if the log lost it
+    unsigned long long last_lsn = 0;
+    for (int i = 0; i < STATE_STRIPES; i++) {
+        if (stripe_lsns[i] > last_lsn)
+            last_lsn = stripe_lsns[i];
+    }
+    unsigned long replayed = 0;
+    unsigned long failed = 0;
+    int rvalue = 0;
+    for (size_t i = 0; i < segments && rvalue == 0; i++)
+        rvalue = wal_replay_segment(sequences[i], i == segments - 1, stripe_lsns, &last_lsn, &replayed, &failed);
+    wal->segment = segments > 0 ? sequences[segments - 1] : 0;
+    free(sequences);
+    if (rvalue < 0)
+        return -1;
+
+    wal->next_lsn = last_lsn + 1;
+    wal->durable_lsn = last_lsn;
+    wal->records = replayed;
+    if (wal_open_segment(wal) < 0)
+        return -1;
+    printf("recovered %lu snapshot records and %lu logged operations (%lu failed) up to lsn %llu in %.1f ms\n",
+           snapshot_records, replayed, failed, last_lsn, (monotonic_ns() - start) / 1e6);
+    return 0;
+}
+
+/**
+* @brief write-ahead log writer thread function. Commits whatever is pending as soon as the previous commit
+*        is done, so every record appended during an fsync shares the next one, and every SNAPSHOT_INTERVAL
+*        records starts a segment and has the snapshot thread write a snapshot covering the earlier ones
+* @param wal write-ahead log
+*/
+void *wal_writer_thread(void *wal_ptr) {
+    struct wal *wal = wal_ptr;
+    struct buffer writing = {0};
+    while (1) {
+        pthread_mutex_lock(&wal->lock);
+        while (wal->pending.len == 0)
+            pthread_cond_wait(&wal->pending_ready, &wal->lock);
+        pthread_mutex_unlock(&wal->lock);
+
+        wal_commit(wal, &writing);
+
+        // one snapshot at a time, commits go on meanwhile
+        pthread_mutex_lock(&wal->lock);
+        int snapshot_due = wal->records >= SNAPSHOT_INTERVAL && wal->snapshot_segment == 0;
+        pthread_mutex_unlock(&wal->lock);
+        if (!snapshot_due)
+            continue;
+        int wal_open_segment_rvalue = wal_open_segment(wal);
+        pthread_mutex_lock(&wal->lock);
+        wal->records = 0;
+        if (wal_open_segment_rvalue == 0) {
+            wal->snapshot_segment = wal->segment;
+            pthread_cond_signal(&wal->snapshot_due);
+        }
+        pthread_mutex_unlock(&wal->lock);
+    }
+
+    return NULL;
+}
+
+/**
+* @brief snapshot thread function. Writes a snapshot whenever the writer thread starts a segment for one
+* @param wal write-ahead log
+*/
+void *snapshot_thread(void *wal_ptr) {
+    struct wal *wal = wal_ptr;
+    while (1) {
+        pthread_mutex_lock(&wal->lock);
+        while (wal->snapshot_segment == 0)
+            pthread_cond_wait(&wal->snapshot_due, &wal->lock);
+        unsigned int segment = wal->snapshot_segment;
+        pthread_mutex_unlock(&wal->lock);
+
+        // a failed snapshot leaves its segments, the next one covers them
+        snapshot_write(wal, segment);
+
+        pthread_mutex_lock(&wal->lock);
+        wal->snapshot_segment = 0;
+        pthread_mutex_unlock(&wal->lock);
+    }
+
+    return NULL;
+}
+
+/**
+* @brief get the page of a list a request asks for. v1 requests always get the whole list
+* @param request parsed request
+* @param cursor set to the cursor the page starts at (what it names depends on the list), 0 for the first page
+* @param limit set to the maximum number of entries of the page
+* @return 0 if successful
+* @return -1 if the cursor or the limit aren't numbers
+*/
+int list_page(struct request *request, unsigned long long *cursor, unsigned long *limit) {
+    *cursor = 0;
+    *limit = request->protocol == PROTOCOL_V1 ? V1_LIST_MAX : LIST_PAGE_SIZE;
+
+    char *end;
+    if (request->cursor[0] != '\0') {
+        *cursor = strtoull(request->cursor, &end, 10);
+        if (*end != '\0')
+            return -1;
+    }
+    if (request->limit[0] != '\0') {
+        *limit = strtoul(request->limit, &end, 10);
+        if (*end != '\0')
+            return -1;
+        if (*limit == 0 || *limit > LIST_PAGE_MAX)
+            *limit = LIST_PAGE_MAX;
+    }
+    return 0;
+}
+
+/**
+* @brief add a list page to the reply: its entry count, the entries and, in v2, the cursor of the next page
+*        (0 once the list is over). Entries are encoded into page first, since their count goes before them
+* @param request request being replied
+* @param reply reply to the client
+* @param page encoded entries
+* @param count number of entries
+* @param next_cursor cursor of the next page
+* @param v1_size count size in v1
+* @return 0 if successful
+* @return -1 if error
+*/
+int reply_page(struct request *request, struct buffer *reply, struct buffer *page, unsigned int count, unsigned long long next_cursor, size_t v1_size) {
+    if (reply_count(request, reply, count, v1_size) < 0 || buffer_append(reply, page->data, page->len) < 0)
+        return -1;
+    if (request->protocol == PROTOCOL_V2)
+        return buffer_append_varint(reply, next_cursor);
+    return 0;
+}
+
+/**
+* @brief gets a page of the connected users and sends their info to the client. Users are listed stripe by
+*        stripe, each in connection order, from the connected views of the stripes, so no stripe is locked and
+*        connecting and disconnecting users never wait for the page to be built. The cursor names the stripe and
+*        connection sequence of the first user of the page, so users connecting and disconnecting between pages
+*        don't shift the users that are still to be listed (cursors don't survive a restart)
+* @param request parsed request
+* @param reply reply to the client
+* @return 0 if successful
+* @return -1 if error
+*/
+int list_users(struct request *request, struct buffer *reply) {
+    // check if username exists
+    int check_username_existence_rvalue = check_username_existence(request->username);
+    if (check_username_existence_rvalue == 0) {
+        reply_status(request, reply, 1);
+        return 0;
+    } else if (check_username_existence_rvalue < 0) {
+        reply_status(request, reply, 3);
+        return -1;
+    }
+
+    // check if user is connected
+    int check_user_connection_rvalue = check_user_connection(request->username);
+    if (check_user_connection_rvalue == 0) {
+        reply_status(request, reply, 2);
+        return 0;
+    } else if (check_user_connection_rvalue < 0) {
+        reply_status(request, reply, 3);
         return -1;
     }
 
-    // open username file
-    char *username_filename = malloc(strlen(files_foldername) + strlen(username) + 2);
-    asprintf(&username_filename, "%s%s", files_foldername, username);
-    pthread_mutex_lock(&files_folder_lock);
-    FILE *username_file = fopen(username_filename, "a");
-    free(username_filename);
-    if (username_file == NULL) {
-        pthread_mutex_unlock(&files_folder_lock);
-        perror("fopen");
+    // get requested page
+    unsigned long long cursor;
+    unsigned long limit;
+    if (list_page(request, &cursor, &limit) < 0) {
+        reply_status(request, reply, 3);
         return -1;
     }
+    int first_stripe = cursor & (STATE_STRIPES - 1);
+    unsigned long long first_sequence = cursor >> STATE_STRIPE_BITS;
+
+    // encode the page's users from the cursor's stripe on, starting there at the first user that connected at
+    // or after the cursor's one (views are in connection order, so it is found by binary search)
+    struct buffer page = {.arena = request->arena};
+    unsigned int usernum = 0;
+    unsigned long long next_cursor = 0;
+    for (int i = first_stripe; i < STATE_STRIPES && next_cursor == 0; i++) {
+        struct state_stripe *stripe = &stripes[i];
+        struct connected_view *view = connected_view_acquire(stripe);
+        unsigned long first = 0, last = view->count;
+        while (i == first_stripe && first < last) {
+            unsigned long middle = first + (last - first) / 2;
+            if (view->users[middle].sequence < first_sequence)
+                first = middle + 1;
+            else
+                last = middle;
+        }
+        for (unsigned long j = first; j < view->count; j++) {
+            struct connected_user *user = &view->users[j];
+            if (usernum == limit) {
+                // there are more users after the page, sequences start at 1 so the cursor is never 0
+                next_cursor = user->sequence << STATE_STRIPE_BITS | i;
+                break;
+            }
+            if (reply_string(request, &page, user->username, USERNAME_SIZE) < 0 || reply_string(request, &page, user->ip, IP_ADDRESS_SIZE) < 0 || reply_string(request, &page, user->port, PORT_SIZE) < 0) {
+                connected_view_release(stripe, view);
+                reply_status(request, reply, 3);
+                return -1;
+            }
+            usernum++;
+        }
+        connected_view_release(stripe, view);
+    }
 
-    // write filename;description at the end of the file
-    fprintf(username_file, "%s;%s\n", filename, description);
-    fclose(username_file);
-    pthread_mutex_unlock(&files_folder_lock);
-
-    return 0;
+    // send usernum, userlist and next cursor to client
+    reply_status(request, reply, 0);
+    return reply_page(request, reply, &page, usernum, next_cursor, NUMBER_USERS_SIZE);
 }
 
 /**
-* @brief publish operation handler. Calls publish_file() and sends error code to client
-* @param client_socket socket of client
+* @brief gets a page of the files published by the requested user, optionally only the ones whose name
+*        starts with a prefix, and sends them to the client. The cursor is the publication sequence of the
+*        first file of the page, so files published and deleted between pages don't shift the files that are
+*        still to be listed (cursors don't survive a restart)
+* @param request parsed request
+* @param reply reply to the client
 * @return 0 if successful
 * @return -1 if error
 */
-int handle_publish(int client_socket) {
-    // get datetime from client socket
-    char datetime[DATETIME_SIZE];
-    if (read(client_socket, datetime, DATETIME_SIZE) < 0) {
-        perror("read");
-        return -1;
-    }
-    
-    // get username from client socket
-    char username[USERNAME_SIZE];
-    if (read(client_socket, username, USERNAME_SIZE) < 0) {
-        perror("read");
+int list_content(struct request *request, struct buffer *reply) {
+    // check if username exists
+    int check_username_existence_rvalue = check_username_existence(request->username);
+    if (check_username_existence_rvalue == 0) {
+        reply_status(request, reply, 1);
+        return 0;
+    } else if (check_username_existence_rvalue < 0) {
+        reply_status(request, reply, 3);
         return -1;
     }
 
-    // get filename from client socket
-    char filename[FILENAME_SIZE];
-    if (read(client_socket, filename, FILENAME_SIZE) < 0) {
-        perror("read");
+    // check if user is connected
+    int check_user_connection_rvalue = check_user_connection(request->username);
+    if (check_user_connection_rvalue == 0) {
+        reply_status(request, reply, 2);
+        return 0;
+    } else if (check_user_connection_rvalue < 0) {
+        reply_status(request, reply, 3);
         return -1;
     }
 
-    // get description from client socket
-    char description[DESCRIPTION_SIZE];
-    if (read(client_socket, description, DESCRIPTION_SIZE) < 0) {
-        perror("read");
+    // get requested page
+    unsigned long long cursor;
+    unsigned long limit;
+    if (list_page(request, &cursor, &limit) < 0) {
+        reply_status(request, reply, 3);
         return -1;
     }
+    size_t prefix_len = strlen(request->prefix);
 
-    // attempt to publish file
-    int publish_file_rvalue = publish_file(username, filename, description);
-    
-    // send error code to client
-    if (publish_file_rvalue < 0) {
-        // in case there was an error
-        write(client_socket, "4", EXECUTION_STATUS_SIZE);
-        return -1;
-    } else if (publish_file_rvalue == 1) {
-        // in case username doesn't exist
-        write(client_socket, "1", EXECUTION_STATUS_SIZE);
-    } else if (publish_file_rvalue == 2) {
-        // in case user is not connected
-        write(client_socket, "2", EXECUTION_STATUS_SIZE);
-    } else if (publish_file_rvalue == 3) {
-        // in case file has already been published
-        write(client_socket, "3", EXECUTION_STATUS_SIZE);
-    } else {
-        write(client_socket, "0", EXECUTION_STATUS_SIZE);
+    // check if requested username is connected
+    struct state_stripe *stripe;
+    struct registered_user *user;
+    if (lock_connected_user(request->requested_username, 0, &stripe, &user) != 0) {
+        reply_status(request, reply, 2);
+        return 0;
     }
 
-    printf("OPERATION FROM %s\n", username);
-        
-    // send info to RPC server
-    int rpc_server_result;
-    if (print_file_operation_1(username, "PUBLISH", filename, datetime, &rpc_server_result, clnt) < 0) {
-        clnt_perror(clnt, "list_content");
+    // take the current version of their catalog and what it held at this point: the files appended so far,
+    // without the ones deleted so far. Later changes don't touch that, so it is read with the stripe unlocked
+    struct catalog *catalog = user->catalog;
+    __atomic_add_fetch(&catalog->refs, 1, __ATOMIC_RELAXED);
+    size_t count = catalog->count;
+    unsigned long long changes = catalog->changes;
+    pthread_rwlock_unlock(&stripe->lock);
+
+    // encode the page's files in publication order from the first one published at or after the cursor's one
+    // (found by binary search, deleted files keep their place), skipping the ones that don't match
+    struct buffer page = {.arena = request->arena};
+    unsigned int filenum = 0;
+    unsigned long long next_cursor = 0;
+    size_t first = 0, last = count;
+    while (first < last) {
+        size_t middle = first + (last - first) / 2;
+        if (catalog->files[middle]->sequence < cursor)
+            first = middle + 1;
+        else
+            last = middle;
     }
-    
-    return 0;
+    for (size_t i = first; i < count; i++) {
+        struct published_file *file = catalog->files[i];
+        if (__atomic_load_n(&file->deleted, __ATOMIC_RELAXED) <= changes)
+            continue;
+        if (strncmp(file->filename, request->prefix, prefix_len) != 0)
+            continue;
+        if (filenum == limit) {
+            // there are more matching files after the page, sequences start at 1 so the cursor is never 0
+            next_cursor = file->sequence;
+            break;
+        }
+        if (reply_string(request, &page, file->filename, FILENAME_SIZE) < 0 || reply_string(request, &page, file->description, DESCRIPTION_SIZE) < 0) {
+            catalog_release(catalog);
+            reply_status(request, reply, 3);
+            return -1;
+        }
+        filenum++;
+    }
+
+    catalog_release(catalog);
+
+    // send filenum, filelist and next cursor to client
+    reply_status(request, reply, 0);
+    return reply_page(request, reply, &page, filenum, next_cursor, NUMBER_FILES_SIZE);
 }
 
 /**
-* @brief adds username, ip and port to connected.csv and creates username file in files folder
-* @param client_socket socket of client
+* @brief searches the files published by every connected user. Files match when each query term is one of the
+*        tokens of their filename or description (or starts one, for terms ending in '*'), and are ranked by
+*        where the terms matched, then newest first. The ranking is cut at SEARCH_MAX_RESULTS matches
+* @param request parsed request
+* @param reply reply to the client
 * @return 0 if successful
-* @return 1 if user doesn't exist
-* @return 2 if user is ubt already connected
 * @return -1 if error
 */
-int connect_user(USERNAME username, char ip[IP_ADDRESS_SIZE], char port[PORT_SIZE]) {
-    // check if user is registered
-    int check_username_existence_rvalue = check_username_existence(username);
+int search_files(struct request *request, struct buffer *reply) {
+    // check if username exists
+    int check_username_existence_rvalue = check_username_existence(request->username);
     if (check_username_existence_rvalue == 0) {
-        return 1;
+        reply_status(request, reply, 1);
+        return 0;
     } else if (check_username_existence_rvalue < 0) {
+        reply_status(request, reply, 3);
         return -1;
     }
 
-    // check if user is connected already
-    int check_user_connection_rvalue = check_user_connection(username);
-    if (check_user_connection_rvalue == 1) {
-        return 2;
+    // check if user is connected
+    int check_user_connection_rvalue = check_user_connection(request->username);
+    if (check_user_connection_rvalue == 0) {
+        reply_status(request, reply, 2);
+        return 0;
     } else if (check_user_connection_rvalue < 0) {
+        reply_status(request, reply, 3);
         return -1;
     }
 
-    // write client's username, ip and port to connected.csv
-    pthread_mutex_lock(&connected_file_lock);
-    FILE *connected_file = fopen(connected_filename, "a");
-    if (connected_file == NULL) {
-        pthread_mutex_unlock(&connected_file_lock);
-        perror("fopen");
+    // get requested page, only the best SEARCH_MAX_RESULTS matches are ranked. One match past the page is
+    // ranked too, to know if there are more
+    unsigned long long cursor;
+    unsigned long limit;
+    if (list_page(request, &cursor, &limit) < 0) {
+        reply_status(request, reply, 3);
         return -1;
     }
-    fprintf(connected_file, "%s;%s;%s\n", username, ip, port);
-    fclose(connected_file);
-    pthread_mutex_unlock(&connected_file_lock);
+    struct search_term terms[SEARCH_MAX_TERMS];
+    int term_count = search_parse_query(request->query, terms);
+    struct search_heap heap = {NULL, 0, 0};
+    if (cursor < SEARCH_MAX_RESULTS && term_count > 0) {
+        heap.capacity = limit < SEARCH_MAX_RESULTS - cursor ? cursor + limit + 1 : SEARCH_MAX_RESULTS;
+        heap.results = arena_alloc(request->arena, heap.capacity * sizeof(struct search_result));
+        if (heap.results == NULL) {
+            reply_status(request, reply, 3);
+            return -1;
+        }
+    }
 
-    // create or clear username file in files folder
-    char *username_filename = malloc(strlen(files_foldername) + strlen(username) + 2);
-    asprintf(&username_filename, "%s%s", files_foldername, username);
-    pthread_mutex_lock(&files_folder_lock);
-    FILE *username_file = fopen(username_filename, "w");
-    free(username_filename);
-    if (username_file == NULL) {
-        pthread_mutex_unlock(&files_folder_lock);
-        perror("fopen");
-        return -1;
+    // rank the matches of every stripe, each one read locked while its index is walked
+    for (int i = 0; i < STATE_STRIPES && heap.capacity > 0; i++) {
+        pthread_rwlock_rdlock(&stripes[i].lock);
+        int search_stripe_rvalue = search_stripe(&stripes[i], terms, term_count, &heap, request->arena);
+        pthread_rwlock_unlock(&stripes[i].lock);
+        if (search_stripe_rvalue < 0) {
+            reply_status(request, reply, 3);
+            return -1;
+        }
+    }
+    qsort(heap.results, heap.count, sizeof(struct search_result), search_result_compare);
+
+    // encode the page's matches
+    struct buffer page = {.arena = request->arena};
+    unsigned int resultnum = 0;
+    for (unsigned long long i = cursor; i < heap.count && resultnum < limit; i++) {
+        struct search_result *result = &heap.results[i];
+        if (reply_string(request, &page, result->username, USERNAME_SIZE) < 0 || reply_string(request, &page, result->filename, FILENAME_SIZE) < 0 || reply_string(request, &page, result->description, DESCRIPTION_SIZE) < 0) {
+            reply_status(request, reply, 3);
+            return -1;
+        }
+        resultnum++;
     }
-    fclose(username_file);
-    pthread_mutex_unlock(&files_folder_lock);
+    unsigned long long next_cursor = 0;
+    if (cursor + resultnum < heap.count)
+        next_cursor = cursor + resultnum;
 
+    // send resultnum, results and next cursor to client
+    reply_status(request, reply, 0);
+    return reply_page(request, reply, &page, resultnum, next_cursor, NUMBER_FILES_SIZE);
+}
+
+/**
+* @brief add a publisher to a SOURCES page: username, ip, port and the filename they published the content as
+* @param request request being replied
+* @param page page being encoded
+* @param user publisher
+* @param file published file
+* @return 0 if successful
+* @return -1 if error
+*/
+int reply_source(struct request *request, struct buffer *page, struct registered_user *user, struct published_file *file) {
+    if (reply_string(request, page, user->username, USERNAME_SIZE) < 0 || reply_string(request, page, user->ip, IP_ADDRESS_SIZE) < 0
+        || reply_string(request, page, user->port, PORT_SIZE) < 0 || reply_string(request, page, file->filename, FILENAME_SIZE) < 0)
+        return -1;
     return 0;
 }
 
 /**
-* @brief connect operation handler. Calls connect_user() and sends error code to client
-* @param client_socket socket of client
+* @brief gets the content id of a file published by the requested user and every connected user publishing the
+*        same content, so the client can download it from all of them at once. The requested user comes first,
+*        then the others stripe by stripe, each stripe read locked while its content index is read. The list is
+*        cut at SOURCES_MAX publishers, and only holds the requested user if the content is unknown
+* @param request parsed request
+* @param reply reply to the client
 * @return 0 if successful
 * @return -1 if error
 */
-int handle_connect(int client_socket) {
-    // get datetime from client socket
-    char datetime[DATETIME_SIZE];
-    if (read(client_socket, datetime, DATETIME_SIZE) < 0) {
-        perror("read");
+int list_sources(struct request *request, struct buffer *reply) {
+    // check if username exists
+    int check_username_existence_rvalue = check_username_existence(request->username);
+    if (check_username_existence_rvalue == 0) {
+        reply_status(request, reply, 1);
+        return 0;
+    } else if (check_username_existence_rvalue < 0) {
+        reply_status(request, reply, 4);
         return -1;
     }
-    
-    // get username from client socket
-    char username[USERNAME_SIZE];
-    if (read(client_socket, username, USERNAME_SIZE) < 0) {
-        perror("read");
+
+    // check if user is connected
+    int check_user_connection_rvalue = check_user_connection(request->username);
+    if (check_user_connection_rvalue == 0) {
+        reply_status(request, reply, 2);
+        return 0;
+    } else if (check_user_connection_rvalue < 0) {
+        reply_status(request, reply, 4);
         return -1;
     }
 
-    // save client's ip in a variable
-    char client_ip[IP_ADDRESS_SIZE];
-    struct sockaddr_in addr;
-    socklen_t addr_len = sizeof(addr);
-
-    // get socket ip
-    if (getpeername(client_socket, (struct sockaddr *)&addr, &addr_len) == -1) {
-        perror("getpeername");
+    // check if requested username is connected and published the file
+    struct state_stripe *stripe;
+    struct registered_user *user;
+    if (lock_connected_user(request->requested_username, 0, &stripe, &user) != 0) {
+        reply_status(request, reply, 3);
+        return 0;
+    }
+    struct published_file *file = file_index_lookup(&user->published, request->filename);
+    if (file == NULL) {
+        pthread_rwlock_unlock(&stripe->lock);
+        reply_status(request, reply, 3);
+        return 0;
+    }
+    char content[CONTENT_SIZE];
+    strcpy(content, file->content);
+    struct buffer page = {.arena = request->arena};
+    int failed = reply_source(request, &page, user, file) < 0;
+    pthread_rwlock_unlock(&stripe->lock);
+    unsigned int sourcenum = 1;
+
+    // every other publisher of the content
+    for (int i = 0; i < STATE_STRIPES && content[0] != '\0' && sourcenum < SOURCES_MAX && !failed; i++) {
+        pthread_rwlock_rdlock(&stripes[i].lock);
+        for (struct published_file *other = content_index_lookup(&stripes[i].contents, content); other != NULL && sourcenum < SOURCES_MAX && !failed; other = other->content_next) {
+            if (strcmp(other->owner->username, request->requested_username) == 0)
+                continue;
+            failed = reply_source(request, &page, other->owner, other) < 0;
+            sourcenum++;
+        }
+        pthread_rwlock_unlock(&stripes[i].lock);
+    }
+    if (failed) {
+        reply_status(request, reply, 4);
         return -1;
     }
 
-    // convert ip to decimal dot notation
-    strcpy(client_ip, inet_ntoa(addr.sin_addr));
-    if (strcmp(client_ip, "0.0.0.0") == 0) {
-        perror("inet_ntoa");
+    // send content, sourcenum and sources to client, in a single page
+    reply_status(request, reply, 0);
+    if (reply_string(request, reply, content, CONTENT_SIZE) < 0)
         return -1;
+    return reply_page(request, reply, &page, sourcenum, 0, NUMBER_USERS_SIZE);
+}
+
+const double metrics_quantiles[] = {0.5, 0.9, 0.99, 0.999, 1};
+
+/**
+* @brief add a latency histogram to the metrics text, as a summary (its quantiles, sum and count) in seconds
+* @param text metrics text
+* @param name metric name
+* @param labels labels of the metric (name="value" pairs, separated by commas), empty if none
+* @param histogram histogram
+* @return 0 if successful
+* @return -1 if error
+*/
+int metrics_format_summary(struct buffer *text, const char *name, const char *labels, struct histogram *histogram) {
+    unsigned long count = histogram_count(histogram);
+    const char *separator = labels[0] == '\0' ? "" : ",";
+    for (size_t i = 0; i < sizeof(metrics_quantiles) / sizeof(metrics_quantiles[0]); i++) {
+        double quantile = metrics_quantiles[i];
+        if (count == 0 && buffer_printf(text, "%s{%s%squantile=\"%g\"} NaN\n", name, labels, separator, quantile) < 0)
+            return -1;
+        if (count > 0 && buffer_printf(text, "%s{%s%squantile=\"%g\"} %.9f\n", name, labels, separator, quantile, histogram_quantile(histogram, count, quantile) / 1e9) < 0)
+            return -1;
     }
+    const char *open = labels[0] == '\0' ? "" : "{";
+    const char *close = labels[0] == '\0' ? "" : "}";
+    if (buffer_printf(text, "%s_sum%s%s%s %.9f\n", name, open, labels, close, histogram->sum_ns / 1e9) < 0)
+        return -1;
+    return buffer_printf(text, "%s_count%s%s%s %lu\n", name, open, labels, close, count);
+}
 
-    // get port from client socket
-    char port[PORT_SIZE];
-    if (read(client_socket, port, PORT_SIZE) < 0) {
-        perror("read");
+/**
+* @brief write every metric in the Prometheus text format: the shards of every thread added up, and the depth
+*        of the queues between threads
+* @param text metrics text
+* @param arena arena the totals are added up in
+* @return 0 if successful
+* @return -1 if error
+*/
+int metrics_format(struct buffer *text, struct arena *arena) {
+    struct metrics_shard *total = arena_alloc(arena, sizeof(struct metrics_shard));
+    if (total == NULL)
         return -1;
+    memset(total, 0, sizeof(struct metrics_shard));
+    pthread_mutex_lock(&metrics_shards_lock);
+    struct metrics_shard *shard = metrics_shards;
+    pthread_mutex_unlock(&metrics_shards_lock);
+    for (; shard != NULL; shard = shard->next) {
+        for (int i = 0; i < METRICS_OPCODES; i++) {
+            for (int j = 0; j < METRICS_STATUSES; j++)
+                total->requests[i][j] += __atomic_load_n(&shard->requests[i][j], __ATOMIC_RELAXED);
+            histogram_merge(&total->latency[i], &shard->latency[i]);
+        }
+        total->malformed += __atomic_load_n(&shard->malformed, __ATOMIC_RELAXED);
+        total->audit_ring += __atomic_load_n(&shard->audit_ring, __ATOMIC_RELAXED);
+        histogram_merge(&total->audit_rpc, &shard->audit_rpc);
+        histogram_merge(&total->audit_wait, &shard->audit_wait);
+        histogram_merge(&total->wal_commit, &shard->wal_commit);
     }
 
-    // attempt to connect
-    int connect_rvalue = connect_user(username, client_ip, port);
+    // requests by operation
+    int failed = buffer_printf(text, "# HELP server_requests_total Requests handled, by operation and reply status.\n# TYPE server_requests_total counter\n");
+    const char *names[METRICS_OPCODES];
+    for (int i = 0; i < METRICS_OPCODES; i++) {
+        names[i] = __atomic_load_n(&metrics_operation_names[i], __ATOMIC_RELAXED);
+        for (int j = 0; j < METRICS_STATUSES && names[i] != NULL; j++) {
+            if (total->requests[i][j] > 0)
+                failed |= buffer_printf(text, "server_requests_total{operation=\"%s\",status=\"%d\"} %lu\n", names[i], j, total->requests[i][j]);
+        }
+    }
+    failed |= buffer_printf(text, "# HELP server_malformed_requests_total Requests that couldn't be parsed.\n# TYPE server_malformed_requests_total counter\nserver_malformed_requests_total %lu\n", total->malformed);
+    failed |= buffer_printf(text, "# HELP server_request_duration_seconds Time handling a request, until its reply is ready.\n# TYPE server_request_duration_seconds summary\n");
+    for (int i = 0; i < METRICS_OPCODES; i++) {
+        if (names[i] == NULL)
+            continue;
+        char labels[OPERATION_SIZE];
+        snprintf(labels, sizeof(labels), "operation=\"%s\"", names[i]);
+        failed |= metrics_format_summary(text, "server_request_duration_seconds", labels, &total->latency[i]);
+    }
 
-    // send execution status
-    if (connect_rvalue < 0) {
-        // in case there was an error
-        write(client_socket, "3", EXECUTION_STATUS_SIZE);
+    // audit queue and RPC calls
+    pthread_mutex_lock(&audit.lock);
+    unsigned long enqueued = audit.enqueued, sent = audit.sent, dropped = audit.dropped, failed_records = audit.failed, batches = audit.batches;
+    unsigned long reconnects = audit.reconnects;
+    int audit_depth = audit.count;
+    pthread_mutex_unlock(&audit.lock);
+    failed |= buffer_printf(text, "# HELP server_audit_records_total Operations queued for the RPC server, and what became of them.\n# TYPE server_audit_records_total counter\n"
+                            "server_audit_records_total{result=\"queued\"} %lu\nserver_audit_records_total{result=\"sent\"} %lu\n"
+                            "server_audit_records_total{result=\"dropped\"} %lu\nserver_audit_records_total{result=\"failed\"} %lu\n",
+                            enqueued, sent, dropped, failed_records);
+    failed |= buffer_printf(text, "# HELP server_audit_batches_total RPC calls that sent an audit batch.\n# TYPE server_audit_batches_total counter\nserver_audit_batches_total %lu\n", batches);
+    failed |= buffer_printf(text, "# HELP server_audit_ring_records_total Operations written to the shared-memory ring of a co-located RPC server instead.\n# TYPE server_audit_ring_records_total counter\nserver_audit_ring_records_total %lu\n", total->audit_ring);
+    failed |= buffer_printf(text, "# HELP server_audit_rpc_reconnects_total RPC clients connected again after the RPC server went away.\n# TYPE server_audit_rpc_reconnects_total counter\nserver_audit_rpc_reconnects_total %lu\n", reconnects);
+    failed |= buffer_printf(text, "# HELP server_audit_queue_depth Operations waiting for the RPC server.\n# TYPE server_audit_queue_depth gauge\nserver_audit_queue_depth %d\n", audit_depth);
+    failed |= buffer_printf(text, "# HELP server_audit_queue_capacity Operations the audit queue holds before dropping them.\n# TYPE server_audit_queue_capacity gauge\nserver_audit_queue_capacity %d\n", audit.capacity);
+    failed |= buffer_printf(text, "# HELP server_audit_queue_wait_seconds Time an operation waits in the audit queue.\n# TYPE server_audit_queue_wait_seconds summary\n");
+    failed |= metrics_format_summary(text, "server_audit_queue_wait_seconds", "", &total->audit_wait);
+    failed |= buffer_printf(text, "# HELP server_audit_rpc_duration_seconds Time of the RPC call sending an audit batch.\n# TYPE server_audit_rpc_duration_seconds summary\n");
+    failed |= metrics_format_summary(text, "server_audit_rpc_duration_seconds", "", &total->audit_rpc);
+
+    // write-ahead log
+    pthread_mutex_lock(&wal.lock);
+    size_t wal_pending = wal.pending.len;
+    unsigned long long wal_waiting = wal.next_lsn - 1 - wal.durable_lsn;
+    unsigned long wal_commits = wal.commits;
+    pthread_mutex_unlock(&wal.lock);
+    failed |= buffer_printf(text, "# HELP server_wal_pending_bytes Log bytes waiting for the writer thread.\n# TYPE server_wal_pending_bytes gauge\nserver_wal_pending_bytes %zu\n", wal_pending);
+    failed |= buffer_printf(text, "# HELP server_wal_pending_records Log records appended and not durable yet.\n# TYPE server_wal_pending_records gauge\nserver_wal_pending_records %llu\n", wal_waiting);
+    failed |= buffer_printf(text, "# HELP server_wal_commits_total Log fsyncs, each one commits a group of records.\n# TYPE server_wal_commits_total counter\nserver_wal_commits_total %lu\n", wal_commits);
+    failed |= buffer_printf(text, "# HELP server_wal_commit_duration_seconds Time writing and fsyncing a group of log records.\n# TYPE server_wal_commit_duration_seconds summary\n");
+    failed |= metrics_format_summary(text, "server_wal_commit_duration_seconds", "", &total->wal_commit);
+
+    // worker pool, empty in epoll mode
+    pthread_mutex_lock(&pending_sockets.lock);
+    int socket_depth = pending_sockets.count, busy_workers = pending_sockets.busy_workers;
+    pthread_mutex_unlock(&pending_sockets.lock);
+    failed |= buffer_printf(text, "# HELP server_socket_queue_depth Accepted connections and readable sessions waiting for a worker thread.\n# TYPE server_socket_queue_depth gauge\nserver_socket_queue_depth %d\n", socket_depth);
+    failed |= buffer_printf(text, "# HELP server_socket_queue_capacity Petitions the socket queue holds.\n# TYPE server_socket_queue_capacity gauge\nserver_socket_queue_capacity %d\n", pending_sockets.capacity);
+    failed |= buffer_printf(text, "# HELP server_workers_busy Worker threads handling a connection.\n# TYPE server_workers_busy gauge\nserver_workers_busy %d\n", busy_workers);
+    failed |= buffer_printf(text, "# HELP server_workers Worker threads.\n# TYPE server_workers gauge\nserver_workers %d\n", pending_sockets.workers);
+
+    return failed ? -1 : 0;
+}
+
+/**
+* @brief stats operation handler. Sends the metrics text to the client, one list entry per line
+* @param request parsed request
+* @param reply reply to the client
+* @return 0 if successful
+* @return -1 if error
+*/
+int handle_stats(struct request *request, struct buffer *reply) {
+    struct buffer text = {.arena = request->arena};
+    struct buffer page = {.arena = request->arena};
+    unsigned int linenum = 0;
+    int failed = metrics_format(&text, request->arena);
+    for (size_t start = 0; start < text.len && !failed; linenum++) {
+        char *end = memchr(text.data + start, '\n', text.len - start);
+        *end = '\0';
+        failed = reply_string(request, &page, text.data + start, STATS_LINE_SIZE) < 0;
+        start = end - text.data + 1;
+    }
+    if (failed) {
+        reply_status(request, reply, 1);
         return -1;
-    } else if (connect_rvalue == 1) {
-        // in case username doesn't exist
-        write(client_socket, "1", EXECUTION_STATUS_SIZE);
-    } else if (connect_rvalue == 2) {
-        // in case user is already connected
-        write(client_socket, "2", EXECUTION_STATUS_SIZE);
-    } else {
-        write(client_socket, "0", EXECUTION_STATUS_SIZE);
     }
 
-    printf("OPERATION FROM %s\n", username);
-        
-    // send info to RPC server
-    int rpc_server_result;
-    if (print_operation_1(username, "CONNECT", datetime, &rpc_server_result, clnt) < 0) {
-        clnt_perror(clnt, "list_content");
+    // send linenum and lines to client, in a single page
+    reply_status(request, reply, 0);
+    return reply_page(request, reply, &page, linenum, 0, NUMBER_FILES_SIZE);
+}
+
+// request fields, in the order clients send them after the operation name
+enum request_field {
+    FIELD_DATETIME,
+    FIELD_USERNAME,
+    FIELD_REQUESTED_USERNAME,
+    FIELD_FILENAME,
+    FIELD_DESCRIPTION,
+    FIELD_PORT,
+    FIELD_CURSOR,
+    FIELD_LIMIT,
+    FIELD_PREFIX,
+    FIELD_QUERY,
+    FIELD_CONTENT
+};
+
+#define MAX_REQUEST_FIELDS 6
+
+// v2 opcodes, sent as the first byte of every request
+enum opcode {
+    OP_HELLO = 0,  // never a valid first byte in v1, so it also tells both protocols apart
+    OP_REGISTER,
+    OP_UNREGISTER,
+    OP_CONNECT,
+    OP_PUBLISH,
+    OP_DISCONNECT,
+    OP_DELETE,
+    OP_LIST_USERS,
+    OP_LIST_CONTENT,
+    OP_SEARCH,
+    OP_STATS,
+    OP_SOURCES
+};
+
+// what is sent to the RPC server about an operation
+enum audit {
+    AUDIT_NONE,  // nothing, nor printed
+    AUDIT_OPERATION,  // username, operation and datetime
+    AUDIT_FILENAME  // the filename too
+};
+
+// operation supported by the server
+struct operation {
+    enum opcode opcode;
+    const char *name;
+    int (*handler)(struct request *request, struct buffer *reply);
+    enum audit audit;
+    int v1_field_count;  // fields past it are only sent in v2, v1 requests leave them empty
+    int field_count;
+    enum request_field fields[MAX_REQUEST_FIELDS];
+};
+
+const struct operation operations[] = {
+    {OP_REGISTER, "REGISTER", handle_register, AUDIT_OPERATION, 2, 2, {FIELD_DATETIME, FIELD_USERNAME}},
+    {OP_UNREGISTER, "UNREGISTER", handle_unregister, AUDIT_OPERATION, 2, 2, {FIELD_DATETIME, FIELD_USERNAME}},
+    {OP_CONNECT, "CONNECT", handle_connect, AUDIT_OPERATION, 3, 3, {FIELD_DATETIME, FIELD_USERNAME, FIELD_PORT}},
+    {OP_PUBLISH, "PUBLISH", handle_publish, AUDIT_FILENAME, 4, 5, {FIELD_DATETIME, FIELD_USERNAME, FIELD_FILENAME, FIELD_DESCRIPTION, FIELD_CONTENT}},
+    {OP_DISCONNECT, "DISCONNECT", handle_disconnect, AUDIT_OPERATION, 2, 2, {FIELD_DATETIME, FIELD_USERNAME}},
+    {OP_DELETE, "DELETE", handle_delete, AUDIT_FILENAME, 3, 3, {FIELD_DATETIME, FIELD_USERNAME, FIELD_FILENAME}},
+    {OP_LIST_USERS, "LIST_USERS", list_users, AUDIT_OPERATION, 2, 4, {FIELD_DATETIME, FIELD_USERNAME, FIELD_CURSOR, FIELD_LIMIT}},
+    {OP_LIST_CONTENT, "LIST_CONTENT", list_content, AUDIT_OPERATION, 3, 6, {FIELD_DATETIME, FIELD_USERNAME, FIELD_REQUESTED_USERNAME, FIELD_CURSOR, FIELD_LIMIT, FIELD_PREFIX}},
+    {OP_SEARCH, "SEARCH", search_files, AUDIT_OPERATION, 3, 5, {FIELD_DATETIME, FIELD_USERNAME, FIELD_QUERY, FIELD_CURSOR, FIELD_LIMIT}},
+    {OP_STATS, "STATS", handle_stats, AUDIT_NONE, 1, 1, {FIELD_DATETIME}},
+    {OP_SOURCES, "SOURCES", list_sources, AUDIT_FILENAME, 4, 4, {FIELD_DATETIME, FIELD_USERNAME, FIELD_REQUESTED_USERNAME, FIELD_FILENAME}},
+};
+
+/**
+* @brief get the request member a field is stored in
+* @param request request
+* @param field field
+* @param size set to the size of the member
+* @return member
+*/
+char *request_field_member(struct request *request, enum request_field field, size_t *size) {
+    switch (field) {
+        case FIELD_DATETIME:
+            *size = DATETIME_SIZE;
+            return request->datetime;
+        case FIELD_USERNAME:
+            *size = USERNAME_SIZE;
+            return request->username;
+        case FIELD_REQUESTED_USERNAME:
+            *size = USERNAME_SIZE;
+            return request->requested_username;
+        case FIELD_FILENAME:
+            *size = FILENAME_SIZE;
+            return request->filename;
+        case FIELD_DESCRIPTION:
+            *size = DESCRIPTION_SIZE;
+            return request->description;
+        case FIELD_CURSOR:
+            *size = CURSOR_SIZE;
+            return request->cursor;
+        case FIELD_LIMIT:
+            *size = CURSOR_SIZE;
+            return request->limit;
+        case FIELD_PREFIX:
+            *size = FILENAME_SIZE;
+            return request->prefix;
+        case FIELD_QUERY:
+            *size = DESCRIPTION_SIZE;
+            return request->query;
+        case FIELD_CONTENT:
+            *size = CONTENT_SIZE;
+            return request->content;
+        case FIELD_PORT:
+        default:
+            *size = PORT_SIZE;
+            return request->port;
     }
-    
-    return 0;
 }
 
 /**
-* @brief deletes a file from the username
-* @param client_socket socket of client
-* @return 0 if successful
-* @return 1 if user doesn't exist
-* @return 2 if user is not connected
-* @return 3 if the file has not been published by user
-* @return -1 if error
+* @brief find a '\0' terminated string at the start of data
+* @param data received bytes
+* @param len number of received bytes
+* @param size maximum string size, including the '\0'
+* @return string length + 1 if complete
+* @return 0 if more bytes are needed
+* @return -1 if the string doesn't fit in size
 */
-int delete(USERNAME username, FILENAME filename) {
-    // check if user exists
-    int check_username_existence_rvalue = check_username_existence(username);
-    if (check_username_existence_rvalue == 0) {
-        return 1;
-    } else if (check_username_existence_rvalue < 0) {
+int parse_string(const char *data, size_t len, size_t size) {
+    const char *end = memchr(data, '\0', len < size ? len : size);
+    if (end != NULL)
+        return end - data + 1;
+    return len < size ? 0 : -1;
+}
+
+/**
+* @brief parse a varint at the start of data
+* @param data received bytes
+* @param len number of received bytes
+* @param value set to the parsed value
+* @return varint size if complete
+* @return 0 if more bytes are needed
+* @return -1 if the varint is too long
+*/
+int parse_varint(const unsigned char *data, size_t len, unsigned int *value) {
+    *value = 0;
+    for (size_t i = 0; i < VARINT_MAX_SIZE; i++) {
+        if (i == len)
+            return 0;
+        *value |= (unsigned int)(data[i] & 0x7F) << (7 * i);
+        if ((data[i] & 0x80) == 0)
+            return i + 1;
+    }
+    return -1;
+}
+
+/**
+* @brief find the operation with a given opcode
+* @param opcode opcode
+* @return operation, NULL if there isn't one
+*/
+const struct operation *find_operation(enum opcode opcode) {
+    for (size_t i = 0; i < sizeof(operations) / sizeof(operations[0]); i++) {
+        if (operations[i].opcode == opcode)
+            return &operations[i];
+    }
+    return NULL;
+}
+
+/**
+* @brief parse a v1 request from the bytes received so far. Every field is a '\0' terminated string,
+*        so requests can be parsed no matter how the client split them into writes
+* @param data received bytes
+* @param len number of received bytes
+* @param request request to fill
+* @return number of bytes used by the request if complete
+* @return 0 if more bytes are needed
+* @return -1 if the request is malformed
+*/
+int parse_request_v1(const char *data, size_t len, struct request *request) {
+    // operation name
+    int used = parse_string(data, len, OPERATION_SIZE);
+    if (used <= 0)
+        return used;
+    request->operation = NULL;
+    for (size_t i = 0; i < sizeof(operations) / sizeof(operations[0]); i++) {
+        if (strcmp(data, operations[i].name) == 0)
+            request->operation = &operations[i];
+    }
+    if (request->operation == NULL) {
+        printf("INCORRECT OPERATION\n");
         return -1;
     }
 
-    // check if user is connected
-    int check_user_connection_rvalue = check_user_connection(username);
-    if (check_user_connection_rvalue == 0) {
-        return 2;
-    } else if (check_user_connection_rvalue < 0) {
+    // operation fields
+    for (int i = 0; i < request->operation->v1_field_count; i++) {
+        size_t size;
+        char *member = request_field_member(request, request->operation->fields[i], &size);
+        int field_len = parse_string(data + used, len - used, size);
+        if (field_len <= 0)
+            return field_len;
+        memcpy(member, data + used, field_len);
+        used += field_len;
+    }
+    for (int i = request->operation->v1_field_count; i < request->operation->field_count; i++) {
+        size_t size;
+        request_field_member(request, request->operation->fields[i], &size)[0] = '\0';
+    }
+
+    return used;
+}
+
+/**
+* @brief parse a v2 request from the bytes received so far: an opcode byte, then every field
+*        of the operation as a varint length followed by that many bytes
+* @param data received bytes
+* @param len number of received bytes
+* @param request request to fill
+* @return number of bytes used by the request if complete
+* @return 0 if more bytes are needed
+* @return -1 if the request is malformed
+*/
+int parse_request_v2(const char *data, size_t len, struct request *request) {
+    if (len == 0)
+        return 0;
+    request->operation = find_operation((unsigned char)data[0]);
+    if (request->operation == NULL) {
+        printf("INCORRECT OPERATION\n");
         return -1;
     }
+    size_t used = 1;
 
-    // check if the file has been published by the user
-    int check_published_file_existance_rvalue = check_published_file_existance(username, filename);
-    if (check_published_file_existance_rvalue == 0) {
-        return 3;
-    } else if (check_published_file_existance_rvalue < 0) {
+    for (int i = 0; i < request->operation->field_count; i++) {
+        unsigned int field_len;
+        int varint_len = parse_varint((const unsigned char *)data + used, len - used, &field_len);
+        if (varint_len <= 0)
+            return varint_len;
+
+        size_t size;
+        char *member = request_field_member(request, request->operation->fields[i], &size);
+        if (field_len >= size)
+            return -1;
+        if (len - used - varint_len < field_len)
+            return 0;
+        used += varint_len;
+        memcpy(member, data + used, field_len);
+        member[field_len] = '\0';
+        used += field_len;
+    }
+
+    return used;
+}
+
+/**
+* @brief parse a request from the bytes received so far
+* @param data received bytes
+* @param len number of received bytes
+* @param protocol protocol of the connection
+* @param request request to fill
+* @return number of bytes used by the request if complete
+* @return 0 if more bytes are needed
+* @return -1 if the request is malformed
+*/
+int parse_request(const char *data, size_t len, int protocol, struct request *request) {
+    request->protocol = protocol;
+    if (protocol == PROTOCOL_V2)
+        return parse_request_v2(data, len, request);
+    return parse_request_v1(data, len, request);
+}
+
+/**
+* @brief parse a HELLO (opcode byte, varint with the highest version the client supports) and
+*        add the reply (opcode byte, varint with the version both sides will use)
+* @param data received bytes
+* @param len number of received bytes
+* @param protocol set to the negotiated protocol
+* @param reply reply to the client
+* @return number of bytes used by the HELLO if complete
+* @return 0 if more bytes are needed
+* @return -1 if the HELLO is malformed
+*/
+int parse_hello(const char *data, size_t len, int *protocol, struct buffer *reply) {
+    unsigned int client_version;
+    int varint_len = parse_varint((const unsigned char *)data + 1, len - 1, &client_version);
+    if (varint_len <= 0)
+        return varint_len;
+    if (client_version < PROTOCOL_V1)
         return -1;
+
+    *protocol = client_version < PROTOCOL_VERSION ? client_version : PROTOCOL_VERSION;
+    char opcode = OP_HELLO;
+    if (buffer_append(reply, &opcode, 1) < 0 || buffer_append_varint(reply, *protocol) < 0)
+        return -1;
+    return 1 + varint_len;
+}
+
+/**
+* @brief log a completed request and queue it for the RPC server. Operations reach it in the order they are
+*        queued through the ring and through RPC, but not across both: records left in the ring when the server
+*        falls back to RPC can be written after later ones sent over RPC
+* @param request completed request
+*/
+void report_request(struct request *request) {
+    if (request->operation->audit == AUDIT_NONE)
+        return;
+    printf("OPERATION FROM %s\n", request->username);
+    if (request->datetime[0] == '\0')
+        server_datetime(request->datetime);
+
+    // hand info to a co-located RPC server through shared memory, or queue it to send over RPC
+    const char *filename = request->operation->audit == AUDIT_FILENAME ? request->filename : "";
+    if (audit_ring_push(request->username, request->operation->name, filename, request->datetime) == 0) {
+        struct metrics_shard *shard = metrics_shard();
+        if (shard != NULL)
+            metrics_add(&shard->audit_ring, 1);
+        return;
     }
+    audit_queue_push(&audit, request->username, request->operation->name, filename, request->datetime);
+}
 
-    // remove the file from the user file
-    // open the user file in files
-    char *username_filename = malloc(strlen(files_foldername) + strlen(username) + 2);
-    asprintf(&username_filename, "%s%s", files_foldername, username);
-    pthread_mutex_lock(&files_folder_lock);
-    FILE *username_file = fopen(username_filename, "r");
-    if (username_file == NULL) {
-        pthread_mutex_unlock(&files_folder_lock);
-        perror("fopen");
+// client connection and the state of its requests. v1 connections carry a single request, v2 connections are
+// sessions carrying any number of them, possibly pipelined, and replied in order
+struct connection {
+    int socket;
+    char ip[IP_ADDRESS_SIZE];
+    char data[REQUEST_BUFFER_SIZE];  // bytes received and not parsed yet
+    size_t len;
+    int protocol;  // 0 until the first byte tells whether the client negotiates v2 with HELLO
+    struct request request;
+    struct buffer reply;
+    size_t reply_sent;
+    int peer_closed;  // 1 once the client has closed its side
+    int closing;  // 1 once no more requests will be handled, the connection closes when the reply is sent
+    unsigned long long commit_lsn;  // the reply can't be sent until the log is durable up to it
+    unsigned int events;  // epoll events the connection is registered for
+    struct connection *prev_waiting;  // list of epoll connections waiting for a log commit
+    struct connection *next_waiting;
+    int waiting;  // 1 while in that list
+};
+
+/**
+* @brief initialize a connection, getting the client's ip from the socket
+* @param connection connection to initialize
+* @param socket client socket
+* @return 0 if successful
+* @return -1 if error
+*/
+int connection_init(struct connection *connection, int socket) {
+    memset(connection, 0, sizeof(struct connection));
+    connection->socket = socket;
+
+    // get socket ip
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    if (getpeername(socket, (struct sockaddr *)&addr, &addr_len) == -1) {
+        perror("getpeername");
         return -1;
     }
 
-    // temp file to edit user file
-    char *temp_file = malloc(strlen(files_foldername) + strlen(username) + strlen(filename) + 3);
-    asprintf(&temp_file, "%s%s_%s", files_foldername, username, filename);
-    FILE *temp_username_file = fopen(temp_file, "w");
-    if (temp_username_file == NULL) {
-        pthread_mutex_unlock(&files_folder_lock);
-        perror("fopen");
+    // convert ip to decimal dot notation (inet_ntoa isn't thread safe)
+    if (inet_ntop(AF_INET, &addr.sin_addr, connection->ip, IP_ADDRESS_SIZE) == NULL) {
+        perror("inet_ntop");
         return -1;
     }
 
-    // go line by line in username file and check if the line contains the filename
-    const long MAXLINE = 4096;
-    char line[MAXLINE];
-    char modified_line[MAXLINE];
-    while (fgets(line, MAXLINE, username_file) != NULL) {
-        strcpy(modified_line, line);
-        char *possible_filename = strtok(modified_line, ";");
-        if (strcmp(possible_filename, filename) != 0) {  // if line doesn't containt the filename, write it into the temp file
-            fprintf(temp_username_file, "%s", line);
+    return 0;
+}
+
+/**
+* @brief count a malformed request, which closes its connection
+* @param shard metrics shard of the calling thread, may be NULL
+* @return -1
+*/
+int connection_malformed(struct metrics_shard *shard) {
+    if (shard != NULL)
+        metrics_add(&shard->malformed, 1);
+    return -1;
+}
+
+/**
+* @brief parse the received bytes, handling every complete request into the reply buffer
+* @param connection connection
+* @return number of requests handled
+* @return -1 if a request is malformed
+*/
+int connection_process(struct connection *connection) {
+    struct metrics_shard *shard = metrics_shard();
+    int handled = 0;
+    while (!connection->closing && connection->reply.len < SESSION_REPLY_LIMIT) {
+        // v1 requests start with the operation name, v2 connections with HELLO
+        if (connection->protocol == 0) {
+            if (connection->len == 0)
+                break;
+            if (connection->data[0] != OP_HELLO) {
+                connection->protocol = PROTOCOL_V1;
+            } else {
+                int parse_hello_rvalue = parse_hello(connection->data, connection->len, &connection->protocol, &connection->reply);
+                if (parse_hello_rvalue < 0)
+                    return connection_malformed(shard);
+                if (parse_hello_rvalue == 0)
+                    break;
+                connection->len -= parse_hello_rvalue;
+                memmove(connection->data, connection->data + parse_hello_rvalue, connection->len);
+            }
+        }
+
+        int parse_request_rvalue = parse_request(connection->data, connection->len, connection->protocol, &connection->request);
+        if (parse_request_rvalue < 0)
+            return connection_malformed(shard);
+        if (parse_request_rvalue == 0) {
+            if (connection->len == REQUEST_BUFFER_SIZE)
+                return connection_malformed(shard);
+            break;
+        }
+
+        strcpy(connection->request.ip, connection->ip);
+        wal_thread_lsn = 0;
+        connection->request.status = 0;
+        connection->request.arena = &request_arena;
+        const struct operation *operation = connection->request.operation;
+        unsigned long long start_ns = monotonic_ns();
+        int handler_rvalue = operation->handler(&connection->request, &connection->reply);
+        if (shard != NULL) {
+            histogram_record(&shard->latency[operation->opcode], monotonic_ns() - start_ns);
+            metrics_add(&shard->requests[operation->opcode][connection->request.status], 1);
+            if (__atomic_load_n(&metrics_operation_names[operation->opcode], __ATOMIC_RELAXED) == NULL)
+                __atomic_store_n(&metrics_operation_names[operation->opcode], operation->name, __ATOMIC_RELAXED);
         }
+        arena_reset(&request_arena);
+        if (handler_rvalue >= 0)
+            report_request(&connection->request);
+        if (wal_thread_lsn > connection->commit_lsn)
+            connection->commit_lsn = wal_thread_lsn;
+        handled++;
+
+        // drop the request's bytes, the next pipelined request may already be behind them
+        connection->len -= parse_request_rvalue;
+        memmove(connection->data, connection->data + parse_request_rvalue, connection->len);
+        if (connection->protocol == PROTOCOL_V1)
+            connection->closing = 1;
     }
 
-    fclose(temp_username_file);
-    fclose(username_file);
-    remove(username_filename);
-    rename(temp_file, username_filename);
-    free(temp_file);
-    free(username_filename);
+    // requests cut short by the client closing its side are dropped
+    if (connection->peer_closed && connection->reply.len < SESSION_REPLY_LIMIT)
+        connection->closing = 1;
 
-    pthread_mutex_unlock(&files_folder_lock);
-    
-    return 0;
+    return handled;
 }
 
+// connections closed by the calling thread, kept with their reply buffers for the next ones it opens
+__thread struct connection *connection_cache[CONNECTION_CACHE_SIZE];
+__thread int connection_cache_count;
+
 /**
-* @brief delete operation handler. Calls delete() and sends error code to client
-* @param client_socket socket of client
-* @return 0 if successful
-* @return -1 if error
+* @brief close a connection's socket, keeping the connection for the calling thread to reuse unless it already
+*        keeps CONNECTION_CACHE_SIZE of them or its reply buffer grew past CONNECTION_REPLY_KEEP
+* @param connection connection
+*/
+void connection_close(struct connection *connection) {
+    if (close(connection->socket) < 0) {
+        perror("close");
+    }
+    if (connection_cache_count < CONNECTION_CACHE_SIZE && connection->reply.capacity <= CONNECTION_REPLY_KEEP) {
+        connection_cache[connection_cache_count++] = connection;
+        return;
+    }
+    free(connection->reply.data);
+    free(connection);
+}
+
+/**
+* @brief get a connection for a client socket, reusing one the calling thread closed if there is any
+* @param socket client socket
+* @return connection
+* @return NULL if error, the socket is closed then
 */
-int handle_delete(int client_socket) {
-    // get datetime from client socket
-    char datetime[DATETIME_SIZE];
-    if (read(client_socket, datetime, DATETIME_SIZE) < 0) {
-        perror("read");
-        return -1;
-    }
-    
-    // get username from client
-    char username[USERNAME_SIZE];
-    if (read(client_socket, username, USERNAME_SIZE) < 0) {
-        perror("read");
-        return -1;
+struct connection *connection_open(int socket) {
+    struct connection *connection;
+    struct buffer reply = {0};
+    if (connection_cache_count > 0) {
+        connection = connection_cache[--connection_cache_count];
+        reply = connection->reply;
+        reply.len = 0;
+    } else if ((connection = malloc(sizeof(struct connection))) == NULL) {
+        perror("malloc");
+        close(socket);
+        return NULL;
     }
 
-    // get filename from client
-    char filename[FILENAME_SIZE];
-    if (read(client_socket, filename, FILENAME_SIZE) < 0) {
-        perror("read");
-        return -1;
+    int connection_init_rvalue = connection_init(connection, socket);
+    connection->reply = reply;
+    if (connection_init_rvalue < 0) {
+        connection_close(connection);
+        return NULL;
     }
+    return connection;
+}
 
-    // delete the file and send error code to client
-    int delete_rvalue = delete(username, filename);
-    if (delete_rvalue < 0) {
-        write(client_socket, "4", EXECUTION_STATUS_SIZE);
-        return -1;
-    } else if (delete_rvalue == 1) {
-        // in case username doesn't exist
-        write(client_socket, "1", EXECUTION_STATUS_SIZE);
-    } else if (delete_rvalue == 2) {
-        // in case user is not connected
-        write(client_socket, "2", EXECUTION_STATUS_SIZE);
-    } else if (delete_rvalue == 3) {
-        // in case file has not been published by user
-        write(client_socket, "3", EXECUTION_STATUS_SIZE);
-    } else {
-        write(client_socket, "0", EXECUTION_STATUS_SIZE);
+/**
+* @brief send as much of the pending reply as the socket accepts
+* @param connection connection
+* @return 1 if the whole reply has been sent
+* @return 0 if the socket is non-blocking and full
+* @return -1 if error
+*/
+int connection_flush(struct connection *connection) {
+    while (connection->reply_sent < connection->reply.len) {
+        // a client that closes its socket before reading its replies fails the send, it doesn't raise SIGPIPE
+        ssize_t n = send(connection->socket, connection->reply.data + connection->reply_sent, connection->reply.len - connection->reply_sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            if (errno == EINTR)
+                continue;
+            if (errno != EPIPE && errno != ECONNRESET)
+                perror("send");
+            return -1;
+        }
+        connection->reply_sent += n;
     }
 
-    printf("OPERATION FROM %s\n", username);
+    // everything sent, reuse the buffer
+    connection->reply.len = 0;
+    connection->reply_sent = 0;
+    return 1;
+}
 
-    // send info to RPC server
-    int rpc_server_result;
-    if (print_file_operation_1(username, "DELETE", filename, datetime, &rpc_server_result, clnt) < 0) {
-        clnt_perror(clnt, "list_content");
+/**
+* @brief handle the petitions a client has sent so far on a blocking socket, sending the replies (HELLO's too)
+*        as soon as they are ready. The connection is closed once the client closes it (after the first request
+*        in v1); otherwise, as soon as there is nothing left to read, it is handed to the session poller, so
+*        idle sessions don't keep a worker
+* @param queue socket queue
+* @param petition socket just accepted or session with bytes to read
+*/
+void petition_handler(struct socket_queue *queue, struct petition petition) {
+    struct connection *connection = petition.connection;
+    if (connection == NULL && (connection = connection_open(petition.socket)) == NULL)
+        return;
+
+    while (!connection->closing) {
+        ssize_t n = recv(connection->socket, connection->data + connection->len, REQUEST_BUFFER_SIZE - connection->len, MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            // one shot, so only one worker at a time gets the session, and it can't be touched after this
+            struct epoll_event event = {.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT, .data.ptr = connection};
+            int operation = connection->events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+            connection->events = event.events;
+            if (epoll_ctl(queue->epoll_fd, operation, connection->socket, &event) == 0)
+                return;
+            perror("epoll_ctl");
+            break;
+        }
+        if (n < 0) {
+            perror("read");
+            break;
+        }
+        if (n == 0)
+            connection->peer_closed = 1;
+        connection->len += n;
+
+        // the reply limit may stop processing before every pipelined request is handled
+        int connection_process_rvalue;
+        do {
+            connection_process_rvalue = connection_process(connection);
+            if (connection_process_rvalue < 0)
+                break;
+            wal_wait(connection->commit_lsn);
+            if (connection_flush(connection) < 0)
+                break;
+        } while (connection_process_rvalue > 0);
+        // a reply left unsent means the write failed
+        if (connection_process_rvalue < 0 || connection->reply.len > 0)
+            break;
     }
 
-    return 0;
+    connection_close(connection);
 }
 
-// user in connected.csv, with username, ip, port
-struct user {
-    char username[USERNAME_SIZE];
-    char ip[IP_ADDRESS_SIZE];
-    char port[PORT_SIZE];
-};
-
 /**
-* @brief gets all users in connected.csv and sends their info to the client
-* @param client_socket socket of client
+* @brief set a socket as non-blocking
+* @param socket socket
 * @return 0 if successful
 * @return -1 if error
 */
-int list_users(int client_socket) {
-    // get datetime from client socket
-    char datetime[DATETIME_SIZE];
-    if (read(client_socket, datetime, DATETIME_SIZE) < 0) {
-        perror("read");
-        return -1;
-    }
-    
-    // get username from client
-    char username[USERNAME_SIZE];
-    if (read(client_socket, username, USERNAME_SIZE) < 0) {
-        perror("read");
-        return -1;
-    }
-
-    // check if username exists
-    int check_username_existence_rvalue = check_username_existence(username);
-    if (check_username_existence_rvalue == 0) {
-        write(client_socket, "1", EXECUTION_STATUS_SIZE);
-        return 0;
-    } else if (check_username_existence_rvalue < 0) {
-        write(client_socket, "3", EXECUTION_STATUS_SIZE);
+int set_nonblocking(int socket) {
+    int flags = fcntl(socket, F_GETFL, 0);
+    if (flags < 0 || fcntl(socket, F_SETFL, flags | O_NONBLOCK) < 0) {
+        perror("fcntl");
         return -1;
     }
+    return 0;
+}
 
-    // check if user is connected
-    int check_user_connection_rvalue = check_user_connection(username);
-    if (check_user_connection_rvalue == 0) {
-        write(client_socket, "2", EXECUTION_STATUS_SIZE);
-        return 0;
-    } else if (check_user_connection_rvalue < 0) {
-        write(client_socket, "3", EXECUTION_STATUS_SIZE);
-        return -1;
-    }
+struct connection *commit_waiters = NULL;  // epoll connections whose replies wait for a log commit
 
-    write(client_socket, "0", EXECUTION_STATUS_SIZE);
+/**
+* @brief add a connection to the ones waiting for a log commit
+* @param connection connection
+*/
+void event_loop_wait_commit(struct connection *connection) {
+    if (connection->waiting)
+        return;
+    connection->waiting = 1;
+    connection->prev_waiting = NULL;
+    connection->next_waiting = commit_waiters;
+    if (commit_waiters != NULL)
+        commit_waiters->prev_waiting = connection;
+    commit_waiters = connection;
+}
 
-    // open connected.csv
-    pthread_mutex_lock(&connected_file_lock);
-    FILE *connected_file = fopen(connected_filename, "r");
-    if (connected_file == NULL) {
-        perror("fopen");
-        return -1;
+/**
+* @brief close a connection of the event loop, removing it from epoll and from the commit waiters
+* @param epoll_fd epoll instance
+* @param connection connection
+*/
+void event_loop_close(int epoll_fd, struct connection *connection) {
+    if (connection->waiting) {
+        if (connection->prev_waiting != NULL)
+            connection->prev_waiting->next_waiting = connection->next_waiting;
+        else
+            commit_waiters = connection->next_waiting;
+        if (connection->next_waiting != NULL)
+            connection->next_waiting->prev_waiting = connection->prev_waiting;
     }
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, connection->socket, NULL);
+    connection_close(connection);
+}
 
-    int MAX_USERS = 100;
-    struct user userlist[MAX_USERS];
-    int usernum = 0;
-    int MAXLINE = 4096;
-    char line[MAXLINE];
-
-    // get user's info from connected.csv
-    while (fgets(line, MAXLINE, connected_file) != 0) {
-        strcpy(userlist[usernum].username, strtok(line, ";"));
-        strcpy(userlist[usernum].ip, strtok(NULL, ";"));
-        strcpy(userlist[usernum].port, strtok(NULL, ";"));
-        usernum++;
-    }
+/**
+* @brief accept every pending connection and add it to epoll
+* @param epoll_fd epoll instance
+* @param server_socket non-blocking server socket
+*/
+void event_loop_accept(int epoll_fd, int server_socket) {
+    while (1) {
+        int client_socket = accept4(server_socket, NULL, NULL, SOCK_NONBLOCK);
+        if (client_socket < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                perror("accept4");
+            return;
+        }
 
-    // send usernum to client
-    char *usernum_str;
-    asprintf(&usernum_str, "%d", usernum);
-    sleep(0.1);
-    write(client_socket, usernum_str, strlen(usernum_str));
+        struct connection *connection = connection_open(client_socket);
+        if (connection == NULL)
+            continue;
 
-    // send userlist to client
-    for (int i = 0; i < usernum; i++) {
-        sleep(0.1);
-        if (write(client_socket, userlist[i].username, USERNAME_SIZE) < 0) {
-            perror("write");
-            fclose(connected_file);
-            pthread_mutex_unlock(&connected_file_lock);
-            return -1;
+        connection->events = EPOLLIN | EPOLLRDHUP;
+        struct epoll_event event = {.events = connection->events, .data.ptr = connection};
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_socket, &event) < 0) {
+            perror("epoll_ctl");
+            connection_close(connection);
         }
-        sleep(0.1);
-        if (write(client_socket, userlist[i].ip, IP_ADDRESS_SIZE) < 0) {
-            perror("write");
-            fclose(connected_file);
-            pthread_mutex_unlock(&connected_file_lock);
+    }
+}
+
+/**
+* @brief read what a client has sent, without handling it yet
+* @param connection connection
+* @return 0 if successful
+* @return -1 if error
+*/
+int event_loop_read(struct connection *connection) {
+    while (connection->len < REQUEST_BUFFER_SIZE) {
+        ssize_t n = read(connection->socket, connection->data + connection->len, REQUEST_BUFFER_SIZE - connection->len);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            if (errno == EINTR)
+                continue;
+            perror("read");
             return -1;
         }
-        sleep(0.1);
-        if (write(client_socket, userlist[i].port, PORT_SIZE) < 0) {
-            perror("write");
-            fclose(connected_file);
-            pthread_mutex_unlock(&connected_file_lock);
-            return -1;
+        if (n == 0) {
+            connection->peer_closed = 1;
+            break;
         }
+        connection->len += n;
     }
-
-    fclose(connected_file);
-    pthread_mutex_unlock(&connected_file_lock);
-
-    printf("OPERATION FROM %s\n", username);
-
-    // send info to RPC server
-    int rpc_server_result;
-    if (print_operation_1(username, "LIST_USERS", datetime, &rpc_server_result, clnt) < 0) {
-        clnt_perror(clnt, "list_content");
-    }
-
     return 0;
 }
 
-struct file {
-    char filename[FILENAME_SIZE];
-    char description[DESCRIPTION_SIZE];
-};
+/**
+* @brief handle the requests received so far and send their replies as long as the socket accepts them
+*        and the operations they reply to are durable
+* @param connection connection
+* @return 2 if the reply waits for a log commit
+* @return 1 if the whole reply has been sent
+* @return 0 if the socket is full
+* @return -1 if error
+*/
+int event_loop_serve(struct connection *connection) {
+    int connection_process_rvalue;
+    int connection_flush_rvalue;
+    do {
+        connection_process_rvalue = connection_process(connection);
+        if (connection_process_rvalue < 0)
+            return -1;
+        if (!wal_durable(connection->commit_lsn))
+            return 2;
+        connection_flush_rvalue = connection_flush(connection);
+    } while (connection_flush_rvalue == 1 && connection_process_rvalue > 0);
+    return connection_flush_rvalue;
+}
 
-int list_content(int client_socket) {
-    // get datetime from client socket
-    char datetime[DATETIME_SIZE];
-    if (read(client_socket, datetime, DATETIME_SIZE) < 0) {
-        perror("read");
-        return -1;
+/**
+* @brief close a connection or change the epoll events it waits for, after serving it
+* @param epoll_fd epoll instance
+* @param connection connection
+* @param event_loop_serve_rvalue what event_loop_serve() returned
+*/
+void event_loop_update(int epoll_fd, struct connection *connection, int event_loop_serve_rvalue) {
+    // close once the last reply has been sent
+    if (event_loop_serve_rvalue < 0 || (event_loop_serve_rvalue == 1 && connection->closing)) {
+        event_loop_close(epoll_fd, connection);
+        return;
     }
 
-    // get username from client
-    char username[USERNAME_SIZE];
-    if (read(client_socket, username, USERNAME_SIZE) < 0) {
-        perror("read");
-        return -1;
+    // wait for the commit with no events, for EPOLLOUT while the socket is full, for more bytes otherwise
+    unsigned int wanted_events = EPOLLIN | EPOLLRDHUP;
+    if (event_loop_serve_rvalue == 2) {
+        event_loop_wait_commit(connection);
+        wanted_events = 0;
+    } else if (event_loop_serve_rvalue == 0) {
+        wanted_events = EPOLLOUT;
     }
-
-    // get requested username from client
-    char requested_username[USERNAME_SIZE];
-    if (read(client_socket, requested_username, USERNAME_SIZE) < 0) {
-        perror("read");
-        return -1;
+    if (wanted_events != connection->events) {
+        connection->events = wanted_events;
+        struct epoll_event event = {.events = wanted_events, .data.ptr = connection};
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, connection->socket, &event) < 0) {
+            perror("epoll_ctl");
+            event_loop_close(epoll_fd, connection);
+        }
     }
+}
 
-    // check if username exists
-    int check_username_existence_rvalue = check_username_existence(username);
-    if (check_username_existence_rvalue == 0) {
-        write(client_socket, "1", EXECUTION_STATUS_SIZE);
-        return 0;
-    } else if (check_username_existence_rvalue < 0) {
-        write(client_socket, "3", EXECUTION_STATUS_SIZE);
+/**
+* @brief serve clients from a single thread with non-blocking sockets and epoll. Requests are parsed
+*        incrementally as bytes arrive, so idle connections cost no thread
+* @param server_socket listening server socket
+* @return -1 if error
+*/
+int event_loop(int server_socket) {
+    if (set_nonblocking(server_socket) < 0)
         return -1;
-    }
 
-    // check if user is connected
-    int check_user_connection_rvalue = check_user_connection(username);
-    if (check_user_connection_rvalue == 0) {
-        write(client_socket, "2", EXECUTION_STATUS_SIZE);
-        return 0;
-    } else if (check_user_connection_rvalue < 0) {
-        write(client_socket, "3", EXECUTION_STATUS_SIZE);
+    int epoll_fd = epoll_create1(0);
+    if (epoll_fd < 0) {
+        perror("epoll_create1");
         return -1;
     }
-
-    // check if requested username is connected
-    int check_requested_user_connection_rvalue = check_user_connection(requested_username);
-    if (check_requested_user_connection_rvalue == 0) {
-        write(client_socket, "2", EXECUTION_STATUS_SIZE);
-        return 0;
-    } else if (check_requested_user_connection_rvalue < 0) {
-        write(client_socket, "3", EXECUTION_STATUS_SIZE);
+    struct epoll_event server_event = {.events = EPOLLIN, .data.ptr = NULL};
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_socket, &server_event) < 0) {
+        perror("epoll_ctl");
         return -1;
     }
 
-    write(client_socket, "0", EXECUTION_STATUS_SIZE);
-
-    // open username files in files folder
-    char *username_filename = malloc(strlen(files_foldername) + strlen(requested_username) + 2);
-    asprintf(&username_filename, "%s%s", files_foldername, requested_username);
-    pthread_mutex_lock(&files_folder_lock);
-    FILE *username_file = fopen(username_filename, "r");
-    free(username_filename);
-    if (username_file == NULL) {
-        perror("fopen");
+    // the log writer signals every commit, so replies waiting for one can be sent
+    int commit_fd = eventfd(0, EFD_NONBLOCK);
+    struct epoll_event commit_event = {.events = EPOLLIN, .data.ptr = &wal};
+    if (commit_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, commit_fd, &commit_event) < 0) {
+        perror("eventfd");
         return -1;
     }
+    wal.event_fd = commit_fd;
 
-    // get files from username file
-    struct file filelist[100];
-    int filenum = 0;
-    int MAXLINE = 4096;
-    char line[MAXLINE];
-    while (fgets(line, MAXLINE, username_file) != 0) {
-        if ((strcmp(line, "\n") == 0) || (strcmp(line, "") == 0)) {
-            break;
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+    while (1) {
+        int event_count = epoll_wait(epoll_fd, events, EPOLL_MAX_EVENTS, -1);
+        if (event_count < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            return -1;
         }
-        strcpy(filelist[filenum].filename, strtok(line, ";"));
-        strcpy(filelist[filenum].description, strtok(NULL, ";"));
-        filenum++;
-    }
-
-    // send filenum to client
-    char *filenum_str;
-    asprintf(&filenum_str, "%d", filenum);
-    sleep(0.1);
-    write(client_socket, filenum_str, strlen(filenum_str));
 
-    // send filelist to client
-    for (int i = 0; i < filenum; i++) {
-        sleep(0.1);
-        if (write(client_socket, filelist[i].filename, FILENAME_SIZE) < 0) {
-            perror("write");
-            fclose(username_file);
-            pthread_mutex_unlock(&files_folder_lock);
-            return -1;
+        int committed = 0;
+        for (int i = 0; i < event_count; i++) {
+            struct connection *connection = events[i].data.ptr;
+            if (connection == NULL) {
+                event_loop_accept(epoll_fd, server_socket);
+                continue;
+            }
+            if (events[i].data.ptr == &wal) {
+                unsigned long long commits;
+                if (read(commit_fd, &commits, sizeof(commits)) < 0 && errno != EAGAIN)
+                    perror("read");
+                committed = 1;
+                continue;
+            }
+
+            if (!connection->closing && (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+                if (event_loop_read(connection) < 0) {
+                    event_loop_close(epoll_fd, connection);
+                    continue;
+                }
+            }
+
+            // handle requests and send replies
+            event_loop_update(epoll_fd, connection, event_loop_serve(connection));
         }
-        sleep(0.1);
-        if (write(client_socket, filelist[i].description, DESCRIPTION_SIZE) < 0) {
-            perror("write");
-            fclose(username_file);
-            pthread_mutex_unlock(&files_folder_lock);
-            return -1;
+
+        // serve every connection waiting for a commit again (after the events, which may point to the ones
+        // that get closed), the ones still not durable wait for the next commit
+        if (committed) {
+            struct connection *waiters = commit_waiters;
+            commit_waiters = NULL;
+            while (waiters != NULL) {
+                struct connection *connection = waiters;
+                waiters = connection->next_waiting;
+                connection->waiting = 0;
+                event_loop_update(epoll_fd, connection, event_loop_serve(connection));
+            }
         }
     }
+}
 
-    fclose(username_file);
-    pthread_mutex_unlock(&files_folder_lock);
-
-    // send info to RPC server
-    int rpc_server_result;
-    if (print_operation_1(username, "LIST_CONTENT", datetime, &rpc_server_result, clnt) < 0) {
-        clnt_perror(clnt, "list_content");
-    }
+/**
+* @brief add a petition to the queue, waiting while it is full
+* @param queue socket queue
+* @param petition socket just accepted or session with bytes to read
+*/
+void socket_queue_push(struct socket_queue *queue, struct petition petition) {
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == queue->capacity)
+        pthread_cond_wait(&queue->not_full, &queue->lock);
+    queue->petitions[(queue->head + queue->count) % queue->capacity] = petition;
+    queue->count++;
+    if (queue->count > queue->max_count)
+        queue->max_count = queue->count;
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+}
 
-    printf("OPERATION FROM %s\n", username);
-    return 0;
+/**
+* @brief take the oldest petition from the queue, waiting while it is empty
+* @param queue socket queue
+* @return petition
+*/
+struct petition socket_queue_pop(struct socket_queue *queue) {
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0)
+        pthread_cond_wait(&queue->not_empty, &queue->lock);
+    struct petition petition = queue->petitions[queue->head];
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count--;
+    queue->busy_workers++;
+    pthread_cond_signal(&queue->not_full);
+    pthread_mutex_unlock(&queue->lock);
+
+    return petition;
 }
 
 /**
-* @brief thread function to handle petition from client, calling the specific handler
-* @param client_socket client socket
+* @brief worker thread function, handling petitions from the socket queue forever
+* @param queue socket queue
 */
-void petition_handler(void *client_socket) {
-    // get petition from client socket
+void *worker_thread(void *queue_ptr) {
+    struct socket_queue *queue = queue_ptr;
+    while (1) {
+        struct petition petition = socket_queue_pop(queue);
+        unsigned long long start = monotonic_ns();
 
-    if (socket_copied == 1)
-        pthread_exit(NULL); 
-    pthread_mutex_lock(&socket_lock);
-    int socket = *(int *)client_socket;
-    socket_copied = 1;
-    pthread_cond_signal(&socket_cond);
-    pthread_mutex_unlock(&socket_lock);
+        petition_handler(queue, petition);
 
-    char operation[OPERATION_SIZE];
-    if (read(socket, operation, OPERATION_SIZE) < 0) {
-        perror("read");
-        pthread_exit(NULL);
+        unsigned long long elapsed = monotonic_ns() - start;
+        pthread_mutex_lock(&queue->lock);
+        queue->busy_workers--;
+        queue->served++;
+        queue->busy_ns += elapsed;
+        pthread_mutex_unlock(&queue->lock);
     }
 
-    // handle petition, calling the specific handler
-    if (strcmp(operation, "REGISTER") == 0) {
-        if (handle_register(socket) < 0) {
-            pthread_exit(NULL);
-        }
-    } else if (strcmp(operation, "UNREGISTER") == 0) {
-        if (handle_unregister(socket) < 0) {
-            pthread_exit(NULL);
-        }
-    } else if (strcmp(operation, "CONNECT") == 0) {
-        if (handle_connect(socket) < 0) {
-            pthread_exit(NULL);
-        }
-    } else if (strcmp(operation, "PUBLISH") == 0) {
-        if (handle_publish(socket) < 0) {
-            pthread_exit(NULL);
+    return NULL;
+}
+
+/**
+* @brief session poller thread function, queuing the idle sessions the workers handed over again as soon as
+*        they have bytes to read (or the client closed them)
+* @param queue socket queue
+*/
+void *session_poller_thread(void *queue_ptr) {
+    struct socket_queue *queue = queue_ptr;
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+    while (1) {
+        int event_count = epoll_wait(queue->epoll_fd, events, EPOLL_MAX_EVENTS, -1);
+        if (event_count < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            exit(1);
         }
-    } else if (strcmp(operation, "DISCONNECT") == 0) {
-        if (handle_disconnect(socket) < 0) {
-            pthread_exit(NULL);
+        for (int i = 0; i < event_count; i++) {
+            struct connection *connection = events[i].data.ptr;
+            socket_queue_push(queue, (struct petition){.socket = connection->socket, .connection = connection});
         }
-    } else if (strcmp(operation, "DELETE") == 0) {
-        if (handle_delete(socket) < 0) {
-            pthread_exit(NULL);
+    }
+
+    return NULL;
+}
+
+/**
+* @brief reporting thread function, printing queue depth and worker utilization every POOL_REPORT_INTERVAL seconds
+* @param queue socket queue
+*/
+void *pool_report_thread(void *queue_ptr) {
+    struct socket_queue *queue = queue_ptr;
+    unsigned long last_served = 0;
+    unsigned long long last_busy_ns = 0;
+    unsigned long long last_report = monotonic_ns();
+    while (1) {
+        sleep(POOL_REPORT_INTERVAL);
+
+        pthread_mutex_lock(&queue->lock);
+        unsigned long served = queue->served;
+        unsigned long long busy_ns = queue->busy_ns;
+        int depth = queue->count;
+        int max_depth = queue->max_count;
+        int busy_workers = queue->busy_workers;
+        queue->max_count = queue->count;
+        pthread_mutex_unlock(&queue->lock);
+
+        // only report intervals with activity
+        unsigned long long now = monotonic_ns();
+        if (served != last_served || busy_workers > 0) {
+            double utilization = 100.0 * (busy_ns - last_busy_ns) / ((double)(now - last_report) * queue->workers);
+            printf("pool: %lu petitions, queue depth %d (max %d/%d), busy workers %d/%d, utilization %.1f%%\n",
+                   served - last_served, depth, max_depth, queue->capacity, busy_workers, queue->workers, utilization);
+            fflush(stdout);
         }
-    } else if (strcmp(operation, "LIST_USERS") == 0) {
-        if (list_users(socket) < 0) {
-            pthread_exit(NULL);
+        last_served = served;
+        last_busy_ns = busy_ns;
+        last_report = now;
+    }
+
+    return NULL;
+}
+
+int metrics_socket = -1;  // listening socket of the metrics endpoint
+
+/**
+* @brief metrics endpoint thread function. Answers every connection to the metrics port with the metrics in the
+*        Prometheus text format, as an HTTP/1.0 response whatever the request
+* @param socket_ptr listening metrics socket
+*/
+void *metrics_server_thread(void *socket_ptr) {
+    int server_socket = *(int *)socket_ptr;
+    while (1) {
+        int client_socket = accept(server_socket, NULL, NULL);
+        if (client_socket < 0) {
+            perror("accept");
+            continue;
         }
-    } else if (strcmp(operation, "LIST_CONTENT") == 0) {
-        if (list_content(socket) < 0) {
-            pthread_exit(NULL);
+
+        // the request isn't needed, but it is read so closing the socket doesn't reset the connection
+        struct timeval timeout = {.tv_sec = 1, .tv_usec = 0};
+        char request[1024];
+        if (setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0 || read(client_socket, request, sizeof(request)) < 0)
+            perror("read");
+
+        struct buffer text = {.arena = &request_arena};
+        struct buffer response = {.arena = &request_arena};
+        if (metrics_format(&text, &request_arena) == 0 && buffer_printf(&response, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", text.len) == 0 && buffer_append(&response, text.data, text.len) == 0) {
+            size_t sent = 0;
+            while (sent < response.len) {
+                ssize_t n = send(client_socket, response.data + sent, response.len - sent, MSG_NOSIGNAL);
+                if (n < 0) {
+                    perror("send");
+                    break;
+                }
+                sent += n;
+            }
         }
-    } else {
-        printf("INCORRECT OPERATION\n");
-        pthread_exit(NULL);
+        arena_reset(&request_arena);
+        close(client_socket);
+    }
+
+    return NULL;
+}
+
+/**
+* @brief start the metrics endpoint on a local port
+* @param port metrics port
+* @return 0 if successful
+* @return -1 if error
+*/
+int metrics_server_start(int port) {
+    metrics_socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (metrics_socket < 0) {
+        perror("socket");
+        return -1;
+    }
+    int opt = 1;
+    if (setsockopt(metrics_socket, SOL_SOCKET, SO_REUSEADDR, (char *)&opt, sizeof(opt)) < 0) {
+        perror("setsockopt");
+        return -1;
+    }
+
+    // only reachable from this machine
+    struct sockaddr_in metrics_address;
+    metrics_address.sin_family = AF_INET;
+    metrics_address.sin_port = htons(port);
+    metrics_address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(metrics_socket, (struct sockaddr *)&metrics_address, sizeof(metrics_address)) < 0) {
+        perror("bind");
+        return -1;
+    }
+    if (listen(metrics_socket, SOMAXCONN) < 0) {
+        perror("listen");
+        return -1;
     }
 
-    pthread_exit(NULL);
+    pthread_t metrics_thread;
+    if (pthread_create(&metrics_thread, NULL, metrics_server_thread, &metrics_socket) != 0) {
+        perror("pthread_create");
+        return -1;
+    }
+    pthread_detach(metrics_thread);
+    return 0;
 }
 
 /**
-* @brief handle SIGINT, closing every mutex before exiting
+* @brief shutdown thread function. Waits for SIGINT or SIGTERM (blocked in every thread, so they are only taken
+*        here, outside of any signal handler), then exports users.csv, waits for the log to be durable and for
+*        the audit queue to drain, and exits
+* @param signals_ptr signals to wait for
 */
-void handle_sigint() {
-    // delete all mutexes
-    pthread_mutex_destroy(&users_file_lock);
-    pthread_mutex_destroy(&files_folder_lock);
-    pthread_mutex_destroy(&socket_lock);
+void *shutdown_thread(void *signals_ptr) {
+    int signal_number;
+    int sigwait_rvalue = sigwait(signals_ptr, &signal_number);
+    if (sigwait_rvalue != 0) {
+        fprintf(stderr, "sigwait: %s\n", strerror(sigwait_rvalue));
+        exit(1);
+    }
+    printf("\ns> shutting down\n");
+    fflush(stdout);
+
+    // the locks are still in use by the other threads, which keep running until exit()
+    export_users();
+    pthread_mutex_lock(&wal.lock);
+    unsigned long long lsn = wal.next_lsn - 1;
+    pthread_mutex_unlock(&wal.lock);
+    wal_wait(lsn);
+    if (audit_queue_drain(&audit, AUDIT_DRAIN_TIMEOUT) < 0)
+        fprintf(stderr, "audit: operations still queued after %d seconds, not sent\n", AUDIT_DRAIN_TIMEOUT);
 
     exit(0);
 }
 
 int main(int argc, char* argv[]) {
-    // register signal handler
-    signal(SIGINT, handle_sigint);
-
-    // check given port's validity
-    unsigned int port_number = check_arguments(argc, argv);
-    if ((port_number < 1024) | (port_number > 65535)) {
-        fprintf(stderr, "Invalid port: '%s'\n", argv[2]);
+    // every thread inherits the blocked signals, the shutdown thread takes them
+    static sigset_t shutdown_signals;
+    sigemptyset(&shutdown_signals);
+    sigaddset(&shutdown_signals, SIGINT);
+    sigaddset(&shutdown_signals, SIGTERM);
+    if (pthread_sigmask(SIG_BLOCK, &shutdown_signals, NULL) != 0) {
+        perror("pthread_sigmask");
         exit(1);
     }
+    // replies are sent with MSG_NOSIGNAL, but the RPC client writes to its socket with write()
+    signal(SIGPIPE, SIG_IGN);
+
+    // check program arguments
+    struct server_options options;
+    if (check_arguments(argc, argv, &options) < 0)
+        exit(1);
+    int port_number = options.port;
 
     // get local ip
     struct local_ip_info server_ip = get_local_ip();
@@ -1212,37 +5339,22 @@ int main(int argc, char* argv[]) {
     // init messsage
     printf("init server %s:%d\n", server_ip.ip, port_number);
 
-    // create/clear users.csv
-    FILE *tuples_file = fopen(users_filename, "w");
-    if (tuples_file == NULL || fclose(tuples_file) < 0) {
-        perror("fopen");
+    // bring back the state of the last run and start logging (users.csv is only an export of it, written on
+    // shutdown)
+    if (state_init() < 0 || wal_recover(&wal) < 0)
         exit(1);
-    }
-
-    // create/clear connected.csv
-    FILE *connected_users_file = fopen(connected_filename, "w");
-    if (connected_users_file == NULL || fclose(connected_users_file) < 0) {
-        perror("fopen");
+    pthread_t wal_thread;
+    if (pthread_create(&wal_thread, NULL, wal_writer_thread, &wal) != 0) {
+        perror("pthread_create");
         exit(1);
     }
-
-    // empty files folder
-    DIR *files_folder = opendir(files_foldername);
-    if (files_folder == NULL) {
-        perror("opendir");
+    pthread_detach(wal_thread);
+    pthread_t snapshot;
+    if (pthread_create(&snapshot, NULL, snapshot_thread, &wal) != 0) {
+        perror("pthread_create");
         exit(1);
     }
-    struct dirent *file;
-    while ((file = readdir(files_folder)) != NULL) {
-        if (strcmp(file->d_name, ".") != 0 && strcmp(file->d_name, "..") != 0) {
-            char *file_path = malloc(strlen(files_foldername) + strlen(file->d_name) + 2);
-            strcpy(file_path, files_foldername);
-            strcat(file_path, file->d_name);
-            remove(file_path);
-            free(file_path);
-        }
-    }
-    closedir(files_folder);
+    pthread_detach(snapshot);
 
     // generate server socket
     int server_socket = socket(AF_INET, SOCK_STREAM, 0);
@@ -1268,25 +5380,87 @@ int main(int argc, char* argv[]) {
         exit(1);
     }
 
-    // create thread for handling new connections
-    pthread_attr_t threads_attr;
-    pthread_attr_init(&threads_attr);
-    pthread_attr_setdetachstate(&threads_attr, PTHREAD_CREATE_JOINABLE);
-    pthread_t thread;
+    // start the audit sender, handlers only queue their operations. It connects its own RPC client (and
+    // reconnects it whenever the RPC server goes away), so the server starts without it. There is only one, as
+    // several senders would have their batches written in whatever order their calls ended
+    rpc_host = strdup(server_ip.ip);
+    audit.capacity = AUDIT_QUEUE_SIZE;
+    audit.entries = malloc(AUDIT_QUEUE_SIZE * sizeof(struct audit_entry));
+    if (audit.entries == NULL || rpc_host == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    pthread_t audit_thread;
+    if (pthread_create(&audit_thread, NULL, audit_sender_thread, &audit) != 0) {
+        perror("pthread_create");
+        exit(1);
+    }
+    pthread_detach(audit_thread);
 
-    // initiate RPC client
-	clnt = clnt_create (server_ip.ip, filemanager, VERNUM, "tcp");
-	if (clnt == NULL) {
-		clnt_pcreateerror (server_ip.ip);
-		exit (1);
-	}
+    pthread_t signal_thread;
+    if (pthread_create(&signal_thread, NULL, shutdown_thread, &shutdown_signals) != 0) {
+        perror("pthread_create");
+        exit(1);
+    }
+    pthread_detach(signal_thread);
+
+    // prefer the shared-memory ring of a co-located RPC server, RPC stays the fallback
+    if (options.audit_ring != NULL) {
+        audit_ring_producer.name = options.audit_ring;
+        if (audit_ring_attach() == 0)
+            printf("s> audit records through shared-memory ring %s\n", options.audit_ring);
+        else
+            printf("s> audit ring %s not available yet, sending audit records over RPC\n", options.audit_ring);
+    }
+
+    // serve the metrics on their own local port
+    if (options.metrics_port != 0) {
+        if (metrics_server_start(options.metrics_port) < 0)
+            exit(1);
+        printf("s> metrics on 127.0.0.1:%d\n", options.metrics_port);
+    }
 
-    // listen for new connections (allocate memory for 5 requests at a time)
-    if (listen(server_socket, 5) < 0) {
+    // listen for new connections (the socket queue bounds pending petitions, so use the system's backlog)
+    if (listen(server_socket, SOMAXCONN) < 0) {
         perror("listen");
         exit(1);
     }
 
+    if (options.mode == MODE_EPOLL) {
+        printf("s> serving with epoll\n");
+        fflush(stdout);
+        event_loop(server_socket);
+        exit(1);
+    }
+
+    // create worker threads, fed through the socket queue by the main thread and the session poller
+    pending_sockets.capacity = options.queue_size;
+    pending_sockets.workers = options.workers;
+    pending_sockets.petitions = malloc(options.queue_size * sizeof(struct petition));
+    if (pending_sockets.petitions == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    pending_sockets.epoll_fd = epoll_create1(0);
+    if (pending_sockets.epoll_fd < 0) {
+        perror("epoll_create1");
+        exit(1);
+    }
+    pthread_attr_t threads_attr;
+    pthread_attr_init(&threads_attr);
+    pthread_attr_setdetachstate(&threads_attr, PTHREAD_CREATE_DETACHED);
+    pthread_t thread;
+    for (int i = 0; i < options.workers; i++) {
+        if (pthread_create(&thread, &threads_attr, worker_thread, &pending_sockets) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    if (pthread_create(&thread, &threads_attr, session_poller_thread, &pending_sockets) != 0 || pthread_create(&thread, &threads_attr, pool_report_thread, &pending_sockets) != 0) {
+        perror("pthread_create");
+        exit(1);
+    }
+
     while (1) {
         printf("s> ");
         fflush(stdout);
@@ -1298,28 +5472,7 @@ int main(int argc, char* argv[]) {
             exit(1);
         }
 
-        // create thread
-        pthread_mutex_lock(&socket_lock);
-        socket_copied = 0;
-        if (pthread_create(&thread, &threads_attr, (void *) petition_handler, (void *) &client_socket) < 0) {
-            perror("pthread_create");
-            exit(1);
-        }
-        while (socket_copied == 0)
-            pthread_cond_wait(&socket_cond, &socket_lock);
-        pthread_mutex_unlock(&socket_lock);
-
-        // ensure the system knows that the thread can be cleaned up automatically without the server waiting
-        if (pthread_join(thread, NULL) < 0) {
-            // doing this for good practice, pthread_join on a detached thread always returns success
-            perror("pthread_join");
-            exit(1);  
-        }
-
-        // close client socket
-        if (close(client_socket) < 0) {
-            perror("close");
-            exit(1);
-        }
+        // hand the socket to a worker thread (waits if the queue is full)
+        socket_queue_push(&pending_sockets, (struct petition){.socket = client_socket, .connection = NULL});
     }
 }
@@ -1,3 +1,5 @@
+# datetime web service for legacy clients, which stamp their operations with it. The server stamps the
+# operations of clients that leave the datetime empty (like client.py) with its own clock, without it
 import sys
 from datetime import datetime
 from spyne import Application, ServiceBase, rpc